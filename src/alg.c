@@ -6,78 +6,296 @@
  *    See also the file 'COPYING'.
  *
  */
+#include "translate.h"
 #include "motion.h"
 #include "alg.h"
+#include "alg_simd.h"
+#include "workpool.h"
+
+/* Height below which a stripe is not worth a detection thread */
+#define ALG_STRIPE_MIN_ROWS 32
+
+/* alg_luma_stats samples one pixel in ALG_LUMA_STEP x ALG_LUMA_STEP */
+#define ALG_LUMA_STEP 8
+
+/* One per pixel stage of the detection split in horizontal stripes */
+struct alg_stripe_job {
+    struct context *cnt;
+    int stripes;
+    char filter;                        /* Despeckle step */
+    struct alg_diff_data dd;            /* Diff of the whole image */
+    int accept_timer;                   /* Reference frame update */
+    int threshold_ref;
+    int noise_tune;                     /* Fused detection measures the noise */
+    int tiles;                          /* Diff only the words of the active tiles */
+    int counts;                         /* The despeckle step counts rows and columns */
+    int sums[ALG_STRIPE_MAX];           /* Result of each stripe */
+    long long noise_sums[ALG_STRIPE_MAX];
+    int noise_counts[ALG_STRIPE_MAX];
+};
+
+/* A run of motion pixels in row y from start up to but not including end */
+struct label_run {
+    int y;
+    int start;
+    int end;
+    int label;
+};
 
-#ifdef __MMX__
-#define HAVE_MMX
-#include "mmx.h"
-#endif
+/**
+ * alg_state_row
+ *      Points to the fields of row y of the per pixel state.
+ */
+void alg_state_row(struct images *imgs, int y, struct alg_state *row)
+{
+    unsigned char *base = imgs->state + (size_t)y * ALG_STATE_FIELDS * imgs->state_pitch;
+
+    row->ref = base;
+    row->smartmask_final = base + imgs->state_pitch;
+    row->mask = base + 2 * imgs->state_pitch;
+    row->smartmask = base + 3 * imgs->state_pitch;
+    row->ref_dyn = (uint16_t *)(base + 4 * imgs->state_pitch);
+    row->smartmask_buffer = (uint16_t *)(base + 6 * imgs->state_pitch);
+}
+
+/**
+ * alg_state_init
+ *      Sets the size of the detection from detection_scale and allocates
+ *      the image it runs on and the per pixel state, aligned to the cache
+ *      lines, with an empty fixed and smart mask.
+ */
+void alg_state_init(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    struct alg_state row;
+    int y;
+
+    if (cnt->conf.detection_scale != 1 && cnt->conf.detection_scale != 2 &&
+        cnt->conf.detection_scale != 4) {
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
+            ,_("Config option \"detection_scale\" not 1, 2 or 4: %d")
+            ,cnt->conf.detection_scale);
+        cnt->conf.detection_scale = 1;
+    }
+
+    imgs->detect_scale = cnt->conf.detection_scale;
+    imgs->detect_width = imgs->width / imgs->detect_scale;
+    imgs->detect_height = imgs->height / imgs->detect_scale;
+    if (imgs->detect_scale > 1)
+        imgs->image_detect = mymalloc(imgs->detect_width * imgs->detect_height);
+    else
+        imgs->image_detect = imgs->image_vprvcy.image_norm;
+
+    imgs->state_pitch = (imgs->detect_width + 63) & ~63;
+    imgs->state = mymalloc_aligned((size_t)ALG_STATE_FIELDS * imgs->state_pitch * imgs->detect_height, 64);
+
+    imgs->tile_cols = (imgs->detect_width + ALG_TILE_SIZE - 1) / ALG_TILE_SIZE;
+    imgs->tile_rows = (imgs->detect_height + ALG_TILE_SIZE - 1) / ALG_TILE_SIZE;
+    imgs->tile_sad = mymalloc(imgs->tile_cols * imgs->tile_rows * sizeof(*imgs->tile_sad));
+    imgs->tile_map = mymalloc(imgs->tile_cols * imgs->tile_rows);
+
+    for (y = 0; y < imgs->detect_height; y++) {
+        alg_state_row(imgs, y, &row);
+        memset(row.mask, 255, imgs->state_pitch);
+        memset(row.smartmask_final, 255, imgs->state_pitch);
+    }
+}
+
+/**
+ * alg_state_deinit
+ *      Frees the per pixel state.
+ */
+void alg_state_deinit(struct context *cnt)
+{
+    if (cnt->imgs.detect_scale > 1)
+        free(cnt->imgs.image_detect);
+    cnt->imgs.image_detect = NULL;
+
+    free(cnt->imgs.state);
+    cnt->imgs.state = NULL;
+    cnt->imgs.state_pitch = 0;
+
+    free(cnt->imgs.tile_sad);
+    cnt->imgs.tile_sad = NULL;
+    free(cnt->imgs.tile_map);
+    cnt->imgs.tile_map = NULL;
+}
 
-#define MAX2(x, y) ((x) > (y) ? (x) : (y))
-#define MAX3(x, y, z) ((x) > (y) ? ((x) > (z) ? (x) : (z)) : ((y) > (z) ? (y) : (z)))
+/**
+ * alg_state_mask
+ *      Takes the fixed mask loaded in imgs.mask into the per pixel state,
+ *      scaled down to the detection like the image.
+ */
+void alg_state_mask(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    struct alg_state row;
+    int y, scale = imgs->detect_scale;
+
+    for (y = 0; y < imgs->detect_height; y++) {
+        alg_state_row(imgs, y, &row);
+        if (imgs->mask)
+            alg_simd_shrink(row.mask, imgs->mask + y * scale * imgs->width, imgs->width
+                , imgs->detect_width, scale);
+        else
+            memset(row.mask, 255, imgs->detect_width);
+    }
+}
+
+/**
+ * alg_smartmask_reset
+ *      Clears the smart mask so no pixel is excluded.
+ */
+void alg_smartmask_reset(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    struct alg_state row;
+    int y;
+
+    for (y = 0; y < imgs->detect_height; y++) {
+        alg_state_row(imgs, y, &row);
+        memset(row.smartmask, 0, imgs->detect_width);
+        memset(row.smartmask_final, 255, imgs->detect_width);
+    }
+    memset(imgs->smartmask_final, 255, imgs->detect_width * imgs->detect_height);
+}
+
+/**
+ * alg_run_dist
+ *      Sum of the distances of the pixels of a run from start up to but not
+ *      including end to the column c.
+ */
+static long long alg_run_dist(int start, int end, int c)
+{
+    long long dist = 0;
+    int first, last;
+
+    /* The pixels left of c */
+    last = (end < c) ? end : c;
+    if (start < last)
+        dist += (long long)(last - start) * (2 * c - start - last + 1) / 2;
+
+    /* The pixels from c on */
+    first = (start > c) ? start : c;
+    if (first < end)
+        dist += (long long)(end - first) * (first + end - 1 - 2 * c) / 2;
+
+    return dist;
+}
 
 /**
  * alg_locate_center_size
- *      Locates the center and size of the movement.
+ *      Locates the center and size of the movement. The movement is found
+ *      at the size of the detection and scaled back to width and height.
  */
 void alg_locate_center_size(struct images *imgs, int width, int height, struct coord *cent)
 {
-    unsigned char *out = imgs->img_motion.image_norm;
-    int *labels = imgs->labels;
-    int x, y, centc = 0, xdist = 0, ydist = 0;
+    const uint64_t *bits = imgs->motion_bits;
+    uint64_t word;
+    struct label_stats *stat;
+    struct label_run *run;
+    long long sumx = 0, sumy = 0, xdist = 0, ydist = 0;
+    int x, y, indx, label, centc = 0;
+    int scale = imgs->detect_scale;
+    int dwidth = width / scale, dheight = height / scale;
 
     cent->x = 0;
     cent->y = 0;
     cent->maxx = 0;
     cent->maxy = 0;
-    cent->minx = width;
-    cent->miny = height;
+    cent->minx = dwidth;
+    cent->miny = dheight;
 
-    /* If Labeling enabled - locate center of largest labelgroup. */
+    /*
+     * If Labeling enabled - the labeling already collected the area and the
+     * centroid sums of each label. The movement is the group of labels above
+     * the threshold, sized by the mean distance of their pixels from the
+     * center which is summed over the runs of these labels.
+     */
     if (imgs->labelsize_max) {
-        /* Locate largest labelgroup */
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(labels++) & 32768) {
-                    cent->x += x;
-                    cent->y += y;
-                    centc++;
-                }
+        for (label = 1; label <= imgs->labels_total; label++) {
+            stat = &imgs->label_stats[label];
+            if (!stat->above)
+                continue;
+
+            sumx += stat->sumx;
+            sumy += stat->sumy;
+            centc += stat->area;
+        }
+
+        if (centc) {
+            cent->x = sumx / centc;
+            cent->y = sumy / centc;
+
+            run = imgs->label_runs;
+            for (indx = 0; indx < imgs->label_runs_count; indx++, run++) {
+                if (!imgs->label_stats[run->label].above)
+                    continue;
+                xdist += alg_run_dist(run->start, run->end, cent->x);
+                ydist += (long long)abs(run->y - cent->y) * (run->end - run->start);
             }
+
+            cent->minx = cent->x - xdist / centc * 2;
+            cent->maxx = cent->x + xdist / centc * 2;
+            cent->miny = cent->y - ydist / centc * 3;
+            cent->maxy = cent->y + ydist / centc * 2;
+        }
+
+    } else if (imgs->motion_counts) {
+        /*
+         * The diff or the despeckle counted the pixels of each column and
+         * row as they were flagged, which gives the same centroid and mean
+         * distances as the scan of the bitmap below.
+         */
+        for (x = 0; x < dwidth; x++) {
+            sumx += (long long)x * imgs->motion_cols[x];
+            centc += imgs->motion_cols[x];
+        }
+        for (y = 0; y < dheight; y++)
+            sumy += (long long)y * imgs->motion_rows[y];
+
+        if (centc) {
+            cent->x = sumx / centc;
+            cent->y = sumy / centc;
+
+            for (x = 0; x < dwidth; x++)
+                xdist += (long long)abs(x - cent->x) * imgs->motion_cols[x];
+            for (y = 0; y < dheight; y++)
+                ydist += (long long)abs(y - cent->y) * imgs->motion_rows[y];
+
+            cent->minx = cent->x - xdist / centc * 2;
+            cent->maxx = cent->x + xdist / centc * 2;
+            cent->miny = cent->y - ydist / centc * 3;
+            cent->maxy = cent->y + ydist / centc * 2;
         }
 
     } else {
-        /* Locate movement */
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(out++)) {
-                    cent->x += x;
-                    cent->y += y;
+        /* Locate movement when the counts do not match the bitmap */
+        for (y = 0; y < dheight; y++, bits += imgs->motion_stride) {
+            for (indx = 0; indx < imgs->motion_stride; indx++) {
+                for (word = bits[indx]; word; word &= word - 1) {
+                    sumx += 64 * indx + __builtin_ctzll(word);
+                    sumy += y;
                     centc++;
                 }
             }
         }
 
-    }
-
-    if (centc) {
-        cent->x = cent->x / centc;
-        cent->y = cent->y / centc;
-    }
+        if (centc) {
+            cent->x = sumx / centc;
+            cent->y = sumy / centc;
+        }
 
-    /* Now we find the size of the Motion. */
+        /* Now we find the size of the Motion. */
 
-    /* First reset pointers back to initial value. */
-    centc = 0;
-    labels = imgs->labels;
-    out = imgs->img_motion.image_norm;
+        /* First reset pointers back to initial value. */
+        centc = 0;
+        bits = imgs->motion_bits;
 
-    /* If Labeling then we find the area around largest labelgroup instead. */
-    if (imgs->labelsize_max) {
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(labels++) & 32768) {
+        for (y = 0; y < dheight; y++, bits += imgs->motion_stride) {
+            for (indx = 0; indx < imgs->motion_stride; indx++) {
+                for (word = bits[indx]; word; word &= word - 1) {
+                    x = 64 * indx + __builtin_ctzll(word);
                     if (x > cent->x)
                         xdist += x - cent->x;
                     else if (x < cent->x)
@@ -93,37 +311,27 @@ void alg_locate_center_size(struct images *imgs, int width, int height, struct c
             }
         }
 
-    } else {
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(out++)) {
-                    if (x > cent->x)
-                        xdist += x - cent->x;
-                    else if (x < cent->x)
-                        xdist += cent->x - x;
-
-                    if (y > cent->y)
-                        ydist += y - cent->y;
-                    else if (y < cent->y)
-                        ydist += cent->y - y;
-
-                    centc++;
-                }
-            }
+        if (centc) {
+            cent->minx = cent->x - xdist / centc * 2;
+            cent->maxx = cent->x + xdist / centc * 2;
+            /*
+             * Make the box a little bigger in y direction to make sure the
+             * heads fit in so we multiply by 3 instead of 2 which seems to
+             * to work well in practical.
+             */
+            cent->miny = cent->y - ydist / centc * 3;
+            cent->maxy = cent->y + ydist / centc * 2;
         }
-
     }
 
-    if (centc) {
-        cent->minx = cent->x - xdist / centc * 2;
-        cent->maxx = cent->x + xdist / centc * 2;
-        /*
-         * Make the box a little bigger in y direction to make sure the
-         * heads fit in so we multiply by 3 instead of 2 which seems to
-         * to work well in practical.
-         */
-        cent->miny = cent->y - ydist / centc * 3;
-        cent->maxy = cent->y + ydist / centc * 2;
+    /* Each pixel of the detection covers a block of scale x scale pixels */
+    if (scale > 1) {
+        cent->x = cent->x * scale + scale / 2;
+        cent->y = cent->y * scale + scale / 2;
+        cent->minx = cent->minx * scale;
+        cent->miny = cent->miny * scale;
+        cent->maxx = cent->maxx * scale + scale - 1;
+        cent->maxy = cent->maxy * scale + scale - 1;
     }
 
     if (cent->maxx > width - 1)
@@ -168,15 +376,18 @@ void alg_locate_center_size(struct images *imgs, int width, int height, struct c
 /**
  * alg_draw_location
  *      Draws a box around the movement.
+ *      The box is drawn on the planes described by view and, for the
+ *      debug box, on the packed motion image.
  */
-void alg_draw_location(struct coord *cent, struct images *imgs, int width, unsigned char *new,
+void alg_draw_location(struct coord *cent, struct images *imgs, struct image_view *view,
                        int style, int mode, int process_thisframe)
 {
     unsigned char *out = imgs->img_motion.image_norm;
+    unsigned char *new = view->plane[0];
+    int width = imgs->width;
+    int stride = view->stride[0];
     int x, y;
 
-    out = imgs->img_motion.image_norm;
-
     /* Debug image always gets a 'normal' box. */
     if ((mode == LOCATE_BOTH) && process_thisframe) {
         int width_miny = width * cent->miny;
@@ -199,34 +410,35 @@ void alg_draw_location(struct coord *cent, struct images *imgs, int width, unsig
         }
     }
     if (style == LOCATE_BOX) { /* Draw a box on normal images. */
-        int width_miny = width * cent->miny;
-        int width_maxy = width * cent->maxy;
+        int stride_miny = stride * cent->miny;
+        int stride_maxy = stride * cent->maxy;
 
         for (x = cent->minx; x <= cent->maxx; x++) {
-            int width_miny_x = x + width_miny;
-            int width_maxy_x = x + width_maxy;
+            int stride_miny_x = x + stride_miny;
+            int stride_maxy_x = x + stride_maxy;
 
-            new[width_miny_x] =~new[width_miny_x];
-            new[width_maxy_x] =~new[width_maxy_x];
+            new[stride_miny_x] =~new[stride_miny_x];
+            new[stride_maxy_x] =~new[stride_maxy_x];
         }
 
         for (y = cent->miny; y <= cent->maxy; y++) {
-            int width_minx_y = cent->minx + y * width;
-            int width_maxx_y = cent->maxx + y * width;
+            int stride_minx_y = cent->minx + y * stride;
+            int stride_maxx_y = cent->maxx + y * stride;
 
-            new[width_minx_y] =~new[width_minx_y];
-            new[width_maxx_y] =~new[width_maxx_y];
+            new[stride_minx_y] =~new[stride_minx_y];
+            new[stride_maxx_y] =~new[stride_maxx_y];
         }
     } else if (style == LOCATE_CROSS) { /* Draw a cross on normal images. */
         int centy = cent->y * width;
+        int scenty = cent->y * stride;
 
         for (x = cent->x - 10;  x <= cent->x + 10; x++) {
-            new[centy + x] =~new[centy + x];
+            new[scenty + x] =~new[scenty + x];
             out[centy + x] =~out[centy + x];
         }
 
         for (y = cent->y - 10; y <= cent->y + 10; y++) {
-            new[cent->x + y * width] =~new[cent->x + y * width];
+            new[cent->x + y * stride] =~new[cent->x + y * stride];
             out[cent->x + y * width] =~out[cent->x + y * width];
         }
     }
@@ -236,21 +448,20 @@ void alg_draw_location(struct coord *cent, struct images *imgs, int width, unsig
 /**
  * alg_draw_red_location
  *          Draws a RED box around the movement.
+ *          The box is drawn on the planes described by view and, for the
+ *          debug box, on the packed motion image.
  */
-void alg_draw_red_location(struct coord *cent, struct images *imgs, int width, unsigned char *new,
+void alg_draw_red_location(struct coord *cent, struct images *imgs, struct image_view *view,
                            int style, int mode, int process_thisframe)
 {
     unsigned char *out = imgs->img_motion.image_norm;
-    unsigned char *new_u, *new_v;
-    int x, y, v, cwidth, cblock;
-
-    cwidth = width / 2;
-    cblock = imgs->motionsize / 4;
-    x = imgs->motionsize;
-    v = x + cblock;
-    out = imgs->img_motion.image_norm;
-    new_u = new + x;
-    new_v = new + v;
+    unsigned char *new = view->plane[0];
+    unsigned char *new_u = view->plane[1];
+    unsigned char *new_v = view->plane[2];
+    int width = imgs->width;
+    int stride = view->stride[0];
+    int cstride = view->stride[1];
+    int x, y;
 
     /* Debug image always gets a 'normal' box. */
     if ((mode == LOCATE_BOTH) && process_thisframe) {
@@ -275,73 +486,73 @@ void alg_draw_red_location(struct coord *cent, struct images *imgs, int width, u
     }
 
     if (style == LOCATE_REDBOX) { /* Draw a red box on normal images. */
-        int width_miny = width * cent->miny;
-        int width_maxy = width * cent->maxy;
-        int cwidth_miny = cwidth * (cent->miny / 2);
-        int cwidth_maxy = cwidth * (cent->maxy / 2);
+        int stride_miny = stride * cent->miny;
+        int stride_maxy = stride * cent->maxy;
+        int cstride_miny = cstride * (cent->miny / 2);
+        int cstride_maxy = cstride * (cent->maxy / 2);
 
         for (x = cent->minx + 2; x <= cent->maxx - 2; x += 2) {
-            int width_miny_x = x + width_miny;
-            int width_maxy_x = x + width_maxy;
-            int cwidth_miny_x = x / 2 + cwidth_miny;
-            int cwidth_maxy_x = x / 2 + cwidth_maxy;
+            int stride_miny_x = x + stride_miny;
+            int stride_maxy_x = x + stride_maxy;
+            int cstride_miny_x = x / 2 + cstride_miny;
+            int cstride_maxy_x = x / 2 + cstride_maxy;
 
-            new_u[cwidth_miny_x] = 128;
-            new_u[cwidth_maxy_x] = 128;
-            new_v[cwidth_miny_x] = 255;
-            new_v[cwidth_maxy_x] = 255;
+            new_u[cstride_miny_x] = 128;
+            new_u[cstride_maxy_x] = 128;
+            new_v[cstride_miny_x] = 255;
+            new_v[cstride_maxy_x] = 255;
 
-            new[width_miny_x] = 128;
-            new[width_maxy_x] = 128;
+            new[stride_miny_x] = 128;
+            new[stride_maxy_x] = 128;
 
-            new[width_miny_x + 1] = 128;
-            new[width_maxy_x + 1] = 128;
+            new[stride_miny_x + 1] = 128;
+            new[stride_maxy_x + 1] = 128;
 
-            new[width_miny_x + width] = 128;
-            new[width_maxy_x + width] = 128;
+            new[stride_miny_x + stride] = 128;
+            new[stride_maxy_x + stride] = 128;
 
-            new[width_miny_x + 1 + width] = 128;
-            new[width_maxy_x + 1 + width] = 128;
+            new[stride_miny_x + 1 + stride] = 128;
+            new[stride_maxy_x + 1 + stride] = 128;
         }
 
         for (y = cent->miny; y <= cent->maxy; y += 2) {
-            int width_minx_y = cent->minx + y * width;
-            int width_maxx_y = cent->maxx + y * width;
-            int cwidth_minx_y = (cent->minx / 2) + (y / 2) * cwidth;
-            int cwidth_maxx_y = (cent->maxx / 2) + (y / 2) * cwidth;
+            int stride_minx_y = cent->minx + y * stride;
+            int stride_maxx_y = cent->maxx + y * stride;
+            int cstride_minx_y = (cent->minx / 2) + (y / 2) * cstride;
+            int cstride_maxx_y = (cent->maxx / 2) + (y / 2) * cstride;
 
-            new_u[cwidth_minx_y] = 128;
-            new_u[cwidth_maxx_y] = 128;
-            new_v[cwidth_minx_y] = 255;
-            new_v[cwidth_maxx_y] = 255;
+            new_u[cstride_minx_y] = 128;
+            new_u[cstride_maxx_y] = 128;
+            new_v[cstride_minx_y] = 255;
+            new_v[cstride_maxx_y] = 255;
 
-            new[width_minx_y] = 128;
-            new[width_maxx_y] = 128;
+            new[stride_minx_y] = 128;
+            new[stride_maxx_y] = 128;
 
-            new[width_minx_y + width] = 128;
-            new[width_maxx_y + width] = 128;
+            new[stride_minx_y + stride] = 128;
+            new[stride_maxx_y + stride] = 128;
 
-            new[width_minx_y + 1] = 128;
-            new[width_maxx_y + 1] = 128;
+            new[stride_minx_y + 1] = 128;
+            new[stride_maxx_y + 1] = 128;
 
-            new[width_minx_y + width + 1] = 128;
-            new[width_maxx_y + width + 1] = 128;
+            new[stride_minx_y + stride + 1] = 128;
+            new[stride_maxx_y + stride + 1] = 128;
         }
     } else if (style == LOCATE_REDCROSS) { /* Draw a red cross on normal images. */
-        int cwidth_maxy = cwidth * (cent->y / 2);
+        int cstride_maxy = cstride * (cent->y / 2);
 
         for (x = cent->x - 10; x <= cent->x + 10; x += 2) {
-            int cwidth_maxy_x = x / 2 + cwidth_maxy;
+            int cstride_maxy_x = x / 2 + cstride_maxy;
 
-            new_u[cwidth_maxy_x] = 128;
-            new_v[cwidth_maxy_x] = 255;
+            new_u[cstride_maxy_x] = 128;
+            new_v[cstride_maxy_x] = 255;
         }
 
         for (y = cent->y - 10; y <= cent->y + 10; y += 2) {
-            int cwidth_minx_y = (cent->x / 2) + (y / 2) * cwidth;
+            int cstride_minx_y = (cent->x / 2) + (y / 2) * cstride;
 
-            new_u[cwidth_minx_y] = 128;
-            new_v[cwidth_minx_y] = 255;
+            new_u[cstride_minx_y] = 128;
+            new_v[cstride_minx_y] = 255;
         }
     }
 }
@@ -359,28 +570,46 @@ void alg_draw_red_location(struct coord *cent, struct images *imgs, int width, u
 void alg_noise_tune(struct context *cnt, unsigned char *new)
 {
     struct images *imgs = &cnt->imgs;
-    int i;
-    unsigned char *ref = imgs->ref;
+    struct alg_state row;
+    int x, y;
     int diff, sum = 0, count = 0;
-    unsigned char *mask = imgs->mask;
-    unsigned char *smartmask = imgs->smartmask_final;
 
-    i = imgs->motionsize;
+    /* The fused detection measured it before the reference was updated */
+    if (imgs->ref_fused) {
+        count = imgs->noise_count;
+        if (count > 3)
+            sum = imgs->noise_sum / (count / 3);
+        else
+            sum = imgs->noise_sum;
+        cnt->noise = 4 + (cnt->noise + sum) / 2;
+        return;
+    }
+
+    /* The same sums over the grid of alg_luma_stats */
+    if (imgs->luma_valid) {
+        for (diff = 0; diff < 256; diff++)
+            sum += imgs->luma_diffs[diff] * (diff + 1);
+        count = imgs->luma_samples;
+        if (count > 3)
+            sum /= count / 3;
+        cnt->noise = 4 + (cnt->noise + sum) / 2;
+        return;
+    }
+
+    for (y = 0; y < imgs->detect_height; y++) {
+        alg_state_row(imgs, y, &row);
 
-    for (; i > 0; i--) {
-        diff = ABS(*ref - *new);
+        for (x = 0; x < imgs->detect_width; x++, new++) {
+            diff = ABS(row.ref[x] - *new);
 
-        if (mask)
-            diff = ((diff * *mask++) / 255);
+            if (imgs->mask)
+                diff = ((diff * row.mask[x]) / 255);
 
-        if (*smartmask) {
-            sum += diff + 1;
-            count++;
+            if (row.smartmask_final[x]) {
+                sum += diff + 1;
+                count++;
+            }
         }
-
-        ref++;
-        new++;
-        smartmask++;
     }
 
     if (count > 3)  /* Avoid divide by zero. */
@@ -431,85 +660,121 @@ void alg_threshold_tune(struct context *cnt, int diffs, int motion)
 
 /*
  * Labeling by Joerg Weber. Based on an idea from Hubert Mara.
- * Floodfill enhanced by Ian McConnel based on code from
- * http://www.acm.org/pubs/tog/GraphicsGems/
- * http://www.codeproject.com/gdi/QuickFill.asp
-
- * Filled horizontal segment of scanline y for xl <= x <= xr.
- * Parent segment was on line y - dy.  dy = 1 or -1
+ *
+ * Two pass connected component labeling with union-find over the runs of
+ * motion pixels in each row. The first pass finds the runs of a row from
+ * a bit mask of 64 pixels at a time and gives each run the label of the
+ * runs of the row above it touches (4 connectivity), joining their labels
+ * when there are several, or a new provisional label. The labels are then
+ * resolved to consecutive final numbers and the second pass writes them to
+ * imgs->labels while it collects the area, bounding box and coordinate sums
+ * of every label, once per run. The cost is two linear sweeps whatever the
+ * number of areas in the image.
+ *
+ * imgs->label_parent holds the union-find forest. Each label points to a
+ * smaller one or to itself, so a single pass in increasing order resolves
+ * them. 4 connectivity creates at most one label per two pixels.
  */
 
-#define MAXS 10000               /* max depth of stack */
-
-#define PUSH(Y, XL, XR, DY)     /* push new segment on stack */  \
-        if (sp<stack+MAXS && Y+(DY) >= 0 && Y+(DY) < height)     \
-        {sp->y = Y; sp->xl = XL; sp->xr = XR; sp->dy = DY; sp++;}
-
-#define POP(Y, XL, XR, DY)      /* pop segment off stack */      \
-        {sp--; Y = sp->y+(DY = sp->dy); XL = sp->xl; XR = sp->xr;}
-
-typedef struct {
-    short y, xl, xr, dy;
-} Segment;
-
 /**
- * iflood
- *
+ * alg_label_find
+ *      Root of a provisional label, halving the path on the way.
  */
-static int iflood(int x, int y, int width, int height,
-                  unsigned char *out, int *labels, int newvalue, int oldvalue)
+static int alg_label_find(int *parent, int label)
 {
-    int l, x1, x2, dy;
-    Segment stack[MAXS], *sp = stack;    /* Stack of filled segments. */
-    int count = 0;
-
-    if (x < 0 || x >= width || y < 0 || y >= height)
-        return 0;
-
-    PUSH(y, x, x, 1);             /* Needed in some cases. */
-    PUSH(y+1, x, x, -1);          /* Seed segment (popped 1st). */
-
-    while (sp > stack) {
-        /* Pop segment off stack and fill a neighboring scan line. */
-        POP(y, x1, x2, dy);
-        /*
-         * Segment of scan line y-dy for x1<=x<=x2 was previously filled,
-         * now explore adjacent pixels in scan line y
-         */
-        for (x = x1; x >= 0 && out[y * width + x] != 0 && labels[y * width + x] == oldvalue; x--) {
-            labels[y * width + x] = newvalue;
-            count++;
-        }
-
-        if (x >= x1)
-            goto skip;
-
-        l = x + 1;
+    while (parent[label] != label) {
+        parent[label] = parent[parent[label]];
+        label = parent[label];
+    }
+    return label;
+}
 
-        if (l < x1)
-            PUSH(y, l, x1 - 1, -dy);  /* Leak on left? */
+/**
+ * alg_label_union
+ *      Joins two provisional labels under the smaller root.
+ */
+static int alg_label_union(int *parent, int label1, int label2)
+{
+    label1 = alg_label_find(parent, label1);
+    label2 = alg_label_find(parent, label2);
 
-        x = x1 + 1;
+    if (label1 < label2) {
+        parent[label2] = label1;
+        return label1;
+    }
+    parent[label1] = label2;
+    return label2;
+}
 
-        do {
-            for (; x < width && out[y * width + x] != 0 && labels[y * width + x] == oldvalue; x++) {
-                labels[y * width + x] = newvalue;
+/**
+ * alg_label_row
+ *      Appends the runs of motion pixels of one row of the motion bitmap
+ *      to runs. Returns the new number of runs.
+ */
+static int alg_label_row(const uint64_t *row, int width, int y,
+                         struct label_run *runs, int count)
+{
+    uint64_t mask, starts, ends, carry = 0;
+    int x, pos, start = 0;
+
+    for (x = 0; x < width; x += 64) {
+        mask = row[x >> 6];
+
+        /* A run starts at a set bit after a clear one and ends at the opposite */
+        starts = mask & ~((mask << 1) | carry);
+        ends = ~mask & ((mask << 1) | carry);
+        carry = mask >> 63;
+
+        while (starts | ends) {
+            pos = __builtin_ctzll(starts | ends);
+            if (starts & ((uint64_t)1 << pos)) {
+                start = x + pos;
+                starts &= starts - 1;
+            } else {
+                runs[count].y = y;
+                runs[count].start = start;
+                runs[count].end = x + pos;
                 count++;
+                ends &= ends - 1;
             }
+        }
+    }
 
-            PUSH(y, l, x - 1, dy);
-
-            if (x > x2 + 1)
-                PUSH(y, x2 + 1, x - 1, -dy);  /* Leak on right? */
+    /* A run reaching the right edge of a row that fills its last word */
+    if (carry) {
+        runs[count].y = y;
+        runs[count].start = start;
+        runs[count].end = width;
+        count++;
+    }
 
-            skip:
+    return count;
+}
 
-            for (x++; x <= x2 && !(out[y * width + x] != 0 && labels[y * width + x] == oldvalue); x++);
+/**
+ * alg_label_alloc
+ *      Makes room for count runs and count label statistics plus the
+ *      unused label 0. Both grow with the busiest image seen so far.
+ */
+static void alg_label_alloc(struct images *imgs, int runs, int stats)
+{
+    int size;
+
+    if (runs > imgs->label_runs_size) {
+        size = imgs->label_runs_size ? imgs->label_runs_size : 1024;
+        while (size < runs) size *= 2;
+        imgs->label_runs = myrealloc(imgs->label_runs, size * sizeof(struct label_run)
+            , "alg_label_alloc");
+        imgs->label_runs_size = size;
+    }
 
-            l = x;
-        } while (x <= x2);
+    if (stats + 1 > imgs->label_stats_size) {
+        size = imgs->label_stats_size ? imgs->label_stats_size : 64;
+        while (size < stats + 1) size *= 2;
+        imgs->label_stats = myrealloc(imgs->label_stats, size * sizeof(struct label_stats)
+            , "alg_label_alloc");
+        imgs->label_stats_size = size;
     }
-    return count;
 }
 
 /**
@@ -519,13 +784,16 @@ static int iflood(int x, int y, int width, int height,
 static int alg_labeling(struct context *cnt)
 {
     struct images *imgs = &cnt->imgs;
-    unsigned char *out = imgs->img_motion.image_norm;
-    int *labels = imgs->labels;
-    int ix, iy, pixelpos;
-    int width = imgs->width;
-    int height = imgs->height;
-    int labelsize = 0;
-    int current_label = 2;
+    struct label_stats *stat;
+    struct label_run *runs, *run;
+    const uint64_t *bits = imgs->motion_bits;
+    int *labels;
+    int *parent = imgs->label_parent;
+    int x, y, label, indx, above, row_first, prev_first = 0, count = 0, provisional = 0;
+    int width = imgs->detect_width;
+    int height = imgs->detect_height;
+    /* The areas are compared and reported in pixels of the image */
+    int area, area_scale = imgs->detect_scale * imgs->detect_scale;
     /* Keep track of the area just under the threshold.  */
     int max_under = 0;
 
@@ -534,53 +802,98 @@ static int alg_labeling(struct context *cnt)
     /* ALL labels above threshold are counted as labelgroup. */
     imgs->labelgroup_max = 0;
     imgs->labels_above = 0;
-
-    /* Init: 0 means no label set / not checked. */
-    memset(labels, 0, width * height * sizeof(*labels));
-    pixelpos = 0;
-
-    for (iy = 0; iy < height - 1; iy++) {
-        for (ix = 0; ix < width - 1; ix++, pixelpos++) {
-            /* No motion - no label */
-            if (out[pixelpos] == 0) {
-                labels[pixelpos] = 1;
-                continue;
+    imgs->labels_total = 0;
+
+    /* First pass: the runs of each row joined to the runs above them. */
+    parent[0] = 0;
+    for (y = 0; y < height; y++, bits += imgs->motion_stride) {
+        alg_label_alloc(imgs, count + width / 2 + 1, 0);
+        runs = imgs->label_runs;
+
+        row_first = count;
+        count = alg_label_row(bits, width, y, runs, count);
+
+        above = prev_first;
+        for (indx = row_first; indx < count; indx++) {
+            run = &runs[indx];
+            label = 0;
+
+            /* Runs of the row above that overlap this one */
+            while (above < row_first && runs[above].end <= run->start) above++;
+            for (x = above; x < row_first && runs[x].start < run->end; x++) {
+                if (label == 0)
+                    label = runs[x].label;
+                else if (runs[x].label != label)
+                    label = alg_label_union(parent, label, runs[x].label);
             }
+            /* The last of them may also touch the next run */
+            if (x > above) above = x - 1;
 
-            /* Already visited by iflood */
-            if (labels[pixelpos] > 0)
-                continue;
-
-            labelsize = iflood(ix, iy, width, height, out, labels, current_label, 0);
+            if (label == 0) {
+                provisional++;
+                parent[provisional] = provisional;
+                label = provisional;
+            }
+            run->label = label;
+        }
+        prev_first = row_first;
+    }
 
-            if (labelsize > 0) {
-                //MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "Label: %i (%i) Size: %i (%i,%i)",
-                //            current_label, cnt->current_image->total_labels,
-                //           labelsize, ix, iy);
+    /* Resolve the provisional labels to consecutive final labels. */
+    for (label = 1; label <= provisional; label++) {
+        if (parent[label] == label)
+            parent[label] = ++imgs->labels_total;
+        else
+            parent[label] = parent[parent[label]];
+    }
 
-                /* Label above threshold? Mark it again (add 32768 to labelnumber). */
-                if (labelsize > cnt->threshold) {
-                    labelsize = iflood(ix, iy, width, height, out, labels, current_label + 32768, current_label);
-                    imgs->labelgroup_max += labelsize;
-                    imgs->labels_above++;
-                } else if(max_under < labelsize)
-                    max_under = labelsize;
+    imgs->label_runs_count = count;
+    alg_label_alloc(imgs, 0, imgs->labels_total);
+    memset(imgs->label_stats, 0, (imgs->labels_total + 1) * sizeof(struct label_stats));
+
+    /* Second pass: final labels and the statistics of each of them, per run. */
+    memset(imgs->labels, 0, width * height * sizeof(*imgs->labels));
+    for (run = imgs->label_runs; run < imgs->label_runs + count; run++) {
+        label = parent[run->label];
+        run->label = label;
+        labels = imgs->labels + run->y * width;
+        for (x = run->start; x < run->end; x++) labels[x] = label;
+
+        stat = &imgs->label_stats[label];
+        if (stat->area == 0) {
+            stat->minx = run->start;
+            stat->maxx = run->end - 1;
+            stat->miny = run->y;
+        } else {
+            if (run->start < stat->minx) stat->minx = run->start;
+            if (run->end - 1 > stat->maxx) stat->maxx = run->end - 1;
+        }
+        stat->maxy = run->y;
+        stat->area += run->end - run->start;
+        stat->sumx += (long long)(run->start + run->end - 1) * (run->end - run->start) / 2;
+        stat->sumy += (long long)run->y * (run->end - run->start);
+    }
 
-                if (imgs->labelsize_max < labelsize) {
-                    imgs->labelsize_max = labelsize;
-                    imgs->largest_label = current_label;
-                }
+    for (label = 1; label <= imgs->labels_total; label++) {
+        stat = &imgs->label_stats[label];
+        area = stat->area * area_scale;
+
+        /* Label above threshold? Count it in the labelgroup. */
+        if (area > cnt->threshold) {
+            stat->above = 1;
+            imgs->labelgroup_max += area;
+            imgs->labels_above++;
+        } else if (max_under < area) {
+            max_under = area;
+        }
 
-                cnt->current_image->total_labels++;
-                current_label++;
-            }
+        if (imgs->labelsize_max < area) {
+            imgs->labelsize_max = area;
+            imgs->largest_label = label;
         }
-        pixelpos++; /* Compensate for ix < width - 1 */
     }
 
-    //MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%i Labels found. Largest connected Area: %i Pixel(s). "
-    //           "Largest Label: %i", imgs->largest_label, imgs->labelsize_max,
-    //           cnt->current_image->total_labels);
+    cnt->current_image->total_labels = imgs->labels_total;
 
     /* Return group of significant labels or if that's none, the next largest
      * group (which is under the threshold, but especially for setup gives an
@@ -589,161 +902,114 @@ static int alg_labeling(struct context *cnt)
     return imgs->labelgroup_max ? imgs->labelgroup_max : max_under;
 }
 
+/*
+ * The despeckle filters below work in place on a stripe of rows of the
+ * motion bitmap, 64 pixels per operation. The horizontal neighbours of
+ * the pixels of a word are the word shifted by one bit, with the bit
+ * carried in from the next word. above and below are copies of the rows
+ * just outside the stripe taken before any stripe was changed; NULL at
+ * the image border, where the rows outside the image count as no motion.
+ * Like the byte filters they replace, they clear the left and right
+ * columns and return the number of pixels left in motion.
+ */
+
 /**
- * dilate9
- *      Dilates a 3x3 box.
+ * alg_bits_west
+ *      The pixels of a row moved one to the right: bit x is pixel x - 1.
  */
-static int dilate9(unsigned char *img, int width, int height, void *buffer)
+static uint64_t alg_bits_west(const uint64_t *row, int indx)
 {
-    /*
-     * - row1, row2 and row3 represent lines in the temporary buffer.
-     * - Window is a sliding window containing max values of the columns
-     *   in the 3x3 matrix.
-     * - width is an index into the sliding window (this is faster than
-     *   doing modulo 3 on i).
-     * - blob keeps the current max value.
-     */
-    int y, i, sum = 0, widx;
-    unsigned char *row1, *row2, *row3, *rowTemp,*yp;
-    unsigned char window[3], blob, latest;
-
-    /* Set up row pointers in the temporary buffer. */
-    row1 = buffer;
-    row2 = row1 + width;
-    row3 = row2 + width;
-
-    /* Init rows 2 and 3. */
-    memset(row2, 0, width);
-    memcpy(row3, img, width);
-
-    /* Pointer to the current row in img. */
-    yp = img;
-
-    for (y = 0; y < height; y++) {
-        /* Move down one step; row 1 becomes the previous row 2 and so on. */
-        rowTemp = row1;
-        row1 = row2;
-        row2 = row3;
-        row3 = rowTemp;
-
-        /* If we're at the last row, fill with zeros, otherwise copy from img. */
-        if (y == height - 1)
-            memset(row3, 0, width);
-        else
-            memcpy(row3, yp+width, width);
-
-        /* Init slots 0 and 1 in the moving window. */
-        window[0] = MAX3(row1[0], row2[0], row3[0]);
-        window[1] = MAX3(row1[1], row2[1], row3[1]);
-
-        /* Init blob to the current max, and set window index. */
-        blob = MAX2(window[0], window[1]);
-        widx = 2;
-
-        /*
-         * Iterate over the current row; index i is off by one to eliminate
-         * a lot of +1es in the loop.
-         */
-        for (i = 2; i <= width - 1; i++) {
-            /* Get the max value of the next column in the 3x3 matrix. */
-            latest = window[widx] = MAX3(row1[i], row2[i], row3[i]);
-
-            /*
-             * If the value is larger than the current max, use it. Otherwise,
-             * calculate a new max (because the new value may not be the max.
-             */
-            if (latest >= blob)
-                blob = latest;
-            else
-                blob = MAX3(window[0], window[1], window[2]);
-
-            /* Write the max value (blob) to the image. */
-            if (blob != 0) {
-                *(yp + i - 1) = blob;
-                sum++;
-            }
-
-            /* Wrap around the window index if necessary. */
-            if (++widx == 3)
-                widx = 0;
-        }
-
-        /* Store zeros in the vertical sides. */
-        *yp = *(yp + width - 1) = 0;
-        yp += width;
-    }
+    return (row[indx] << 1) | (indx > 0 ? row[indx - 1] >> 63 : 0);
+}
 
-    return sum;
+/**
+ * alg_bits_east
+ *      The pixels of a row moved one to the left: bit x is pixel x + 1.
+ */
+static uint64_t alg_bits_east(const uint64_t *row, int indx, int stride)
+{
+    return (row[indx] >> 1) | (indx < stride - 1 ? row[indx + 1] << 63 : 0);
 }
 
 /**
- * dilate5
- *      Dilates a + shape.
+ * alg_bits_filter
+ *      Runs one despeckle step, E erode9, e erode5, D dilate9 or d dilate5,
+ *      on a stripe of the motion bitmap.
  */
-static int dilate5(unsigned char *img, int width, int height, void *buffer)
+static int alg_bits_filter(uint64_t *bits, int width, int stride, int height, uint64_t *buffer,
+                           const uint64_t *above, const uint64_t *below, char filter)
 {
+    uint64_t *prev, *cur, *vert, *zero, *rowTemp, *row;
+    const uint64_t *next;
+    uint64_t last;
+    int y, indx, sum = 0;
+
     /*
-     * - row1, row2 and row3 represent lines in the temporary buffer.
-     * - mem holds the max value of the overlapping part of two + shapes.
+     * Copies of the unchanged previous and current row, the columns of the
+     * 3x3 box and a row without motion.
      */
-    int y, i, sum = 0;
-    unsigned char *row1, *row2, *row3, *rowTemp, *yp;
-    unsigned char blob, mem, latest;
-
-    /* Set up row pointers in the temporary buffer. */
-    row1 = buffer;
-    row2 = row1 + width;
-    row3 = row2 + width;
-
-    /* Init rows 2 and 3. */
-    memset(row2, 0, width);
-    memcpy(row3, img, width);
-
-    /* Pointer to the current row in img. */
-    yp = img;
-
-    for (y = 0; y < height; y++) {
-        /* Move down one step; row 1 becomes the previous row 2 and so on. */
-        rowTemp = row1;
-        row1 = row2;
-        row2 = row3;
-        row3 = rowTemp;
-
-        /* If we're at the last row, fill with zeros, otherwise copy from img. */
-        if (y == height - 1)
-            memset(row3, 0, width);
+    prev = buffer;
+    cur = prev + stride;
+    vert = cur + stride;
+    zero = vert + stride;
+    memset(zero, 0, stride * sizeof(*zero));
+
+    if (above)
+        memcpy(prev, above, stride * sizeof(*prev));
+    else
+        memset(prev, 0, stride * sizeof(*prev));
+
+    /* The pixels right of the last column are never in motion */
+    last = (width & 63) ? ((uint64_t)1 << (width & 63)) - 1 : ~(uint64_t)0;
+    last &= ~((uint64_t)1 << ((width - 1) & 63));
+
+    for (y = 0, row = bits; y < height; y++, row += stride) {
+        memcpy(cur, row, stride * sizeof(*cur));
+
+        if (y < height - 1)
+            next = row + stride;
         else
-            memcpy(row3, yp + width, width);
+            next = below ? below : zero;
 
-        /* Init mem and set blob to force an evaluation of the entire + shape. */
-        mem = MAX2(row2[0], row2[1]);
-        blob = 1; /* dummy value, must be > 0 */
-
-        for (i = 1; i < width - 1; i++) {
-            /* Get the max value of the "right edge" of the + shape. */
-            latest = MAX3(row1[i], row2[i + 1], row3[i]);
+        switch (filter) {
+        case 'E':
+            /* All of the 3x3 box in motion: the columns, then left and right */
+            for (indx = 0; indx < stride; indx++)
+                vert[indx] = prev[indx] & cur[indx] & next[indx];
+            for (indx = 0; indx < stride; indx++)
+                row[indx] = vert[indx] & alg_bits_west(vert, indx) & alg_bits_east(vert, indx, stride);
+            break;
+        case 'e':
+            for (indx = 0; indx < stride; indx++)
+                row[indx] = prev[indx] & next[indx] & cur[indx] &
+                    alg_bits_west(cur, indx) & alg_bits_east(cur, indx, stride);
+            break;
+        case 'D':
+            /* Any of the 3x3 box in motion */
+            for (indx = 0; indx < stride; indx++)
+                vert[indx] = prev[indx] | cur[indx] | next[indx];
+            for (indx = 0; indx < stride; indx++)
+                row[indx] = vert[indx] | alg_bits_west(vert, indx) | alg_bits_east(vert, indx, stride);
+            break;
+        case 'd':
+            for (indx = 0; indx < stride; indx++)
+                row[indx] = prev[indx] | next[indx] | cur[indx] |
+                    alg_bits_west(cur, indx) | alg_bits_east(cur, indx, stride);
+            break;
+        }
 
-            if (blob == 0) {
-                /* In case the last blob is zero, only latest matters. */
-                blob = latest;
-                mem = row2[i + 1];
-            } else {
-                /* Otherwise, we have to check both latest and mem. */
-                blob = MAX2(mem, latest);
-                mem = MAX2(row2[i], row2[i + 1]);
-            }
+        /* Clear the vertical sides */
+        row[0] &= ~(uint64_t)1;
+        row[stride - 1] &= last;
 
-            /* Write the max value (blob) to the image. */
-            if (blob != 0) {
-                *(yp + i) = blob;
-                sum++;
-            }
-        }
+        for (indx = 0; indx < stride; indx++)
+            sum += __builtin_popcountll(row[indx]);
 
-        /* Store zeros in the vertical sides. */
-        *yp = *(yp + width - 1) = 0;
-        yp += width;
+        rowTemp = prev;
+        prev = cur;
+        cur = rowTemp;
     }
+
     return sum;
 }
 
@@ -753,8 +1019,8 @@ static int dilate5(unsigned char *img, int width, int height, void *buffer)
  */
 static int erode9(unsigned char *img, int width, int height, void *buffer, unsigned char flag)
 {
-    int y, i, sum = 0;
-    char *Row1,*Row2,*Row3;
+    int y, sum = 0;
+    unsigned char *Row1,*Row2,*Row3;
 
     Row1 = buffer;
     Row2 = Row1 + width;
@@ -771,20 +1037,7 @@ static int erode9(unsigned char *img, int width, int height, void *buffer, unsig
         else
             memcpy(Row3, img + (y+1) * width, width);
 
-        for (i = width - 2; i >= 1; i--) {
-            if (Row1[i - 1] == 0 ||
-                Row1[i]     == 0 ||
-                Row1[i + 1] == 0 ||
-                Row2[i - 1] == 0 ||
-                Row2[i]     == 0 ||
-                Row2[i + 1] == 0 ||
-                Row3[i - 1] == 0 ||
-                Row3[i]     == 0 ||
-                Row3[i + 1] == 0)
-                img[y * width + i] = 0;
-            else
-                sum++;
-        }
+        sum += alg_simd_erode(img + y * width, Row1, Row2, Row3, width, FALSE);
 
         img[y * width] = img[y * width + width - 1] = flag;
     }
@@ -797,8 +1050,8 @@ static int erode9(unsigned char *img, int width, int height, void *buffer, unsig
  */
 static int erode5(unsigned char *img, int width, int height, void *buffer, unsigned char flag)
 {
-    int y, i, sum = 0;
-    char *Row1,*Row2,*Row3;
+    int y, sum = 0;
+    unsigned char *Row1,*Row2,*Row3;
 
     Row1 = buffer;
     Row2 = Row1 + width;
@@ -815,53 +1068,215 @@ static int erode5(unsigned char *img, int width, int height, void *buffer, unsig
         else
             memcpy(Row3, img + (y + 1) * width, width);
 
-        for (i = width - 2; i >= 1; i--) {
-            if (Row1[i]     == 0 ||
-                Row2[i - 1] == 0 ||
-                Row2[i]     == 0 ||
-                Row2[i + 1] == 0 ||
-                Row3[i]     == 0)
-                img[y * width + i] = 0;
-            else
-                sum++;
-        }
+        sum += alg_simd_erode(img + y * width, Row1, Row2, Row3, width, TRUE);
 
         img[y * width] = img[y * width + width - 1] = flag;
     }
     return sum;
 }
 
+/**
+ * alg_stripe_rows
+ *      First row and number of rows of one stripe of the motion image.
+ */
+static void alg_stripe_rows(struct alg_stripe_job *job, int indx, int *row, int *rows)
+{
+    int height = job->cnt->imgs.detect_height;
+
+    *row = (height * indx) / job->stripes;
+    *rows = (height * (indx + 1)) / job->stripes - *row;
+}
+
+/**
+ * alg_stripe_run
+ *      Runs fn on every stripe, in the worker pool when the camera has more
+ *      than one detection thread, and returns the sum of the stripe results.
+ */
+static int alg_stripe_run(struct alg_stripe_job *job, workpool_fn fn)
+{
+    int indx, sum = 0;
+
+    workpool_run(fn, job, job->stripes);
+
+    for (indx = 0; indx < job->stripes; indx++) sum += job->sums[indx];
+
+    return sum;
+}
+
+/**
+ * alg_stripe_init
+ *      Splits the image in one stripe per detection thread. Stripes are kept
+ *      at least ALG_STRIPE_MIN_ROWS high so that the halo rows and the
+ *      hand-over stay small next to the work.
+ */
+static void alg_stripe_init(struct context *cnt, struct alg_stripe_job *job)
+{
+    int stripes = cnt->conf.detection_threads;
+
+    if (stripes > cnt->imgs.detect_height / ALG_STRIPE_MIN_ROWS)
+        stripes = cnt->imgs.detect_height / ALG_STRIPE_MIN_ROWS;
+    if (stripes > ALG_STRIPE_MAX)
+        stripes = ALG_STRIPE_MAX;
+    if (stripes < 1)
+        stripes = 1;
+
+    job->cnt = cnt;
+    job->stripes = stripes;
+}
+
+/**
+ * alg_count_row
+ *      Counts the pixels in motion of row y in motion_rows and adds them to
+ *      the column counts of a stripe. count is the number of pixels in
+ *      motion of the row when the caller knows it, -1 otherwise.
+ */
+static int alg_count_row(struct images *imgs, int *cols, int y, int count)
+{
+    const uint64_t *bits = imgs->motion_bits + y * imgs->motion_stride;
+    uint64_t word;
+    int indx;
+
+    if (count < 0) {
+        count = 0;
+        for (indx = 0; indx < imgs->motion_stride; indx++)
+            count += __builtin_popcountll(bits[indx]);
+    }
+    imgs->motion_rows[y] = count;
+
+    for (indx = 0; count && indx < imgs->motion_stride; indx++) {
+        for (word = bits[indx]; word; word &= word - 1)
+            cols[64 * indx + __builtin_ctzll(word)]++;
+    }
+
+    return count;
+}
+
+/**
+ * alg_count_merge
+ *      Adds up the column counts the stripes left one after the other at
+ *      cols into motion_cols, which then match the motion bitmap.
+ */
+static void alg_count_merge(struct images *imgs, struct alg_stripe_job *job, const int *cols)
+{
+    int indx, x;
+
+    memcpy(imgs->motion_cols, cols, imgs->detect_width * sizeof(*imgs->motion_cols));
+    for (indx = 1; indx < job->stripes; indx++) {
+        cols += imgs->detect_width;
+        for (x = 0; x < imgs->detect_width; x++)
+            imgs->motion_cols[x] += cols[x];
+    }
+
+    imgs->motion_counts = TRUE;
+}
+
+/**
+ * alg_despeckle_cols
+ *      The column counts of the stripes follow the work buffers and the
+ *      halo rows of the despeckle in common_buffer.
+ */
+static int *alg_despeckle_cols(struct alg_stripe_job *job)
+{
+    return (int *)((uint64_t *)job->cnt->imgs.common_buffer + 6 * job->stripes * job->cnt->imgs.motion_stride);
+}
+
+/**
+ * alg_despeckle_stripe
+ *      Runs one erode or dilate step of the despeckle on one stripe.
+ */
+static void alg_despeckle_stripe(void *arg, int indx)
+{
+    struct alg_stripe_job *job = arg;
+    int stride = job->cnt->imgs.motion_stride;
+    int row, rows, y, *cols;
+    uint64_t *buffer, *halo, *above, *below;
+
+    alg_stripe_rows(job, indx, &row, &rows);
+
+    /* Four rows of work buffer per stripe followed by the halo rows. */
+    buffer = (uint64_t *)job->cnt->imgs.common_buffer + 4 * indx * stride;
+    halo = (uint64_t *)job->cnt->imgs.common_buffer + (4 * job->stripes + 2 * indx) * stride;
+    above = (indx > 0) ? halo : NULL;
+    below = (indx < job->stripes - 1) ? halo + stride : NULL;
+
+    job->sums[indx] = alg_bits_filter(job->cnt->imgs.motion_bits + row * stride
+        , job->cnt->imgs.detect_width, stride, rows, buffer, above, below, job->filter);
+
+    /* The last step counts the rows of the stripe while they are in the cache */
+    if (job->counts) {
+        cols = alg_despeckle_cols(job) + indx * job->cnt->imgs.detect_width;
+        memset(cols, 0, job->cnt->imgs.detect_width * sizeof(*cols));
+        for (y = row; y < row + rows; y++)
+            alg_count_row(&job->cnt->imgs, cols, y, -1);
+    }
+}
+
+/**
+ * alg_despeckle_step
+ *      Runs one erode or dilate step over all stripes. The rows around each
+ *      stripe are saved first since the neighbouring stripes change them.
+ *      The last step counts the pixels in motion per row and column.
+ *      Returns the pixels left in motion counted in pixels of the image.
+ */
+static int alg_despeckle_step(struct alg_stripe_job *job, char filter, int counts)
+{
+    int stride = job->cnt->imgs.motion_stride;
+    uint64_t *bits = job->cnt->imgs.motion_bits;
+    uint64_t *halo;
+    int indx, row, rows, diffs;
+
+    if (job->stripes > 1) {
+        for (indx = 0; indx < job->stripes; indx++) {
+            alg_stripe_rows(job, indx, &row, &rows);
+            halo = (uint64_t *)job->cnt->imgs.common_buffer + (4 * job->stripes + 2 * indx) * stride;
+            if (indx > 0)
+                memcpy(halo, bits + (row - 1) * stride, stride * sizeof(*halo));
+            if (indx < job->stripes - 1)
+                memcpy(halo + stride, bits + (row + rows) * stride, stride * sizeof(*halo));
+        }
+    }
+
+    job->filter = filter;
+    job->counts = counts;
+    /* The counts of the diff no longer match the bitmap */
+    job->cnt->imgs.motion_counts = FALSE;
+
+    diffs = alg_stripe_run(job, alg_despeckle_stripe);
+    if (job->counts)
+        alg_count_merge(&job->cnt->imgs, job, alg_despeckle_cols(job));
+
+    return diffs * job->cnt->imgs.detect_scale * job->cnt->imgs.detect_scale;
+}
+
 /**
  * alg_despeckle
  *      Despeckling routine to remove noisy detections.
  */
 int alg_despeckle(struct context *cnt, int olddiffs)
 {
+    struct alg_stripe_job job;
     int diffs = 0;
-    unsigned char *out = cnt->imgs.img_motion.image_norm;
-    int width = cnt->imgs.width;
-    int height = cnt->imgs.height;
-    int done = 0, i, len = strlen(cnt->conf.despeckle_filter);
-    unsigned char *common_buffer = cnt->imgs.common_buffer;
+    int done = 0, i, last, len = strlen(cnt->conf.despeckle_filter);
+
+    alg_stripe_init(cnt, &job);
+
+    /* The last erode or dilate, the labeling leaves the bitmap as it is */
+    for (i = 0, last = -1; i < len && cnt->conf.despeckle_filter[i] != 'l'; i++) {
+        if (strchr("EeDd", cnt->conf.despeckle_filter[i]))
+            last = i;
+    }
 
     for (i = 0; i < len; i++) {
         switch (cnt->conf.despeckle_filter[i]) {
         case 'E':
-            if ((diffs = erode9(out, width, height, common_buffer, 0)) == 0)
-                i = len;
-            done = 1;
-            break;
         case 'e':
-            if ((diffs = erode5(out, width, height, common_buffer, 0)) == 0)
+            if ((diffs = alg_despeckle_step(&job, cnt->conf.despeckle_filter[i], i == last)) == 0)
                 i = len;
             done = 1;
             break;
         case 'D':
-            diffs = dilate9(out, width, height, common_buffer);
-            done = 1;
-            break;
         case 'd':
-            diffs = dilate5(out, width, height, common_buffer);
+            diffs = alg_despeckle_step(&job, cnt->conf.despeckle_filter[i], i == last);
             done = 1;
             break;
         /* No further despeckle after labeling! */
@@ -891,314 +1306,407 @@ int alg_despeckle(struct context *cnt, int olddiffs)
  */
 void alg_tune_smartmask(struct context *cnt)
 {
-    int i, diff;
-    int motionsize = cnt->imgs.motionsize;
-    unsigned char *smartmask = cnt->imgs.smartmask;
+    int y;
+    struct alg_state row;
     unsigned char *smartmask_final = cnt->imgs.smartmask_final;
-    int *smartmask_buffer = cnt->imgs.smartmask_buffer;
     int sensitivity = cnt->lastrate * (11 - cnt->smartmask_speed);
 
-    for (i = 0; i < motionsize; i++) {
-        /* Decrease smart_mask sensitivity every 5*speed seconds only. */
-        if (smartmask[i] > 0)
-            smartmask[i]--;
-        /* Increase smart_mask sensitivity based on the buffered values. */
-        diff = smartmask_buffer[i]/sensitivity;
-
-        if (diff) {
-            if (smartmask[i] <= diff + 80)
-                smartmask[i] += diff;
-            else
-                smartmask[i] = 80;
-            smartmask_buffer[i] %= sensitivity;
-        }
-        /* Transfer raw mask to the final stage when above trigger value. */
-        if (smartmask[i] > 20)
-            smartmask_final[i] = 0;
-        else
-            smartmask_final[i] = 255;
+    for (y = 0; y < cnt->imgs.detect_height; y++) {
+        alg_state_row(&cnt->imgs, y, &row);
+        alg_simd_smartmask(row.smartmask, row.smartmask_buffer
+            , smartmask_final + y * cnt->imgs.detect_width, sensitivity, cnt->imgs.detect_width);
     }
     /* Further expansion (here:erode due to inverted logic!) of the mask. */
-    diff = erode9(smartmask_final, cnt->imgs.width, cnt->imgs.height,
+    erode9(smartmask_final, cnt->imgs.detect_width, cnt->imgs.detect_height,
                   cnt->imgs.common_buffer, 255);
-    diff = erode5(smartmask_final, cnt->imgs.width, cnt->imgs.height,
+    erode5(smartmask_final, cnt->imgs.detect_width, cnt->imgs.detect_height,
                   cnt->imgs.common_buffer, 255);
-}
 
-/* Increment for *smartmask_buffer in alg_diff_standard. */
-#define SMARTMASK_SENSITIVITY_INCR 5
+    /* The diff reads the eroded mask from the state */
+    for (y = 0; y < cnt->imgs.detect_height; y++) {
+        alg_state_row(&cnt->imgs, y, &row);
+        memcpy(row.smartmask_final, smartmask_final + y * cnt->imgs.detect_width
+            , cnt->imgs.detect_width);
+    }
+}
 
 /**
- * alg_diff_standard
- *
+ * alg_update_reference_row
+ *      Updates the reference frame on one row of the image. Pixels in
+ *      motion are kept out of the reference frame for accept_timer frames.
  */
-int alg_diff_standard(struct context *cnt, unsigned char *new)
+static void alg_update_reference_row(struct context *cnt, int y, int accept_timer, int threshold_ref)
 {
-    struct images *imgs = &cnt->imgs;
-    int i, diffs = 0;
-    int noise = cnt->noise;
-    int smartmask_speed = cnt->smartmask_speed;
-    unsigned char *ref = imgs->ref;
-    unsigned char *out = imgs->img_motion.image_norm;
-    unsigned char *mask = imgs->mask;
-    unsigned char *smartmask_final = imgs->smartmask_final;
-    int *smartmask_buffer = imgs->smartmask_buffer;
-#ifdef HAVE_MMX
-    mmx_t mmtemp; /* Used for transferring to/from memory. */
-    int unload;   /* Counter for unloading diff counts. */
-#endif
-
-    i = imgs->motionsize;
-    memset(out + i, 128, i / 2); /* Motion pictures are now b/w i.o. green */
-    /*
-     * Keeping this memset in the MMX case when zeroes are necessarily
-     * written anyway seems to be beneficial in terms of speed. Perhaps a
-     * cache thing?
-     */
-    memset(out, 0, i);
+    struct alg_ref_data rd;
+    struct alg_state row;
+
+    alg_state_row(&cnt->imgs, y, &row);
+    rd.ref = row.ref;
+    rd.ref_dyn = row.ref_dyn;
+    rd.new = cnt->imgs.image_detect + y * cnt->imgs.detect_width;
+    rd.smartmask = row.smartmask_final;
+    rd.bits = cnt->imgs.motion_bits + y * cnt->imgs.motion_stride;
+    rd.accept_timer = accept_timer;
+    rd.threshold_ref = threshold_ref;
+    rd.count = cnt->imgs.detect_width;
+
+    alg_simd_update_ref(&rd);
+}
 
-#ifdef HAVE_MMX
-    /*
-     * NOTE: The Pentium has two instruction pipes: U and V. I have grouped MMX
-     * instructions in pairs according to how I think they will be scheduled in
-     * the U and V pipes. Due to pairing constraints, the V pipe will sometimes
-     * be empty (for example, memory access always goes into the U pipe).
-     *
-     * The following MMX registers are kept throughout the loop:
-     * mm5 - 8 separate diff counters (unloaded periodically)
-     * mm6 - mask: 00ff 00ff 00ff 00ff
-     * mm7 - noise level as 8 packed bytes
-     *
-     * -- Per Jonsson
-     */
+#define ACCEPT_STATIC_OBJECT_TIME 10  /* Seconds */
+#define EXCLUDE_LEVEL_PERCENT 20
 
-    /*
-     * To avoid a div, we work with differences multiplied by 255 in the
-     * default case and *mask otherwise. Thus, the limit to compare with is
-     * 255 * (noise + 1) - 1).
-     */
-    mmtemp.uw[0] = mmtemp.uw[1] = mmtemp.uw[2] = mmtemp.uw[3] =
-                   (unsigned short)(noise * 255 + 254);
+/**
+ * alg_update_reference_init
+ *      Sets the limits of the reference frame update in job.
+ */
+static void alg_update_reference_init(struct context *cnt, struct alg_stripe_job *job)
+{
+    job->accept_timer = cnt->lastrate * ACCEPT_STATIC_OBJECT_TIME;
+    if (cnt->lastrate > 5)  /* Match rate limit */
+        job->accept_timer /= (cnt->lastrate / 3);
+    job->threshold_ref = cnt->noise * EXCLUDE_LEVEL_PERCENT / 100;
+}
 
-    /*
-     * Reset mm5 to zero, set the mm6 mask, and store the multiplied noise
-     * level as four words in mm7.
-     */
-    movq_m2r(mmtemp, mm7);             /* U */
-    pcmpeqb_r2r(mm6, mm6);             /* V */
+/**
+ * alg_update_reference_stripe
+ *      Updates the reference frame on one stripe of the image.
+ */
+static void alg_update_reference_stripe(void *arg, int indx)
+{
+    struct alg_stripe_job *job = arg;
+    int y, row, rows;
 
-    pxor_r2r(mm5, mm5);                /* U */
-    psrlw_i2r(8, mm6);                 /* V */
+    alg_stripe_rows(job, indx, &row, &rows);
 
-    /*
-     * We must unload mm5 every 255th round, because the diffs accumulate
-     * in each packed byte, which can hold at most 255 diffs before it
-     * gets saturated.
-     */
-    unload = 255;
+    for (y = row; y < row + rows; y++)
+        alg_update_reference_row(job->cnt, y, job->accept_timer, job->threshold_ref);
 
-    for (; i > 7; i -= 8) {
-        /* Calculate abs(*ref-*new) for 8 pixels in parallel. */
-        movq_m2r(*ref, mm0);           /* U: mm0 = r7 r6 r5 r4 r3 r2 r1 r0 */
-        pxor_r2r(mm4, mm4);            /* V: mm4 = 0 */
+    job->sums[indx] = 0;
+}
 
-        movq_m2r(*new, mm1);           /* U: mm1 = n7 n6 n5 n4 n3 n2 n1 n0 */
-        movq_r2r(mm0, mm2);            /* V: mm2 = r7 r6 r5 r4 r3 r2 r1 r0 */
+/* Increment for *smartmask_buffer in alg_diff_standard. */
+#define SMARTMASK_SENSITIVITY_INCR 5
 
-        /* These subtractions are saturated, i.e. won't go below 0. */
-        psubusb_r2r(mm1, mm0);         /* U: mm0 = (r7-n7) ... (r0-n0) */
-        psubusb_r2r(mm2, mm1);         /* V: mm1 = (n7-r7) ... (n0-r0) */
+/**
+ * alg_tiles_word
+ *      Whether a word of 64 pixels of the motion bitmap overlaps an active
+ *      tile of its row of tiles.
+ */
+static int alg_tiles_word(const unsigned char *map, int cols, int word)
+{
+    int tile = word * (64 / ALG_TILE_SIZE);
+    int last = tile + (64 / ALG_TILE_SIZE);
+
+    if (last > cols)
+        last = cols;
+    for (; tile < last; tile++) {
+        if (map[tile])
+            return TRUE;
+    }
 
-        /* Each byte dX in mm0 is abs(nX-rX). */
-        por_r2r(mm1, mm0);             /* U: mm0 = d7 d6 d5 d4 d3 d2 d1 d0 */
+    return FALSE;
+}
 
-        /* Expand the absolute differences to words in mm0 and mm1. */
-        movq_r2r(mm0, mm1);            /* U: mm1 = d7 d6 d5 d4 d3 d2 d1 d0 */
-        punpcklbw_r2r(mm4, mm0);       /* V: mm0 =    d3    d2    d1    d0 */
+/**
+ * alg_diff_row_tiles
+ *      Runs the diff kernel on the runs of words of one row that overlap
+ *      active tiles and clears the other words. The runs start on a word
+ *      so the kernel stores whole words of the bitmap.
+ */
+static int alg_diff_row_tiles(struct alg_stripe_job *job, const struct alg_diff_data *row_dd, int y)
+{
+    struct images *imgs = &job->cnt->imgs;
+    const unsigned char *map = imgs->tile_map + (y / ALG_TILE_SIZE) * imgs->tile_cols;
+    struct alg_diff_data dd = *row_dd;
+    int word = 0, first, x, diffs = 0;
+
+    while (word < imgs->motion_stride) {
+        if (!alg_tiles_word(map, imgs->tile_cols, word)) {
+            row_dd->bits[word++] = 0;
+            continue;
+        }
 
-        punpckhbw_r2r(mm4, mm1);       /* U: mm1 =    d7    d6    d5    d4 */
+        first = word;
+        while (word < imgs->motion_stride && alg_tiles_word(map, imgs->tile_cols, word))
+            word++;
+
+        x = 64 * first;
+        dd.ref = row_dd->ref + x;
+        dd.new = row_dd->new + x;
+        dd.bits = row_dd->bits + first;
+        if (dd.mask) dd.mask = row_dd->mask + x;
+        if (dd.smartmask) {
+            dd.smartmask = row_dd->smartmask + x;
+            dd.smartmask_buffer = row_dd->smartmask_buffer + x;
+        }
+        dd.count = ((64 * word < imgs->detect_width) ? 64 * word : imgs->detect_width) - x;
+        diffs += alg_simd_diff(&dd);
+    }
 
-        if (mask) {
-            /*
-             * Load and expand 8 mask bytes to words in mm2 and mm3. Then
-             * multiply by mm0 and mm1, respectively.
-             */
-            movq_m2r(*mask, mm2);      /* U: mm2 = m7 m6 m5 m4 m3 m2 m1 m0 */
+    return diffs;
+}
 
-            movq_r2r(mm2, mm3);        /* U: mm3 = m7 m6 m5 m4 m3 m2 m1 m0 */
-            punpcklbw_r2r(mm4, mm2);   /* v: mm2 =    m3    m2    m1    m0 */
+/**
+ * alg_diff_row
+ *      Runs the diff kernel on one row. Each row starts on a new word of
+ *      the motion bitmap. Returns the number of pixels in motion.
+ */
+static int alg_diff_row(struct alg_stripe_job *job, int y)
+{
+    struct alg_diff_data dd = job->dd;
+    struct alg_state row;
+
+    alg_state_row(&job->cnt->imgs, y, &row);
+    dd.ref = row.ref;
+    dd.new += y * job->cnt->imgs.detect_width;
+    dd.bits += y * job->cnt->imgs.motion_stride;
+    if (dd.mask) dd.mask = row.mask;
+    if (dd.smartmask) {
+        dd.smartmask = row.smartmask_final;
+        dd.smartmask_buffer = row.smartmask_buffer;
+    }
 
-            punpckhbw_r2r(mm4, mm3);   /* U: mm3 =    m7    m6    m5    m4 */
-            pmullw_r2r(mm2, mm0);      /* V: mm0 = (d3*m3) ... (d0*m0) */
+    if (job->tiles)
+        return alg_diff_row_tiles(job, &dd, y);
 
-            pmullw_r2r(mm3, mm1);      /* U: mm1 = (d7*m7) ... (d4*m4) */
+    return alg_simd_diff(&dd);
+}
 
-            mask += 8;
-        } else {
-            /*
-             * Not using mask - multiply the absolute differences by 255. We
-             * do this by left-shifting 8 places and then subtracting dX.
-             */
-            movq_r2r(mm0, mm2);        /* U: mm2 =    d3    d2    d1    d0 */
-            psllw_i2r(8, mm0);         /* V: mm2 = (256*d3) ... (256*d0) */
+/**
+ * alg_diff_stripe
+ *      Runs the diff kernel on the rows of one stripe and counts the pixels
+ *      in motion per row and, in its own part of common_buffer, per column.
+ */
+static void alg_diff_stripe(void *arg, int indx)
+{
+    struct alg_stripe_job *job = arg;
+    struct images *imgs = &job->cnt->imgs;
+    int *cols = (int *)imgs->common_buffer + indx * imgs->detect_width;
+    int row, rows, y;
 
-            movq_r2r(mm1, mm3);        /* U: mm3 =    d7    d6    d5    d4 */
-            psllw_i2r(8, mm1);         /* V: mm3 = (256*d7) ... (256*d4) */
+    alg_stripe_rows(job, indx, &row, &rows);
+    job->sums[indx] = 0;
+    memset(cols, 0, imgs->detect_width * sizeof(*cols));
 
-            psubusw_r2r(mm2, mm0);     /* U */
-            psubusw_r2r(mm3, mm1);     /* V */
-        }
+    for (y = row; y < row + rows; y++)
+        job->sums[indx] += alg_count_row(imgs, cols, y, alg_diff_row(job, y));
+}
 
-        /*
-         * Next, compare the multiplied absolute differences with the multiplied
-         * noise level (repeated as 4 words in mm7), resulting in a "motion flag"
-         * for each pixel.
-         *
-         * Since pcmpgtw performs signed comparisons, we have to subtract noise,
-         * test for equality to 0 and then invert the result.
-         *
-         * Note that it is safe to generate the "motion flags" before the
-         * smartmask code, as all that can happen is that individual flags get
-         * reset to 0 because of the smartmask.
-         */
-        psubusw_r2r(mm7, mm0);         /* U: subtract by (multiplied) noise */
-        psubusw_r2r(mm7, mm1);         /* V */
+/**
+ * alg_diff_noise_row
+ *      Adds the masked differences of one row to the sums of alg_noise_tune.
+ */
+static void alg_diff_noise_row(struct alg_stripe_job *job, int indx, int y)
+{
+    struct images *imgs = &job->cnt->imgs;
+    const unsigned char *new = job->dd.new + y * imgs->detect_width;
+    struct alg_state row;
+    int x, diff;
+
+    alg_state_row(imgs, y, &row);
+
+    for (x = 0; x < imgs->detect_width; x++) {
+        if (!row.smartmask_final[x])
+            continue;
+        diff = ABS(row.ref[x] - new[x]);
+        if (job->dd.mask)
+            diff = ((diff * row.mask[x]) / 255);
+        job->noise_sums[indx] += diff + 1;
+        job->noise_counts[indx]++;
+    }
+}
 
-        pcmpeqw_r2r(mm4, mm0);         /* U: test for equality with 0 */
-        pcmpeqw_r2r(mm4, mm1);         /* V */
+/**
+ * alg_diff_fused_stripe
+ *      Runs the fused detection on the rows of one stripe. Each row is
+ *      diffed, counted, measured for the noise tuning and merged into the
+ *      reference frame while its pixels are still in the cache. The column
+ *      counts of the stripe go to its own part of common_buffer.
+ */
+static void alg_diff_fused_stripe(void *arg, int indx)
+{
+    struct alg_stripe_job *job = arg;
+    struct images *imgs = &job->cnt->imgs;
+    int *cols = (int *)imgs->common_buffer + indx * imgs->detect_width;
+    int row, rows, y;
 
-        pand_r2r(mm6, mm0);            /* U: convert 0xffff -> 0x00ff */
-        pand_r2r(mm6, mm1);            /* V */
+    alg_stripe_rows(job, indx, &row, &rows);
+    job->sums[indx] = 0;
+    job->noise_sums[indx] = 0;
+    job->noise_counts[indx] = 0;
+    memset(cols, 0, imgs->detect_width * sizeof(*cols));
 
-        pxor_r2r(mm6, mm0);            /* U: invert the result */
-        pxor_r2r(mm6, mm1);            /* V */
+    for (y = row; y < row + rows; y++) {
+        job->sums[indx] += alg_count_row(imgs, cols, y, alg_diff_row(job, y));
 
-        /* Each fX is the "motion flag" = 0 for no motion, 0xff for motion. */
-        packuswb_r2r(mm1, mm0);        /* U: mm0 = f7 f6 f5 f4 f3 f2 f1 f0 */
+        /* The noise is measured against the reference before it is updated */
+        if (job->noise_tune)
+            alg_diff_noise_row(job, indx, y);
 
-        if (smartmask_speed) {
-            /*
-             * Apply the smartmask. Basically, if *smartmask_final is 0, the
-             * corresponding "motion flag" in mm0 will be reset.
-             */
-            movq_m2r(*smartmask_final, mm3); /* U: mm3 = s7 s6 s5 s4 s3 s2 s1 s0 */
+        alg_update_reference_row(job->cnt, y, job->accept_timer, job->threshold_ref);
+    }
+}
 
-            /*
-             * ...but move the "motion flags" to memory before, in order to
-             * increment *smartmask_buffer properly below.
-             */
-            movq_r2m(mm0, mmtemp);           /* U */
-            pcmpeqb_r2r(mm4, mm3);           /* V: mm3 = 0xff where sX==0 */
-
-            /* AND negates the target before anding. */
-            pandn_r2r(mm0, mm3);             /* U: mm3 = 0xff where dX>noise && sX>0 */
-
-            movq_r2r(mm3, mm0);              /* U */
-
-            /* Add to *smartmask_buffer. This is probably the fastest way to do it. */
-            if (cnt->event_nr != cnt->prev_event) {
-                if (mmtemp.ub[0]) smartmask_buffer[0] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[1]) smartmask_buffer[1] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[2]) smartmask_buffer[2] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[3]) smartmask_buffer[3] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[4]) smartmask_buffer[4] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[5]) smartmask_buffer[5] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[6]) smartmask_buffer[6] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[7]) smartmask_buffer[7] += SMARTMASK_SENSITIVITY_INCR;
-            }
+/**
+ * alg_diff_fused
+ *      Adds up the results of the stripes of the fused detection.
+ */
+static int alg_diff_fused(struct context *cnt, struct alg_stripe_job *job)
+{
+    struct images *imgs = &cnt->imgs;
+    int diffs, indx;
 
-            smartmask_buffer += 8;
-            smartmask_final += 8;
-        }
+    alg_update_reference_init(cnt, job);
+    job->noise_tune = cnt->conf.noise_tune;
 
-        movq_m2r(*new, mm2);           /* U: mm1 = n7 n6 n5 n4 n3 n2 n1 n0 */
+    diffs = alg_stripe_run(job, alg_diff_fused_stripe);
 
-        /*
-         * Cancel out pixels in *new according to the "motion flags" in mm0.
-         * Each NX is either 0 or nX as from *new.
-         */
-        pand_r2r(mm0, mm2);            /* U: mm1 = N7 N6 N5 N4 N3 N2 N1 N0 */
-        psubb_r2r(mm0, mm4);           /* V: mm4 = 0x01 where dX>noise */
+    alg_count_merge(imgs, job, (int *)imgs->common_buffer);
+    imgs->noise_sum = 0;
+    imgs->noise_count = 0;
+    for (indx = 0; indx < job->stripes; indx++) {
+        imgs->noise_sum += job->noise_sums[indx];
+        imgs->noise_count += job->noise_counts[indx];
+    }
 
-        /*
-         * mm5 holds 8 separate counts - each one is increased according to
-         * the contents of mm4 (where each byte is either 0x00 or 0x01).
-         */
-        movq_r2m(mm2, *out);           /* U: this will stall */
-        paddusb_r2r(mm4, mm5);         /* V: add counts to mm5 */
+    imgs->ref_fused = TRUE;
 
-        /*
-         * Every 255th turn, we need to unload mm5 into the diffs variable,
-         * because otherwise the packed bytes will get saturated.
-         */
-        if (--unload == 0) {
-            /* Unload mm5 to memory and reset it. */
-            movq_r2m(mm5, mmtemp);     /* U */
-            pxor_r2r(mm5, mm5);        /* V: mm5 = 0 */
-
-            diffs += mmtemp.ub[0] + mmtemp.ub[1] + mmtemp.ub[2] + mmtemp.ub[3] +
-                     mmtemp.ub[4] + mmtemp.ub[5] + mmtemp.ub[6] + mmtemp.ub[7];
-            unload = 255;
-        }
+    return diffs;
+}
 
-        out += 8;
-        ref += 8;
-        new += 8;
+/**
+ * alg_tiles_stripe
+ *      Adds up the differences to the reference frame of each tile of the
+ *      tile rows of one stripe and marks the tiles whose mean difference
+ *      is above half the noise level as active.
+ */
+static void alg_tiles_stripe(void *arg, int indx)
+{
+    struct alg_stripe_job *job = arg;
+    struct images *imgs = &job->cnt->imgs;
+    struct alg_state row;
+    unsigned int *sad;
+    unsigned char *map;
+    int first = (imgs->tile_rows * indx) / job->stripes;
+    int last = (imgs->tile_rows * (indx + 1)) / job->stripes;
+    int tx, ty, y, y_end, x_end, pixels;
+
+    job->sums[indx] = 0;
+
+    for (ty = first; ty < last; ty++) {
+        sad = imgs->tile_sad + ty * imgs->tile_cols;
+        map = imgs->tile_map + ty * imgs->tile_cols;
+        memset(sad, 0, imgs->tile_cols * sizeof(*sad));
+
+        y_end = (ty + 1) * ALG_TILE_SIZE;
+        if (y_end > imgs->detect_height)
+            y_end = imgs->detect_height;
+        y = ty * ALG_TILE_SIZE;
+        alg_state_row(imgs, y, &row);
+        alg_simd_sad(row.ref, ALG_STATE_FIELDS * imgs->state_pitch
+            , job->dd.new + y * imgs->detect_width, imgs->detect_width
+            , imgs->detect_width, y_end - y, sad);
+
+        for (tx = 0; tx < imgs->tile_cols; tx++) {
+            x_end = (tx + 1) * ALG_TILE_SIZE;
+            if (x_end > imgs->detect_width)
+                x_end = imgs->detect_width;
+            pixels = (x_end - tx * ALG_TILE_SIZE) * (y_end - ty * ALG_TILE_SIZE);
+            map[tx] = (2 * (long long)sad[tx] > (long long)pixels * job->dd.noise);
+            job->sums[indx] += map[tx];
+        }
     }
+}
 
-    /*
-     * Check if there are diffs left in mm5 that need to be copied to the
-     * diffs variable.
-     */
-    if (unload < 255) {
-        movq_r2m(mm5, mmtemp);
-        diffs += mmtemp.ub[0] + mmtemp.ub[1] + mmtemp.ub[2] + mmtemp.ub[3] +
-                 mmtemp.ub[4] + mmtemp.ub[5] + mmtemp.ub[6] + mmtemp.ub[7];
-    }
+/**
+ * alg_diff_tiles
+ *      Builds the tile map of the frame. Returns the number of active tiles.
+ */
+static int alg_diff_tiles(struct alg_stripe_job *job)
+{
+    return alg_stripe_run(job, alg_tiles_stripe);
+}
 
-    emms();
+/**
+ * alg_diff_init
+ *      Sets up the diff of new in job.
+ */
+static void alg_diff_init(struct context *cnt, struct alg_stripe_job *job, unsigned char *new)
+{
+    struct images *imgs = &cnt->imgs;
 
-#endif
+    alg_stripe_init(cnt, job);
+
+    /* alg_diff_row points ref and the masks to the state of each row */
+    job->dd.ref = NULL;
+    job->dd.new = new;
+    job->dd.bits = imgs->motion_bits;
+    job->dd.mask = imgs->mask;
+    job->dd.smartmask = cnt->smartmask_speed ? imgs->smartmask_final : NULL;
+    job->dd.smartmask_buffer = NULL;
     /*
-     * Note that the non-MMX code is present even if the MMX code is present.
-     * This is necessary if the resolution is not a multiple of 8, in which
-     * case the non-MMX code needs to take care of the remaining pixels.
+     * Increase smart_mask sensitivity every frame when motion is detected
+     * outside of an event. (with speed=5, mask is increased by 1 every
+     * second. To be able to increase by 5 every second (with speed=10) we
+     * add 5 here. NOT related to the 5 at ratio-calculation.
      */
+    job->dd.smartmask_incr = (cnt->event_nr != cnt->prev_event) ? SMARTMASK_SENSITIVITY_INCR : 0;
+    job->dd.noise = cnt->noise;
+    job->dd.count = imgs->detect_width;
+    job->tiles = cnt->conf.detection_tiles;
+}
 
-    for (; i > 0; i--) {
-        register unsigned char curdiff = (int)(abs(*ref - *new)); /* Using a temp variable is 12% faster. */
-        /* Apply fixed mask */
-        if (mask)
-            curdiff = ((int)(curdiff * *mask++) / 255);
-
-        if (smartmask_speed) {
-            if (curdiff > noise) {
-                /*
-                 * Increase smart_mask sensitivity every frame when motion
-                 * is detected. (with speed=5, mask is increased by 1 every
-                 * second. To be able to increase by 5 every second (with
-                 * speed=10) we add 5 here. NOT related to the 5 at ratio-
-                 * calculation.
-                 */
-                if (cnt->event_nr != cnt->prev_event)
-                    (*smartmask_buffer) += SMARTMASK_SENSITIVITY_INCR;
-                /* Apply smart_mask */
-                if (!*smartmask_final)
-                    curdiff = 0;
-            }
-            smartmask_final++;
-            smartmask_buffer++;
-        }
-        /* Pixel still in motion after all the masks? */
-        if (curdiff > noise) {
-            *out = *new;
-            diffs++;
-        }
-        out++;
-        ref++;
-        new++;
-    }
-    return diffs;
+/**
+ * alg_diff_run
+ *      Runs the diff set up in job, fused with the reference frame update
+ *      with detection_fused. Returns the pixels in motion counted in pixels
+ *      of the image.
+ */
+static int alg_diff_run(struct context *cnt, struct alg_stripe_job *job)
+{
+    struct images *imgs = &cnt->imgs;
+    int diffs, area_scale = imgs->detect_scale * imgs->detect_scale;
+
+    if (cnt->conf.detection_fused)
+        return alg_diff_fused(cnt, job) * area_scale;
+
+    diffs = alg_stripe_run(job, alg_diff_stripe);
+    alg_count_merge(imgs, job, (int *)imgs->common_buffer);
+
+    return diffs * area_scale;
+}
+
+/**
+ * alg_diff_standard
+ *
+ *  Flags the changed pixels of new, the image at the size of the detection,
+ *  in the motion bitmap and counts them in pixels of the image. The work is
+ *  done by the kernel alg_simd_init selected for this processor, on one
+ *  stripe of the image per detection thread, which also counts the pixels
+ *  in motion per row and column for alg_locate_center_size. With
+ *  detection_fused the same sweep also updates the reference frame. With
+ *  detection_tiles only the tiles with a change are diffed.
+ */
+int alg_diff_standard(struct context *cnt, unsigned char *new)
+{
+    struct alg_stripe_job job;
+
+    alg_diff_init(cnt, &job, new);
+    if (job.tiles)
+        alg_diff_tiles(&job);
+
+    return alg_diff_run(cnt, &job);
+}
+
+/**
+ * alg_diff_clear
+ *      Clears the motion bitmap of a frame whose full diff is skipped.
+ */
+static void alg_diff_clear(struct context *cnt)
+{
+    memset(cnt->imgs.motion_bits, 0, cnt->imgs.motion_stride * cnt->imgs.detect_height * sizeof(uint64_t));
+    cnt->imgs.motion_counts = FALSE;
 }
 
 /**
@@ -1208,25 +1716,32 @@ int alg_diff_standard(struct context *cnt, unsigned char *new)
 static char alg_diff_fast(struct context *cnt, int max_n_changes, unsigned char *new)
 {
     struct images *imgs = &cnt->imgs;
-    int i, diffs = 0, step = imgs->motionsize/10000;
+    int i, diffs = 0, step = imgs->detect_width * imgs->detect_height / 10000;
     int noise = cnt->noise;
-    unsigned char *ref = imgs->ref;
+    struct alg_state row;
+    int x = 0, y = 0;
 
-    if (!step % 2)
+    /* An odd step keeps the samples from lining up in columns */
+    if (step % 2 == 0)
         step++;
-    /* We're checking only 1 of several pixels. */
-    max_n_changes /= step;
+    /* We're checking only 1 of several pixels, each standing for a block of the image. */
+    max_n_changes /= step * imgs->detect_scale * imgs->detect_scale;
 
-    i = imgs->motionsize;
+    i = imgs->detect_width * imgs->detect_height;
+    alg_state_row(imgs, y, &row);
 
     for (; i > 0; i -= step) {
-        register unsigned char curdiff = (int)(abs((char)(*ref - *new))); /* Using a temp variable is 12% faster. */
+        register unsigned char curdiff = (int)(abs((char)(row.ref[x] - *new))); /* Using a temp variable is 12% faster. */
         if (curdiff >  noise) {
             diffs++;
             if (diffs > max_n_changes)
                 return 1;
         }
-        ref += step;
+        /* The same step through the rows of the state */
+        for (x += step; x >= imgs->detect_width; x -= imgs->detect_width)
+            y++;
+        if (y < imgs->detect_height)
+            alg_state_row(imgs, y, &row);
         new += step;
     }
 
@@ -1235,19 +1750,63 @@ static char alg_diff_fast(struct context *cnt, int max_n_changes, unsigned char
 
 /**
  * alg_diff
- *      Uses diff_fast to quickly decide if there is anything worth
- *      sending to diff_standard.
+ *      Uses diff_fast, or with detection_tiles the tile map, to quickly
+ *      decide if there is anything worth sending to diff_standard.
  */
 int alg_diff(struct context *cnt, unsigned char *new)
 {
-    int diffs = 0;
+    struct alg_stripe_job job;
+    int diffs = 0, changed;
+
+    alg_diff_init(cnt, &job, new);
+
+    if (job.tiles)
+        changed = alg_diff_tiles(&job);
+    else
+        changed = alg_diff_fast(cnt, cnt->conf.threshold / 2, new);
 
-    if (alg_diff_fast(cnt, cnt->conf.threshold / 2, new))
-        diffs = alg_diff_standard(cnt, new);
+    if (changed)
+        diffs = alg_diff_run(cnt, &job);
+    else
+        alg_diff_clear(cnt);
 
     return diffs;
 }
 
+/**
+ * alg_motion_render
+ *      Renders the motion bitmap to the motion image for the motion
+ *      pictures, movies and streams: the pixels in motion show the new
+ *      image, all others are black. Motion pictures are b/w i.o. green.
+ *      A pixel of the detection shows its whole block of the image.
+ */
+void alg_motion_render(struct context *cnt, unsigned char *new)
+{
+    struct images *imgs = &cnt->imgs;
+    unsigned char *out = imgs->img_motion.image_norm;
+    const uint64_t *bits = imgs->motion_bits;
+    uint64_t word;
+    int y, indx, x, pos, scale = imgs->detect_scale;
+
+    memset(out, 0, imgs->motionsize);
+
+    for (y = 0; y < imgs->detect_height * scale; y++) {
+        for (indx = 0; indx < imgs->motion_stride; indx++) {
+            for (word = bits[indx]; word; word &= word - 1) {
+                pos = (64 * indx + __builtin_ctzll(word)) * scale;
+                for (x = 0; x < scale; x++)
+                    out[pos + x] = new[pos + x];
+            }
+        }
+        out += imgs->width;
+        new += imgs->width;
+        if ((y + 1) % scale == 0)
+            bits += imgs->motion_stride;
+    }
+
+    memset(imgs->img_motion.image_norm + imgs->motionsize, 128, imgs->motionsize / 2);
+}
+
 /**
  * alg_lightswitch
  *      Detects a sudden massive change in the picture.
@@ -1270,43 +1829,158 @@ int alg_lightswitch(struct context *cnt, int diffs)
     return 0;
 }
 
+/**
+ * alg_luma_stats
+ *      Samples the image of the detection and the reference frame on a grid
+ *      of one pixel in ALG_LUMA_STEP x ALG_LUMA_STEP before the diff: the
+ *      mean luma of both and a histogram of the masked differences of the
+ *      pixels the smart mask leaves in. The lightswitch and the noise
+ *      tuning use it instead of the full diff.
+ */
+void alg_luma_stats(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    const unsigned char *new;
+    struct alg_state row;
+    long long sum = 0, sum_ref = 0;
+    int x, y, diff;
+
+    memset(imgs->luma_diffs, 0, sizeof(imgs->luma_diffs));
+    imgs->luma_count = 0;
+    imgs->luma_samples = 0;
+
+    for (y = ALG_LUMA_STEP / 2; y < imgs->detect_height; y += ALG_LUMA_STEP) {
+        alg_state_row(imgs, y, &row);
+        new = imgs->image_detect + y * imgs->detect_width;
+
+        for (x = ALG_LUMA_STEP / 2; x < imgs->detect_width; x += ALG_LUMA_STEP) {
+            sum += new[x];
+            sum_ref += row.ref[x];
+            imgs->luma_count++;
+
+            if (!row.smartmask_final[x])
+                continue;
+            diff = ABS(row.ref[x] - new[x]);
+            if (imgs->mask)
+                diff = ((diff * row.mask[x]) / 255);
+            imgs->luma_diffs[diff]++;
+            imgs->luma_samples++;
+        }
+    }
+
+    if (imgs->luma_count) {
+        imgs->luma_mean = sum / imgs->luma_count;
+        imgs->luma_ref_mean = sum_ref / imgs->luma_count;
+    }
+    imgs->luma_valid = TRUE;
+}
+
+/**
+ * alg_lightswitch_sampled
+ *      The lightswitch check of alg_lightswitch on the grid of
+ *      alg_luma_stats, so that the full diff of a frame with a lightswitch
+ *      can be skipped. Clears the motion bitmap when it finds one.
+ */
+int alg_lightswitch_sampled(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    int diff, changed = 0;
+
+    if (!imgs->luma_valid || !imgs->luma_count)
+        return 0;
+
+    for (diff = (cnt->noise < 0 ? 0 : cnt->noise + 1); diff < 256; diff++)
+        changed += imgs->luma_diffs[diff];
+
+    if (!alg_lightswitch(cnt, (int)((long long)changed * imgs->motionsize / imgs->luma_count)))
+        return 0;
+
+    alg_diff_clear(cnt);
+
+    return 1;
+}
+
 /**
  * alg_switchfilter
  *
  */
-int alg_switchfilter(struct context *cnt, int diffs, unsigned char *newimg)
+int alg_switchfilter(struct context *cnt, int diffs, struct image_view *view)
 {
-    int linediff = diffs / cnt->imgs.height;
-    unsigned char *out = cnt->imgs.img_motion.image_norm;
-    int y, x, line;
+    /* The lines are those of the detection, diffs is in pixels of the image */
+    int linediff = diffs / (cnt->imgs.detect_scale * cnt->imgs.detect_scale) / cnt->imgs.detect_height;
+    const uint64_t *bits = cnt->imgs.motion_bits;
+    int y, indx, line;
     int lines = 0, vertlines = 0;
 
-    for (y = 0; y < cnt->imgs.height; y++) {
-        line = 0;
-        for (x = 0; x < cnt->imgs.width; x++) {
-            if (*(out++))
-                line++;
+    for (y = 0; y < cnt->imgs.detect_height; y++, bits += cnt->imgs.motion_stride) {
+        if (cnt->imgs.motion_counts) {
+            line = cnt->imgs.motion_rows[y];
+        } else {
+            line = 0;
+            for (indx = 0; indx < cnt->imgs.motion_stride; indx++)
+                line += __builtin_popcountll(bits[indx]);
         }
 
-        if (line > cnt->imgs.width / 18)
+        if (line > cnt->imgs.detect_width / 18)
             vertlines++;
 
         if (line > linediff * 2)
             lines++;
     }
 
-    if (vertlines > cnt->imgs.height / 10 && lines < vertlines / 3 &&
-        (vertlines > cnt->imgs.height / 4 || lines - vertlines > lines / 2)) {
+    if (vertlines > cnt->imgs.detect_height / 10 && lines < vertlines / 3 &&
+        (vertlines > cnt->imgs.detect_height / 4 || lines - vertlines > lines / 2)) {
         if (cnt->conf.text_changes) {
             char tmp[80];
             sprintf(tmp, "%d %d", lines, vertlines);
-            draw_text(newimg, cnt->imgs.width, cnt->imgs.height, cnt->imgs.width - 10, 20, tmp, cnt->conf.text_scale);
+            draw_text_view(view, cnt->imgs.width, cnt->imgs.height, cnt->imgs.width - 10, 20, tmp, cnt->conf.text_scale);
         }
         return diffs;
     }
     return 0;
 }
 
+/**
+ * alg_detect_stripe
+ *      Scales the rows of one stripe of the privacy masked image down to
+ *      the detection.
+ */
+static void alg_detect_stripe(void *arg, int indx)
+{
+    struct alg_stripe_job *job = arg;
+    struct images *imgs = &job->cnt->imgs;
+    int y, row, rows, scale = imgs->detect_scale;
+
+    alg_stripe_rows(job, indx, &row, &rows);
+
+    for (y = row; y < row + rows; y++)
+        alg_simd_shrink(imgs->image_detect + y * imgs->detect_width
+            , imgs->image_vprvcy.image_norm + y * scale * imgs->width
+            , imgs->width, imgs->detect_width, scale);
+
+    job->sums[indx] = 0;
+}
+
+/**
+ * alg_detect_image
+ *      Makes image_detect from the luma of image_vprvcy. Each pixel is the
+ *      mean of a block of detect_scale x detect_scale pixels; without a
+ *      scale image_detect is image_vprvcy itself.
+ */
+void alg_detect_image(struct context *cnt)
+{
+    struct alg_stripe_job job;
+
+    /* The samples of alg_luma_stats belong to the previous image */
+    cnt->imgs.luma_valid = FALSE;
+
+    if (cnt->imgs.detect_scale == 1)
+        return;
+
+    alg_stripe_init(cnt, &job);
+    alg_stripe_run(&job, alg_detect_stripe);
+}
+
 /**
  * alg_update_reference_frame
  *
@@ -1320,55 +1994,33 @@ int alg_switchfilter(struct context *cnt, int diffs, unsigned char *newimg)
  *   action - UPDATE_REF_FRAME or RESET_REF_FRAME
  *
  */
-#define ACCEPT_STATIC_OBJECT_TIME 10  /* Seconds */
-#define EXCLUDE_LEVEL_PERCENT 20
 void alg_update_reference_frame(struct context *cnt, int action)
 {
-    int accept_timer = cnt->lastrate * ACCEPT_STATIC_OBJECT_TIME;
-    int i, threshold_ref;
-    int *ref_dyn = cnt->imgs.ref_dyn;
-    unsigned char *image_virgin = cnt->imgs.image_vprvcy.image_norm;
-    unsigned char *ref = cnt->imgs.ref;
-    unsigned char *smartmask = cnt->imgs.smartmask_final;
-    unsigned char *out = cnt->imgs.img_motion.image_norm;
-
-    if (cnt->lastrate > 5)  /* Match rate limit */
-        accept_timer /= (cnt->lastrate / 3);
+    struct alg_stripe_job job;
+    struct alg_state row;
+    int y;
 
     if (action == UPDATE_REF_FRAME) { /* Black&white only for better performance. */
-        threshold_ref = cnt->noise * EXCLUDE_LEVEL_PERCENT / 100;
-
-        for (i = cnt->imgs.motionsize; i > 0; i--) {
-            /* Exclude pixels from ref frame well below noise level. */
-            if (((int)(abs(*ref - *image_virgin)) > threshold_ref) && (*smartmask)) {
-                if (*ref_dyn == 0) { /* Always give new pixels a chance. */
-                    *ref_dyn = 1;
-                } else if (*ref_dyn > accept_timer) { /* Include static Object after some time. */
-                    *ref_dyn = 0;
-                    *ref = *image_virgin;
-                } else if (*out) {
-                    (*ref_dyn)++; /* Motionpixel? Keep excluding from ref frame. */
-                } else {
-                    *ref_dyn = 0; /* Nothing special - release pixel. */
-                    *ref = (*ref + *image_virgin) / 2;
-                }
+        /* The fused detection already updated it along with the diff of this frame */
+        if (cnt->imgs.ref_fused) {
+            cnt->imgs.ref_fused = FALSE;
+            return;
+        }
 
-            } else {  /* No motion: copy to ref frame. */
-                *ref_dyn = 0; /* Reset pixel */
-                *ref = *image_virgin;
-            }
+        alg_stripe_init(cnt, &job);
+        alg_update_reference_init(cnt, &job);
 
-            ref++;
-            image_virgin++;
-            smartmask++;
-            ref_dyn++;
-            out++;
-        } /* end for i */
+        alg_stripe_run(&job, alg_update_reference_stripe);
 
     } else {   /* action == RESET_REF_FRAME - also used to initialize the frame at startup. */
+        cnt->imgs.ref_fused = FALSE;
         /* Copy fresh image */
-        memcpy(cnt->imgs.ref, cnt->imgs.image_vprvcy.image_norm, cnt->imgs.size_norm);
-        /* Reset static objects */
-        memset(cnt->imgs.ref_dyn, 0, cnt->imgs.motionsize * sizeof(*cnt->imgs.ref_dyn));
+        alg_detect_image(cnt);
+        for (y = 0; y < cnt->imgs.detect_height; y++) {
+            alg_state_row(&cnt->imgs, y, &row);
+            memcpy(row.ref, cnt->imgs.image_detect + y * cnt->imgs.detect_width, cnt->imgs.detect_width);
+            /* Reset static objects */
+            memset(row.ref_dyn, 0, cnt->imgs.detect_width * sizeof(*row.ref_dyn));
+        }
     }
 }
@@ -12,6 +12,32 @@
 
 #include "motion.h"
 
+/* Most stripes the per pixel stages are split in (conf.detection_threads) */
+#define ALG_STRIPE_MAX 64
+
+/* Fields of a row of the per pixel state, in units of imgs.state_pitch */
+#define ALG_STATE_FIELDS 8
+
+/* Width and height of the tiles of the detection_tiles prefilter */
+#define ALG_TILE_SIZE 16
+
+/*
+ * The per pixel state of the detection is kept row by row in one
+ * allocation: the reference frame, the masks and the counters of a row
+ * follow each other, each field padded to whole cache lines. A pass over
+ * a row finds everything within a few KB instead of in six planes of the
+ * image, and the counters take 16 bits. alg_state_row points to the
+ * fields of one row.
+ */
+struct alg_state {
+    unsigned char *ref;               /* The reference frame (luma) */
+    unsigned char *smartmask_final;   /* 0 where the smart mask excludes the pixel */
+    unsigned char *mask;              /* The fixed mask, 255 without a mask file */
+    unsigned char *smartmask;         /* Raw smart mask before the erode */
+    uint16_t *ref_dyn;                /* Frames a moving object was kept out of ref */
+    uint16_t *smartmask_buffer;       /* Changes counted for the smart mask */
+};
+
 struct coord {
     int x;
     int y;
@@ -31,13 +57,22 @@ struct segment {
     int count;
 };
 
+void alg_state_init(struct context *);
+void alg_state_deinit(struct context *);
+void alg_state_row(struct images *, int y, struct alg_state *);
+void alg_state_mask(struct context *);
+void alg_smartmask_reset(struct context *);
+void alg_detect_image(struct context *);
 void alg_locate_center_size(struct images *, int width, int height, struct coord *);
-void alg_draw_location(struct coord *, struct images *, int width, unsigned char *, int, int, int);
-void alg_draw_red_location(struct coord *, struct images *, int width, unsigned char *, int, int, int);
+void alg_draw_location(struct coord *, struct images *, struct image_view *, int, int, int);
+void alg_draw_red_location(struct coord *, struct images *, struct image_view *, int, int, int);
 int alg_diff(struct context *, unsigned char *);
 int alg_diff_standard(struct context *, unsigned char *);
+void alg_motion_render(struct context *, unsigned char *);
 int alg_lightswitch(struct context *, int diffs);
-int alg_switchfilter(struct context *, int, unsigned char *);
+void alg_luma_stats(struct context *);
+int alg_lightswitch_sampled(struct context *);
+int alg_switchfilter(struct context *, int, struct image_view *);
 void alg_noise_tune(struct context *, unsigned char *);
 void alg_threshold_tune(struct context *, int, int);
 int alg_despeckle(struct context *, int);
@@ -0,0 +1,1299 @@
+/*    alg_simd.c
+ *
+ *    Vectorized kernels of the motion detection with runtime CPU dispatch.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ *    The scalar kernels are the reference implementation. The SSE2 and
+ *    AVX2 kernels are compiled through function attributes so that the
+ *    binary stays runnable on any CPU of the architecture; the fastest
+ *    kernel the processor supports is chosen once at startup.
+ *
+ */
+#include "translate.h"
+#include "motion.h"
+#include "alg_simd.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define ALG_SIMD_X86
+#include <immintrin.h>
+#endif
+
+static enum ALG_SIMD_KERNEL alg_simd_kernel = ALG_SIMD_SCALAR;
+
+/**
+ * alg_simd_diff_from
+ *
+ *  Scalar kernel of alg_diff_standard from pixel indx on: flags the pixels
+ *  whose absolute difference to the reference, weighted by the fixed mask,
+ *  exceeds the noise level and which the smart mask does not suppress.
+ *  The flags are gathered in words of 64 pixels that are counted as they
+ *  are stored.
+ *
+ * Parameters:
+ *
+ *   dd   - The planes and settings of the pass.
+ *   indx - First pixel to process.
+ *   word - Flags a vector kernel already gathered for the word of indx.
+ *
+ * Returns: The number of pixels in motion in the words stored.
+ */
+static int alg_simd_diff_from(const struct alg_diff_data *dd, int indx, uint64_t word)
+{
+    const unsigned char *ref = dd->ref;
+    const unsigned char *new = dd->new;
+    const unsigned char *mask = dd->mask;
+    const unsigned char *smartmask_final = dd->smartmask;
+    uint16_t *smartmask_buffer = dd->smartmask_buffer;
+    int noise = dd->noise;
+    int sum, diffs = 0;
+
+    for (; indx < dd->count; indx++) {
+        register unsigned char curdiff = (int)(abs(ref[indx] - new[indx])); /* Using a temp variable is 12% faster. */
+        /* Apply fixed mask */
+        if (mask)
+            curdiff = ((int)(curdiff * mask[indx]) / 255);
+
+        if (smartmask_final) {
+            if (curdiff > noise) {
+                /* The 16 bit counter saturates instead of wrapping */
+                sum = smartmask_buffer[indx] + dd->smartmask_incr;
+                smartmask_buffer[indx] = (sum > 0xffff) ? 0xffff : sum;
+                /* Apply smart_mask */
+                if (!smartmask_final[indx])
+                    curdiff = 0;
+            }
+        }
+        /* Pixel still in motion after all the masks? */
+        if (curdiff > noise)
+            word |= (uint64_t)1 << (indx & 63);
+
+        if ((indx & 63) == 63) {
+            dd->bits[indx >> 6] = word;
+            diffs += __builtin_popcountll(word);
+            word = 0;
+        }
+    }
+
+    if (dd->count & 63) {
+        dd->bits[dd->count >> 6] = word;
+        diffs += __builtin_popcountll(word);
+    }
+
+    return diffs;
+}
+
+/**
+ * alg_simd_diff_scalar
+ *
+ *  Reference kernel of alg_diff_standard.
+ *
+ * Parameters:
+ *
+ *   dd - The planes and settings of the pass.
+ *
+ * Returns: The number of pixels in motion.
+ */
+int alg_simd_diff_scalar(const struct alg_diff_data *dd)
+{
+    return alg_simd_diff_from(dd, 0, 0);
+}
+
+/**
+ * alg_simd_shrink_from
+ *
+ *  Scalar kernel of alg_simd_shrink from output pixel indx on: each output
+ *  pixel is the rounded mean of a block of scale x scale input pixels.
+ *
+ * Parameters:
+ *
+ *   dst    - The output row.
+ *   src    - The first of the scale input rows.
+ *   stride - Bytes from one input row to the next.
+ *   width  - Number of output pixels.
+ *   scale  - Width and height of the blocks.
+ *   indx   - First output pixel to process.
+ *
+ * Returns: nothing
+ */
+static void alg_simd_shrink_from(unsigned char *dst, const unsigned char *src, int stride
+    , int width, int scale, int indx)
+{
+    const unsigned char *block;
+    int x, y, sum, area = scale * scale;
+
+    for (; indx < width; indx++) {
+        block = src + indx * scale;
+        sum = 0;
+        for (y = 0; y < scale; y++, block += stride) {
+            for (x = 0; x < scale; x++)
+                sum += block[x];
+        }
+        dst[indx] = (sum + area / 2) / area;
+    }
+}
+
+/**
+ * alg_simd_shrink_scalar
+ *
+ *  Reference kernel of alg_simd_shrink.
+ *
+ * Parameters:
+ *
+ *   dst    - The output row.
+ *   src    - The first of the scale input rows.
+ *   stride - Bytes from one input row to the next.
+ *   width  - Number of output pixels.
+ *   scale  - Width and height of the blocks.
+ *
+ * Returns: nothing
+ */
+void alg_simd_shrink_scalar(unsigned char *dst, const unsigned char *src, int stride
+    , int width, int scale)
+{
+    alg_simd_shrink_from(dst, src, stride, width, scale, 0);
+}
+
+/**
+ * alg_simd_sad_from
+ *
+ *  Scalar kernel of alg_simd_sad from pixel indx on.
+ *
+ * Parameters:
+ *
+ *   ref        - The first row of the reference frame.
+ *   ref_stride - Bytes from one row of the reference frame to the next.
+ *   new        - The first row of the new image.
+ *   new_stride - Bytes from one row of the new image to the next.
+ *   count      - Number of pixels per row.
+ *   rows       - Number of rows.
+ *   sums       - Receives the sum of each group of 16 columns.
+ *   indx       - First pixel of each row to process.
+ *
+ * Returns: nothing
+ */
+static void alg_simd_sad_from(const unsigned char *ref, int ref_stride
+    , const unsigned char *new, int new_stride, int count, int rows
+    , unsigned int *sums, int indx)
+{
+    int x, y, end;
+    unsigned int sum;
+
+    for (y = 0; y < rows; y++, ref += ref_stride, new += new_stride) {
+        for (x = indx; x < count; x = end) {
+            end = (x | 15) + 1;
+            if (end > count)
+                end = count;
+            for (sum = 0; x < end; x++)
+                sum += abs(ref[x] - new[x]);
+            sums[(end - 1) >> 4] += sum;
+        }
+    }
+}
+
+/**
+ * alg_simd_sad_scalar
+ *
+ *  Reference kernel of alg_simd_sad.
+ *
+ * Parameters:
+ *
+ *   ref        - The first row of the reference frame.
+ *   ref_stride - Bytes from one row of the reference frame to the next.
+ *   new        - The first row of the new image.
+ *   new_stride - Bytes from one row of the new image to the next.
+ *   count      - Number of pixels per row.
+ *   rows       - Number of rows.
+ *   sums       - Receives the sum of each group of 16 columns.
+ *
+ * Returns: nothing
+ */
+void alg_simd_sad_scalar(const unsigned char *ref, int ref_stride
+    , const unsigned char *new, int new_stride, int count, int rows, unsigned int *sums)
+{
+    alg_simd_sad_from(ref, ref_stride, new, new_stride, count, rows, sums, 0);
+}
+
+/**
+ * alg_simd_update_ref_from
+ *
+ *  Scalar kernel of the reference frame update from pixel indx on. Pixels
+ *  that differ from the reference by more than threshold_ref, and that the
+ *  smart mask does not exclude, are kept out of the reference while they
+ *  are in motion, for at most accept_timer frames. Pixels that stopped
+ *  moving are blended in and all others are copied.
+ *
+ * Parameters:
+ *
+ *   rd   - The planes and settings of the row.
+ *   indx - First pixel to process.
+ *
+ * Returns: nothing
+ */
+static void alg_simd_update_ref_from(const struct alg_ref_data *rd, int indx)
+{
+    unsigned char *ref = rd->ref;
+    uint16_t *ref_dyn = rd->ref_dyn;
+    const unsigned char *image_virgin = rd->new;
+
+    for (; indx < rd->count; indx++) {
+        /* Exclude pixels from ref frame well below noise level. */
+        if (((int)(abs(ref[indx] - image_virgin[indx])) > rd->threshold_ref) && rd->smartmask[indx]) {
+            if (ref_dyn[indx] == 0) { /* Always give new pixels a chance. */
+                ref_dyn[indx] = 1;
+            } else if (ref_dyn[indx] > rd->accept_timer) { /* Include static Object after some time. */
+                ref_dyn[indx] = 0;
+                ref[indx] = image_virgin[indx];
+            } else if ((rd->bits[indx >> 6] >> (indx & 63)) & 1) {
+                ref_dyn[indx]++; /* Motionpixel? Keep excluding from ref frame. */
+            } else {
+                ref_dyn[indx] = 0; /* Nothing special - release pixel. */
+                ref[indx] = (ref[indx] + image_virgin[indx]) / 2;
+            }
+
+        } else {  /* No motion: copy to ref frame. */
+            ref_dyn[indx] = 0; /* Reset pixel */
+            ref[indx] = image_virgin[indx];
+        }
+    }
+}
+
+/**
+ * alg_simd_update_ref_scalar
+ *
+ *  Reference kernel of alg_simd_update_ref.
+ *
+ * Parameters:
+ *
+ *   rd - The planes and settings of the row.
+ *
+ * Returns: nothing
+ */
+void alg_simd_update_ref_scalar(const struct alg_ref_data *rd)
+{
+    alg_simd_update_ref_from(rd, 0);
+}
+
+/**
+ * alg_simd_smartmask_from
+ *
+ *  Scalar kernel of the smart mask tuning from pixel indx on. The raw mask
+ *  decays by one and grows by the changes buffered since the last tuning
+ *  in units of sensitivity, which leave their remainder in the buffer.
+ *  Pixels whose raw mask is above 20 are excluded by the final mask.
+ *
+ * Parameters:
+ *
+ *   smartmask   - The raw smart mask of the row.
+ *   buffer      - The changes counted by the diff.
+ *   final       - Receives the final mask, before the erode.
+ *   sensitivity - Changes per step of the raw mask.
+ *   count       - Number of pixels.
+ *   indx        - First pixel to process.
+ *
+ * Returns: nothing
+ */
+static void alg_simd_smartmask_from(unsigned char *smartmask, uint16_t *buffer, unsigned char *final
+    , int sensitivity, int count, int indx)
+{
+    int diff;
+
+    for (; indx < count; indx++) {
+        /* Decrease smart_mask sensitivity every 5*speed seconds only. */
+        if (smartmask[indx] > 0)
+            smartmask[indx]--;
+        /* Increase smart_mask sensitivity based on the buffered values. */
+        diff = buffer[indx] / sensitivity;
+
+        if (diff) {
+            if (smartmask[indx] <= diff + 80)
+                smartmask[indx] += diff;
+            else
+                smartmask[indx] = 80;
+            buffer[indx] %= sensitivity;
+        }
+        /* Transfer raw mask to the final stage when above trigger value. */
+        if (smartmask[indx] > 20)
+            final[indx] = 0;
+        else
+            final[indx] = 255;
+    }
+}
+
+/**
+ * alg_simd_smartmask_scalar
+ *
+ *  Reference kernel of alg_simd_smartmask.
+ *
+ * Parameters:
+ *
+ *   smartmask   - The raw smart mask of the row.
+ *   buffer      - The changes counted by the diff.
+ *   final       - Receives the final mask, before the erode.
+ *   sensitivity - Changes per step of the raw mask.
+ *   count       - Number of pixels.
+ *
+ * Returns: nothing
+ */
+void alg_simd_smartmask_scalar(unsigned char *smartmask, uint16_t *buffer, unsigned char *final
+    , int sensitivity, int count)
+{
+    alg_simd_smartmask_from(smartmask, buffer, final, sensitivity, count, 0);
+}
+
+/**
+ * alg_simd_erode_from
+ *
+ *  Scalar kernel of the erode of one row from pixel indx on: a pixel is
+ *  cleared when a pixel of its 3x3 box, or of the + shape when cross is
+ *  set, is 0. The first and the last pixel of the row are not touched.
+ *
+ * Parameters:
+ *
+ *   dst    - The row to erode.
+ *   above  - A copy of the row above.
+ *   row    - A copy of the row before the erode.
+ *   below  - A copy of the row below.
+ *   width  - Number of pixels of the row.
+ *   cross  - Erode in a + shape instead of the box.
+ *   indx   - First pixel to process, at least 1.
+ *
+ * Returns: The number of pixels that are kept.
+ */
+static int alg_simd_erode_from(unsigned char *dst, const unsigned char *above, const unsigned char *row
+    , const unsigned char *below, int width, int cross, int indx)
+{
+    int sum = 0;
+
+    for (; indx < width - 1; indx++) {
+        if (above[indx] == 0 ||
+            row[indx - 1] == 0 ||
+            row[indx] == 0 ||
+            row[indx + 1] == 0 ||
+            below[indx] == 0 ||
+            (!cross && (above[indx - 1] == 0 ||
+                        above[indx + 1] == 0 ||
+                        below[indx - 1] == 0 ||
+                        below[indx + 1] == 0)))
+            dst[indx] = 0;
+        else
+            sum++;
+    }
+
+    return sum;
+}
+
+/**
+ * alg_simd_erode_scalar
+ *
+ *  Reference kernel of alg_simd_erode.
+ *
+ * Parameters:
+ *
+ *   dst    - The row to erode.
+ *   above  - A copy of the row above.
+ *   row    - A copy of the row before the erode.
+ *   below  - A copy of the row below.
+ *   width  - Number of pixels of the row.
+ *   cross  - Erode in a + shape instead of the box.
+ *
+ * Returns: The number of pixels that are kept.
+ */
+int alg_simd_erode_scalar(unsigned char *dst, const unsigned char *above, const unsigned char *row
+    , const unsigned char *below, int width, int cross)
+{
+    return alg_simd_erode_from(dst, above, row, below, width, cross, 1);
+}
+
+#ifdef ALG_SIMD_X86
+
+/*
+ * The vector kernels avoid the division by 255 of the masked difference:
+ * (d * m) / 255 > noise holds exactly when d * m > noise * 255 + 254, which
+ * is tested with an unsigned saturated subtraction. Without a mask d is
+ * compared against the noise level directly. A noise level above 255 can
+ * never be exceeded so it is clamped to keep the limits within 16 bits;
+ * a negative noise level is left to the scalar kernel.
+ */
+
+__attribute__((target("sse2")))
+static int alg_simd_diff_sse2(const struct alg_diff_data *dd)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8(-1);
+    const int noise = dd->noise > 255 ? 255 : dd->noise;
+    const __m128i noise8 = _mm_set1_epi8((char)noise);
+    const __m128i limit = _mm_set1_epi16((short)(noise * 255 + 254));
+    const __m128i incr = _mm_set1_epi16((short)dd->smartmask_incr);
+    __m128i r, n, d, m, lo, hi, flag;
+    __m128i *buf;
+    uint64_t word = 0;
+    int indx, vcount, diffs = 0;
+
+    if (dd->noise < 0) return alg_simd_diff_scalar(dd);
+
+    vcount = dd->count & ~15;
+    for (indx = 0; indx < vcount; indx += 16) {
+        r = _mm_loadu_si128((const __m128i *)(dd->ref + indx));
+        n = _mm_loadu_si128((const __m128i *)(dd->new + indx));
+        d = _mm_or_si128(_mm_subs_epu8(r, n), _mm_subs_epu8(n, r));
+
+        if (dd->mask) {
+            m = _mm_loadu_si128((const __m128i *)(dd->mask + indx));
+            lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(m, zero));
+            hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(m, zero));
+            lo = _mm_cmpeq_epi16(_mm_subs_epu16(lo, limit), zero);
+            hi = _mm_cmpeq_epi16(_mm_subs_epu16(hi, limit), zero);
+            flag = _mm_xor_si128(_mm_packs_epi16(lo, hi), ones);
+        } else {
+            flag = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(d, noise8), zero), ones);
+        }
+
+        if (dd->smartmask) {
+            if (dd->smartmask_incr) {
+                /* Widen the 0x00/0xff flags to 16 bit lanes and add the increment */
+                buf = (__m128i *)(dd->smartmask_buffer + indx);
+                _mm_storeu_si128(buf + 0, _mm_adds_epu16(_mm_loadu_si128(buf + 0),
+                    _mm_and_si128(_mm_unpacklo_epi8(flag, flag), incr)));
+                _mm_storeu_si128(buf + 1, _mm_adds_epu16(_mm_loadu_si128(buf + 1),
+                    _mm_and_si128(_mm_unpackhi_epi8(flag, flag), incr)));
+            }
+            m = _mm_loadu_si128((const __m128i *)(dd->smartmask + indx));
+            flag = _mm_andnot_si128(_mm_cmpeq_epi8(m, zero), flag);
+        }
+
+        /* The byte flags become 16 bits of the word of the 64 pixels */
+        word |= (uint64_t)(unsigned int)_mm_movemask_epi8(flag) << (indx & 63);
+        if ((indx & 63) == 48) {
+            dd->bits[indx >> 6] = word;
+            diffs += __builtin_popcountll(word);
+            word = 0;
+        }
+    }
+
+    return diffs + alg_simd_diff_from(dd, vcount, word);
+}
+
+__attribute__((target("avx2")))
+static int alg_simd_diff_avx2(const struct alg_diff_data *dd)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi8(-1);
+    const int noise = dd->noise > 255 ? 255 : dd->noise;
+    const __m256i noise8 = _mm256_set1_epi8((char)noise);
+    const __m256i limit = _mm256_set1_epi16((short)(noise * 255 + 254));
+    const __m256i incr = _mm256_set1_epi16((short)dd->smartmask_incr);
+    __m256i r, n, d, m, lo, hi, flag;
+    __m256i *buf;
+    uint64_t word = 0;
+    int indx, vcount, diffs = 0;
+
+    if (dd->noise < 0) return alg_simd_diff_scalar(dd);
+
+    vcount = dd->count & ~31;
+    for (indx = 0; indx < vcount; indx += 32) {
+        r = _mm256_loadu_si256((const __m256i *)(dd->ref + indx));
+        n = _mm256_loadu_si256((const __m256i *)(dd->new + indx));
+        d = _mm256_or_si256(_mm256_subs_epu8(r, n), _mm256_subs_epu8(n, r));
+
+        if (dd->mask) {
+            /* Unpack and pack work within 128 bit lanes so the byte order is kept */
+            m = _mm256_loadu_si256((const __m256i *)(dd->mask + indx));
+            lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(m, zero));
+            hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(m, zero));
+            lo = _mm256_cmpeq_epi16(_mm256_subs_epu16(lo, limit), zero);
+            hi = _mm256_cmpeq_epi16(_mm256_subs_epu16(hi, limit), zero);
+            flag = _mm256_xor_si256(_mm256_packs_epi16(lo, hi), ones);
+        } else {
+            flag = _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_subs_epu8(d, noise8), zero), ones);
+        }
+
+        if (dd->smartmask) {
+            if (dd->smartmask_incr) {
+                /* Sign extension widens the 0x00/0xff flags to 16 bit lanes */
+                buf = (__m256i *)(dd->smartmask_buffer + indx);
+                _mm256_storeu_si256(buf + 0, _mm256_adds_epu16(_mm256_loadu_si256(buf + 0),
+                    _mm256_and_si256(_mm256_cvtepi8_epi16(_mm256_castsi256_si128(flag)), incr)));
+                _mm256_storeu_si256(buf + 1, _mm256_adds_epu16(_mm256_loadu_si256(buf + 1),
+                    _mm256_and_si256(_mm256_cvtepi8_epi16(_mm256_extracti128_si256(flag, 1)), incr)));
+            }
+            m = _mm256_loadu_si256((const __m256i *)(dd->smartmask + indx));
+            flag = _mm256_andnot_si256(_mm256_cmpeq_epi8(m, zero), flag);
+        }
+
+        word |= (uint64_t)(unsigned int)_mm256_movemask_epi8(flag) << (indx & 63);
+        if ((indx & 63) == 32) {
+            dd->bits[indx >> 6] = word;
+            diffs += __builtin_popcountll(word);
+            word = 0;
+        }
+    }
+
+    return diffs + alg_simd_diff_from(dd, vcount, word);
+}
+/*
+ * The shrink kernels add the bytes of a row pairwise into 16 bit lanes:
+ * the even bytes masked out plus the odd bytes shifted down. Scale 2 adds
+ * the pair sums of two rows, scale 4 those of four rows and then the two
+ * pairs of each block with a multiply-add by one into 32 bit lanes. The
+ * rounded means are packed back to bytes. Other scales, and the pixels
+ * past the last full vector, go to the scalar kernel.
+ */
+
+__attribute__((target("sse2")))
+static __m128i alg_simd_pairs_sse2(const unsigned char *src)
+{
+    const __m128i low = _mm_set1_epi16(0x00ff);
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+
+    return _mm_add_epi16(_mm_and_si128(v, low), _mm_srli_epi16(v, 8));
+}
+
+__attribute__((target("sse2")))
+static void alg_simd_shrink_sse2(unsigned char *dst, const unsigned char *src, int stride
+    , int width, int scale)
+{
+    const __m128i two = _mm_set1_epi16(2);
+    const __m128i eight = _mm_set1_epi32(8);
+    const __m128i one = _mm_set1_epi16(1);
+    const unsigned char *in;
+    __m128i s[4];
+    int indx, vcount = width & ~15, chunk;
+
+    if (scale == 2) {
+        for (indx = 0; indx < vcount; indx += 16) {
+            in = src + 2 * indx;
+            s[0] = _mm_add_epi16(alg_simd_pairs_sse2(in), alg_simd_pairs_sse2(in + stride));
+            s[1] = _mm_add_epi16(alg_simd_pairs_sse2(in + 16), alg_simd_pairs_sse2(in + stride + 16));
+            s[0] = _mm_srli_epi16(_mm_add_epi16(s[0], two), 2);
+            s[1] = _mm_srli_epi16(_mm_add_epi16(s[1], two), 2);
+            _mm_storeu_si128((__m128i *)(dst + indx), _mm_packus_epi16(s[0], s[1]));
+        }
+    } else if (scale == 4) {
+        for (indx = 0; indx < vcount; indx += 16) {
+            for (chunk = 0; chunk < 4; chunk++) {
+                in = src + 4 * indx + 16 * chunk;
+                s[chunk] = _mm_add_epi16(
+                    _mm_add_epi16(alg_simd_pairs_sse2(in), alg_simd_pairs_sse2(in + stride)),
+                    _mm_add_epi16(alg_simd_pairs_sse2(in + 2 * stride), alg_simd_pairs_sse2(in + 3 * stride)));
+                s[chunk] = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(s[chunk], one), eight), 4);
+            }
+            _mm_storeu_si128((__m128i *)(dst + indx), _mm_packus_epi16(
+                _mm_packs_epi32(s[0], s[1]), _mm_packs_epi32(s[2], s[3])));
+        }
+    } else {
+        vcount = 0;
+    }
+
+    alg_simd_shrink_from(dst, src, stride, width, scale, vcount);
+}
+
+__attribute__((target("avx2")))
+static __m256i alg_simd_pairs_avx2(const unsigned char *src)
+{
+    const __m256i low = _mm256_set1_epi16(0x00ff);
+    __m256i v = _mm256_loadu_si256((const __m256i *)src);
+
+    return _mm256_add_epi16(_mm256_and_si256(v, low), _mm256_srli_epi16(v, 8));
+}
+
+__attribute__((target("avx2")))
+static void alg_simd_shrink_avx2(unsigned char *dst, const unsigned char *src, int stride
+    , int width, int scale)
+{
+    const __m256i two = _mm256_set1_epi16(2);
+    const __m256i eight = _mm256_set1_epi32(8);
+    const __m256i one = _mm256_set1_epi16(1);
+    /* Packing works within 128 bit lanes, these put the pixels back in order */
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    const unsigned char *in;
+    __m256i s[4];
+    int indx, vcount = width & ~31, chunk;
+
+    if (scale == 2) {
+        for (indx = 0; indx < vcount; indx += 32) {
+            in = src + 2 * indx;
+            s[0] = _mm256_add_epi16(alg_simd_pairs_avx2(in), alg_simd_pairs_avx2(in + stride));
+            s[1] = _mm256_add_epi16(alg_simd_pairs_avx2(in + 32), alg_simd_pairs_avx2(in + stride + 32));
+            s[0] = _mm256_srli_epi16(_mm256_add_epi16(s[0], two), 2);
+            s[1] = _mm256_srli_epi16(_mm256_add_epi16(s[1], two), 2);
+            _mm256_storeu_si256((__m256i *)(dst + indx),
+                _mm256_permute4x64_epi64(_mm256_packus_epi16(s[0], s[1]), 0xD8));
+        }
+    } else if (scale == 4) {
+        for (indx = 0; indx < vcount; indx += 32) {
+            for (chunk = 0; chunk < 4; chunk++) {
+                in = src + 4 * indx + 32 * chunk;
+                s[chunk] = _mm256_add_epi16(
+                    _mm256_add_epi16(alg_simd_pairs_avx2(in), alg_simd_pairs_avx2(in + stride)),
+                    _mm256_add_epi16(alg_simd_pairs_avx2(in + 2 * stride), alg_simd_pairs_avx2(in + 3 * stride)));
+                s[chunk] = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(s[chunk], one), eight), 4);
+            }
+            _mm256_storeu_si256((__m256i *)(dst + indx), _mm256_permutevar8x32_epi32(
+                _mm256_packus_epi16(_mm256_packs_epi32(s[0], s[1]), _mm256_packs_epi32(s[2], s[3])), order));
+        }
+    } else {
+        vcount = 0;
+    }
+
+    alg_simd_shrink_from(dst, src, stride, width, scale, vcount);
+}
+/*
+ * The SAD instructions add up the absolute differences of each 8 bytes
+ * into a 64 bit lane, two lanes make the sum of a group of 16 pixels.
+ * The lanes of a group of columns are added up over all rows in a
+ * register before they are stored.
+ */
+
+__attribute__((target("sse2")))
+static void alg_simd_sad_sse2(const unsigned char *ref, int ref_stride
+    , const unsigned char *new, int new_stride, int count, int rows, unsigned int *sums)
+{
+    __m128i acc;
+    int indx, y, vcount = count & ~15;
+
+    for (indx = 0; indx < vcount; indx += 16) {
+        acc = _mm_setzero_si128();
+        for (y = 0; y < rows; y++) {
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(
+                _mm_loadu_si128((const __m128i *)(ref + y * ref_stride + indx)),
+                _mm_loadu_si128((const __m128i *)(new + y * new_stride + indx))));
+        }
+        sums[indx >> 4] += _mm_cvtsi128_si32(_mm_add_epi32(acc, _mm_srli_si128(acc, 8)));
+    }
+
+    alg_simd_sad_from(ref, ref_stride, new, new_stride, count, rows, sums, vcount);
+}
+
+__attribute__((target("avx2")))
+static void alg_simd_sad_avx2(const unsigned char *ref, int ref_stride
+    , const unsigned char *new, int new_stride, int count, int rows, unsigned int *sums)
+{
+    __m256i acc;
+    __m128i pair;
+    int indx, y, vcount = count & ~31;
+
+    for (indx = 0; indx < vcount; indx += 32) {
+        acc = _mm256_setzero_si256();
+        for (y = 0; y < rows; y++) {
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+                _mm256_loadu_si256((const __m256i *)(ref + y * ref_stride + indx)),
+                _mm256_loadu_si256((const __m256i *)(new + y * new_stride + indx))));
+        }
+        /* Lanes 0 and 1 are the first group, 2 and 3 the second */
+        acc = _mm256_permute4x64_epi64(acc, 0xD8);
+        pair = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        sums[indx >> 4] += _mm_cvtsi128_si32(pair);
+        sums[(indx >> 4) + 1] += _mm_cvtsi128_si32(_mm_srli_si128(pair, 8));
+    }
+
+    alg_simd_sad_from(ref, ref_stride, new, new_stride, count, rows, sums, vcount);
+}
+
+/*
+ * The reference update sorts the pixels of a vector into three cases with
+ * compare masks: copied from the new image (no exclusion or a static
+ * object accepted), counted on in ref_dyn (new or still moving pixels) and
+ * blended with the new image (released pixels). The floor of the mean is
+ * the rounded up mean of pavgb less the low bit of the xor. The 16 bit
+ * counters are compared without sign by flipping their top bit, and their
+ * masks are packed to bytes next to the byte masks. The motion bits of the
+ * pixels are spread to bytes and tested against the bit of each byte.
+ * The accept timer is clamped to 16 bits, which does not change the
+ * outcome since ref_dyn is never 0 when it is compared; a negative
+ * threshold is left to the scalar kernel.
+ */
+
+__attribute__((target("sse2")))
+static void alg_simd_update_ref_sse2(const struct alg_ref_data *rd)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8(-1);
+    const __m128i low = _mm_set1_epi8(1);
+    const __m128i one16 = _mm_set1_epi16(1);
+    const __m128i sign16 = _mm_set1_epi16((short)0x8000);
+    const __m128i select = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const int timer = rd->accept_timer < 0 ? 0 : (rd->accept_timer > 0xffff ? 0xffff : rd->accept_timer);
+    const __m128i timer16 = _mm_set1_epi16((short)(timer ^ 0x8000));
+    const __m128i threshold = _mm_set1_epi8((char)(rd->threshold_ref > 255 ? 255 : rd->threshold_ref));
+    __m128i r, n, d, cond, motion, dyn0, dyn1, zero8, over8, copy, keep, blend, mean;
+    __m128i *dyn;
+    int indx, vcount;
+
+    if (rd->threshold_ref < 0) {
+        alg_simd_update_ref_scalar(rd);
+        return;
+    }
+
+    vcount = rd->count & ~15;
+    for (indx = 0; indx < vcount; indx += 16) {
+        r = _mm_loadu_si128((const __m128i *)(rd->ref + indx));
+        n = _mm_loadu_si128((const __m128i *)(rd->new + indx));
+        d = _mm_or_si128(_mm_subs_epu8(r, n), _mm_subs_epu8(n, r));
+        cond = _mm_xor_si128(_mm_or_si128(_mm_cmpeq_epi8(_mm_subs_epu8(d, threshold), zero),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(rd->smartmask + indx)), zero)), ones);
+
+        motion = _mm_cvtsi32_si128((int)((rd->bits[indx >> 6] >> (indx & 63)) & 0xffff));
+        motion = _mm_unpacklo_epi8(motion, motion);
+        motion = _mm_unpacklo_epi16(motion, motion);
+        motion = _mm_unpacklo_epi32(motion, motion);
+        motion = _mm_cmpeq_epi8(_mm_and_si128(motion, select), select);
+
+        dyn = (__m128i *)(rd->ref_dyn + indx);
+        dyn0 = _mm_loadu_si128(dyn + 0);
+        dyn1 = _mm_loadu_si128(dyn + 1);
+        zero8 = _mm_packs_epi16(_mm_cmpeq_epi16(dyn0, zero), _mm_cmpeq_epi16(dyn1, zero));
+        over8 = _mm_packs_epi16(_mm_cmpgt_epi16(_mm_xor_si128(dyn0, sign16), timer16),
+            _mm_cmpgt_epi16(_mm_xor_si128(dyn1, sign16), timer16));
+
+        copy = _mm_or_si128(_mm_xor_si128(cond, ones), over8);
+        keep = _mm_andnot_si128(over8, _mm_and_si128(cond, _mm_or_si128(zero8, motion)));
+        blend = _mm_xor_si128(_mm_or_si128(copy, keep), ones);
+        mean = _mm_sub_epi8(_mm_avg_epu8(r, n), _mm_and_si128(_mm_xor_si128(r, n), low));
+
+        _mm_storeu_si128((__m128i *)(rd->ref + indx), _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(copy, n), _mm_and_si128(blend, mean)), _mm_and_si128(keep, r)));
+        _mm_storeu_si128(dyn + 0, _mm_and_si128(_mm_add_epi16(dyn0, one16), _mm_unpacklo_epi8(keep, keep)));
+        _mm_storeu_si128(dyn + 1, _mm_and_si128(_mm_add_epi16(dyn1, one16), _mm_unpackhi_epi8(keep, keep)));
+    }
+
+    alg_simd_update_ref_from(rd, vcount);
+}
+
+__attribute__((target("avx2")))
+static void alg_simd_update_ref_avx2(const struct alg_ref_data *rd)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi8(-1);
+    const __m256i low = _mm256_set1_epi8(1);
+    const __m256i one16 = _mm256_set1_epi16(1);
+    const __m256i sign16 = _mm256_set1_epi16((short)0x8000);
+    const __m256i select = _mm256_set1_epi64x((long long)0x8040201008040201ULL);
+    /* Each byte of the 32 motion bits goes to 8 bytes, within the 128 bit lanes */
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+        2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const int timer = rd->accept_timer < 0 ? 0 : (rd->accept_timer > 0xffff ? 0xffff : rd->accept_timer);
+    const __m256i timer16 = _mm256_set1_epi16((short)(timer ^ 0x8000));
+    const __m256i threshold = _mm256_set1_epi8((char)(rd->threshold_ref > 255 ? 255 : rd->threshold_ref));
+    __m256i r, n, d, cond, motion, dyn0, dyn1, zero8, over8, copy, keep, blend, mean;
+    __m256i *dyn;
+    int indx, vcount;
+
+    if (rd->threshold_ref < 0) {
+        alg_simd_update_ref_scalar(rd);
+        return;
+    }
+
+    vcount = rd->count & ~31;
+    for (indx = 0; indx < vcount; indx += 32) {
+        r = _mm256_loadu_si256((const __m256i *)(rd->ref + indx));
+        n = _mm256_loadu_si256((const __m256i *)(rd->new + indx));
+        d = _mm256_or_si256(_mm256_subs_epu8(r, n), _mm256_subs_epu8(n, r));
+        cond = _mm256_xor_si256(_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_subs_epu8(d, threshold), zero),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(rd->smartmask + indx)), zero)), ones);
+
+        motion = _mm256_set1_epi32((int)(uint32_t)(rd->bits[indx >> 6] >> (indx & 63)));
+        motion = _mm256_shuffle_epi8(motion, spread);
+        motion = _mm256_cmpeq_epi8(_mm256_and_si256(motion, select), select);
+
+        /* Packing works within 128 bit lanes, the permute puts the pixels back in order */
+        dyn = (__m256i *)(rd->ref_dyn + indx);
+        dyn0 = _mm256_loadu_si256(dyn + 0);
+        dyn1 = _mm256_loadu_si256(dyn + 1);
+        zero8 = _mm256_permute4x64_epi64(_mm256_packs_epi16(
+            _mm256_cmpeq_epi16(dyn0, zero), _mm256_cmpeq_epi16(dyn1, zero)), 0xD8);
+        over8 = _mm256_permute4x64_epi64(_mm256_packs_epi16(
+            _mm256_cmpgt_epi16(_mm256_xor_si256(dyn0, sign16), timer16),
+            _mm256_cmpgt_epi16(_mm256_xor_si256(dyn1, sign16), timer16)), 0xD8);
+
+        copy = _mm256_or_si256(_mm256_xor_si256(cond, ones), over8);
+        keep = _mm256_andnot_si256(over8, _mm256_and_si256(cond, _mm256_or_si256(zero8, motion)));
+        blend = _mm256_xor_si256(_mm256_or_si256(copy, keep), ones);
+        mean = _mm256_sub_epi8(_mm256_avg_epu8(r, n), _mm256_and_si256(_mm256_xor_si256(r, n), low));
+
+        _mm256_storeu_si256((__m256i *)(rd->ref + indx), _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(copy, n), _mm256_and_si256(blend, mean)),
+            _mm256_and_si256(keep, r)));
+        _mm256_storeu_si256(dyn + 0, _mm256_and_si256(_mm256_add_epi16(dyn0, one16),
+            _mm256_cvtepi8_epi16(_mm256_castsi256_si128(keep))));
+        _mm256_storeu_si256(dyn + 1, _mm256_and_si256(_mm256_add_epi16(dyn1, one16),
+            _mm256_cvtepi8_epi16(_mm256_extracti128_si256(keep, 1))));
+    }
+
+    alg_simd_update_ref_from(rd, vcount);
+}
+/*
+ * The smart mask tuning divides the 16 bit buffers by the sensitivity in
+ * single precision: for a dividend below 2^16 the quotient rounded to
+ * float never reaches the next integer, so the truncation is the integer
+ * quotient, and the product with the divisor is exact. The raw mask is
+ * worked on in 16 bit lanes where it adds up without the wrap of its
+ * byte, which the mask with 0xff brings back. A sensitivity below 1 is
+ * left to the scalar kernel.
+ */
+
+__attribute__((target("sse2")))
+static __m128i alg_simd_divide_sse2(__m128i buf, __m128 divisor, __m128i *quot)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias32 = _mm_set1_epi32(0x8000);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    __m128 lo, hi;
+    __m128i rem_lo, rem_hi, quot_lo, quot_hi;
+
+    lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(buf, zero));
+    hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(buf, zero));
+    quot_lo = _mm_cvttps_epi32(_mm_div_ps(lo, divisor));
+    quot_hi = _mm_cvttps_epi32(_mm_div_ps(hi, divisor));
+    rem_lo = _mm_cvttps_epi32(_mm_sub_ps(lo, _mm_mul_ps(_mm_cvtepi32_ps(quot_lo), divisor)));
+    rem_hi = _mm_cvttps_epi32(_mm_sub_ps(hi, _mm_mul_ps(_mm_cvtepi32_ps(quot_hi), divisor)));
+
+    /* Signed saturation would clip above 32767, the bias keeps the values */
+    *quot = _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(quot_lo, bias32), _mm_sub_epi32(quot_hi, bias32)), bias16);
+    return _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(rem_lo, bias32), _mm_sub_epi32(rem_hi, bias32)), bias16);
+}
+
+__attribute__((target("sse2")))
+static __m128i alg_simd_smartmask_step_sse2(__m128i mask, __m128i quot)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i byte = _mm_set1_epi16(0xff);
+    const __m128i eighty = _mm_set1_epi16(80);
+    __m128i grown, below, idle;
+
+    below = _mm_cmpeq_epi16(_mm_subs_epu16(mask, _mm_adds_epu16(quot, eighty)), zero);
+    grown = _mm_or_si128(_mm_and_si128(below, _mm_and_si128(_mm_add_epi16(mask, quot), byte)),
+        _mm_andnot_si128(below, eighty));
+    /* Without changes the mask only decays */
+    idle = _mm_cmpeq_epi16(quot, zero);
+
+    return _mm_or_si128(_mm_and_si128(idle, mask), _mm_andnot_si128(idle, grown));
+}
+
+__attribute__((target("sse2")))
+static void alg_simd_smartmask_sse2(unsigned char *smartmask, uint16_t *buffer, unsigned char *final
+    , int sensitivity, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i twenty = _mm_set1_epi8(20);
+    const __m128 divisor = _mm_set1_ps((float)sensitivity);
+    __m128i mask, quot, lo, hi;
+    __m128i *buf;
+    int indx, vcount;
+
+    if (sensitivity < 1) {
+        alg_simd_smartmask_scalar(smartmask, buffer, final, sensitivity, count);
+        return;
+    }
+
+    vcount = count & ~15;
+    for (indx = 0; indx < vcount; indx += 16) {
+        mask = _mm_subs_epu8(_mm_loadu_si128((const __m128i *)(smartmask + indx)), one);
+        buf = (__m128i *)(buffer + indx);
+
+        _mm_storeu_si128(buf + 0, alg_simd_divide_sse2(_mm_loadu_si128(buf + 0), divisor, &quot));
+        lo = alg_simd_smartmask_step_sse2(_mm_unpacklo_epi8(mask, zero), quot);
+        _mm_storeu_si128(buf + 1, alg_simd_divide_sse2(_mm_loadu_si128(buf + 1), divisor, &quot));
+        hi = alg_simd_smartmask_step_sse2(_mm_unpackhi_epi8(mask, zero), quot);
+
+        mask = _mm_packus_epi16(lo, hi);
+        _mm_storeu_si128((__m128i *)(smartmask + indx), mask);
+        _mm_storeu_si128((__m128i *)(final + indx), _mm_cmpeq_epi8(_mm_subs_epu8(mask, twenty), zero));
+    }
+
+    alg_simd_smartmask_from(smartmask, buffer, final, sensitivity, count, vcount);
+}
+
+__attribute__((target("avx2")))
+static __m256i alg_simd_divide_avx2(__m256i buf, __m256 divisor, __m256i *quot)
+{
+    __m256 lo, hi;
+    __m256i rem_lo, rem_hi, quot_lo, quot_hi;
+
+    lo = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(buf)));
+    hi = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(buf, 1)));
+    quot_lo = _mm256_cvttps_epi32(_mm256_div_ps(lo, divisor));
+    quot_hi = _mm256_cvttps_epi32(_mm256_div_ps(hi, divisor));
+    rem_lo = _mm256_cvttps_epi32(_mm256_sub_ps(lo, _mm256_mul_ps(_mm256_cvtepi32_ps(quot_lo), divisor)));
+    rem_hi = _mm256_cvttps_epi32(_mm256_sub_ps(hi, _mm256_mul_ps(_mm256_cvtepi32_ps(quot_hi), divisor)));
+
+    /* Packing works within 128 bit lanes, the permute puts the pixels back in order */
+    *quot = _mm256_permute4x64_epi64(_mm256_packus_epi32(quot_lo, quot_hi), 0xD8);
+    return _mm256_permute4x64_epi64(_mm256_packus_epi32(rem_lo, rem_hi), 0xD8);
+}
+
+__attribute__((target("avx2")))
+static void alg_simd_smartmask_avx2(unsigned char *smartmask, uint16_t *buffer, unsigned char *final
+    , int sensitivity, int count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i byte = _mm256_set1_epi16(0xff);
+    const __m256i eighty = _mm256_set1_epi16(80);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i twenty = _mm_set1_epi8(20);
+    const __m256 divisor = _mm256_set1_ps((float)sensitivity);
+    __m256i mask, quot, grown, below, idle;
+    __m256i *buf;
+    __m128i packed;
+    int indx, vcount;
+
+    if (sensitivity < 1) {
+        alg_simd_smartmask_scalar(smartmask, buffer, final, sensitivity, count);
+        return;
+    }
+
+    vcount = count & ~15;
+    for (indx = 0; indx < vcount; indx += 16) {
+        mask = _mm256_cvtepu8_epi16(_mm_subs_epu8(_mm_loadu_si128((const __m128i *)(smartmask + indx)), one));
+        buf = (__m256i *)(buffer + indx);
+        _mm256_storeu_si256(buf, alg_simd_divide_avx2(_mm256_loadu_si256(buf), divisor, &quot));
+
+        below = _mm256_cmpeq_epi16(_mm256_subs_epu16(mask, _mm256_adds_epu16(quot, eighty)), zero);
+        grown = _mm256_blendv_epi8(eighty, _mm256_and_si256(_mm256_add_epi16(mask, quot), byte), below);
+        idle = _mm256_cmpeq_epi16(quot, zero);
+        mask = _mm256_blendv_epi8(grown, mask, idle);
+
+        packed = _mm_packus_epi16(_mm256_castsi256_si128(mask), _mm256_extracti128_si256(mask, 1));
+        _mm_storeu_si128((__m128i *)(smartmask + indx), packed);
+        _mm_storeu_si128((__m128i *)(final + indx), _mm_cmpeq_epi8(_mm_subs_epu8(packed, twenty), _mm_setzero_si128()));
+    }
+
+    alg_simd_smartmask_from(smartmask, buffer, final, sensitivity, count, vcount);
+}
+/*
+ * The erode tests the neighbours of a vector of pixels with unaligned
+ * loads shifted by one pixel and clears the pixels where any of them is
+ * 0. The vectors start at pixel 1 so the loads stay within the row.
+ */
+
+__attribute__((target("sse2")))
+static int alg_simd_erode_sse2(unsigned char *dst, const unsigned char *above, const unsigned char *row
+    , const unsigned char *below, int width, int cross)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i hit;
+    int indx, sum = 0;
+
+#define ALG_SIMD_ZERO_SSE2(src, offs) \
+    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)((src) + indx + (offs))), zero)
+
+    for (indx = 1; indx + 16 < width; indx += 16) {
+        hit = _mm_or_si128(_mm_or_si128(ALG_SIMD_ZERO_SSE2(above, 0), ALG_SIMD_ZERO_SSE2(below, 0)),
+            _mm_or_si128(_mm_or_si128(ALG_SIMD_ZERO_SSE2(row, -1), ALG_SIMD_ZERO_SSE2(row, 0)),
+                ALG_SIMD_ZERO_SSE2(row, 1)));
+        if (!cross) {
+            hit = _mm_or_si128(hit, _mm_or_si128(
+                _mm_or_si128(ALG_SIMD_ZERO_SSE2(above, -1), ALG_SIMD_ZERO_SSE2(above, 1)),
+                _mm_or_si128(ALG_SIMD_ZERO_SSE2(below, -1), ALG_SIMD_ZERO_SSE2(below, 1))));
+        }
+        _mm_storeu_si128((__m128i *)(dst + indx),
+            _mm_andnot_si128(hit, _mm_loadu_si128((const __m128i *)(dst + indx))));
+        sum += 16 - __builtin_popcount(_mm_movemask_epi8(hit));
+    }
+
+#undef ALG_SIMD_ZERO_SSE2
+
+    return sum + alg_simd_erode_from(dst, above, row, below, width, cross, indx);
+}
+
+__attribute__((target("avx2")))
+static int alg_simd_erode_avx2(unsigned char *dst, const unsigned char *above, const unsigned char *row
+    , const unsigned char *below, int width, int cross)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i hit;
+    int indx, sum = 0;
+
+#define ALG_SIMD_ZERO_AVX2(src, offs) \
+    _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)((src) + indx + (offs))), zero)
+
+    for (indx = 1; indx + 32 < width; indx += 32) {
+        hit = _mm256_or_si256(_mm256_or_si256(ALG_SIMD_ZERO_AVX2(above, 0), ALG_SIMD_ZERO_AVX2(below, 0)),
+            _mm256_or_si256(_mm256_or_si256(ALG_SIMD_ZERO_AVX2(row, -1), ALG_SIMD_ZERO_AVX2(row, 0)),
+                ALG_SIMD_ZERO_AVX2(row, 1)));
+        if (!cross) {
+            hit = _mm256_or_si256(hit, _mm256_or_si256(
+                _mm256_or_si256(ALG_SIMD_ZERO_AVX2(above, -1), ALG_SIMD_ZERO_AVX2(above, 1)),
+                _mm256_or_si256(ALG_SIMD_ZERO_AVX2(below, -1), ALG_SIMD_ZERO_AVX2(below, 1))));
+        }
+        _mm256_storeu_si256((__m256i *)(dst + indx),
+            _mm256_andnot_si256(hit, _mm256_loadu_si256((const __m256i *)(dst + indx))));
+        sum += 32 - __builtin_popcount((unsigned int)_mm256_movemask_epi8(hit));
+    }
+
+#undef ALG_SIMD_ZERO_AVX2
+
+    return sum + alg_simd_erode_from(dst, above, row, below, width, cross, indx);
+}
+
+#endif /* ALG_SIMD_X86 */
+
+/**
+ * alg_simd_supported
+ *
+ *  Asks the processor whether it implements the instructions of a kernel.
+ *
+ * Parameters:
+ *
+ *   kernel - The kernel to check.
+ *
+ * Returns: 1 when the kernel can run on this machine, 0 otherwise.
+ */
+static int alg_simd_supported(enum ALG_SIMD_KERNEL kernel)
+{
+    switch (kernel) {
+    case ALG_SIMD_SCALAR:
+        return 1;
+#ifdef ALG_SIMD_X86
+    case ALG_SIMD_SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2") ? 1 : 0;
+    case ALG_SIMD_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/**
+ * alg_simd_name
+ *
+ * Parameters:
+ *
+ *   kernel - The kernel to name.
+ *
+ * Returns: The name of the kernel for the log and the benchmark.
+ */
+const char *alg_simd_name(enum ALG_SIMD_KERNEL kernel)
+{
+    switch (kernel) {
+    case ALG_SIMD_SSE2: return "sse2";
+    case ALG_SIMD_AVX2: return "avx2";
+    default:            return "scalar";
+    }
+}
+
+/**
+ * alg_simd_select
+ *
+ *  Forces the kernels used by the detection, mainly for the benchmark.
+ *
+ * Parameters:
+ *
+ *   kernel - The kernel to use from now on.
+ *
+ * Returns: 0 on success, -1 when the processor does not support the kernel.
+ */
+int alg_simd_select(enum ALG_SIMD_KERNEL kernel)
+{
+    if (!alg_simd_supported(kernel)) return -1;
+
+    alg_simd_kernel = kernel;
+
+    return 0;
+}
+
+/**
+ * alg_simd_init
+ *
+ *  Selects the fastest kernels the processor supports. Called once at
+ *  startup before any camera thread runs.
+ */
+void alg_simd_init(void)
+{
+    if (alg_simd_select(ALG_SIMD_AVX2) != 0 &&
+        alg_simd_select(ALG_SIMD_SSE2) != 0)
+        alg_simd_select(ALG_SIMD_SCALAR);
+
+    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO
+        ,_("Motion detection uses the %s kernels")
+        ,alg_simd_name(alg_simd_kernel));
+}
+
+/**
+ * alg_simd_diff
+ *
+ *  Runs the selected kernel of alg_diff_standard.
+ *
+ * Parameters:
+ *
+ *   dd - The planes and settings of the pass.
+ *
+ * Returns: The number of pixels in motion.
+ */
+int alg_simd_diff(const struct alg_diff_data *dd)
+{
+    switch (alg_simd_kernel) {
+#ifdef ALG_SIMD_X86
+    case ALG_SIMD_AVX2:
+        return alg_simd_diff_avx2(dd);
+    case ALG_SIMD_SSE2:
+        return alg_simd_diff_sse2(dd);
+#endif
+    default:
+        return alg_simd_diff_scalar(dd);
+    }
+}
+
+/**
+ * alg_simd_shrink
+ *
+ *  Runs the selected kernel that scales a band of rows down to one row of
+ *  box means for the detection at a reduced scale.
+ *
+ * Parameters:
+ *
+ *   dst    - The output row.
+ *   src    - The first of the scale input rows.
+ *   stride - Bytes from one input row to the next.
+ *   width  - Number of output pixels.
+ *   scale  - Width and height of the blocks.
+ *
+ * Returns: nothing
+ */
+void alg_simd_shrink(unsigned char *dst, const unsigned char *src, int stride, int width, int scale)
+{
+    switch (alg_simd_kernel) {
+#ifdef ALG_SIMD_X86
+    case ALG_SIMD_AVX2:
+        alg_simd_shrink_avx2(dst, src, stride, width, scale);
+        break;
+    case ALG_SIMD_SSE2:
+        alg_simd_shrink_sse2(dst, src, stride, width, scale);
+        break;
+#endif
+    default:
+        alg_simd_shrink_scalar(dst, src, stride, width, scale);
+    }
+}
+
+/**
+ * alg_simd_sad
+ *
+ *  Runs the selected kernel that adds up the absolute differences of a
+ *  band of rows of the new image to the reference frame per group of 16
+ *  columns, a row of tiles of the detection prefilter.
+ *
+ * Parameters:
+ *
+ *   ref        - The first row of the reference frame.
+ *   ref_stride - Bytes from one row of the reference frame to the next.
+ *   new        - The first row of the new image.
+ *   new_stride - Bytes from one row of the new image to the next.
+ *   count      - Number of pixels per row.
+ *   rows       - Number of rows.
+ *   sums       - Receives the sum of each group of 16 columns.
+ *
+ * Returns: nothing
+ */
+void alg_simd_sad(const unsigned char *ref, int ref_stride
+    , const unsigned char *new, int new_stride, int count, int rows, unsigned int *sums)
+{
+    switch (alg_simd_kernel) {
+#ifdef ALG_SIMD_X86
+    case ALG_SIMD_AVX2:
+        alg_simd_sad_avx2(ref, ref_stride, new, new_stride, count, rows, sums);
+        break;
+    case ALG_SIMD_SSE2:
+        alg_simd_sad_sse2(ref, ref_stride, new, new_stride, count, rows, sums);
+        break;
+#endif
+    default:
+        alg_simd_sad_scalar(ref, ref_stride, new, new_stride, count, rows, sums);
+    }
+}
+
+/**
+ * alg_simd_update_ref
+ *
+ *  Runs the selected kernel that updates one row of the reference frame.
+ *
+ * Parameters:
+ *
+ *   rd - The planes and settings of the row.
+ *
+ * Returns: nothing
+ */
+void alg_simd_update_ref(const struct alg_ref_data *rd)
+{
+    switch (alg_simd_kernel) {
+#ifdef ALG_SIMD_X86
+    case ALG_SIMD_AVX2:
+        alg_simd_update_ref_avx2(rd);
+        break;
+    case ALG_SIMD_SSE2:
+        alg_simd_update_ref_sse2(rd);
+        break;
+#endif
+    default:
+        alg_simd_update_ref_scalar(rd);
+    }
+}
+
+/**
+ * alg_simd_smartmask
+ *
+ *  Runs the selected kernel that tunes one row of the raw smart mask and
+ *  derives the final mask from it.
+ *
+ * Parameters:
+ *
+ *   smartmask   - The raw smart mask of the row.
+ *   buffer      - The changes counted by the diff.
+ *   final       - Receives the final mask, before the erode.
+ *   sensitivity - Changes per step of the raw mask.
+ *   count       - Number of pixels.
+ *
+ * Returns: nothing
+ */
+void alg_simd_smartmask(unsigned char *smartmask, uint16_t *buffer, unsigned char *final
+    , int sensitivity, int count)
+{
+    switch (alg_simd_kernel) {
+#ifdef ALG_SIMD_X86
+    case ALG_SIMD_AVX2:
+        alg_simd_smartmask_avx2(smartmask, buffer, final, sensitivity, count);
+        break;
+    case ALG_SIMD_SSE2:
+        alg_simd_smartmask_sse2(smartmask, buffer, final, sensitivity, count);
+        break;
+#endif
+    default:
+        alg_simd_smartmask_scalar(smartmask, buffer, final, sensitivity, count);
+    }
+}
+
+/**
+ * alg_simd_erode
+ *
+ *  Runs the selected kernel that erodes one row of a mask.
+ *
+ * Parameters:
+ *
+ *   dst    - The row to erode.
+ *   above  - A copy of the row above.
+ *   row    - A copy of the row before the erode.
+ *   below  - A copy of the row below.
+ *   width  - Number of pixels of the row.
+ *   cross  - Erode in a + shape instead of the box.
+ *
+ * Returns: The number of pixels that are kept.
+ */
+int alg_simd_erode(unsigned char *dst, const unsigned char *above, const unsigned char *row
+    , const unsigned char *below, int width, int cross)
+{
+    switch (alg_simd_kernel) {
+#ifdef ALG_SIMD_X86
+    case ALG_SIMD_AVX2:
+        return alg_simd_erode_avx2(dst, above, row, below, width, cross);
+    case ALG_SIMD_SSE2:
+        return alg_simd_erode_sse2(dst, above, row, below, width, cross);
+#endif
+    default:
+        return alg_simd_erode_scalar(dst, above, row, below, width, cross);
+    }
+}
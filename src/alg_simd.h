@@ -0,0 +1,66 @@
+/*    alg_simd.h
+ *
+ *    Vectorized kernels of the motion detection with runtime CPU dispatch.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ */
+
+#ifndef _INCLUDE_ALG_SIMD_H
+#define _INCLUDE_ALG_SIMD_H
+
+enum ALG_SIMD_KERNEL {
+    ALG_SIMD_SCALAR = 0,
+    ALG_SIMD_SSE2,
+    ALG_SIMD_AVX2
+};
+
+/* Arguments of one pass of the image difference over the luma plane. */
+struct alg_diff_data {
+    const unsigned char *ref;
+    const unsigned char *new;
+    uint64_t *bits;                   /* Receives one bit per pixel in motion, from bit 0 of
+                                         the first word on; the last word is padded with 0 */
+    const unsigned char *mask;        /* Fixed mask or NULL */
+    const unsigned char *smartmask;   /* smartmask_final or NULL when disabled */
+    uint16_t *smartmask_buffer;       /* Saturates at 65535 */
+    int smartmask_incr;               /* Added to smartmask_buffer per changed pixel */
+    int noise;
+    int count;                        /* Number of pixels */
+};
+
+/* Arguments of the update of one row of the reference frame. */
+struct alg_ref_data {
+    unsigned char *ref;
+    uint16_t *ref_dyn;                /* Frames a moving object was kept out of ref */
+    const unsigned char *new;
+    const unsigned char *smartmask;   /* smartmask_final, 0 where the smart mask excludes */
+    const uint64_t *bits;             /* Motion bitmap of the row */
+    int accept_timer;                 /* Frames before a static object joins ref */
+    int threshold_ref;                /* Differences up to this are taken into ref */
+    int count;                        /* Number of pixels */
+};
+
+void alg_simd_init(void);
+int alg_simd_select(enum ALG_SIMD_KERNEL kernel);
+const char *alg_simd_name(enum ALG_SIMD_KERNEL kernel);
+int alg_simd_diff(const struct alg_diff_data *dd);
+int alg_simd_diff_scalar(const struct alg_diff_data *dd);
+void alg_simd_shrink(unsigned char *dst, const unsigned char *src, int stride, int width, int scale);
+void alg_simd_shrink_scalar(unsigned char *dst, const unsigned char *src, int stride, int width, int scale);
+void alg_simd_sad(const unsigned char *ref, int ref_stride
+    , const unsigned char *new, int new_stride, int count, int rows, unsigned int *sums);
+void alg_simd_sad_scalar(const unsigned char *ref, int ref_stride
+    , const unsigned char *new, int new_stride, int count, int rows, unsigned int *sums);
+void alg_simd_update_ref(const struct alg_ref_data *rd);
+void alg_simd_update_ref_scalar(const struct alg_ref_data *rd);
+void alg_simd_smartmask(unsigned char *smartmask, uint16_t *buffer, unsigned char *final
+    , int sensitivity, int count);
+void alg_simd_smartmask_scalar(unsigned char *smartmask, uint16_t *buffer, unsigned char *final
+    , int sensitivity, int count);
+int alg_simd_erode(unsigned char *dst, const unsigned char *above, const unsigned char *row
+    , const unsigned char *below, int width, int cross);
+int alg_simd_erode_scalar(unsigned char *dst, const unsigned char *above, const unsigned char *row
+    , const unsigned char *below, int width, int cross);
+
+#endif /* _INCLUDE_ALG_SIMD_H */
@@ -0,0 +1,1301 @@
+/*
+ *    bench.c
+ *
+ *    Micro-benchmark of the image transform and detection kernels.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    The kernels are run on synthetic YUV420P frames at the common camera
+ *    resolutions.  The frames are made from a fixed seed so runs with the
+ *    same seed work on the same pixels.  Each kernel is timed on its own for
+ *    a number of iterations and the median is reported as nanoseconds per
+ *    pixel of the frame and as GB/s.  The GB/s counts the bytes of the
+ *    images the kernel reads and writes once, not its internal passes.
+ *
+ *    Built and run from src with 'make bench'.  Options are passed with
+ *    BENCH_FLAGS, for example: make bench BENCH_FLAGS="-r 1080p -k alg_"
+ *    The kernels with a reference are compared against it before they are
+ *    timed and any difference makes the exit status 1.  'make bench-check'
+ *    runs only these comparisons, at vga and without timing.
+ *
+ */
+#include "translate.h"
+#include "motion.h"
+#include "alg.h"
+#include "alg_simd.h"
+#include "workpool.h"
+#include "crop.h"
+#include "rotate.h"
+#include "picture.h"
+#include "jpegutils.h"
+#include "video_common.h"
+
+#define BENCH_ITERATIONS  20
+#define BENCH_SEED        1
+
+struct bench_resolution {
+    const char *name;
+    int width;
+    int height;
+};
+
+static struct bench_resolution bench_resolutions[] = {
+    {"vga",    640,  480},
+    {"720p",  1280,  720},
+    {"1080p", 1920, 1080},
+    {"4k",    3840, 2160},
+    {NULL,       0,    0}
+};
+
+/* Data shared by the kernels of one resolution */
+struct bench_data {
+    struct context *cnt;
+    char flip_axis[8];
+    int width;
+    int height;
+    unsigned char *frame[2];        /* YUV420P frames, the second one with motion */
+    unsigned char *src;             /* Capture formats for the converters */
+    unsigned char *dst;
+    unsigned char *jpeg;
+    int jpeg_size;
+    unsigned char *motion;          /* Motion bitmap of the diff for the despeckle */
+    unsigned char *state;           /* Per pixel state before the update */
+    struct image_data img;
+    double bytes;                   /* Bytes read and written by one call of the kernel */
+    int skip;                       /* The kernel cannot run on this machine */
+};
+
+struct bench_kernel {
+    const char *name;
+    void (*setup)(struct bench_data *bd);
+    void (*prepare)(struct bench_data *bd);     /* Before each call, not timed */
+    void (*run)(struct bench_data *bd);
+};
+
+static unsigned int bench_state;
+static int bench_threads = 1;
+static int bench_failed;            /* A kernel differs from its reference */
+
+/**
+ * bench_rand
+ *
+ *  xorshift32 so the frames only depend on the seed.
+ */
+static unsigned int bench_rand(void){
+
+    bench_state ^= bench_state << 13;
+    bench_state ^= bench_state >> 17;
+    bench_state ^= bench_state << 5;
+
+    return bench_state;
+}
+
+static void bench_fill(unsigned char *buf, int size){
+    int indx;
+
+    for (indx = 0; indx < size; indx++) buf[indx] = bench_rand() & 0xff;
+}
+
+/**
+ * bench_frames
+ *
+ *  Makes the two YUV420P frames.  Both are a gradient with some noise and
+ *  the second one has a bright block in it so the detection finds motion.
+ */
+static void bench_frames(struct bench_data *bd){
+    int x, y, wh;
+    unsigned char *pix;
+
+    wh = bd->width * bd->height;
+
+    pix = bd->frame[0];
+    for (y = 0; y < bd->height; y++) {
+        for (x = 0; x < bd->width; x++) {
+            *pix++ = (((x + y) * 255) / (bd->width + bd->height)) + (bench_rand() & 7);
+        }
+    }
+    for (y = 0; y < bd->height / 2; y++) {
+        for (x = 0; x < bd->width / 2; x++) {
+            pix[0] = 96 + ((x * 64) / bd->width);
+            pix[wh / 4] = 96 + ((y * 64) / bd->height);
+            pix++;
+        }
+    }
+
+    pix = bd->frame[1];
+    memcpy(pix, bd->frame[0], (wh * 3) / 2);
+    for (y = 0; y < bd->height; y++) {
+        for (x = 0; x < bd->width; x++) {
+            if ((y >= bd->height / 4) && (y < bd->height / 2) &&
+                (x >= bd->width / 4) && (x < bd->width / 2)) {
+                pix[x] = 230 + (bench_rand() & 15);
+            } else {
+                pix[x] = pix[x] + (bench_rand() & 3);
+            }
+        }
+        pix += bd->width;
+    }
+}
+
+/**
+ * bench_context
+ *
+ *  Sets up a context with the rotation and crop in the way motion_init does.
+ */
+static void bench_context(struct bench_data *bd, int rotate, const char *flip, int crop){
+    struct context *cnt;
+
+    cnt = mymalloc(sizeof(struct context));
+    snprintf(bd->flip_axis, sizeof(bd->flip_axis), "%s", flip);
+
+    cnt->conf.rotate = rotate;
+    cnt->conf.flip_axis = bd->flip_axis;
+    cnt->conf.crop_left = crop;
+    cnt->conf.crop_right = crop;
+    cnt->conf.crop_top = crop;
+    cnt->conf.crop_bottom = crop;
+
+    cnt->imgs.width = bd->width;
+    cnt->imgs.height = bd->height;
+    cnt->imgs.size_norm = (bd->width * bd->height * 3) / 2;
+    cnt->imgs.motionsize = bd->width * bd->height;
+
+    rotate_init(cnt);
+    crop_init(cnt);
+
+    bd->cnt = cnt;
+    bd->img.image_norm = mymalloc(cnt->crop_data.capture_size_norm);
+    pic_view_init(&bd->img.view_norm, bd->img.image_norm, bd->width, bd->height);
+}
+
+static void bench_context_free(struct bench_data *bd){
+    struct context *cnt = bd->cnt;
+
+    if (cnt == NULL) return;
+
+    rotate_deinit(cnt);
+    crop_deinit(cnt);
+
+    alg_state_deinit(cnt);
+    free(cnt->imgs.img_motion.image_norm);
+    free(cnt->imgs.motion_bits);
+    free(cnt->imgs.motion_rows);
+    free(cnt->imgs.motion_cols);
+    free(cnt->imgs.image_detect);
+    free(cnt->imgs.mask);
+    free(cnt->imgs.smartmask_final);
+    free(cnt->imgs.labels);
+    free(cnt->imgs.label_parent);
+    free(cnt->imgs.label_stats);
+    free(cnt->imgs.label_runs);
+    free(cnt->imgs.common_buffer);
+    free(cnt->current_image);
+    free(cnt);
+
+    free(bd->img.image_norm);
+    bd->img.image_norm = NULL;
+    free(bd->state);
+    bd->state = NULL;
+    bd->cnt = NULL;
+}
+
+static void bench_prepare_copy(struct bench_data *bd){
+
+    memcpy(bd->img.image_norm, bd->frame[0], (bd->width * bd->height * 3) / 2);
+}
+
+/* crop_map only sets the views so it is measured with the copy that packs the image */
+static void bench_setup_crop(struct bench_data *bd){
+
+    bench_context(bd, 0, "none", bd->width / 8);
+    bd->bytes = 2.0 * bd->cnt->imgs.size_norm;
+}
+
+static void bench_run_crop(struct bench_data *bd){
+
+    crop_map(bd->cnt, &bd->img);
+    pic_view_copy(bd->dst, &bd->img.view_norm, bd->cnt->imgs.width, bd->cnt->imgs.height);
+}
+
+static void bench_setup_rotate90(struct bench_data *bd){
+
+    bench_context(bd, 90, "none", 0);
+    bd->bytes = 2.0 * bd->cnt->imgs.size_norm;
+}
+
+static void bench_setup_rotate90_crop(struct bench_data *bd){
+
+    bench_context(bd, 90, "none", bd->height / 8);
+    bd->bytes = 2.0 * bd->cnt->imgs.size_norm;
+}
+
+static void bench_setup_rotate180(struct bench_data *bd){
+
+    bench_context(bd, 180, "none", 0);
+    bd->bytes = 2.0 * bd->cnt->imgs.size_norm;
+}
+
+static void bench_setup_flip(struct bench_data *bd){
+
+    bench_context(bd, 0, "h", 0);
+    bd->bytes = 2.0 * bd->cnt->imgs.size_norm;
+}
+
+static void bench_run_rotate(struct bench_data *bd){
+
+    rotate_map(bd->cnt, &bd->img);
+    crop_map(bd->cnt, &bd->img);
+}
+
+static int bench_bits_size(struct context *cnt){
+
+    return cnt->imgs.motion_stride * cnt->imgs.detect_height * sizeof(uint64_t);
+}
+
+static int bench_state_size(struct context *cnt){
+
+    return ALG_STATE_FIELDS * cnt->imgs.state_pitch * cnt->imgs.detect_height;
+}
+
+/**
+ * bench_setup_alg_scale
+ *
+ *  Allocates the detection buffers as motion_init does for a detection_scale
+ *  and runs the diff once so the despeckle and the reference update work on
+ *  its output.
+ */
+static void bench_setup_alg_scale(struct bench_data *bd, int scale){
+    struct context *cnt;
+    int detect_size;
+
+    bench_context(bd, 0, "none", 0);
+    cnt = bd->cnt;
+
+    cnt->conf.detection_scale = scale;
+    cnt->imgs.image_vprvcy.image_norm = mymalloc(cnt->imgs.size_norm);
+    alg_state_init(cnt);
+    detect_size = cnt->imgs.detect_width * cnt->imgs.detect_height;
+
+    cnt->imgs.img_motion.image_norm = mymalloc(cnt->imgs.size_norm);
+    cnt->imgs.motion_stride = (cnt->imgs.detect_width + 63) / 64;
+    cnt->imgs.motion_bits = mymalloc(bench_bits_size(cnt));
+    cnt->imgs.motion_rows = mymalloc(cnt->imgs.detect_height * sizeof(int));
+    cnt->imgs.motion_cols = mymalloc(cnt->imgs.detect_width * sizeof(int));
+    cnt->imgs.smartmask_final = mymalloc(detect_size);
+    cnt->imgs.labels = mymalloc(detect_size * sizeof(*cnt->imgs.labels));
+    cnt->imgs.label_parent = mymalloc((detect_size/2+2) * sizeof(*cnt->imgs.label_parent));
+    cnt->imgs.common_buffer = mymalloc(3 * cnt->imgs.width * cnt->imgs.height);
+    cnt->current_image = mymalloc(sizeof(struct image_data));
+    alg_smartmask_reset(cnt);
+    bd->state = mymalloc(bench_state_size(cnt));
+
+    /* The defaults of the configuration */
+    cnt->conf.despeckle_filter = (char *)"EedDl";
+    cnt->noise = 32;
+    cnt->threshold = 1500;
+    cnt->lastrate = 15;
+    cnt->conf.detection_threads = bench_threads;
+
+    memcpy(cnt->imgs.image_vprvcy.image_norm, bd->frame[0], cnt->imgs.size_norm);
+    alg_update_reference_frame(cnt, RESET_REF_FRAME);
+    memcpy(cnt->imgs.image_vprvcy.image_norm, bd->frame[1], cnt->imgs.size_norm);
+    alg_detect_image(cnt);
+    alg_diff_standard(cnt, cnt->imgs.image_detect);
+
+    memcpy(bd->motion, cnt->imgs.motion_bits, bench_bits_size(cnt));
+    memcpy(bd->state, cnt->imgs.state, bench_state_size(cnt));
+}
+
+static void bench_setup_alg(struct bench_data *bd){
+
+    bench_setup_alg_scale(bd, 1);
+}
+
+static void bench_setup_diff(struct bench_data *bd){
+
+    bench_setup_alg(bd);
+    /* new, ref and smartmask_final in, motion bitmap out */
+    bd->bytes = 3.0 * bd->cnt->imgs.motionsize + bench_bits_size(bd->cnt);
+}
+
+static void bench_run_diff(struct bench_data *bd){
+
+    alg_diff_standard(bd->cnt, bd->cnt->imgs.image_detect);
+}
+
+/**
+ * bench_setup_diff_simd
+ *
+ *  Forces one kernel of the diff and checks that it gives the same motion
+ *  bitmap, count and smart mask as the scalar reference before it is timed.
+ *  The masked variant also runs the fixed mask and the smart mask outside
+ *  of an event.
+ */
+static void bench_setup_diff_simd(struct bench_data *bd, enum ALG_SIMD_KERNEL kernel, int masked){
+    struct context *cnt;
+    struct alg_diff_data dd;
+    struct alg_state row;
+    unsigned char *state;
+    uint64_t *bits;
+    int motionsize, diffs, indx, x, y;
+
+    bench_setup_diff(bd);
+    if (alg_simd_select(kernel) != 0) {
+        bd->skip = TRUE;
+        return;
+    }
+    cnt = bd->cnt;
+    motionsize = cnt->imgs.motionsize;
+
+    if (masked) {
+        cnt->imgs.mask = mymalloc(motionsize);
+        for (indx = 0; indx < motionsize; indx++)
+            cnt->imgs.mask[indx] = (bench_rand() & 1) ? 255 : (unsigned char)bench_rand();
+        alg_state_mask(cnt);
+        for (y = 0; y < cnt->imgs.height; y++) {
+            alg_state_row(&cnt->imgs, y, &row);
+            for (x = 0; x < cnt->imgs.width; x++)
+                row.smartmask_final[x] = (bench_rand() & 7) ? 255 : 0;
+        }
+        cnt->smartmask_speed = 5;
+        cnt->event_nr = 1;
+        bd->bytes += 3.0 * motionsize;
+    }
+
+    /* The scalar kernel runs first, the state is restored for the kernel under test */
+    bits = mymalloc(bench_bits_size(cnt));
+    state = mymalloc(bench_state_size(cnt));
+    memcpy(bd->state, cnt->imgs.state, bench_state_size(cnt));
+    diffs = 0;
+    for (y = 0; y < cnt->imgs.height; y++) {
+        alg_state_row(&cnt->imgs, y, &row);
+        dd.ref = row.ref;
+        dd.new = cnt->imgs.image_detect + y * cnt->imgs.width;
+        dd.bits = bits + y * cnt->imgs.motion_stride;
+        dd.mask = masked ? row.mask : NULL;
+        dd.smartmask = masked ? row.smartmask_final : NULL;
+        dd.smartmask_buffer = row.smartmask_buffer;
+        dd.smartmask_incr = 5;
+        dd.noise = cnt->noise;
+        dd.count = cnt->imgs.width;
+        diffs += alg_simd_diff_scalar(&dd);
+    }
+    memcpy(state, cnt->imgs.state, bench_state_size(cnt));
+    memcpy(cnt->imgs.state, bd->state, bench_state_size(cnt));
+
+    if ((diffs != alg_diff_standard(cnt, cnt->imgs.image_detect)) ||
+        memcmp(bits, cnt->imgs.motion_bits, bench_bits_size(cnt)) ||
+        memcmp(state, cnt->imgs.state, bench_state_size(cnt))) {
+        fprintf(stderr, "alg_diff %s differs from the scalar kernel\n", alg_simd_name(kernel));
+        bench_failed = TRUE;
+    }
+
+    free(bits);
+    free(state);
+}
+
+static void bench_setup_diff_scalar(struct bench_data *bd){
+    bench_setup_diff_simd(bd, ALG_SIMD_SCALAR, FALSE);
+}
+
+static void bench_setup_diff_sse2(struct bench_data *bd){
+    bench_setup_diff_simd(bd, ALG_SIMD_SSE2, FALSE);
+}
+
+static void bench_setup_diff_avx2(struct bench_data *bd){
+    bench_setup_diff_simd(bd, ALG_SIMD_AVX2, FALSE);
+}
+
+static void bench_setup_diff_scalar_mask(struct bench_data *bd){
+    bench_setup_diff_simd(bd, ALG_SIMD_SCALAR, TRUE);
+}
+
+static void bench_setup_diff_sse2_mask(struct bench_data *bd){
+    bench_setup_diff_simd(bd, ALG_SIMD_SSE2, TRUE);
+}
+
+static void bench_setup_diff_avx2_mask(struct bench_data *bd){
+    bench_setup_diff_simd(bd, ALG_SIMD_AVX2, TRUE);
+}
+
+/* The sampling check of alg_diff followed by the full diff */
+static void bench_run_diff_checked(struct bench_data *bd){
+
+    alg_diff(bd->cnt, bd->cnt->imgs.image_detect);
+}
+
+/**
+ * bench_setup_diff_tiles
+ *
+ *  Forces one kernel of the tile sums of detection_tiles and checks them
+ *  against the scalar reference before it is timed. The motion bitmap
+ *  must match the full diff on the words of the active tiles and be clear
+ *  elsewhere. The masked variant diffs the tiles with the masks of
+ *  bench_setup_diff_simd.
+ */
+static void bench_setup_diff_tiles(struct bench_data *bd, enum ALG_SIMD_KERNEL kernel, int masked){
+    struct context *cnt;
+    struct alg_state row;
+    unsigned int *sad;
+    uint64_t *bits;
+    int y, tx, word, tiles, bad = FALSE;
+
+    bench_setup_diff_simd(bd, kernel, masked);
+    if (bd->skip) return;
+    cnt = bd->cnt;
+    tiles = cnt->imgs.tile_cols * cnt->imgs.tile_rows;
+
+    sad = mymalloc(tiles * sizeof(*sad));
+    memset(sad, 0, tiles * sizeof(*sad));
+    for (y = 0; y < cnt->imgs.detect_height; y++) {
+        alg_state_row(&cnt->imgs, y, &row);
+        alg_simd_sad_scalar(row.ref, 0, cnt->imgs.image_detect + y * cnt->imgs.detect_width, 0
+            , cnt->imgs.detect_width, 1, sad + (y / ALG_TILE_SIZE) * cnt->imgs.tile_cols);
+    }
+    bits = mymalloc(bench_bits_size(cnt));
+    alg_diff_standard(cnt, cnt->imgs.image_detect);
+    memcpy(bits, cnt->imgs.motion_bits, bench_bits_size(cnt));
+
+    cnt->conf.detection_tiles = TRUE;
+    alg_diff(cnt, cnt->imgs.image_detect);
+    if (memcmp(sad, cnt->imgs.tile_sad, tiles * sizeof(*sad))) bad = TRUE;
+    for (y = 0; y < cnt->imgs.detect_height; y++) {
+        for (word = 0; word < cnt->imgs.motion_stride; word++) {
+            for (tx = word * 64 / ALG_TILE_SIZE; tx < (word + 1) * 64 / ALG_TILE_SIZE; tx++) {
+                if (tx < cnt->imgs.tile_cols &&
+                    cnt->imgs.tile_map[(y / ALG_TILE_SIZE) * cnt->imgs.tile_cols + tx]) break;
+            }
+            if (cnt->imgs.motion_bits[y * cnt->imgs.motion_stride + word] !=
+                ((tx < (word + 1) * 64 / ALG_TILE_SIZE) ? bits[y * cnt->imgs.motion_stride + word] : 0))
+                bad = TRUE;
+        }
+    }
+    if (bad) {
+        fprintf(stderr, "alg_diff tiles %s differs from the scalar kernel\n", alg_simd_name(kernel));
+        bench_failed = TRUE;
+    }
+
+    /* new and ref in for the sums, then the diff of the active tiles */
+    bd->bytes = 2.0 * cnt->imgs.motionsize + bench_bits_size(cnt);
+    if (masked) bd->bytes += 3.0 * cnt->imgs.motionsize;
+
+    free(sad);
+    free(bits);
+}
+
+static void bench_setup_diff_tiles_scalar(struct bench_data *bd){
+    bench_setup_diff_tiles(bd, ALG_SIMD_SCALAR, FALSE);
+}
+
+static void bench_setup_diff_tiles_sse2(struct bench_data *bd){
+    bench_setup_diff_tiles(bd, ALG_SIMD_SSE2, FALSE);
+}
+
+static void bench_setup_diff_tiles_avx2(struct bench_data *bd){
+    bench_setup_diff_tiles(bd, ALG_SIMD_AVX2, FALSE);
+}
+
+static void bench_setup_diff_tiles_scalar_mask(struct bench_data *bd){
+    bench_setup_diff_tiles(bd, ALG_SIMD_SCALAR, TRUE);
+}
+
+static void bench_setup_diff_tiles_sse2_mask(struct bench_data *bd){
+    bench_setup_diff_tiles(bd, ALG_SIMD_SSE2, TRUE);
+}
+
+static void bench_setup_diff_tiles_avx2_mask(struct bench_data *bd){
+    bench_setup_diff_tiles(bd, ALG_SIMD_AVX2, TRUE);
+}
+
+static void bench_setup_despeckle(struct bench_data *bd){
+
+    bench_setup_alg(bd);
+    bd->bytes = 2.0 * bench_bits_size(bd->cnt);
+}
+
+static void bench_setup_labeling(struct bench_data *bd){
+
+    bench_setup_despeckle(bd);
+    bd->cnt->conf.despeckle_filter = (char *)"l";
+}
+
+/* A busy scene, like leaves in the wind: small areas of motion all over the frame */
+static void bench_setup_labeling_busy(struct bench_data *bd){
+    uint64_t *bits;
+    int x, y, bx, by, size;
+
+    bench_setup_labeling(bd);
+    bits = (uint64_t *)bd->motion;
+    memset(bits, 0, bench_bits_size(bd->cnt));
+    for (by = 0; by + 8 <= bd->height; by += 8) {
+        for (bx = 0; bx + 8 <= bd->width; bx += 8) {
+            if (bench_rand() & 1) continue;
+            size = 1 + (bench_rand() % 7);
+            for (y = by; y < by + size; y++) {
+                for (x = bx; x < bx + size; x++)
+                    bits[y * bd->cnt->imgs.motion_stride + x / 64] |= (uint64_t)1 << (x % 64);
+            }
+        }
+    }
+}
+
+static void bench_prepare_despeckle(struct bench_data *bd){
+
+    memcpy(bd->cnt->imgs.motion_bits, bd->motion, bench_bits_size(bd->cnt));
+}
+
+static void bench_run_despeckle(struct bench_data *bd){
+
+    alg_despeckle(bd->cnt, 0);
+}
+
+static void bench_setup_reference(struct bench_data *bd){
+
+    bench_setup_alg(bd);
+    /* ref, virgin, smartmask and ref_dyn in, ref and ref_dyn out, plus the motion bitmap */
+    bd->bytes = (double)bd->cnt->imgs.motionsize * (4 + 2 * sizeof(uint16_t)) + bench_bits_size(bd->cnt);
+}
+
+static void bench_prepare_reference(struct bench_data *bd){
+    struct context *cnt = bd->cnt;
+
+    memcpy(cnt->imgs.state, bd->state, bench_state_size(cnt));
+}
+
+static void bench_run_reference(struct bench_data *bd){
+
+    alg_update_reference_frame(bd->cnt, UPDATE_REF_FRAME);
+}
+
+/**
+ * bench_setup_state_simd
+ *
+ *  Spreads the counters and masks of the per pixel state over their range
+ *  so the kernels of the reference update and the smart mask tuning see all
+ *  of their cases, and forces one kernel.
+ */
+static void bench_setup_state_simd(struct bench_data *bd, enum ALG_SIMD_KERNEL kernel){
+    struct context *cnt = bd->cnt;
+    struct alg_state row;
+    int x, y;
+
+    if (alg_simd_select(kernel) != 0) {
+        bd->skip = TRUE;
+        return;
+    }
+
+    cnt->smartmask_speed = 5;
+    for (y = 0; y < cnt->imgs.detect_height; y++) {
+        alg_state_row(&cnt->imgs, y, &row);
+        for (x = 0; x < cnt->imgs.detect_width; x++) {
+            row.ref_dyn[x] = (bench_rand() & 1) ? 0 : bench_rand() & 63;
+            row.smartmask_final[x] = (bench_rand() & 7) ? 255 : 0;
+            row.smartmask[x] = (bench_rand() & 3) ? bench_rand() & 31 : bench_rand() & 0xff;
+            row.smartmask_buffer[x] = (bench_rand() & 3) ? bench_rand() & 0x3ff : bench_rand() & 0xffff;
+        }
+    }
+    memcpy(bd->state, cnt->imgs.state, bench_state_size(cnt));
+}
+
+/**
+ * bench_check_state
+ *
+ *  Runs a stage once with the scalar kernels and once with the forced one
+ *  from the same state and reports when the state differs.
+ */
+static void bench_check_state(struct bench_data *bd, enum ALG_SIMD_KERNEL kernel
+            , void (*run)(struct bench_data *bd), const char *name){
+    struct context *cnt = bd->cnt;
+    unsigned char *state, *final;
+    int detect_size = cnt->imgs.detect_width * cnt->imgs.detect_height;
+
+    state = mymalloc(bench_state_size(cnt));
+    final = mymalloc(detect_size);
+
+    alg_simd_select(ALG_SIMD_SCALAR);
+    bench_prepare_reference(bd);
+    run(bd);
+    memcpy(state, cnt->imgs.state, bench_state_size(cnt));
+    memcpy(final, cnt->imgs.smartmask_final, detect_size);
+
+    alg_simd_select(kernel);
+    bench_prepare_reference(bd);
+    run(bd);
+    if (memcmp(state, cnt->imgs.state, bench_state_size(cnt)) ||
+        memcmp(final, cnt->imgs.smartmask_final, detect_size)) {
+        fprintf(stderr, "%s %s differs from the scalar kernel\n", name, alg_simd_name(kernel));
+        bench_failed = TRUE;
+    }
+
+    free(state);
+    free(final);
+}
+
+static void bench_setup_reference_simd(struct bench_data *bd, enum ALG_SIMD_KERNEL kernel){
+
+    bench_setup_reference(bd);
+    bench_setup_state_simd(bd, kernel);
+    if (bd->skip) return;
+    bench_check_state(bd, kernel, bench_run_reference, "alg_update_reference");
+}
+
+static void bench_setup_reference_scalar(struct bench_data *bd){
+    bench_setup_reference_simd(bd, ALG_SIMD_SCALAR);
+}
+
+static void bench_setup_reference_sse2(struct bench_data *bd){
+    bench_setup_reference_simd(bd, ALG_SIMD_SSE2);
+}
+
+static void bench_setup_reference_avx2(struct bench_data *bd){
+    bench_setup_reference_simd(bd, ALG_SIMD_AVX2);
+}
+
+static void bench_run_smartmask(struct bench_data *bd){
+
+    alg_tune_smartmask(bd->cnt);
+}
+
+static void bench_setup_smartmask(struct bench_data *bd, enum ALG_SIMD_KERNEL kernel){
+
+    bench_setup_alg(bd);
+    bench_setup_state_simd(bd, kernel);
+    if (bd->skip) return;
+    bench_check_state(bd, kernel, bench_run_smartmask, "alg_tune_smartmask");
+    /* smartmask and its buffer in and out, then the final mask through both erodes */
+    bd->bytes = (double)bd->cnt->imgs.motionsize * (4 + 4 * sizeof(uint16_t));
+}
+
+static void bench_setup_smartmask_scalar(struct bench_data *bd){
+    bench_setup_smartmask(bd, ALG_SIMD_SCALAR);
+}
+
+static void bench_setup_smartmask_sse2(struct bench_data *bd){
+    bench_setup_smartmask(bd, ALG_SIMD_SSE2);
+}
+
+static void bench_setup_smartmask_avx2(struct bench_data *bd){
+    bench_setup_smartmask(bd, ALG_SIMD_AVX2);
+}
+
+/* The diff followed by the reference update as the detection runs them without detection_fused */
+static void bench_setup_diff_update(struct bench_data *bd){
+
+    bench_setup_reference(bd);
+    /* new, ref, smartmask_final and ref_dyn in, motion bitmap, ref and ref_dyn out */
+    bd->bytes = (double)bd->cnt->imgs.motionsize * (4 + 2 * sizeof(uint16_t)) + bench_bits_size(bd->cnt);
+}
+
+static void bench_run_diff_update(struct bench_data *bd){
+
+    alg_diff_standard(bd->cnt, bd->cnt->imgs.image_detect);
+    alg_update_reference_frame(bd->cnt, UPDATE_REF_FRAME);
+}
+
+/**
+ * bench_setup_diff_fused
+ *
+ *  Checks that the fused detection gives the same motion bitmap, reference
+ *  frame and counts as the separate diff and update before it is timed.
+ */
+static void bench_setup_diff_fused(struct bench_data *bd){
+    struct context *cnt;
+    unsigned char *state;
+    int *cols;
+    uint64_t *bits, word;
+    int diffs, indx, y, bad;
+
+    bench_setup_diff_update(bd);
+    cnt = bd->cnt;
+
+    bench_prepare_reference(bd);
+    diffs = alg_diff_standard(cnt, cnt->imgs.image_detect);
+    alg_update_reference_frame(cnt, UPDATE_REF_FRAME);
+    bits = mymalloc(bench_bits_size(cnt));
+    state = mymalloc(bench_state_size(cnt));
+    cols = mymalloc(cnt->imgs.width * sizeof(int));
+    memcpy(bits, cnt->imgs.motion_bits, bench_bits_size(cnt));
+    memcpy(state, cnt->imgs.state, bench_state_size(cnt));
+
+    cnt->conf.detection_fused = TRUE;
+    bench_prepare_reference(bd);
+    bad = (diffs != alg_diff_standard(cnt, cnt->imgs.image_detect)) ||
+        memcmp(bits, cnt->imgs.motion_bits, bench_bits_size(cnt)) ||
+        memcmp(state, cnt->imgs.state, bench_state_size(cnt));
+
+    for (y = 0; y < cnt->imgs.height; y++) {
+        diffs = 0;
+        for (indx = 0; indx < cnt->imgs.motion_stride; indx++) {
+            diffs += __builtin_popcountll(bits[y * cnt->imgs.motion_stride + indx]);
+            for (word = bits[y * cnt->imgs.motion_stride + indx]; word; word &= word - 1)
+                cols[64 * indx + __builtin_ctzll(word)]++;
+        }
+        if (diffs != cnt->imgs.motion_rows[y]) bad = TRUE;
+    }
+    if (memcmp(cols, cnt->imgs.motion_cols, cnt->imgs.width * sizeof(int))) bad = TRUE;
+
+    if (bad) {
+        fprintf(stderr, "alg_diff_fused differs from the diff and update\n");
+        bench_failed = TRUE;
+    }
+
+    free(bits);
+    free(state);
+    free(cols);
+}
+
+static void bench_run_diff_fused(struct bench_data *bd){
+
+    alg_diff_standard(bd->cnt, bd->cnt->imgs.image_detect);
+    /* Only clears the flag of the fused update, as mlp_tuning would */
+    alg_update_reference_frame(bd->cnt, UPDATE_REF_FRAME);
+}
+
+/**
+ * bench_setup_shrink
+ *
+ *  Forces one kernel of the scaling down to the detection and checks that
+ *  it gives the same image as the scalar reference before it is timed.
+ */
+static void bench_setup_shrink(struct bench_data *bd, enum ALG_SIMD_KERNEL kernel, int scale){
+    struct context *cnt;
+    unsigned char *detect;
+    int y, detect_size;
+
+    bench_setup_alg_scale(bd, scale);
+    if (alg_simd_select(kernel) != 0) {
+        bd->skip = TRUE;
+        return;
+    }
+    cnt = bd->cnt;
+    detect_size = cnt->imgs.detect_width * cnt->imgs.detect_height;
+    /* Luma in, the scaled luma out */
+    bd->bytes = (double)cnt->imgs.motionsize + detect_size;
+
+    detect = mymalloc(detect_size);
+    for (y = 0; y < cnt->imgs.detect_height; y++) {
+        alg_simd_shrink_scalar(detect + y * cnt->imgs.detect_width
+            , cnt->imgs.image_vprvcy.image_norm + y * scale * cnt->imgs.width
+            , cnt->imgs.width, cnt->imgs.detect_width, scale);
+    }
+    alg_detect_image(cnt);
+    if (memcmp(detect, cnt->imgs.image_detect, detect_size)) {
+        fprintf(stderr, "alg_simd_shrink %s differs from the scalar kernel\n", alg_simd_name(kernel));
+        bench_failed = TRUE;
+    }
+
+    free(detect);
+}
+
+static void bench_setup_shrink2_scalar(struct bench_data *bd){
+    bench_setup_shrink(bd, ALG_SIMD_SCALAR, 2);
+}
+
+static void bench_setup_shrink2_sse2(struct bench_data *bd){
+    bench_setup_shrink(bd, ALG_SIMD_SSE2, 2);
+}
+
+static void bench_setup_shrink2_avx2(struct bench_data *bd){
+    bench_setup_shrink(bd, ALG_SIMD_AVX2, 2);
+}
+
+static void bench_setup_shrink4_scalar(struct bench_data *bd){
+    bench_setup_shrink(bd, ALG_SIMD_SCALAR, 4);
+}
+
+static void bench_setup_shrink4_sse2(struct bench_data *bd){
+    bench_setup_shrink(bd, ALG_SIMD_SSE2, 4);
+}
+
+static void bench_setup_shrink4_avx2(struct bench_data *bd){
+    bench_setup_shrink(bd, ALG_SIMD_AVX2, 4);
+}
+
+static void bench_run_shrink(struct bench_data *bd){
+
+    alg_detect_image(bd->cnt);
+}
+
+/* The scaling down, the diff and the reference update of a frame at a detection_scale */
+static void bench_setup_detect_scale(struct bench_data *bd, int scale){
+
+    bench_setup_alg_scale(bd, scale);
+    /* Luma in, then the diff and update of bench_setup_diff_update on the scaled image */
+    bd->bytes = (double)bd->cnt->imgs.motionsize
+        + (double)bd->cnt->imgs.detect_width * bd->cnt->imgs.detect_height * (5 + 2 * sizeof(uint16_t))
+        + bench_bits_size(bd->cnt);
+}
+
+static void bench_setup_detect_scale2(struct bench_data *bd){
+    bench_setup_detect_scale(bd, 2);
+}
+
+static void bench_setup_detect_scale4(struct bench_data *bd){
+    bench_setup_detect_scale(bd, 4);
+}
+
+static void bench_run_detect_scale(struct bench_data *bd){
+
+    alg_detect_image(bd->cnt);
+    alg_diff_standard(bd->cnt, bd->cnt->imgs.image_detect);
+    alg_update_reference_frame(bd->cnt, UPDATE_REF_FRAME);
+}
+
+/**
+ * bench_check_locate
+ *
+ *  Reports when the location found from the counts of the diff or the
+ *  despeckle differs from the one of the scan of the motion bitmap.
+ */
+static void bench_check_locate(struct bench_data *bd, const char *stage){
+    struct context *cnt = bd->cnt;
+    struct coord counted, scanned;
+
+    if (!cnt->imgs.motion_counts) {
+        fprintf(stderr, "%s left no counts for alg_locate_center_size\n", stage);
+        bench_failed = TRUE;
+        return;
+    }
+    alg_locate_center_size(&cnt->imgs, cnt->imgs.width, cnt->imgs.height, &counted);
+    cnt->imgs.motion_counts = FALSE;
+    alg_locate_center_size(&cnt->imgs, cnt->imgs.width, cnt->imgs.height, &scanned);
+    cnt->imgs.motion_counts = TRUE;
+
+    if (memcmp(&counted, &scanned, sizeof(counted))) {
+        fprintf(stderr, "alg_locate_center_size after %s differs from the scan\n", stage);
+        bench_failed = TRUE;
+    }
+}
+
+/**
+ * bench_setup_locate
+ *
+ *  Checks the counts of the diff and of an erode and dilate despeckle
+ *  against the scan of the bitmap. The scan variant times the locate
+ *  without the counts.
+ */
+static void bench_setup_locate(struct bench_data *bd, int scan){
+    struct context *cnt;
+
+    bench_setup_alg(bd);
+    cnt = bd->cnt;
+
+    bench_check_locate(bd, "alg_diff_standard");
+    cnt->conf.despeckle_filter = (char *)"EedD";
+    alg_despeckle(cnt, 0);
+    bench_check_locate(bd, "alg_despeckle");
+
+    alg_diff_standard(cnt, cnt->imgs.image_detect);
+    cnt->imgs.motion_counts = !scan;
+    /* Either the bitmap twice or the counts of the rows and columns */
+    if (scan)
+        bd->bytes = 2.0 * bench_bits_size(cnt);
+    else
+        bd->bytes = (double)(cnt->imgs.detect_width + cnt->imgs.detect_height) * 2 * sizeof(int);
+}
+
+static void bench_setup_locate_counts(struct bench_data *bd){
+    bench_setup_locate(bd, FALSE);
+}
+
+static void bench_setup_locate_scan(struct bench_data *bd){
+    bench_setup_locate(bd, TRUE);
+}
+
+static void bench_run_locate(struct bench_data *bd){
+    struct coord cent;
+
+    alg_locate_center_size(&bd->cnt->imgs, bd->cnt->imgs.width, bd->cnt->imgs.height, &cent);
+}
+
+/**
+ * bench_setup_luma
+ *
+ *  Checks that the sampled lightswitch agrees with the one of the full diff
+ *  on the frame with motion and on a frame that is brighter as a whole.
+ */
+static void bench_setup_luma(struct bench_data *bd){
+    struct context *cnt;
+    unsigned char *pix;
+    int indx, x, full, sampled;
+
+    bench_setup_alg(bd);
+    cnt = bd->cnt;
+    cnt->conf.lightswitch_percent = 25;
+
+    for (indx = 0; indx < 2; indx++) {
+        if (indx == 1) {
+            /* The lights go on */
+            pix = cnt->imgs.image_vprvcy.image_norm;
+            for (x = 0; x < cnt->imgs.motionsize; x++)
+                pix[x] = (bd->frame[0][x] > 175) ? 255 : bd->frame[0][x] + 80;
+        }
+        alg_detect_image(cnt);
+        alg_luma_stats(cnt);
+        sampled = alg_lightswitch_sampled(cnt);
+        full = alg_lightswitch(cnt, alg_diff_standard(cnt, cnt->imgs.image_detect));
+        if (sampled != full || sampled != indx) {
+            fprintf(stderr, "alg_lightswitch_sampled gives %d, the diff %d\n", sampled, full);
+            bench_failed = TRUE;
+        }
+    }
+
+    memcpy(cnt->imgs.image_vprvcy.image_norm, bd->frame[1], cnt->imgs.size_norm);
+    alg_detect_image(cnt);
+    /* One pixel in 64 of new, ref and the masks */
+    bd->bytes = (double)cnt->imgs.motionsize * 4 / 64;
+}
+
+static void bench_run_luma(struct bench_data *bd){
+
+    alg_luma_stats(bd->cnt);
+}
+
+static void bench_setup_render(struct bench_data *bd){
+
+    bench_setup_alg(bd);
+    /* Motion bitmap and new in, motion image out */
+    bd->bytes = bench_bits_size(bd->cnt) + bd->cnt->imgs.motionsize + bd->cnt->imgs.size_norm;
+}
+
+static void bench_run_render(struct bench_data *bd){
+
+    alg_motion_render(bd->cnt, bd->cnt->imgs.image_vprvcy.image_norm);
+}
+
+static void bench_setup_scale(struct bench_data *bd){
+    int size = (bd->width * bd->height * 3) / 2;
+
+    pic_view_init(&bd->img.view_norm, bd->frame[0], bd->width, bd->height);
+    bd->bytes = size + (size / 4);
+}
+
+static void bench_run_scale(struct bench_data *bd){
+
+    pic_scale_img(bd->width, bd->height, &bd->img.view_norm, bd->dst);
+}
+
+/* The converters take the capture format in src and write to dst */
+static void bench_setup_yuv422(struct bench_data *bd){
+
+    bd->bytes = 3.5 * bd->width * bd->height;
+}
+
+static void bench_setup_rgb24(struct bench_data *bd){
+
+    bd->bytes = 4.5 * bd->width * bd->height;
+}
+
+static void bench_setup_bayer(struct bench_data *bd){
+
+    bd->bytes = 4.0 * bd->width * bd->height;
+}
+
+static void bench_setup_grey(struct bench_data *bd){
+
+    bd->bytes = 2.5 * bd->width * bd->height;
+}
+
+static void bench_setup_y10(struct bench_data *bd){
+
+    bd->bytes = 5.0 * bd->width * bd->height;
+}
+
+static void bench_run_yuv422(struct bench_data *bd){
+
+    vid_yuv422to420p(bd->dst, bd->src, bd->width, bd->height);
+}
+
+static void bench_run_yuv422p(struct bench_data *bd){
+
+    vid_yuv422pto420p(bd->dst, bd->src, bd->width, bd->height);
+}
+
+static void bench_run_uyvy(struct bench_data *bd){
+
+    vid_uyvyto420p(bd->dst, bd->src, bd->width, bd->height);
+}
+
+static void bench_run_rgb24(struct bench_data *bd){
+
+    vid_rgb24toyuv420p(bd->dst, bd->src, bd->width, bd->height);
+}
+
+static void bench_run_bayer(struct bench_data *bd){
+
+    vid_bayer2rgb24(bd->dst, bd->src, bd->width, bd->height);
+}
+
+static void bench_run_grey(struct bench_data *bd){
+
+    vid_greytoyuv420p(bd->dst, bd->src, bd->width, bd->height);
+}
+
+static void bench_run_y10(struct bench_data *bd){
+
+    vid_y10torgb24(bd->dst, bd->src, bd->width, bd->height, 2);
+}
+
+static void bench_setup_mjpeg(struct bench_data *bd){
+    struct image_view view;
+    int size = (bd->width * bd->height * 3) / 2;
+
+    bench_context(bd, 0, "none", 0);
+    pic_view_init(&view, bd->frame[0], bd->width, bd->height);
+    bd->jpeg_size = jpgutl_put_yuv420p(bd->jpeg, size, &view
+        , bd->width, bd->height, 75, bd->cnt, NULL, NULL);
+    bd->bytes = bd->jpeg_size + size;
+}
+
+static void bench_run_mjpeg(struct bench_data *bd){
+
+    vid_mjpegtoyuv420p(bd->dst, bd->jpeg, bd->width, bd->height, bd->jpeg_size);
+}
+
+static struct bench_kernel bench_kernels[] = {
+    {"crop_map",                 bench_setup_crop,          NULL,                    bench_run_crop},
+    {"rotate_map_90",            bench_setup_rotate90,      bench_prepare_copy,      bench_run_rotate},
+    {"rotate_map_90_crop",       bench_setup_rotate90_crop, bench_prepare_copy,      bench_run_rotate},
+    {"rotate_map_180",           bench_setup_rotate180,     bench_prepare_copy,      bench_run_rotate},
+    {"rotate_map_flip",          bench_setup_flip,          bench_prepare_copy,      bench_run_rotate},
+    {"alg_diff_standard",        bench_setup_diff,          NULL,                    bench_run_diff},
+    {"alg_diff_scalar",          bench_setup_diff_scalar,   NULL,                    bench_run_diff},
+    {"alg_diff_sse2",            bench_setup_diff_sse2,     NULL,                    bench_run_diff},
+    {"alg_diff_avx2",            bench_setup_diff_avx2,     NULL,                    bench_run_diff},
+    {"alg_diff_scalar_mask",     bench_setup_diff_scalar_mask, NULL,                 bench_run_diff},
+    {"alg_diff_sse2_mask",       bench_setup_diff_sse2_mask, NULL,                   bench_run_diff},
+    {"alg_diff_avx2_mask",       bench_setup_diff_avx2_mask, NULL,                   bench_run_diff},
+    {"alg_diff",                 bench_setup_diff,          NULL,                    bench_run_diff_checked},
+    {"alg_tiles_scalar",         bench_setup_diff_tiles_scalar, NULL,                bench_run_diff_checked},
+    {"alg_tiles_sse2",           bench_setup_diff_tiles_sse2, NULL,                  bench_run_diff_checked},
+    {"alg_tiles_avx2",           bench_setup_diff_tiles_avx2, NULL,                  bench_run_diff_checked},
+    {"alg_tiles_scalar_mask",    bench_setup_diff_tiles_scalar_mask, NULL,           bench_run_diff_checked},
+    {"alg_tiles_sse2_mask",      bench_setup_diff_tiles_sse2_mask, NULL,             bench_run_diff_checked},
+    {"alg_tiles_avx2_mask",      bench_setup_diff_tiles_avx2_mask, NULL,             bench_run_diff_checked},
+    {"alg_despeckle",            bench_setup_despeckle,     bench_prepare_despeckle, bench_run_despeckle},
+    {"alg_labeling",             bench_setup_labeling,      bench_prepare_despeckle, bench_run_despeckle},
+    {"alg_labeling_busy",        bench_setup_labeling_busy, bench_prepare_despeckle, bench_run_despeckle},
+    {"alg_update_reference",     bench_setup_reference,     bench_prepare_reference, bench_run_reference},
+    {"alg_update_ref_scalar",    bench_setup_reference_scalar, bench_prepare_reference, bench_run_reference},
+    {"alg_update_ref_sse2",      bench_setup_reference_sse2, bench_prepare_reference, bench_run_reference},
+    {"alg_update_ref_avx2",      bench_setup_reference_avx2, bench_prepare_reference, bench_run_reference},
+    {"alg_smartmask_scalar",     bench_setup_smartmask_scalar, bench_prepare_reference, bench_run_smartmask},
+    {"alg_smartmask_sse2",       bench_setup_smartmask_sse2, bench_prepare_reference, bench_run_smartmask},
+    {"alg_smartmask_avx2",       bench_setup_smartmask_avx2, bench_prepare_reference, bench_run_smartmask},
+    {"alg_motion_render",        bench_setup_render,        NULL,                    bench_run_render},
+    {"alg_locate",               bench_setup_locate_counts, NULL,                    bench_run_locate},
+    {"alg_locate_scan",          bench_setup_locate_scan,   NULL,                    bench_run_locate},
+    {"alg_luma_stats",           bench_setup_luma,          NULL,                    bench_run_luma},
+    {"alg_diff_update",          bench_setup_diff_update,   bench_prepare_reference, bench_run_diff_update},
+    {"alg_diff_fused",           bench_setup_diff_fused,    bench_prepare_reference, bench_run_diff_fused},
+    {"alg_shrink2_scalar",       bench_setup_shrink2_scalar, NULL,                   bench_run_shrink},
+    {"alg_shrink2_sse2",         bench_setup_shrink2_sse2,  NULL,                    bench_run_shrink},
+    {"alg_shrink2_avx2",         bench_setup_shrink2_avx2,  NULL,                    bench_run_shrink},
+    {"alg_shrink4_scalar",       bench_setup_shrink4_scalar, NULL,                   bench_run_shrink},
+    {"alg_shrink4_sse2",         bench_setup_shrink4_sse2,  NULL,                    bench_run_shrink},
+    {"alg_shrink4_avx2",         bench_setup_shrink4_avx2,  NULL,                    bench_run_shrink},
+    {"alg_detect_scale2",        bench_setup_detect_scale2, bench_prepare_reference, bench_run_detect_scale},
+    {"alg_detect_scale4",        bench_setup_detect_scale4, bench_prepare_reference, bench_run_detect_scale},
+    {"pic_scale_img",            bench_setup_scale,         NULL,                    bench_run_scale},
+    {"vid_yuv422to420p",         bench_setup_yuv422,        NULL,                    bench_run_yuv422},
+    {"vid_yuv422pto420p",        bench_setup_yuv422,        NULL,                    bench_run_yuv422p},
+    {"vid_uyvyto420p",           bench_setup_yuv422,        NULL,                    bench_run_uyvy},
+    {"vid_rgb24toyuv420p",       bench_setup_rgb24,         NULL,                    bench_run_rgb24},
+    {"vid_bayer2rgb24",          bench_setup_bayer,         NULL,                    bench_run_bayer},
+    {"vid_greytoyuv420p",        bench_setup_grey,          NULL,                    bench_run_grey},
+    {"vid_y10torgb24",           bench_setup_y10,           NULL,                    bench_run_y10},
+    {"vid_mjpegtoyuv420p",       bench_setup_mjpeg,         NULL,                    bench_run_mjpeg},
+    {NULL,                       NULL,                      NULL,                    NULL}
+};
+
+static int bench_compare(const void *a, const void *b){
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+static double bench_elapsed(struct timespec *start, struct timespec *end){
+
+    return ((double)(end->tv_sec - start->tv_sec) * 1e9) + (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+ * bench_kernel
+ *
+ *  Times one kernel at one resolution and prints the line of the report.
+ *  With check the kernel is only compared against its reference.
+ */
+static void bench_kernel(struct bench_kernel *kernel, struct bench_data *bd
+            , const char *resname, int iterations, unsigned int seed, int check)
+{
+    struct timespec start, end;
+    double *times, pixels, median;
+    int indx;
+
+    /* Every kernel sees the same frames */
+    bench_state = seed;
+    bench_frames(bd);
+    bench_fill(bd->src, bd->width * bd->height * 3);
+
+    bd->bytes = 0;
+    bd->skip = FALSE;
+    kernel->setup(bd);
+    if (bd->skip) {
+        printf("%-24s %-6s not supported by this processor\n", kernel->name, resname);
+        bench_context_free(bd);
+        alg_simd_init();
+        return;
+    }
+
+    /* The setup compared the kernel, one call checks the run on its own */
+    if (check) {
+        if (kernel->prepare) kernel->prepare(bd);
+        kernel->run(bd);
+        bench_context_free(bd);
+        alg_simd_init();
+        return;
+    }
+
+    times = mymalloc(iterations * sizeof(double));
+
+    /* One untimed call to warm up the caches */
+    if (kernel->prepare) kernel->prepare(bd);
+    kernel->run(bd);
+
+    for (indx = 0; indx < iterations; indx++) {
+        if (kernel->prepare) kernel->prepare(bd);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        kernel->run(bd);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        times[indx] = bench_elapsed(&start, &end);
+    }
+
+    qsort(times, iterations, sizeof(double), bench_compare);
+    median = times[iterations / 2];
+    pixels = (double)bd->width * bd->height;
+
+    printf("%-24s %-6s %10.3f %10.3f %9.2f\n", kernel->name, resname
+        , median / pixels, times[0] / pixels, (median > 0) ? bd->bytes / median : 0.0);
+
+    free(times);
+    bench_context_free(bd);
+    /* Back to the kernels the detection would use */
+    alg_simd_init();
+}
+
+static void bench_usage(void){
+
+    printf("motion-bench [-r resolutions] [-k kernel] [-n iterations] [-s seed] [-t threads] [-c] [-l]\n");
+    printf("  -r  comma separated list of vga, 720p, 1080p, 4k (default all)\n");
+    printf("  -k  only run the kernels with this text in their name\n");
+    printf("  -n  timed calls per kernel (default %d)\n", BENCH_ITERATIONS);
+    printf("  -s  seed of the synthetic frames (default %d)\n", BENCH_SEED);
+    printf("  -t  detection_threads of the detection kernels (default 1)\n");
+    printf("  -c  only check the kernels against their references, at vga unless -r is given\n");
+    printf("  -l  list the kernels\n");
+}
+
+int main(int argc, char **argv){
+    struct bench_data bd;
+    struct bench_resolution *res;
+    struct bench_kernel *kernel;
+    const char *resolutions = NULL;
+    const char *filter = NULL;
+    int iterations = BENCH_ITERATIONS;
+    unsigned int seed = BENCH_SEED;
+    int opt, maxsize, check = FALSE;
+    char reslist[256], resname[16];
+
+    while ((opt = getopt(argc, argv, "r:k:n:s:t:clh")) != -1) {
+        switch (opt) {
+        case 'r':
+            resolutions = optarg;
+            break;
+        case 'k':
+            filter = optarg;
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            if (iterations < 1) iterations = 1;
+            break;
+        case 's':
+            seed = (unsigned int)strtoul(optarg, NULL, 10);
+            if (seed == 0) seed = BENCH_SEED;
+            break;
+        case 't':
+            bench_threads = atoi(optarg);
+            if (bench_threads < 1) bench_threads = 1;
+            if (bench_threads > ALG_STRIPE_MAX) bench_threads = ALG_STRIPE_MAX;
+            break;
+        case 'c':
+            check = TRUE;
+            break;
+        case 'l':
+            for (kernel = bench_kernels; kernel->name; kernel++) printf("%s\n", kernel->name);
+            return 0;
+        default:
+            bench_usage();
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    pthread_key_create(&tls_key_threadnr, NULL);
+    pthread_setspecific(tls_key_threadnr, (void *)(0));
+    set_log_level(WRN);
+    alg_simd_init();
+    workpool_start(bench_threads - 1);
+
+    /* The buffers are sized for the largest frame and format */
+    maxsize = 0;
+    for (res = bench_resolutions; res->name; res++) {
+        if (res->width * res->height > maxsize) maxsize = res->width * res->height;
+    }
+
+    memset(&bd, 0, sizeof(bd));
+    bd.frame[0] = mymalloc((maxsize * 3) / 2);
+    bd.frame[1] = mymalloc((maxsize * 3) / 2);
+    bd.src = mymalloc(maxsize * 3);
+    bd.dst = mymalloc(maxsize * 3);
+    bd.jpeg = mymalloc((maxsize * 3) / 2);
+    bd.motion = mymalloc((maxsize * 3) / 2);
+
+    if (check) {
+        if (resolutions == NULL) resolutions = "vga";
+    } else {
+        printf("seed %u, %d iterations, %d detection threads, median and minimum per call\n"
+            , seed, iterations, bench_threads);
+        printf("%-24s %-6s %10s %10s %9s\n", "kernel", "res", "ns/pixel", "min", "GB/s");
+    }
+
+    for (res = bench_resolutions; res->name; res++) {
+        if (resolutions) {
+            snprintf(reslist, sizeof(reslist), ",%s,", resolutions);
+            snprintf(resname, sizeof(resname), ",%s,", res->name);
+            if (strstr(reslist, resname) == NULL) continue;
+        }
+        bd.width = res->width;
+        bd.height = res->height;
+        for (kernel = bench_kernels; kernel->name; kernel++) {
+            if (filter && (strstr(kernel->name, filter) == NULL)) continue;
+            bench_kernel(kernel, &bd, res->name, iterations, seed, check);
+        }
+    }
+
+    free(bd.frame[0]);
+    free(bd.frame[1]);
+    free(bd.src);
+    free(bd.dst);
+    free(bd.jpeg);
+    free(bd.motion);
+
+    workpool_stop();
+
+    pthread_key_delete(tls_key_threadnr);
+
+    if (check) printf("Kernels %s their references\n", bench_failed ? "differ from" : "match");
+
+    /* A kernel that differs from its reference fails 'make bench' */
+    return bench_failed ? 1 : 0;
+}
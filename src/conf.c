@@ -43,6 +43,7 @@ struct config conf_template = {
     .log_type =                        NULL,
     .quiet =                           TRUE,
     .native_language =                 TRUE,
+    .camera_workers =                  0,
     .camera_name =                     NULL,
     .camera_id =                       0,
     .camera_dir =                      NULL,
@@ -80,6 +81,13 @@ struct config conf_template = {
     .minimum_frame_time =              0,
     .rotate =                          0,
     .flip_axis =                       "none",
+    .crop_left =                       0,
+    .crop_right =                      0,
+    .crop_top =                        0,
+    .crop_bottom =                     0,
+    .crop_source =                     0,
+    .crop_auto =                       "off",
+    .crop_auto_time =                  3600,
     .locate_motion_mode =              "off",
     .locate_motion_style =             "box",
     .text_left =                       NULL,
@@ -105,7 +113,13 @@ struct config conf_template = {
     .minimum_motion_frames =           1,
     .event_gap =                       DEF_EVENT_GAP,
     .pre_capture =                     0,
+    .pre_capture_raw =                 0,
     .post_capture =                    0,
+    .detection_threads =               1,
+    .detection_fused =                 FALSE,
+    .detection_scale =                 1,
+    .detection_tiles =                 FALSE,
+    .frame_pool_hugepages =            FALSE,
 
     /* Script execution configuration parameters */
     .on_event_start =                  NULL,
@@ -138,6 +152,8 @@ struct config conf_template = {
     .movie_quality =                   60,
     .movie_codec =                     "mkv",
     .movie_duplicate_frames =          FALSE,
+    .movie_output_queue =              0,
+    .movie_output_drop =               FALSE,
     .movie_passthrough =               FALSE,
     .movie_filename =                  DEF_MOVIEPATH,
     .movie_extpipe_use =               FALSE,
@@ -309,6 +325,15 @@ config_param config_params[] = {
     WEBUI_LEVEL_LIMITED
     },
     {
+    "camera_workers",
+    "# Number of threads pinned to cores that run all cameras, 0 for a thread per camera.",
+    1,
+    CONF_OFFSET(camera_workers),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_RESTRICTED
+    },
+    {
     "camera_name",
     "# User defined name for the camera.",
     0,
@@ -583,6 +608,69 @@ config_param config_params[] = {
     WEBUI_LEVEL_LIMITED
     },
     {
+    "crop_left",
+    "# Number of pixels to remove from the left side of the image.",
+    0,
+    CONF_OFFSET(crop_left),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
+    "crop_right",
+    "# Number of pixels to remove from the right side of the image.",
+    0,
+    CONF_OFFSET(crop_right),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
+    "crop_top",
+    "# Number of pixels to remove from the top of the image.",
+    0,
+    CONF_OFFSET(crop_top),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
+    "crop_bottom",
+    "# Number of pixels to remove from the bottom of the image.",
+    0,
+    CONF_OFFSET(crop_bottom),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
+    "crop_source",
+    "# Camera id of the camera whose capture is cropped instead of opening a device.",
+    0,
+    CONF_OFFSET(crop_source),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
+    "crop_auto",
+    "# Learn the crop from where motion is detected (off, suggest, apply).",
+    0,
+    CONF_OFFSET(crop_auto),
+    copy_string,
+    print_string,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
+    "crop_auto_time",
+    "# Seconds of motion statistics used to learn the crop.",
+    0,
+    CONF_OFFSET(crop_auto_time),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
     "locate_motion_mode",
     "# Draw a locate box around the moving object.",
     0,
@@ -793,6 +881,15 @@ config_param config_params[] = {
     WEBUI_LEVEL_LIMITED
     },
     {
+    "pre_capture_raw",
+    "# With movie_passthrough, the number of newest pre_capture frames kept as raw images.",
+    0,
+    CONF_OFFSET(pre_capture_raw),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
     "post_capture",
     "# Number of frames to capture after motion is no longer detected.",
     0,
@@ -802,6 +899,51 @@ config_param config_params[] = {
     WEBUI_LEVEL_LIMITED
     },
     {
+    "detection_threads",
+    "# Number of threads sharing the per pixel work of the motion detection.",
+    0,
+    CONF_OFFSET(detection_threads),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "detection_fused",
+    "# Update the reference frame and count the motion in the same sweep as the diff.",
+    0,
+    CONF_OFFSET(detection_fused),
+    copy_bool,
+    print_bool,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "detection_scale",
+    "# Run the motion detection on the image scaled down by 1, 2 or 4.",
+    0,
+    CONF_OFFSET(detection_scale),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "detection_tiles",
+    "# Only diff the tiles of 16x16 pixels whose total difference shows a change.",
+    0,
+    CONF_OFFSET(detection_tiles),
+    copy_bool,
+    print_bool,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "frame_pool_hugepages",
+    "# Back the image buffers and the pre_capture ring with huge pages.",
+    0,
+    CONF_OFFSET(frame_pool_hugepages),
+    copy_bool,
+    print_bool,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
     "on_event_start",
     "############################################################\n"
     "# Script execution configuration parameters\n"
@@ -1030,6 +1172,24 @@ config_param config_params[] = {
     WEBUI_LEVEL_LIMITED
     },
     {
+    "movie_output_queue",
+    "# Frames queued for the movie encoder thread, 0 encodes on the camera thread.",
+    0,
+    CONF_OFFSET(movie_output_queue),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "movie_output_drop",
+    "# Drop movie frames instead of waiting when the encoder queue is full.",
+    0,
+    CONF_OFFSET(movie_output_drop),
+    copy_bool,
+    print_bool,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
     "movie_passthrough",
     "# Pass through from the camera to the movie without decode/encoding.",
     0,
@@ -3175,6 +3335,7 @@ static void config_parms_intl(){
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","log_type",_("log_type"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","quiet",_("quiet"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","native_language",_("native_language"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","camera_workers",_("camera_workers"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","camera_name",_("camera_name"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","camera_id",_("camera_id"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","target_dir",_("target_dir"));
@@ -3205,6 +3366,13 @@ static void config_parms_intl(){
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","minimum_frame_time",_("minimum_frame_time"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","rotate",_("rotate"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","flip_axis",_("flip_axis"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","crop_left",_("crop_left"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","crop_right",_("crop_right"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","crop_top",_("crop_top"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","crop_bottom",_("crop_bottom"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","crop_source",_("crop_source"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","crop_auto",_("crop_auto"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","crop_auto_time",_("crop_auto_time"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","locate_motion_mode",_("locate_motion_mode"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","locate_motion_style",_("locate_motion_style"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","text_left",_("text_left"));
@@ -3228,7 +3396,13 @@ static void config_parms_intl(){
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","minimum_motion_frames",_("minimum_motion_frames"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","event_gap",_("event_gap"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","pre_capture",_("pre_capture"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","pre_capture_raw",_("pre_capture_raw"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","post_capture",_("post_capture"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","detection_threads",_("detection_threads"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","detection_fused",_("detection_fused"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","detection_scale",_("detection_scale"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","detection_tiles",_("detection_tiles"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","frame_pool_hugepages",_("frame_pool_hugepages"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","on_event_start",_("on_event_start"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","on_event_end",_("on_event_end"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","on_picture_save",_("on_picture_save"));
@@ -3253,6 +3427,8 @@ static void config_parms_intl(){
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_quality",_("movie_quality"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_codec",_("movie_codec"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_duplicate_frames",_("movie_duplicate_frames"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_output_queue",_("movie_output_queue"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_output_drop",_("movie_output_drop"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_passthrough",_("movie_passthrough"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_filename",_("movie_filename"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_extpipe_use",_("movie_extpipe_use"));
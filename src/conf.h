@@ -28,6 +28,7 @@ struct config {
     char            *log_type;
     int             quiet;
     int             native_language;
+    int             camera_workers;
     const char      *camera_name;
     int             camera_id;
     const char      *camera_dir;
@@ -68,6 +69,9 @@ struct config {
     int             crop_right;
     int             crop_top;
     int             crop_bottom;
+    int             crop_source;
+    const char      *crop_auto;
+    int             crop_auto_time;
 
     const char      *flip_axis;
     const char      *locate_motion_mode;
@@ -95,7 +99,13 @@ struct config {
     int             minimum_motion_frames;
     int             event_gap;
     int             pre_capture;
+    int             pre_capture_raw;
     int             post_capture;
+    int             detection_threads;
+    int             detection_fused;
+    int             detection_scale;
+    int             detection_tiles;
+    int             frame_pool_hugepages;
 
     /* Script execution configuration parameters */
     char            *on_event_start;
@@ -128,6 +138,8 @@ struct config {
     int             movie_quality;
     const char      *movie_codec;
     int             movie_duplicate_frames;
+    int             movie_output_queue;
+    int             movie_output_drop;
     int             movie_passthrough;
     const char      *movie_filename;
     int             movie_extpipe_use;
@@ -1,64 +1,148 @@
 /*
  *    crop.c
  *
- *    Module for handling image rotation.
+ *    Module for handling image cropping.
  *
- *    Copyright 2019, Joseph McKenna (per@pjd.nu)
+ *    Copyright 2019, Joseph McKenna
  *
  *    This software is distributed under the GNU Public license
  *    Version 2.  See also the file 'COPYING'.
  *
- *    Image rotation is a feature of Motion that can be used when the
+ *    Image cropping is a feature of Motion that can be used when the
  *    camera is mounted where a large section of the camera does not see
- *    useful space. An example usage would be the view through a peep hole, 
- *    processing performance can be improved to crop the image to only the 
+ *    useful space. An example usage would be the view through a peep hole,
+ *    processing performance can be improved to crop the image to only the
  *    space with information in it
-
+ *
+ *    A camera can also take its images from the capture of another camera
+ *    (conf.crop_source).  The source publishes each image before the crop and
+ *    the camera copies only its own crop out of it, so several regions of one
+ *    camera can be watched with their own detection and events while the
+ *    device is opened and decoded only once.
+ *
+ *    The crop can also be learned (conf.crop_auto).  The motion pixels found
+ *    by the detection are counted per row and per column over a learning
+ *    window and the crop is set to the area where motion was seen plus a
+ *    margin.
+ *
  *    Version history:
  *      v1 (2019)        - initial version
  */
 #include "translate.h"
 #include "crop.h"
-#include <stdint.h>
-#if defined(__APPLE__)
-#include <libkern/OSByteOrder.h>
-#define bswap_32(x) OSSwapInt32(x)
-#elif defined(__FreeBSD__)
-#include <sys/endian.h>
-#define bswap_32(x) bswap32(x)
-#elif defined(__OpenBSD__)
-#include <sys/types.h>
-#define bswap_32(x) swap32(x)
-#elif defined(__NetBSD__)
-#include <sys/bswap.h>
-#define bswap_32(x) bswap32(x)
-#else
-#include <byteswap.h>
-#endif
-
-static void crop(unsigned char* src, register unsigned char* dst,
-		 int size_src, int size_dst,
-                 int width_src,
-		 //int width_src, int width_dst,
-		 //int height_src, int height_dst,
-		 int left, int right, int top, int bottom)
+#include "picture.h"
+#include "rotate.h"
+
+#define CROP_AUTO_MARGIN   32   /* Pixels kept around the area with motion */
+#define CROP_AUTO_ALIGN    16   /* Alignment of the learned crop */
+#define CROP_AUTO_FLOOR  1000   /* Rows and columns with less than 1/1000 of the motion are ignored */
+
+/**
+ * crop_align
+ *
+ *  Adjusts the crop values of one side so the size of the cropped image
+ *  stays a multiple of 8 and the first pixel lines up with the chroma planes.
+ *
+ * Parameters:
+ *
+ *   size  - the dimension of the image before the crop
+ *   lead  - pixels removed at the start (left or top)
+ *   trail - pixels removed at the end (right or bottom)
+ *
+ * Returns: the dimension of the image after the crop
+ */
+static int crop_align(int size, int *lead, int *trail)
 {
-  unsigned char* src_endp, dst_endp;
-  register unsigned char* base;
+    int sizec;
+
+    *lead  -= (*lead % 2);
+    sizec = size - *lead - *trail;
+    if (sizec % 8) sizec = sizec - (sizec % 8) + 8;
+    *trail = size - *lead - sizec;
+    if (*trail < 0) {
+        *lead  += *trail;
+        *trail = 0;
+    }
+
+    return sizec;
+}
+
+/**
+ * crop_setup
+ *
+ *  Aligns the crop and sets the image dimensions to the size after the crop.
+ *
+ * Parameters:
+ *
+ *   cnt - the current thread's context structure
+ *
+ * Returns: nothing
+ */
+static void crop_setup(struct context *cnt){
+    int widthc, heightc;
 
-  src_endp = src + size_src;
+    widthc  = crop_align(cnt->imgs.width, &cnt->crop_data.px_left, &cnt->crop_data.px_right);
+    heightc = crop_align(cnt->imgs.height, &cnt->crop_data.px_top, &cnt->crop_data.px_bottom);
 
-  for (base = src + width_src*top; base < src_endp; base+=right) {
-    for (base = base + left; base < base + left - right; base++) {
-      *dst++ = *base;
+    if ((widthc < 64) || (heightc < 64)) {
+        MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO
+            ,_("Crop leaves an image of %dx%d. Motion only supports width and height"
+               " greater than or equal to 64. Crop disabled.")
+            ,widthc, heightc);
+        cnt->crop_data.enabled = FALSE;
+        return;
     }
-  }
+
+    if ((cnt->crop_data.px_left != cnt->conf.crop_left) ||
+        (cnt->crop_data.px_right != cnt->conf.crop_right) ||
+        (cnt->crop_data.px_top != cnt->conf.crop_top) ||
+        (cnt->crop_data.px_bottom != cnt->conf.crop_bottom)) {
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+            ,_("Crop adjusted to left %d right %d top %d bottom %d to keep the image modulo 8")
+            ,cnt->crop_data.px_left, cnt->crop_data.px_right
+            ,cnt->crop_data.px_top, cnt->crop_data.px_bottom);
+    }
+
+    cnt->crop_data.enabled = TRUE;
+
+    cnt->imgs.width = widthc;
+    cnt->imgs.height = heightc;
+    cnt->imgs.motionsize = widthc * heightc;
+    cnt->imgs.size_norm = (widthc * heightc * 3) / 2;
+
+    /*
+     * The high resolution image covers the same view as the normal image
+     * so the crop is scaled by the ratio of the two widths and heights.
+     */
+    if (cnt->crop_data.capture_size_high > 0) {
+        cnt->crop_data.px_left_high   = (cnt->crop_data.px_left * cnt->imgs.width_high) /
+            cnt->crop_data.capture_width_norm;
+        cnt->crop_data.px_right_high  = (cnt->crop_data.px_right * cnt->imgs.width_high) /
+            cnt->crop_data.capture_width_norm;
+        cnt->crop_data.px_top_high    = (cnt->crop_data.px_top * cnt->imgs.height_high) /
+            cnt->crop_data.capture_height_norm;
+        cnt->crop_data.px_bottom_high = (cnt->crop_data.px_bottom * cnt->imgs.height_high) /
+            cnt->crop_data.capture_height_norm;
+
+        cnt->imgs.width_high  = crop_align(cnt->imgs.width_high
+            , &cnt->crop_data.px_left_high, &cnt->crop_data.px_right_high);
+        cnt->imgs.height_high = crop_align(cnt->imgs.height_high
+            , &cnt->crop_data.px_top_high, &cnt->crop_data.px_bottom_high);
+        cnt->imgs.size_high = (cnt->imgs.width_high * cnt->imgs.height_high * 3) / 2;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+        ,_("Cropping image from %dx%d to %dx%d")
+        ,cnt->crop_data.capture_width_norm, cnt->crop_data.capture_height_norm
+        ,cnt->imgs.width, cnt->imgs.height);
 
 }
 
-/* * crop_init
+/**
+ * crop_auto_init
  *
- *  Initializes crop data - allocates memory.
+ *  Sets up the learning of the crop from conf.crop_auto.  Learning stops
+ *  for the thread once a learned crop has been applied.
  *
  * Parameters:
  *
@@ -66,12 +150,240 @@ static void crop(unsigned char* src, register unsigned char* dst,
  *
  * Returns: nothing
  */
-void crop_init(struct context *cnt){
-    int size_norm, size_high;
+static void crop_auto_init(struct context *cnt){
+
+    cnt->crop_data.auto_mode = CROP_AUTO_OFF;
+    cnt->crop_data.auto_rows = NULL;
+    cnt->crop_data.auto_cols = NULL;
+    cnt->crop_data.auto_start = 0;
+
+    if ((cnt->conf.crop_auto == NULL) || (cnt->crop_data.auto_done)) return;
+
+    if (strcasecmp(cnt->conf.crop_auto, "suggest") == 0) {
+        cnt->crop_data.auto_mode = CROP_AUTO_SUGGEST;
+    } else if (strcasecmp(cnt->conf.crop_auto, "apply") == 0) {
+        cnt->crop_data.auto_mode = CROP_AUTO_APPLY;
+    } else {
+        if (strcasecmp(cnt->conf.crop_auto, "off") != 0) {
+            MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
+                ,_("Invalid crop_auto %s"), cnt->conf.crop_auto);
+        }
+        return;
+    }
+
+    if (cnt->conf.crop_auto_time < 1) cnt->conf.crop_auto_time = 1;
+
+    cnt->crop_data.auto_rows = mymalloc(cnt->imgs.height * sizeof(unsigned int));
+    cnt->crop_data.auto_cols = mymalloc(cnt->imgs.width * sizeof(unsigned int));
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+        ,_("Learning the crop from %d seconds of motion"), cnt->conf.crop_auto_time);
+}
+
+/**
+ * crop_auto_edges
+ *
+ *  Finds the first and last entries of a histogram above the floor.
+ *
+ * Parameters:
+ *
+ *   hist  - motion pixels counted per row or per column
+ *   count - number of entries in hist
+ *   floor - count an entry must exceed
+ *   first - returns the first entry above the floor
+ *   last  - returns the last entry above the floor
+ *
+ * Returns: nothing
+ */
+static void crop_auto_edges(unsigned int *hist, int count, unsigned int floor
+            , int *first, int *last)
+{
+    *first = 0;
+    while ((*first < count - 1) && (hist[*first] <= floor)) (*first)++;
+
+    *last = count - 1;
+    while ((*last > *first) && (hist[*last] <= floor)) (*last)--;
+}
+
+/**
+ * crop_auto_side
+ *
+ *  Converts the area with motion along one dimension into the number of
+ *  pixels to remove from each side of the image before the crop.
+ *
+ * Parameters:
+ *
+ *   size  - the dimension of the image before the crop
+ *   lead  - pixels removed at the start by the current crop
+ *   first - first row or column with motion in the cropped image
+ *   last  - last row or column with motion in the cropped image
+ *   crop_lead  - returns the pixels to remove at the start
+ *   crop_trail - returns the pixels to remove at the end
+ *
+ * Returns: nothing
+ */
+static void crop_auto_side(int size, int lead, int first, int last
+            , int *crop_lead, int *crop_trail)
+{
+    int start, end;
+
+    start = lead + first - CROP_AUTO_MARGIN;
+    if (start < 0) start = 0;
+    start -= start % CROP_AUTO_ALIGN;
+
+    end = lead + last + 1 + CROP_AUTO_MARGIN;
+    if (end % CROP_AUTO_ALIGN) end += CROP_AUTO_ALIGN - (end % CROP_AUTO_ALIGN);
+    if (end > size) end = size;
 
-    /* Make sure buffer_norm isn't freed if it hasn't been allocated. */
-    cnt->crop_data.buffer_norm = NULL;
-    cnt->crop_data.buffer_high = NULL;
+    *crop_lead = start;
+    *crop_trail = size - end;
+}
+
+/**
+ * crop_auto_finish
+ *
+ *  Determines the crop at the end of a learning window.  The crop is
+ *  logged and with crop_auto apply it is set in the configuration so the
+ *  motion loop reallocates the image buffers for the new crop.
+ *
+ * Parameters:
+ *
+ *   cnt - the current thread's context structure
+ *
+ * Returns: nothing
+ */
+static void crop_auto_finish(struct context *cnt){
+    unsigned long long total;
+    unsigned int floor;
+    int indx, first_x, last_x, first_y, last_y;
+    int left, right, top, bottom;
+
+    total = 0;
+    for (indx = 0; indx < cnt->imgs.height; indx++) total += cnt->crop_data.auto_rows[indx];
+
+    if (total == 0) {
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+            ,_("No motion while learning the crop.  Learning again."));
+        return;
+    }
+
+    floor = (unsigned int)(total / CROP_AUTO_FLOOR);
+    crop_auto_edges(cnt->crop_data.auto_rows, cnt->imgs.height, floor, &first_y, &last_y);
+    crop_auto_edges(cnt->crop_data.auto_cols, cnt->imgs.width, floor, &first_x, &last_x);
+
+    crop_auto_side(cnt->crop_data.capture_width_norm, cnt->crop_data.px_left
+        , first_x, last_x, &left, &right);
+    crop_auto_side(cnt->crop_data.capture_height_norm, cnt->crop_data.px_top
+        , first_y, last_y, &top, &bottom);
+
+    if ((left == cnt->conf.crop_left) && (right == cnt->conf.crop_right) &&
+        (top == cnt->conf.crop_top) && (bottom == cnt->conf.crop_bottom)) {
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, _("Learned crop is the crop in use"));
+        return;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+        ,_("Learned crop: crop_left %d crop_right %d crop_top %d crop_bottom %d")
+        ,left, right, top, bottom);
+
+    if (cnt->crop_data.auto_mode != CROP_AUTO_APPLY) return;
+
+    /* The mask files were made for the current image size */
+    if ((cnt->conf.mask_file != NULL) || (cnt->conf.mask_privacy != NULL)) {
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
+            ,_("Learned crop not applied since a mask file is in use"));
+        return;
+    }
+
+    /* The motion loop notices the change and sets up the new crop (crop_changed) */
+    cnt->conf.crop_left = left;
+    cnt->conf.crop_right = right;
+    cnt->conf.crop_top = top;
+    cnt->conf.crop_bottom = bottom;
+    cnt->crop_data.auto_done = TRUE;
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, _("Applying the learned crop"));
+}
+
+/**
+ * crop_auto_learn
+ *
+ *  Counts the motion pixels of the last detection per row and column.
+ *  Called for each frame that was processed by the detection.
+ *
+ * Parameters:
+ *
+ *   cnt - the current thread's context structure
+ *
+ * Returns: nothing
+ */
+void crop_auto_learn(struct context *cnt){
+    const uint64_t *bits;
+    uint64_t word;
+    unsigned int *rows, *cols;
+    int y, x, k, indx, count, scale = cnt->imgs.detect_scale;
+
+    if (cnt->crop_data.auto_mode == CROP_AUTO_OFF) return;
+    if (cnt->crop_data.auto_rows == NULL) return;
+
+    if (cnt->crop_data.auto_start == 0) cnt->crop_data.auto_start = cnt->currenttime;
+
+    /* The motion bitmap only holds the motion pixels when the full detection ran */
+    if (cnt->current_image->diffs > 0) {
+        bits = cnt->imgs.motion_bits;
+        rows = cnt->crop_data.auto_rows;
+        cols = cnt->crop_data.auto_cols;
+        /*
+         * A pixel of the detection stands for a block of scale x scale pixels,
+         * that is scale pixels in each of the scale rows and columns it covers.
+         */
+        if (cnt->imgs.motion_counts) {
+            /* The diff or the despeckle already counted them */
+            for (y = 0; y < cnt->imgs.detect_height * scale; y++)
+                rows[y] += cnt->imgs.motion_rows[y / scale] * scale;
+            for (indx = 0; indx < cnt->imgs.detect_width * scale; indx++)
+                cols[indx] += cnt->imgs.motion_cols[indx / scale] * scale;
+        } else {
+            for (y = 0; y < cnt->imgs.detect_height; y++) {
+                count = 0;
+                for (indx = 0; indx < cnt->imgs.motion_stride; indx++) {
+                    count += __builtin_popcountll(bits[indx]);
+                    for (word = bits[indx]; word; word &= word - 1) {
+                        x = (64 * indx + __builtin_ctzll(word)) * scale;
+                        for (k = 0; k < scale; k++) cols[x + k] += scale;
+                    }
+                }
+                for (k = 0; k < scale; k++) rows[y * scale + k] += count * scale;
+                bits += cnt->imgs.motion_stride;
+            }
+        }
+    }
+
+    if ((cnt->currenttime - cnt->crop_data.auto_start) < cnt->conf.crop_auto_time) return;
+
+    crop_auto_finish(cnt);
+
+    /* Start the next window */
+    cnt->crop_data.auto_start = cnt->currenttime;
+    if (cnt->crop_data.auto_rows != NULL) {
+        memset(cnt->crop_data.auto_rows, 0, cnt->imgs.height * sizeof(unsigned int));
+        memset(cnt->crop_data.auto_cols, 0, cnt->imgs.width * sizeof(unsigned int));
+    }
+}
+
+/**
+ * crop_init
+ *
+ *  Initializes crop data and sets the image dimensions to the size
+ *  after the crop.
+ *
+ * Parameters:
+ *
+ *   cnt - the current thread's context structure
+ *
+ * Returns: nothing
+ */
+void crop_init(struct context *cnt){
 
     /*
      * Assign the values in conf.crop_left/right/top/bottom to crop_data.px_left/px_right/px_top/px_bottom. This way,
@@ -81,124 +393,96 @@ void crop_init(struct context *cnt){
         MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
             ,_("Config option \"crop_left\" not positive number: %d")
             ,cnt->conf.crop_left);
-        cnt->conf.crop_left = 0;     /* Disable crop. */
-        cnt->crop_data.px_left = 0; /* Force return below. */
-    } else {
-        cnt->crop_data.px_left = cnt->conf.crop_left; 
+        cnt->conf.crop_left = 0;
     }
-
     if (cnt->conf.crop_right < 0) {
-      MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
-		 ,_("Config option \"crop_right\" not positive number: %d")
-		 ,cnt->conf.crop_right);
-      cnt->conf.crop_right = 0;     /* Disable crop. */
-      cnt->crop_data.px_left = 0; /* Force return below. */
-    } else {
-      cnt->crop_data.px_right = cnt->conf.crop_right;
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
+            ,_("Config option \"crop_right\" not positive number: %d")
+            ,cnt->conf.crop_right);
+        cnt->conf.crop_right = 0;
     }
-
-
     if (cnt->conf.crop_top < 0) {
-      MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
-		 ,_("Config option \"crop_top\" not positive number: %d")
-		 ,cnt->conf.crop_top);
-      cnt->conf.crop_top = 0;     /* Disable crop. */
-      cnt->crop_data.px_top = 0; /* Force return below. */
-    } else {
-      cnt->crop_data.px_top = cnt->conf.crop_top;
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
+            ,_("Config option \"crop_top\" not positive number: %d")
+            ,cnt->conf.crop_top);
+        cnt->conf.crop_top = 0;
     }
-
-
     if (cnt->conf.crop_bottom < 0) {
-      MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
-		 ,_("Config option \"crop_bottom\" not positive number: %d")
-		 ,cnt->conf.crop_bottom);
-      cnt->conf.crop_bottom = 0;     /* Disable rotation. */
-      cnt->crop_data.px_bottom = 0; /* Force return below. */
-    } else {
-      cnt->crop_data.px_bottom = cnt->conf.crop_bottom;
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
+            ,_("Config option \"crop_bottom\" not positive number: %d")
+            ,cnt->conf.crop_bottom);
+        cnt->conf.crop_bottom = 0;
     }
 
-    if (cnt->conf.crop_left + cnt->conf.crop_right > cnt->imgs.width) {
-      MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
-		 ,_("Config option \"crop_left\" (%d) and \"crop_right\" (%d) take away more than the image width: %d")
-		 ,cnt->conf.crop_left,cnt->conf.crop_right,cnt->imgs.width);
-    }
+    cnt->crop_data.px_left   = cnt->conf.crop_left;
+    cnt->crop_data.px_right  = cnt->conf.crop_right;
+    cnt->crop_data.px_top    = cnt->conf.crop_top;
+    cnt->crop_data.px_bottom = cnt->conf.crop_bottom;
+
+    /* Kept to notice changes made through the webcontrol (crop_changed) */
+    cnt->crop_data.conf_left   = cnt->conf.crop_left;
+    cnt->crop_data.conf_right  = cnt->conf.crop_right;
+    cnt->crop_data.conf_top    = cnt->conf.crop_top;
+    cnt->crop_data.conf_bottom = cnt->conf.crop_bottom;
+    cnt->crop_data.generation++;
 
-    if (cnt->conf.crop_top + cnt->conf.crop_bottom > cnt->imgs.height) {
-      MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
-		 ,_("Config option \"crop_top\" (%d) and \"crop_bottom\" (%d) take away more than the image height: %d")
-		 ,cnt->conf.crop_top,cnt->conf.crop_bottom,cnt->imgs.height);
-    }
-    
     /*
      * Upon entrance to this function, imgs.width and imgs.height contain the
-     * capture dimensions (as set in the configuration file, or read from a
-     * netcam source).
-     *
-     * If rotating 90 or 270 degrees, the capture dimensions and output dimensions
-     * are not the same. Capture dimensions will be contained in capture_width_norm and
-     * capture_height_norm in cnt->rotate_data, while output dimensions will be contained
-     * in imgs.width and imgs.height.
+     * dimensions after the rotation (rotate_init has already been called).
+     * These are the dimensions of the image handed to crop_map and are kept
+     * in capture_width_norm and capture_height_norm while imgs.width and
+     * imgs.height get the dimensions after the crop.
      */
-
-    /* 1. Transfer capture dimensions into capture_width_norm and capture_height_norm. */
     cnt->crop_data.capture_width_norm  = cnt->imgs.width;
     cnt->crop_data.capture_height_norm = cnt->imgs.height;
-
     cnt->crop_data.capture_width_high  = cnt->imgs.width_high;
     cnt->crop_data.capture_height_high = cnt->imgs.height_high;
 
-    size_norm = cnt->imgs.width * cnt->imgs.height * 3 / 2;
-    size_high = cnt->imgs.width_high * cnt->imgs.height_high * 3 / 2;
+    cnt->crop_data.capture_size_norm = (cnt->imgs.width * cnt->imgs.height * 3) / 2;
+    cnt->crop_data.capture_size_high = (cnt->imgs.width_high * cnt->imgs.height_high * 3) / 2;
 
-    if ((cnt->rotate_data.degrees == 90) || (cnt->rotate_data.degrees == 270)) {
-        /* 2. "Swap" imgs.width and imgs.height. */
-        cnt->imgs.width = cnt->rotate_data.capture_height_norm;
-        cnt->imgs.height = cnt->rotate_data.capture_width_norm;
-        if (size_high > 0 ) {
-            cnt->imgs.width_high = cnt->rotate_data.capture_height_high;
-            cnt->imgs.height_high = cnt->rotate_data.capture_width_high;
-        }
+    cnt->crop_data.enabled = FALSE;
+
+    if ((cnt->crop_data.px_left != 0) || (cnt->crop_data.px_right != 0) ||
+        (cnt->crop_data.px_top != 0) || (cnt->crop_data.px_bottom != 0)) {
+        crop_setup(cnt);
     }
 
-    /*
-     * If we're not cropping, let's exit once we have setup the capture dimensions
-     * and output dimensions properly.
-     */
-    if (cnt->crop_data.px_left == 0)
-      if (cnt->crop_data.px_right == 0)
-	if (cnt->crop_data.px_top == 0)
-	  if (cnt->crop_data.px_bottom == 0)
-            return;
-	    
+    /* The rotation is combined with the crop when both are used */
+    rotate_fuse_init(cnt);
 
-    /*
-     * Allocate memory if rotating 90 or 270 degrees, because those rotations
-     * cannot be performed in-place (they can, but it would be too slow).
-     */
-    cnt->imgs.width = cnt->imgs.width
-      - cnt->crop_data.px_left
-      - cnt->crop_data.px_right;
-
-    cnt->imgs.width_high = cnt->imgs.width_high
-      - cnt->crop_data.px_left
-      - cnt->crop_data.px_right;
-    
-    cnt->imgs.height = cnt->imgs.height
-      - cnt->crop_data.px_top
-      - cnt->crop_data.px_bottom;
-
-    cnt->imgs.height_high = cnt->imgs.height_high
-       - cnt->crop_data.px_top
-       - cnt->crop_data.px_bottom;
-     
-    size_norm = cnt->imgs.width * cnt->imgs.height * 3 / 2;
-    size_high = cnt->imgs.width_high * cnt->imgs.height_high * 3 / 2;
-    
-    cnt->crop_data.buffer_norm = mymalloc(size_norm);
-    if (size_high > 0 ) cnt->rotate_data.buffer_high = mymalloc(size_high);
+    crop_auto_init(cnt);
+
+}
 
+/**
+ * crop_view
+ *
+ *  Points the view at the part of a captured image that is kept by the crop.
+ *  The strides stay those of the captured image.
+ *
+ * Parameters:
+ *
+ *   view     - the view to set
+ *   img      - the captured image
+ *   width    - width of the captured image
+ *   height   - height of the captured image
+ *   left     - columns removed on the left side of the image
+ *   top      - rows removed on the top of the image
+ *
+ * Returns: nothing
+ */
+static void crop_view(struct image_view *view, unsigned char *img
+            , int width, int height, int left, int top)
+{
+    int wh = width * height;
+
+    view->plane[0] = img + (width * top) + left;
+    view->plane[1] = img + wh + ((width / 2) * (top / 2)) + (left / 2);
+    view->plane[2] = img + wh + (wh / 4) + ((width / 2) * (top / 2)) + (left / 2);
+    view->stride[0] = width;
+    view->stride[1] = width / 2;
+    view->stride[2] = width / 2;
 }
 
 /**
@@ -214,21 +498,307 @@ void crop_init(struct context *cnt){
  */
 void crop_deinit(struct context *cnt){
 
-    if (cnt->crop_data.buffer_norm)
-        free(cnt->crop_data.buffer_norm);
+    cnt->crop_data.enabled = FALSE;
+
+    if (cnt->crop_data.auto_rows != NULL) free(cnt->crop_data.auto_rows);
+    if (cnt->crop_data.auto_cols != NULL) free(cnt->crop_data.auto_cols);
+    cnt->crop_data.auto_rows = NULL;
+    cnt->crop_data.auto_cols = NULL;
+
+    /* The cameras cropping from this one wait until it publishes again */
+    if (cnt->crop_data.share != NULL) {
+        pthread_mutex_lock(&cnt->crop_data.share->mutex);
+            cnt->crop_data.share->width = 0;
+            cnt->crop_data.share->height = 0;
+        pthread_mutex_unlock(&cnt->crop_data.share->mutex);
+    }
+
+}
+
+/**
+ * crop_changed
+ *
+ *  Tells whether the crop values in the configuration differ from the ones
+ *  the crop was set up from.
+ *
+ * Parameters:
+ *
+ *   cnt - the current thread's context structure
+ *
+ * Returns: TRUE when the crop needs to be set up again
+ */
+int crop_changed(struct context *cnt){
+
+    if ((cnt->conf.crop_left != cnt->crop_data.conf_left) ||
+        (cnt->conf.crop_right != cnt->crop_data.conf_right) ||
+        (cnt->conf.crop_top != cnt->crop_data.conf_top) ||
+        (cnt->conf.crop_bottom != cnt->crop_data.conf_bottom)) {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/**
+ * crop_in_capture
+ *
+ *  Tells whether the capture may discard the pixels removed by the crop
+ *  before crop_map is called.  This is not the case when other cameras crop
+ *  their region from the capture of this camera.
+ *
+ * Parameters:
+ *
+ *   cnt - the current thread's context structure
+ *
+ * Returns: TRUE when the capture may crop
+ */
+int crop_in_capture(struct context *cnt){
+
+    return (cnt->crop_data.enabled && (cnt->crop_data.share == NULL));
+
+}
+
+/**
+ * crop_share_init
+ *
+ *  Links the cameras that have crop_source set to the camera they crop
+ *  from.  Called from the main thread before the camera threads start.
+ *
+ * Parameters:
+ *
+ *   cntlist - the list of context structures
+ *
+ * Returns: nothing
+ */
+void crop_share_init(struct context **cntlist){
+    int indx, indx2, first;
+    struct context *src;
+
+    /* Context 0 only runs when there are no camera config files */
+    first = (cntlist[1] != NULL) ? 1 : 0;
+
+    for (indx = first; cntlist[indx] != NULL; indx++) {
+        cntlist[indx]->crop_data.source = NULL;
+        if (cntlist[indx]->conf.crop_source <= 0) continue;
+
+        src = NULL;
+        for (indx2 = first; cntlist[indx2] != NULL; indx2++) {
+            if ((indx2 != indx) &&
+                (cntlist[indx2]->camera_id == cntlist[indx]->conf.crop_source)) {
+                src = cntlist[indx2];
+            }
+        }
 
-    if (cnt->crop_data.buffer_high)
-        free(cnt->crop_data.buffer_high);
+        if (src == NULL) {
+            MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO
+                ,_("Camera %d: crop_source %d is not a camera id")
+                ,cntlist[indx]->camera_id, cntlist[indx]->conf.crop_source);
+            continue;
+        }
+        if (src->conf.crop_source > 0) {
+            MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO
+                ,_("Camera %d: crop_source %d must open its own device")
+                ,cntlist[indx]->camera_id, cntlist[indx]->conf.crop_source);
+            continue;
+        }
+
+        if (src->crop_data.share == NULL) {
+            src->crop_data.share = mymalloc(sizeof(struct crop_share));
+            pthread_mutex_init(&src->crop_data.share->mutex, NULL);
+        }
+        cntlist[indx]->crop_data.source = src->crop_data.share;
+
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+            ,_("Camera %d crops its image from camera %d")
+            ,cntlist[indx]->camera_id, src->camera_id);
+    }
+}
+
+/**
+ * crop_share_deinit
+ *
+ *  Frees the shared captures.  Called from the main thread once the camera
+ *  threads have finished.
+ *
+ * Parameters:
+ *
+ *   cntlist - the list of context structures
+ *
+ * Returns: nothing
+ */
+void crop_share_deinit(struct context **cntlist){
+    int indx;
+    struct crop_share *share;
+
+    for (indx = 0; cntlist[indx] != NULL; indx++) {
+        cntlist[indx]->crop_data.source = NULL;
+        share = cntlist[indx]->crop_data.share;
+        if (share == NULL) continue;
+
+        pthread_mutex_destroy(&share->mutex);
+        if (share->image != NULL) free(share->image);
+        free(share);
+        cntlist[indx]->crop_data.share = NULL;
+    }
+}
+
+/**
+ * crop_share_put
+ *
+ *  Publishes a captured image, after the rotation and before the crop, for
+ *  the cameras cropping from this camera.
+ *
+ * Parameters:
+ *
+ *   cnt      - the current thread's context structure
+ *   img_data - the captured image
+ *
+ * Returns: nothing
+ */
+static void crop_share_put(struct context *cnt, struct image_data *img_data){
+    struct crop_share *share = cnt->crop_data.share;
+
+    pthread_mutex_lock(&share->mutex);
+        if (share->size < cnt->crop_data.capture_size_norm) {
+            if (share->image != NULL) free(share->image);
+            share->image = mymalloc(cnt->crop_data.capture_size_norm);
+            share->size = cnt->crop_data.capture_size_norm;
+        }
+        memcpy(share->image, img_data->image_norm, cnt->crop_data.capture_size_norm);
+        share->width = cnt->crop_data.capture_width_norm;
+        share->height = cnt->crop_data.capture_height_norm;
+        share->frames++;
+    pthread_mutex_unlock(&share->mutex);
+}
+
+/**
+ * crop_source_start
+ *
+ *  Sets the capture dimensions of a camera with crop_source to those of
+ *  the images published by the source.  Waits for a short while when the
+ *  source has not published yet.
+ *
+ * Parameters:
+ *
+ *   cnt - the current thread's context structure
+ *
+ * Returns:
+ *
+ *   0  - success
+ *   -1 - the source is not available
+ */
+int crop_source_start(struct context *cnt){
+    struct crop_share *source = cnt->crop_data.source;
+    int width, height, indx;
+
+    if (source == NULL) {
+        MOTION_LOG(ERR, TYPE_VIDEO, NO_ERRNO
+            ,_("No camera with id %d to crop from"), cnt->conf.crop_source);
+        return -1;
+    }
+
+    width = 0;
+    height = 0;
+    for (indx = 0; indx < 50; indx++) {
+        pthread_mutex_lock(&source->mutex);
+            width = source->width;
+            height = source->height;
+        pthread_mutex_unlock(&source->mutex);
+        if ((width > 0) || (cnt->finish)) break;
+        SLEEP(0, 100000000L);
+    }
+
+    if (width == 0) {
+        MOTION_LOG(WRN, TYPE_VIDEO, NO_ERRNO
+            ,_("Camera %d has not captured an image yet"), cnt->conf.crop_source);
+        return -1;
+    }
+
+    cnt->imgs.width = width;
+    cnt->imgs.height = height;
+    cnt->imgs.size_norm = (width * height * 3) / 2;
+    cnt->imgs.motionsize = width * height;
+    cnt->imgs.width_high = 0;
+    cnt->imgs.height_high = 0;
+
+    return 0;
+}
+
+/**
+ * crop_source_next
+ *
+ *  Gets the latest image of the source camera.  Without rotation only the
+ *  pixels kept by the crop are copied.
+ *
+ * Parameters:
+ *
+ *   cnt      - the current thread's context structure
+ *   img_data - the image data to fill
+ *
+ * Returns:
+ *
+ *   0  - success
+ *   1  - the source has no new image at the moment
+ *   -1 - the dimensions of the source changed
+ */
+int crop_source_next(struct context *cnt, struct image_data *img_data){
+    struct crop_share *source = cnt->crop_data.source;
+    struct image_view view;
+    int cropped;
+
+    if (source == NULL) return 1;
+
+    cropped = (crop_in_capture(cnt) &&
+               (cnt->rotate_data.degrees == 0) &&
+               (cnt->rotate_data.axis == FLIP_TYPE_NONE));
+
+    pthread_mutex_lock(&source->mutex);
+        if (source->width == 0) {
+            pthread_mutex_unlock(&source->mutex);
+            return 1;
+        }
+        if ((source->width != cnt->rotate_data.capture_width_norm) ||
+            (source->height != cnt->rotate_data.capture_height_norm)) {
+            pthread_mutex_unlock(&source->mutex);
+            MOTION_LOG(WRN, TYPE_VIDEO, NO_ERRNO
+                ,_("Image dimensions of camera %d changed"), cnt->conf.crop_source);
+            return -1;
+        }
+        /* Do not hand out the same image twice */
+        if (source->frames == cnt->crop_data.source_frames) {
+            pthread_mutex_unlock(&source->mutex);
+            return 1;
+        }
+        cnt->crop_data.source_frames = source->frames;
+        if (cropped) {
+            crop_view(&view, source->image, source->width, source->height
+                , cnt->crop_data.px_left, cnt->crop_data.px_top);
+            pic_view_copy(img_data->image_norm, &view, cnt->imgs.width, cnt->imgs.height);
+        } else {
+            memcpy(img_data->image_norm, source->image, (source->width * source->height * 3) / 2);
+        }
+    pthread_mutex_unlock(&source->mutex);
+
+    if (cropped) {
+        pic_view_init(&img_data->view_norm, img_data->image_norm
+            , cnt->imgs.width, cnt->imgs.height);
+        return 0;
+    }
+
+    rotate_map(cnt, img_data);
+    crop_map(cnt, img_data);
+
+    return 0;
 }
 
 /**
  * crop_map
  *
- *  Main entry point for rotation.
+ *  Main entry point for cropping.
  *
  * Parameters:
  *
- *   img_data- pointer to the image data to rotate
+ *   img_data- pointer to the image data to crop
  *   cnt - the current thread's context structure
  *
  * Returns:
@@ -241,77 +811,41 @@ int crop_map(struct context *cnt, struct image_data *img_data){
      * The image format is YUV 4:2:0 planar, which has the pixel
      * data is divided in three parts:
      *    Y - width x height bytes
-     *    U - width x height / 4 bytes
+     *    U - width/2 x height/2 bytes
      *    V - as U
+     * No pixels are moved.  The views of the image are pointed at the first
+     * pixel kept in each plane and keep the strides of the captured image.
+     * Users of the image read it through img_data->view_norm and view_high.
      */
 
-    int indx, indx_max;
-    int wh, wh4 = 0, w2 = 0, h2 = 0;  /* width * height, width * height / 4 etc. */
-    int whc, wh4c =0, w2c = 0, h2c =0; /* width * height after crop, width * height / 4 after crop etc. */
-    int size, sizec, left, right, top, bottom;
-    int width, height;
-    int widthc, heightc;
-    unsigned char *img;
-    unsigned char *temp_buff;
-
-    if ( cnt->crop_data.px_left == 0 )
-      if ( cnt->crop_data.px_right == 0 )
-	if ( cnt->crop_data.px_top == 0 )
-	  if ( cnt->crop_data.px_bottom == 0 )
-	    return 0;
-
-    indx = 0;
-    indx_max = 0;
-    if ((cnt->crop_data.capture_width_high != 0) && (cnt->crop_data.capture_height_high != 0)) indx_max = 1;
-
-    while (indx <= indx_max) {
-        left   = cnt->crop_data.px_left;
-	right  = cnt->crop_data.px_right;
-	top    = cnt->crop_data.px_top;
-	bottom = cnt->crop_data.px_bottom;
-        wh4 = 0;
-        w2 = 0;
-        h2 = 0;
-        if (indx == 0 ){
-            img = img_data->image_norm;
-            width = cnt->crop_data.capture_width_norm;
-            height = cnt->crop_data.capture_height_norm;
-            temp_buff = cnt->crop_data.buffer_norm;
-        } else {
-            img = img_data->image_high;
-            width = cnt->crop_data.capture_width_high;
-            height = cnt->crop_data.capture_height_high;
-            temp_buff = cnt->crop_data.buffer_high;
+    if (img_data->image_norm == NULL) return -1;
+
+    if (cnt->crop_data.share != NULL) crop_share_put(cnt, img_data);
+
+    /*
+     * When the crop is combined with the rotation, rotate_map has already
+     * written the cropped image packed to the start of the buffer.
+     */
+    if (!cnt->crop_data.enabled || cnt->rotate_data.fused_crop) {
+        pic_view_init(&img_data->view_norm, img_data->image_norm
+            , cnt->imgs.width, cnt->imgs.height);
+        if (img_data->image_high != NULL) {
+            pic_view_init(&img_data->view_high, img_data->image_high
+                , cnt->imgs.width_high, cnt->imgs.height_high);
         }
-	widthc  = width - left - right;
-        heightc = height - left - right;
-        /*
-         * Pre-calculate some stuff:
-         *  wh   - size of the Y plane
-         *  size - size of the entire memory block
-         *  wh4  - size of the U plane, and the V plane
-         *  w2   - width of the U plane, and the V plane
-         *  h2   - as w2, but height instead
-         */
-        wh = width * height;
-	whc = widthc * heightc;
-        size = wh * 3 / 2;
-	sizec = whc * 3 / 2;
-        wh4 = wh / 4;
-	wh4c = whc / 4;
-        w2 = width / 2;
-	w2c = widthc / 2;
-        h2 = height / 2;
-	h2c = heightc / 2;
-
-	crop(img           , temp_buff             , wh  , whc  , width,/*width, widthc, height, heightc,*/ left, right, top, bottom);
-	crop(img + wh      , temp_buff + whc       , wh4 , wh4c , width,/*w2   , w2c   , h2    , h2c    ,*/ left, right, top, bottom);
-	crop(img + wh + wh4, temp_buff + whc + wh4c, wh4 , wh4c , width,/*w2   , w2c   , h2    , h2c    ,*/ left, right, top, bottom);
-        memcpy(img, temp_buff, sizec);
-
-        indx++;       
+        return 0;
+    }
+
+    crop_view(&img_data->view_norm, img_data->image_norm
+        , cnt->crop_data.capture_width_norm, cnt->crop_data.capture_height_norm
+        , cnt->crop_data.px_left, cnt->crop_data.px_top);
+
+    if ((cnt->crop_data.capture_width_high != 0) && (cnt->crop_data.capture_height_high != 0)) {
+        if (img_data->image_high == NULL) return -1;
+        crop_view(&img_data->view_high, img_data->image_high
+            , cnt->crop_data.capture_width_high, cnt->crop_data.capture_height_high
+            , cnt->crop_data.px_left_high, cnt->crop_data.px_top_high);
     }
 
     return 0;
 }
-
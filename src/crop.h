@@ -16,8 +16,9 @@
 /**
  * crop_init
  *
- *  Sets up rotation data by allocating a temporary buffer for 90/270 degrees
- *  rotation, and by determining the right rotate-180-degrees function.
+ *  Sets up crop data by validating the crop values and reducing the
+ *  image dimensions in cnt->imgs to the size after the crop. Must be
+ *  called after rotate_init.
  *
  * Parameters:
  *
@@ -28,9 +29,9 @@
 void crop_init(struct context *cnt);
 
 /**
- * rotate_deinit
+ * crop_deinit
  *
- *  Frees memory allocated by rotate_init.
+ *  Frees resources allocated by crop_init.
  *
  * Parameters:
  *
@@ -39,22 +40,115 @@ void crop_init(struct context *cnt);
 void crop_deinit(struct context *cnt);
 
 /**
- * rotate_map
+ * crop_auto_learn
  *
- *  Rotates the image stored in img according to the rotation data
- *  available in cnt. Rotation is performed clockwise. Supports 90,
- *  180 and 270 degrees rotation. 180 degrees rotation is performed
- *  in-place by simply reversing the image data, which is a very
- *  fast operation. 90 and 270 degrees rotation are performed using
- *  a temporary buffer and a somewhat more complicated algorithm,
- *  which makes them slower.
+ *  Adds the motion of the last detection to the statistics used to learn
+ *  the crop (conf.crop_auto) and determines the crop at the end of each
+ *  learning window.
  *
- *  Note that to the caller, all rotations will seem as they are
- *  performed in-place.
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ */
+void crop_auto_learn(struct context *cnt);
+
+/**
+ * crop_changed
+ *
+ *  Tells whether the crop values in the configuration were changed since
+ *  crop_init.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: TRUE when the crop needs to be set up again
+ */
+int crop_changed(struct context *cnt);
+
+/**
+ * crop_in_capture
+ *
+ *  Tells whether the capture may discard the pixels removed by the crop
+ *  before calling crop_map.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: TRUE when the capture may crop
+ */
+int crop_in_capture(struct context *cnt);
+
+/**
+ * crop_share_init
+ *
+ *  Links the cameras with crop_source to the camera they crop from. Must
+ *  be called after the camera ids are set and before the threads start.
+ *
+ * Parameters:
+ *
+ *   cntlist - list of context structures
+ */
+void crop_share_init(struct context **cntlist);
+
+/**
+ * crop_share_deinit
+ *
+ *  Frees the captures shared by crop_share_init.
+ *
+ * Parameters:
+ *
+ *   cntlist - list of context structures
+ */
+void crop_share_deinit(struct context **cntlist);
+
+/**
+ * crop_source_start
+ *
+ *  Sets the capture dimensions of a camera with crop_source from the
+ *  source camera.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns:
+ *
+ *   0  - success
+ *   -1 - the source is not available
+ */
+int crop_source_start(struct context *cnt);
+
+/**
+ * crop_source_next
+ *
+ *  Gets the latest image of the source camera and crops it.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *   img_data - the image data to fill
+ *
+ * Returns:
+ *
+ *   0  - success
+ *   1  - no new image available at the moment
+ *   -1 - the dimensions of the source changed
+ */
+int crop_source_next(struct context *cnt, struct image_data *img_data);
+
+/**
+ * crop_map
+ *
+ *  Crops the image stored in img_data according to the crop data available
+ *  in cnt. No pixels are copied. The views of img_data are set to the
+ *  first pixel kept in each of the Y, U and V planes with the strides of
+ *  the captured image.
  *
  * Parameters:
  *
- *   img_data - the image data to rotate
+ *   img_data - the image data to crop
  *   cnt - current thread's context structure
  *
  * Returns:
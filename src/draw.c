@@ -1068,8 +1068,11 @@ struct draw_char draw_table[]= {
 #define NEWLINE "\\n"
 /**
  * draw_textn
+ *      Draws len characters of text on the luma plane image which has
+ *      stride bytes between the start of two rows.
  */
-static int draw_textn(unsigned char *image, int startx,  int starty,  int width, const char *text, int len, int factor)
+static int draw_textn(unsigned char *image, int startx,  int starty,  int width, int stride
+            , const char *text, int len, int factor)
 {
 
     int x, y;
@@ -1084,10 +1087,10 @@ static int draw_textn(unsigned char *image, int startx,  int starty,  int width,
 
     if ((startx < 1) || (starty < 1) || (len < 1)) return 0;
 
-    line_offset = width - (7 * factor);
-    next_char_offs = (width * 8 * factor) - (6 * factor);
+    line_offset = stride - (7 * factor);
+    next_char_offs = (stride * 8 * factor) - (6 * factor);
 
-    image_ptr = image + startx + (starty * width);
+    image_ptr = image + startx + (starty * stride);
 
     for (pos = 0; pos < len; pos++) {
         int pos_check = (int)text[pos];
@@ -1126,9 +1129,11 @@ static int draw_textn(unsigned char *image, int startx,  int starty,  int width,
 }
 
 /**
- * draw_text
+ * draw_texts
+ *      Draws the possibly multi line text on a luma plane with the given stride.
  */
-int draw_text(unsigned char *image, int width, int height, int startx, int starty, const char *text, int factor)
+static int draw_texts(unsigned char *image, int width, int height, int stride
+            , int startx, int starty, const char *text, int factor)
 {
     int num_nl = 0;
     const char *end, *begin;
@@ -1166,17 +1171,36 @@ int draw_text(unsigned char *image, int width, int height, int startx, int start
     while ((end = strstr(end, NEWLINE))) {
         int len = end-begin;
 
-        draw_textn(image, startx, starty, width, begin, len, factor);
+        draw_textn(image, startx, starty, width, stride, begin, len, factor);
         end += sizeof(NEWLINE)-1;
         begin = end;
         starty += line_space;
     }
 
-    draw_textn(image, startx, starty, width, begin, strlen(begin), factor);
+    draw_textn(image, startx, starty, width, stride, begin, strlen(begin), factor);
 
     return 0;
 }
 
+/**
+ * draw_text
+ *      Draws text on a packed image.
+ */
+int draw_text(unsigned char *image, int width, int height, int startx, int starty, const char *text, int factor)
+{
+    return draw_texts(image, width, height, width, startx, starty, text, factor);
+}
+
+/**
+ * draw_text_view
+ *      Draws text on the image described by view.
+ */
+int draw_text_view(struct image_view *view, int width, int height
+            , int startx, int starty, const char *text, int factor)
+{
+    return draw_texts(view->plane[0], width, height, view->stride[0], startx, starty, text, factor);
+}
+
 /**
  * initialize_chars
  */
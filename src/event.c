@@ -14,6 +14,7 @@
 #include "event.h"
 #include "video_loopback.h"
 #include "video_common.h"
+#include "pipeline.h"
 
 /* Various functions (most doing the actual action)
  * TODO Items:
@@ -388,10 +389,11 @@ static void event_stream_put(struct context *cnt,
             void *dummy2 ATTRIBUTE_UNUSED, struct timeval *tv1 ATTRIBUTE_UNUSED)
 {
     int subsize;
+    struct image_view view_sub;
 
     if (cnt->conf.stream_preview_method == 99){
         if (cnt->conf.stream_port)
-            stream_put(cnt, &cnt->stream, &cnt->stream_count, img_data->image_norm, 0);
+            stream_put(cnt, &cnt->stream, &cnt->stream_count, &img_data->view_norm, 0);
     } else {
         pthread_mutex_lock(&cnt->mutex_stream);
             /* Normal stream processing */
@@ -403,7 +405,7 @@ static void event_stream_put(struct context *cnt,
                     cnt->stream_norm.jpeg_size = put_picture_memory(cnt
                         ,cnt->stream_norm.jpeg_data
                         ,cnt->imgs.size_norm
-                        ,img_data->image_norm
+                        ,&img_data->view_norm
                         ,cnt->conf.stream_quality
                         ,cnt->imgs.width
                         ,cnt->imgs.height);
@@ -426,12 +428,14 @@ static void event_stream_put(struct context *cnt,
                         }
                         pic_scale_img(cnt->imgs.width
                             ,cnt->imgs.height
-                            ,img_data->image_norm
+                            ,&img_data->view_norm
                             ,cnt->imgs.substream_image);
+                        pic_view_init(&view_sub, cnt->imgs.substream_image
+                            ,(cnt->imgs.width / 2), (cnt->imgs.height / 2));
                         cnt->stream_sub.jpeg_size = put_picture_memory(cnt
                             ,cnt->stream_sub.jpeg_data
                             ,subsize
-                            ,cnt->imgs.substream_image
+                            ,&view_sub
                             ,cnt->conf.stream_quality
                             ,(cnt->imgs.width / 2)
                             ,(cnt->imgs.height / 2));
@@ -440,7 +444,7 @@ static void event_stream_put(struct context *cnt,
                         cnt->stream_sub.jpeg_size = put_picture_memory(cnt
                             ,cnt->stream_sub.jpeg_data
                             ,cnt->imgs.size_norm
-                            ,img_data->image_norm
+                            ,&img_data->view_norm
                             ,cnt->conf.stream_quality
                             ,cnt->imgs.width
                             ,cnt->imgs.height);
@@ -457,7 +461,7 @@ static void event_stream_put(struct context *cnt,
                     cnt->stream_motion.jpeg_size = put_picture_memory(cnt
                         ,cnt->stream_motion.jpeg_data
                         ,cnt->imgs.size_norm
-                        ,cnt->imgs.img_motion.image_norm
+                        ,&cnt->imgs.img_motion.view_norm
                         ,cnt->conf.stream_quality
                         ,cnt->imgs.width
                         ,cnt->imgs.height);
@@ -469,11 +473,11 @@ static void event_stream_put(struct context *cnt,
                 if (cnt->stream_source.jpeg_data == NULL){
                     cnt->stream_source.jpeg_data = mymalloc(cnt->imgs.size_norm);
                 }
-                if (cnt->imgs.image_virgin.image_norm != NULL){
+                if (cnt->imgs.image_source != NULL){
                     cnt->stream_source.jpeg_size = put_picture_memory(cnt
                         ,cnt->stream_source.jpeg_data
                         ,cnt->imgs.size_norm
-                        ,cnt->imgs.image_virgin.image_norm
+                        ,&cnt->imgs.image_source->view_norm
                         ,cnt->conf.stream_quality
                         ,cnt->imgs.width
                         ,cnt->imgs.height);
@@ -490,8 +494,16 @@ static void event_vlp_putpipe(struct context *cnt,
             struct image_data *img_data, char *dummy ATTRIBUTE_UNUSED, void *devpipe,
             struct timeval *tv1 ATTRIBUTE_UNUSED)
 {
+    unsigned char *image;
+
     if (*(int *)devpipe >= 0) {
-        if (vlp_putpipe(*(int *)devpipe, img_data->image_norm, cnt->imgs.size_norm) == -1)
+        /* The pipe expects a packed image so a cropped image is gathered first */
+        image = img_data->image_norm;
+        if (!pic_view_packed(&img_data->view_norm, image, cnt->imgs.width, cnt->imgs.height)) {
+            image = cnt->imgs.common_buffer;
+            pic_view_copy(image, &img_data->view_norm, cnt->imgs.width, cnt->imgs.height);
+        }
+        if (vlp_putpipe(*(int *)devpipe, image, cnt->imgs.size_norm) == -1)
             MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO
                 ,_("Failed to put image into video pipe"));
     }
@@ -539,9 +551,9 @@ static void event_image_detect(struct context *cnt,
 
         passthrough = util_check_passthrough(cnt);
         if ((cnt->imgs.size_high > 0) && (!passthrough)) {
-            put_picture(cnt, fullfilename,img_data->image_high, FTYPE_IMAGE);
+            put_picture(cnt, fullfilename, &img_data->view_high, FTYPE_IMAGE);
         } else {
-            put_picture(cnt, fullfilename,img_data->image_norm, FTYPE_IMAGE);
+            put_picture(cnt, fullfilename, &img_data->view_norm, FTYPE_IMAGE);
         }
         event(cnt, EVENT_FILECREATE, NULL, fullfilename, (void *)FTYPE_IMAGE, currenttime_tv);
     }
@@ -580,7 +592,7 @@ static void event_imagem_detect(struct context *cnt,
             , cnt->conf.target_dir
             , (int)(PATH_MAX-2-strlen(cnt->conf.target_dir)-strlen(imageext(cnt)))
             , filenamem, imageext(cnt));
-        put_picture(cnt, fullfilenamem, cnt->imgs.img_motion.image_norm, FTYPE_IMAGE_MOTION);
+        put_picture(cnt, fullfilenamem, &cnt->imgs.img_motion.view_norm, FTYPE_IMAGE_MOTION);
         event(cnt, EVENT_FILECREATE, NULL, fullfilenamem, (void *)FTYPE_IMAGE, currenttime_tv);
     }
 }
@@ -620,7 +632,7 @@ static void event_image_snapshot(struct context *cnt,
             , cnt->conf.target_dir
             , (int)(PATH_MAX-1-strlen(cnt->conf.target_dir))
             , filename);
-        put_picture(cnt, fullfilename, img_data->image_norm, FTYPE_IMAGE_SNAPSHOT);
+        put_picture(cnt, fullfilename, &img_data->view_norm, FTYPE_IMAGE_SNAPSHOT);
         event(cnt, EVENT_FILECREATE, NULL, fullfilename, (void *)FTYPE_IMAGE_SNAPSHOT, currenttime_tv);
 
         /*
@@ -649,7 +661,7 @@ static void event_image_snapshot(struct context *cnt,
             , (int)(PATH_MAX-1-strlen(cnt->conf.target_dir))
             , filename);
         remove(fullfilename);
-        put_picture(cnt, fullfilename, img_data->image_norm, FTYPE_IMAGE_SNAPSHOT);
+        put_picture(cnt, fullfilename, &img_data->view_norm, FTYPE_IMAGE_SNAPSHOT);
         event(cnt, EVENT_FILECREATE, NULL, fullfilename, (void *)FTYPE_IMAGE_SNAPSHOT, currenttime_tv);
     }
 
@@ -716,9 +728,9 @@ static void event_image_preview(struct context *cnt,
 
             passthrough = util_check_passthrough(cnt);
             if ((cnt->imgs.size_high > 0) && (!passthrough)) {
-                put_picture(cnt, previewname, cnt->imgs.preview_image.image_high , FTYPE_IMAGE);
+                put_picture(cnt, previewname, &cnt->imgs.preview_image.view_high, FTYPE_IMAGE);
             } else {
-                put_picture(cnt, previewname, cnt->imgs.preview_image.image_norm , FTYPE_IMAGE);
+                put_picture(cnt, previewname, &cnt->imgs.preview_image.view_norm, FTYPE_IMAGE);
             }
             event(cnt, EVENT_FILECREATE, NULL, previewname, (void *)FTYPE_IMAGE, currenttime_tv);
         } else {
@@ -745,9 +757,9 @@ static void event_image_preview(struct context *cnt,
 
             passthrough = util_check_passthrough(cnt);
             if ((cnt->imgs.size_high > 0) && (!passthrough)) {
-                put_picture(cnt, previewname, cnt->imgs.preview_image.image_high , FTYPE_IMAGE);
+                put_picture(cnt, previewname, &cnt->imgs.preview_image.view_high, FTYPE_IMAGE);
             } else {
-                put_picture(cnt, previewname, cnt->imgs.preview_image.image_norm, FTYPE_IMAGE);
+                put_picture(cnt, previewname, &cnt->imgs.preview_image.view_norm, FTYPE_IMAGE);
             }
             event(cnt, EVENT_FILECREATE, NULL, previewname, (void *)FTYPE_IMAGE, currenttime_tv);
         }
@@ -882,6 +894,34 @@ static void event_create_extpipe(struct context *cnt,
     }
 }
 
+/**
+ * event_extpipe_write
+ *      Writes the planes of the image described by view to the extpipe
+ *      one row at a time.
+ *
+ * Returns 1 on success and 0 when a write failed.
+ */
+static int event_extpipe_write(struct context *cnt, struct image_view *view, int width, int height)
+{
+    int indx, y, widthp, heightp;
+
+    for (indx = 0; indx < 3; indx++) {
+        widthp  = (indx == 0) ? width : width / 2;
+        heightp = (indx == 0) ? height : height / 2;
+        if (view->stride[indx] == widthp) {
+            if (!fwrite(view->plane[indx], widthp * heightp, 1, cnt->extpipe))
+                return 0;
+            continue;
+        }
+        for (y = 0; y < heightp; y++) {
+            if (!fwrite(view->plane[indx] + (y * view->stride[indx]), widthp, 1, cnt->extpipe))
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
 static void event_extpipe_put(struct context *cnt,
             motion_event type ATTRIBUTE_UNUSED,
             struct image_data *img_data, char *dummy1 ATTRIBUTE_UNUSED,
@@ -896,11 +936,11 @@ static void event_extpipe_put(struct context *cnt,
         /* Check that is open */
         if ((cnt->extpipe_open) && (fileno(cnt->extpipe) > 0)) {
             if ((cnt->imgs.size_high > 0) && (!passthrough)){
-                if (!fwrite(img_data->image_high, cnt->imgs.size_high, 1, cnt->extpipe))
+                if (!event_extpipe_write(cnt, &img_data->view_high, cnt->imgs.width_high, cnt->imgs.height_high))
                     MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO
                         ,_("Error writing in pipe , state error %d"), ferror(cnt->extpipe));
             } else {
-                if (!fwrite(img_data->image_norm, cnt->imgs.size_norm, 1, cnt->extpipe))
+                if (!event_extpipe_write(cnt, &img_data->view_norm, cnt->imgs.width, cnt->imgs.height))
                     MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO
                         ,_("Error writing in pipe , state error %d"), ferror(cnt->extpipe));
            }
@@ -1213,8 +1253,10 @@ static void event_ffmpeg_put(struct context *cnt,
             void *dummy2 ATTRIBUTE_UNUSED, struct timeval *currenttime_tv)
 {
     if (cnt->ffmpeg_output) {
-        if (ffmpeg_put_image(cnt->ffmpeg_output, img_data, currenttime_tv) == -1){
-            MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, _("Error encoding image"));
+        if (pipeline_put(cnt, cnt->ffmpeg_output, img_data, currenttime_tv) == -1) {
+            if (ffmpeg_put_image(cnt->ffmpeg_output, img_data, currenttime_tv) == -1){
+                MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, _("Error encoding image"));
+            }
         }
     }
     if (cnt->ffmpeg_output_motion) {
@@ -1232,6 +1274,8 @@ static void event_ffmpeg_closefile(struct context *cnt,
 {
 
     if (cnt->ffmpeg_output) {
+        /* The output stage may still be encoding into the movie */
+        pipeline_drain(cnt);
         ffmpeg_close(cnt->ffmpeg_output);
         free(cnt->ffmpeg_output);
         cnt->ffmpeg_output = NULL;
@@ -1393,44 +1393,52 @@ void ffmpeg_avcodec_log(void *ignoreme ATTRIBUTE_UNUSED, int errno_flag ATTRIBUT
 }
 
 static void ffmpeg_put_pix_nv21(struct ffmpeg *ffmpeg, struct image_data *img_data){
-    unsigned char *image,*imagecr, *imagecb;
-    int cr_len, x, y;
+    struct image_view *view;
+    unsigned char *imagecr, *imagecb, *dest;
+    int x, y, width, height;
 
     if (ffmpeg->high_resolution){
-        image = img_data->image_high;
+        view = &img_data->view_high;
     } else {
-        image = img_data->image_norm;
+        view = &img_data->view_norm;
     }
 
-    cr_len = ffmpeg->ctx_codec->width * ffmpeg->ctx_codec->height / 4;
-    imagecr = image + (ffmpeg->ctx_codec->width * ffmpeg->ctx_codec->height);
-    imagecb = image + (ffmpeg->ctx_codec->width * ffmpeg->ctx_codec->height) + cr_len;
+    width = ffmpeg->ctx_codec->width;
+    height = ffmpeg->ctx_codec->height;
 
-    memcpy(ffmpeg->picture->data[0], image, ffmpeg->ctx_codec->width * ffmpeg->ctx_codec->height);
-    for (y = 0; y < ffmpeg->ctx_codec->height; y++) {
-        for (x = 0; x < ffmpeg->ctx_codec->width/4; x++) {
-            ffmpeg->picture->data[1][y*ffmpeg->ctx_codec->width/2 + x*2] = *imagecb;
-            ffmpeg->picture->data[1][y*ffmpeg->ctx_codec->width/2 + x*2 + 1] = *imagecr;
-            imagecb++;
-            imagecr++;
+    for (y = 0; y < height; y++) {
+        memcpy(ffmpeg->picture->data[0] + (y * ffmpeg->picture->linesize[0])
+            , view->plane[0] + (y * view->stride[0]), width);
+    }
+
+    for (y = 0; y < height / 2; y++) {
+        dest = ffmpeg->picture->data[1] + (y * ffmpeg->picture->linesize[1]);
+        imagecb = view->plane[2] + (y * view->stride[2]);
+        imagecr = view->plane[1] + (y * view->stride[1]);
+        for (x = 0; x < width / 2; x++) {
+            *dest++ = *imagecb++;
+            *dest++ = *imagecr++;
         }
     }
 
 }
 
 static void ffmpeg_put_pix_yuv420(struct ffmpeg *ffmpeg, struct image_data *img_data){
-    unsigned char *image;
+    struct image_view *view;
 
     if (ffmpeg->high_resolution){
-        image = img_data->image_high;
+        view = &img_data->view_high;
     } else {
-        image = img_data->image_norm;
+        view = &img_data->view_norm;
     }
 
-    // Usual setup for image pointers
-    ffmpeg->picture->data[0] = image;
-    ffmpeg->picture->data[1] = image + (ffmpeg->ctx_codec->width * ffmpeg->ctx_codec->height);
-    ffmpeg->picture->data[2] = ffmpeg->picture->data[1] + ((ffmpeg->ctx_codec->width * ffmpeg->ctx_codec->height) / 4);
+    /* The planes are handed to the encoder as they are located in the image */
+    ffmpeg->picture->data[0] = view->plane[0];
+    ffmpeg->picture->data[1] = view->plane[1];
+    ffmpeg->picture->data[2] = view->plane[2];
+    ffmpeg->picture->linesize[0] = view->stride[0];
+    ffmpeg->picture->linesize[1] = view->stride[1];
+    ffmpeg->picture->linesize[2] = view->stride[2];
 
 }
 
@@ -0,0 +1,107 @@
+/*
+ *    framepool.c
+ *
+ *    Slabs holding the image buffers of a camera.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    Rather than one allocation per image, a camera takes its image buffers
+ *    out of a few slabs: one for the images of the detection and the
+ *    preview, and one for the slots of the pre_capture ring.  Every buffer
+ *    starts on a cache line, which suits the vector kernels, and a large
+ *    ring can be backed by huge pages to save TLB misses.
+ */
+#include <sys/mman.h>
+#include "translate.h"
+#include "motion.h"
+#include "framepool.h"
+
+/* Size of a huge page of x86 and arm64, the slab is rounded up to it */
+#define FRAMEPOOL_HUGEPAGE  (2 * 1024 * 1024)
+
+size_t framepool_size(size_t size)
+{
+    return (size + FRAMEPOOL_ALIGN - 1) & ~(size_t)(FRAMEPOOL_ALIGN - 1);
+}
+
+/**
+ * framepool_map
+ *
+ *  Maps a slab for huge pages, NULL when neither kind of huge page can
+ *  be had.
+ */
+static unsigned char *framepool_map(size_t size)
+{
+    void *base;
+
+    #ifdef MAP_HUGETLB
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE
+            , MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) return base;
+    #endif
+
+    #ifdef MADV_HUGEPAGE
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base != MAP_FAILED) {
+            if (madvise(base, size, MADV_HUGEPAGE) == 0) return base;
+            munmap(base, size);
+        }
+    #else
+        (void)base;
+        (void)size;
+    #endif
+
+    return NULL;
+}
+
+void framepool_init(struct framepool *pool, size_t size, int hugepages)
+{
+    pool->base = NULL;
+    pool->used = 0;
+    pool->mapped = FALSE;
+
+    if (hugepages) {
+        pool->size = (size + FRAMEPOOL_HUGEPAGE - 1) & ~(size_t)(FRAMEPOOL_HUGEPAGE - 1);
+        pool->base = framepool_map(pool->size);
+        if (pool->base != NULL) {
+            pool->mapped = TRUE;
+            return;
+        }
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
+            ,_("No huge pages for %llu bytes of images, using normal pages")
+            ,(unsigned long long)pool->size);
+    }
+
+    pool->size = (size > 0) ? size : FRAMEPOOL_ALIGN;
+    pool->base = mymalloc_aligned(pool->size, FRAMEPOOL_ALIGN);
+}
+
+unsigned char *framepool_take(struct framepool *pool, size_t size)
+{
+    unsigned char *buffer;
+
+    size = framepool_size(size);
+    assert(pool->used + size <= pool->size);
+
+    buffer = pool->base + pool->used;
+    pool->used += size;
+
+    return buffer;
+}
+
+void framepool_deinit(struct framepool *pool)
+{
+    if (pool->base != NULL) {
+        if (pool->mapped) {
+            munmap(pool->base, pool->size);
+        } else {
+            free(pool->base);
+        }
+    }
+
+    pool->base = NULL;
+    pool->size = 0;
+    pool->used = 0;
+    pool->mapped = FALSE;
+}
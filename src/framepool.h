@@ -0,0 +1,80 @@
+/*
+ *    framepool.h
+ *
+ *    Include file for the slabs holding the image buffers of a camera.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_FRAMEPOOL_H
+#define _INCLUDE_FRAMEPOOL_H
+
+/* Start of every buffer taken from a pool, one cache line */
+#define FRAMEPOOL_ALIGN     64
+
+struct framepool {
+    unsigned char   *base;
+    size_t          size;           /* Bytes at base */
+    size_t          used;           /* Bytes handed out by framepool_take */
+    int             mapped;         /* base was mapped for huge pages */
+};
+
+/**
+ * framepool_size
+ *
+ *  Rounds the size of one buffer up so the next buffer taken after it
+ *  starts on FRAMEPOOL_ALIGN.
+ *
+ * Parameters:
+ *
+ *  size - bytes of the buffer
+ *
+ * Returns: bytes the buffer takes in the pool
+ */
+size_t framepool_size(size_t size);
+
+/**
+ * framepool_init
+ *
+ *  Allocates one zeroed slab of size bytes. With hugepages the slab is
+ *  mapped from the huge page pool of the kernel, or when that has no
+ *  pages left, asked to be backed by transparent huge pages.
+ *
+ * Parameters:
+ *
+ *  pool      - pool to set up
+ *  size      - bytes of the slab, the sum of framepool_size of the buffers
+ *  hugepages - TRUE to use huge pages
+ *
+ * Returns: nothing
+ */
+void framepool_init(struct framepool *pool, size_t size, int hugepages);
+
+/**
+ * framepool_take
+ *
+ *  Hands out the next buffer of the slab.
+ *
+ * Parameters:
+ *
+ *  pool - pool set up with framepool_init
+ *  size - bytes of the buffer
+ *
+ * Returns: the buffer, aligned to FRAMEPOOL_ALIGN
+ */
+unsigned char *framepool_take(struct framepool *pool, size_t size);
+
+/**
+ * framepool_deinit
+ *
+ *  Releases the slab and all buffers taken from it.
+ *
+ * Parameters:
+ *
+ *  pool - pool set up with framepool_init or zeroed
+ *
+ * Returns: nothing
+ */
+void framepool_deinit(struct framepool *pool);
+
+#endif
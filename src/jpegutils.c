@@ -547,7 +547,7 @@ int jpgutl_decode_jpeg (unsigned char *jpeg_data_in, int jpeg_data_len,
 }
 
 int jpgutl_put_yuv420p(unsigned char *dest_image, int image_size,
-                   unsigned char *input_image, int width, int height, int quality,
+                   struct image_view *view, int width, int height, int quality,
                    struct context *cnt, struct timeval *tv1, struct coord *box)
 
 {
@@ -613,10 +613,10 @@ int jpgutl_put_yuv420p(unsigned char *dest_image, int image_size,
     for (j = 0; j < height; j += 16) {
         for (i = 0; i < 16; i++) {
             if ((width * (i + j)) < (width * height)) {
-                y[i] = input_image + width * (i + j);
+                y[i] = view->plane[0] + view->stride[0] * (i + j);
                 if (i % 2 == 0) {
-                    cb[i / 2] = input_image + width * height + width / 2 * ((i + j) /2);
-                    cr[i / 2] = input_image + width * height + width * height / 4 + width / 2 * ((i + j) / 2);
+                    cb[i / 2] = view->plane[1] + view->stride[1] * ((i + j) / 2);
+                    cr[i / 2] = view->plane[2] + view->stride[2] * ((i + j) / 2);
                 }
             } else {
                 y[i] = 0x00;
@@ -636,7 +636,7 @@ int jpgutl_put_yuv420p(unsigned char *dest_image, int image_size,
 
 
 int jpgutl_put_grey(unsigned char *dest_image, int image_size,
-                   unsigned char *input_image, int width, int height, int quality,
+                   struct image_view *view, int width, int height, int quality,
                    struct context *cnt, struct timeval *tv1, struct coord *box)
 {
     int y, dest_image_size;
@@ -675,11 +675,11 @@ int jpgutl_put_grey(unsigned char *dest_image, int image_size,
 
     put_jpeg_exif(&cjpeg, cnt, tv1, box);
 
-    row_ptr[0] = input_image;
+    row_ptr[0] = view->plane[0];
 
     for (y = 0; y < height; y++) {
         jpeg_write_scanlines(&cjpeg, row_ptr, 1);
-        row_ptr[0] += width;
+        row_ptr[0] += view->stride[0];
     }
 
     jpeg_finish_compress(&cjpeg);
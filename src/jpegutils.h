@@ -14,7 +14,7 @@
 int jpgutl_decode_jpeg (unsigned char *jpeg_data_in, int jpeg_data_len,
                      unsigned int width, unsigned int height, unsigned char *volatile img_out);
 
-int jpgutl_put_yuv420p(unsigned char *, int image, unsigned char *, int, int, int, struct context *, struct timeval *, struct coord *);
-int jpgutl_put_grey(unsigned char *, int image, unsigned char *, int, int, int, struct context *, struct timeval *, struct coord *);
+int jpgutl_put_yuv420p(unsigned char *, int image, struct image_view *, int, int, int, struct context *, struct timeval *, struct coord *);
+int jpgutl_put_grey(unsigned char *, int image, struct image_view *, int, int, int, struct context *, struct timeval *, struct coord *);
 
 #endif
@@ -0,0 +1,15 @@
+/*    main.c
+ *
+ *    Entry point of Motion, the work is done by motion_run in motion.c.
+ *    The benchmark (bench.c) links the same objects without this one.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ */
+#include "translate.h"
+#include "motion.h"
+
+int main (int argc, char **argv)
+{
+    return motion_run(argc, argv);
+}
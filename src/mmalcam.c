@@ -395,15 +395,15 @@ int mmalcam_next(struct context *cnt,  struct image_data *img_data)
     MMAL_BUFFER_HEADER_T *camera_buffer = mmal_queue_wait(mmalcam->camera_buffer_queue);
 
     if (camera_buffer->cmd == 0 && (camera_buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
-            && camera_buffer->length >= cnt->imgs.size_norm) {
+            && camera_buffer->length >= cnt->crop_data.capture_size_norm) {
         mmal_buffer_header_mem_lock(camera_buffer);
-        memcpy(img_data->image_norm, camera_buffer->data, cnt->imgs.size_norm);
+        memcpy(img_data->image_norm, camera_buffer->data, cnt->crop_data.capture_size_norm);
         mmal_buffer_header_mem_unlock(camera_buffer);
     } else {
         MOTION_LOG(ERR, TYPE_VIDEO, NO_ERRNO
             ,_("cmd %d flags %08x size %d/%d at %08x, img_size=%d")
             ,camera_buffer->cmd, camera_buffer->flags, camera_buffer->length
-            ,camera_buffer->alloc_size, camera_buffer->data, cnt->imgs.size_norm);
+            ,camera_buffer->alloc_size, camera_buffer->data, cnt->crop_data.capture_size_norm);
     }
 
     mmal_buffer_header_release(camera_buffer);
@@ -14,10 +14,15 @@
 #include "video_loopback.h"
 #include "conf.h"
 #include "alg.h"
+#include "alg_simd.h"
+#include "workpool.h"
+#include "pipeline.h"
+#include "scheduler.h"
 #include "track.h"
 #include "event.h"
 #include "picture.h"
 #include "rotate.h"
+#include "crop.h"
 #include "webu.h"
 
 
@@ -70,11 +75,246 @@ FILE *ptr_logfile = NULL;
 unsigned int restart = 0;
 
 
+/**
+ * image_preview_copy
+ *
+ * Copies the pixels of the ring slot image_save_as_preview chose into the
+ * preview buffer. This is put off until the slot is about to change or the
+ * preview is written, so the preview is copied once per event instead of
+ * every time a better image turns up.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *
+ * Returns:     nothing
+ */
+static void image_preview_copy(struct context *cnt)
+{
+    struct image_data *img = cnt->imgs.preview_shared;
+
+    if (img == NULL) return;
+    cnt->imgs.preview_shared = NULL;
+
+    /* Copy the actual images for norm and high */
+    pic_view_copy(cnt->imgs.preview_image.image_norm, &img->view_norm, cnt->imgs.width, cnt->imgs.height);
+    if (cnt->imgs.size_high > 0){
+        pic_view_copy(cnt->imgs.preview_image.image_high, &img->view_high
+            , cnt->imgs.width_high, cnt->imgs.height_high);
+    }
+
+    /* draw locate box here when mode = LOCATE_PREVIEW */
+    if (cnt->locate_motion_mode == LOCATE_PREVIEW) {
+
+        if (cnt->locate_motion_style == LOCATE_BOX) {
+            alg_draw_location(&cnt->imgs.preview_image.location, &cnt->imgs, &cnt->imgs.preview_image.view_norm,
+                              LOCATE_BOX, LOCATE_NORMAL, cnt->process_thisframe);
+        } else if (cnt->locate_motion_style == LOCATE_REDBOX) {
+            alg_draw_red_location(&cnt->imgs.preview_image.location, &cnt->imgs, &cnt->imgs.preview_image.view_norm,
+                                  LOCATE_REDBOX, LOCATE_NORMAL, cnt->process_thisframe);
+        } else if (cnt->locate_motion_style == LOCATE_CROSS) {
+            alg_draw_location(&cnt->imgs.preview_image.location, &cnt->imgs, &cnt->imgs.preview_image.view_norm,
+                              LOCATE_CROSS, LOCATE_NORMAL, cnt->process_thisframe);
+        } else if (cnt->locate_motion_style == LOCATE_REDCROSS) {
+            alg_draw_red_location(&cnt->imgs.preview_image.location, &cnt->imgs, &cnt->imgs.preview_image.view_norm,
+                                  LOCATE_REDCROSS, LOCATE_NORMAL, cnt->process_thisframe);
+        }
+    }
+}
+
+/**
+ * image_ring_clear
+ *
+ * Resets a slot of the ring to a grey image without any meta data.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *      img      Slot of the ring
+ *
+ * Returns:     nothing
+ */
+static void image_ring_clear(struct context *cnt, struct image_data *img)
+{
+    unsigned char *image_norm = img->image_norm;
+    unsigned char *image_high = img->image_high;
+
+    memset(img, 0, sizeof(struct image_data));
+    img->image_norm = image_norm;
+    img->image_high = image_high;
+
+    /* A slot without a raw image takes one when the capture comes round to it */
+    if (img->image_norm == NULL) return;
+
+    /* The capture writes the image before the crop into the ring */
+    memset(img->image_norm, 0x80, cnt->crop_data.capture_size_norm);  /* initialize to grey */
+    pic_view_init(&img->view_norm, img->image_norm, cnt->imgs.width, cnt->imgs.height);
+    if (cnt->imgs.size_high > 0){
+        memset(img->image_high, 0x80, cnt->crop_data.capture_size_high);
+        pic_view_init(&img->view_high, img->image_high, cnt->imgs.width_high, cnt->imgs.height_high);
+    }
+}
+
+/**
+ * image_view_move
+ *
+ * Points the planes of a view at the same places in a copy of its image.
+ *
+ * Parameters:
+ *
+ *      view     View of the image at from
+ *      from     Old image
+ *      to       Copy of the image
+ *
+ * Returns:     nothing
+ */
+static void image_view_move(struct image_view *view, unsigned char *from, unsigned char *to)
+{
+    int indx;
+
+    for (indx = 0; indx < 3; indx++)
+        view->plane[indx] = to + (view->plane[indx] - from);
+}
+
+/**
+ * image_ring_grow
+ *
+ * Takes the slots of the ring out of a new ring_pool with room for more slots
+ * than ever before. The slots in use keep their images. Only the first raw
+ * slots get images, the others take theirs in turn from image_ring_take_raw.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *      slots    Number of slots of the new pool
+ *      keep     Number of slots whose images are copied over
+ *      raw      Number of slots with images, at least keep
+ *
+ * Returns:     nothing
+ */
+static void image_ring_grow(struct context *cnt, int slots, int keep, int raw)
+{
+    struct image_data *ring;
+    struct framepool pool;
+    size_t size;
+    int indx;
+
+    size = framepool_size(cnt->crop_data.capture_size_norm);
+    if (cnt->imgs.size_high > 0)
+        size += framepool_size(cnt->crop_data.capture_size_high);
+    framepool_init(&pool, raw * size, cnt->conf.frame_pool_hugepages);
+
+    ring = mymalloc(slots * sizeof(struct image_data));
+    for (indx = 0; indx < raw; indx++) {
+        ring[indx].image_norm = framepool_take(&pool, cnt->crop_data.capture_size_norm);
+        if (cnt->imgs.size_high > 0)
+            ring[indx].image_high = framepool_take(&pool, cnt->crop_data.capture_size_high);
+    }
+
+    for (indx = 0; indx < keep; indx++) {
+        struct image_data *old = &cnt->imgs.image_ring[indx];
+        struct image_data *img = &ring[indx];
+        unsigned char *image_norm = img->image_norm;
+        unsigned char *image_high = img->image_high;
+
+        memcpy(img, old, sizeof(struct image_data));
+        img->image_norm = image_norm;
+        img->image_high = image_high;
+        memcpy(img->image_norm, old->image_norm, cnt->crop_data.capture_size_norm);
+        image_view_move(&img->view_norm, old->image_norm, img->image_norm);
+        if (cnt->imgs.size_high > 0){
+            memcpy(img->image_high, old->image_high, cnt->crop_data.capture_size_high);
+            image_view_move(&img->view_high, old->image_high, img->image_high);
+        }
+    }
+
+    free(cnt->imgs.image_ring);
+    framepool_deinit(&cnt->imgs.ring_pool);
+
+    cnt->imgs.image_ring = ring;
+    cnt->imgs.ring_pool = pool;
+    cnt->imgs.image_ring_slots = slots;
+    cnt->imgs.image_ring_raw = raw;
+}
+
+/**
+ * image_ring_raw_size
+ *
+ * Number of slots of a ring of the given size that hold a raw image.
+ * With movie_passthrough the movie is written from the packets of the camera
+ * and only needs the ids of the frames, so pre_capture_raw limits the raw
+ * images to the newest frames. The other slots keep their meta data only.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *      size     Number of slots of the ring
+ *
+ * Returns:     Number of slots with raw images
+ */
+static int image_ring_raw_size(struct context *cnt, int size)
+{
+    /* The external pipe encodes the raw images */
+    if ((cnt->conf.pre_capture_raw <= 0) || !cnt->movie_passthrough ||
+        cnt->conf.movie_extpipe_use)
+        return size;
+
+    if (cnt->conf.pre_capture_raw < size)
+        return cnt->conf.pre_capture_raw;
+
+    return size;
+}
+
+/**
+ * image_ring_take_raw
+ *
+ * Moves the raw image of the oldest slot still holding one into the current
+ * slot before the capture writes into it. A picture not yet saved from the
+ * old slot is lost, its frame still goes into the movie.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *
+ * Returns:     nothing
+ */
+static void image_ring_take_raw(struct context *cnt)
+{
+    struct image_data *img = cnt->current_image;
+    struct image_data *from;
+    int indx;
+
+    indx = cnt->imgs.image_ring_in;
+    do {
+        if (++indx >= cnt->imgs.image_ring_size)
+            indx = 0;
+        from = &cnt->imgs.image_ring[indx];
+    } while (from->image_norm == NULL);
+
+    if (cnt->imgs.preview_shared == from)
+        image_preview_copy(cnt);
+
+    img->image_norm = from->image_norm;
+    img->image_high = from->image_high;
+    from->image_norm = NULL;
+    from->image_high = NULL;
+    memset(&from->view_norm, 0, sizeof(struct image_view));
+    memset(&from->view_high, 0, sizeof(struct image_view));
+
+    pic_view_init(&img->view_norm, img->image_norm, cnt->imgs.width, cnt->imgs.height);
+    if (cnt->imgs.size_high > 0)
+        pic_view_init(&img->view_high, img->image_high, cnt->imgs.width_high, cnt->imgs.height_high);
+}
+
 /**
  * image_ring_resize
  *
  * This routine is called from motion_loop to resize the image precapture ringbuffer
  * NOTE: This function clears all images in the old ring buffer
+ * The images of the slots come from ring_pool, which only grows. A smaller
+ * ring leaves the slots at the end unused and growing again within the pool
+ * takes no memory. When not all slots hold a raw image the ring is set up
+ * anew on every resize.
 
  * Parameters:
  *
@@ -91,9 +331,11 @@ static void image_ring_resize(struct context *cnt, int new_size)
      * decreasing at last position in new buffer
      * increasing at last position in old buffer
      * e.g. at end of smallest buffer
+     * A destroyed ring is always set up again, also within an event,
+     * since the capture needs a slot to write into.
      */
-    if (cnt->event_nr != cnt->prev_event) {
-        int smallest;
+    if ((cnt->event_nr != cnt->prev_event) || (cnt->imgs.image_ring == NULL)) {
+        int smallest, raw, i;
 
         if (new_size < cnt->imgs.image_ring_size)  /* Decreasing */
             smallest = new_size;
@@ -104,36 +346,22 @@ static void image_ring_resize(struct context *cnt, int new_size)
             MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
                 ,_("Resizing pre_capture buffer to %d items"), new_size);
 
-            /* Create memory for new ring buffer */
-            struct image_data *tmp;
-            tmp = mymalloc(new_size * sizeof(struct image_data));
+            /* The preview can not keep pointing into the old ring */
+            image_preview_copy(cnt);
 
-            /*
-             * Copy all information from old to new
-             * Smallest is 0 at initial init
-             */
-            if (smallest > 0)
-                memcpy(tmp, cnt->imgs.image_ring, sizeof(struct image_data) * smallest);
-
-
-            /* In the new buffers, allocate image memory */
-            {
-                int i;
-                for(i = smallest; i < new_size; i++) {
-                    tmp[i].image_norm = mymalloc(cnt->imgs.size_norm);
-                    memset(tmp[i].image_norm, 0x80, cnt->imgs.size_norm);  /* initialize to grey */
-                    if (cnt->imgs.size_high > 0){
-                        tmp[i].image_high = mymalloc(cnt->imgs.size_high);
-                        memset(tmp[i].image_high, 0x80, cnt->imgs.size_high);
-                    }
-                }
+            raw = image_ring_raw_size(cnt, new_size);
+            if ((raw < new_size) ||
+                (cnt->imgs.image_ring_raw < cnt->imgs.image_ring_slots)) {
+                image_ring_grow(cnt, new_size, 0, raw);
+                smallest = 0;
+            } else if (new_size > cnt->imgs.image_ring_slots) {
+                image_ring_grow(cnt, new_size, smallest, new_size);
             }
 
-            /* Free the old ring */
-            free(cnt->imgs.image_ring);
+            /* The slots coming into use start out grey */
+            for (i = smallest; i < new_size; i++)
+                image_ring_clear(cnt, &cnt->imgs.image_ring[i]);
 
-            /* Point to the new ring */
-            cnt->imgs.image_ring = tmp;
             cnt->current_image = NULL;
 
             cnt->imgs.image_ring_size = new_size;
@@ -157,30 +385,172 @@ static void image_ring_resize(struct context *cnt, int new_size)
  */
 static void image_ring_destroy(struct context *cnt)
 {
-    int i;
-
     /* Exit if don't have any ring */
     if (cnt->imgs.image_ring == NULL)
         return;
 
-    /* Free all image buffers */
-    for (i = 0; i < cnt->imgs.image_ring_size; i++){
-        free(cnt->imgs.image_ring[i].image_norm);
-        if (cnt->imgs.size_high >0 ) free(cnt->imgs.image_ring[i].image_high);
-    }
+    /* The preview buffers may be gone already, the pixels are not needed any more */
+    cnt->imgs.preview_shared = NULL;
 
-    /* Free the ring */
+    /* Free the ring and the images of its slots */
     free(cnt->imgs.image_ring);
+    framepool_deinit(&cnt->imgs.ring_pool);
 
     cnt->imgs.image_ring = NULL;
     cnt->current_image = NULL;
     cnt->imgs.image_ring_size = 0;
+    cnt->imgs.image_ring_slots = 0;
+    cnt->imgs.image_ring_raw = 0;
+}
+
+/**
+ * image_buffers_init
+ *
+ * This routine allocates the image buffers used for the detection at the
+ * image dimensions after the rotation and the crop.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *
+ * Returns:     nothing
+ */
+static void image_buffers_init(struct context *cnt)
+{
+    int detect_size;
+    size_t size;
+
+    /* The images share one slab, the virgin image receives the first capture */
+    size = framepool_size(cnt->crop_data.capture_size_norm) + 3 * framepool_size(cnt->imgs.size_norm);
+    if (cnt->imgs.size_high > 0)
+        size += framepool_size(cnt->crop_data.capture_size_high) + framepool_size(cnt->imgs.size_high);
+    framepool_init(&cnt->imgs.image_pool, size, cnt->conf.frame_pool_hugepages);
+
+    cnt->imgs.image_virgin.image_norm = framepool_take(&cnt->imgs.image_pool, cnt->crop_data.capture_size_norm);
+    cnt->imgs.image_vprvcy.image_norm = framepool_take(&cnt->imgs.image_pool, cnt->imgs.size_norm);
+
+    /* The detection buffers have the size of the detection set up by alg_state_init */
+    alg_state_init(cnt);
+    detect_size = cnt->imgs.detect_width * cnt->imgs.detect_height;
+    cnt->imgs.img_motion.image_norm = framepool_take(&cnt->imgs.image_pool, cnt->imgs.size_norm);
+    cnt->imgs.motion_stride = (cnt->imgs.detect_width + 63) / 64;
+    cnt->imgs.motion_bits = mymalloc(cnt->imgs.motion_stride * cnt->imgs.detect_height * sizeof(uint64_t));
+    cnt->imgs.motion_rows = mymalloc(cnt->imgs.detect_height * sizeof(*cnt->imgs.motion_rows));
+    cnt->imgs.motion_cols = mymalloc(cnt->imgs.detect_width * sizeof(*cnt->imgs.motion_cols));
+    cnt->imgs.motion_counts = FALSE;
+    cnt->imgs.ref_fused = FALSE;
+
+    cnt->imgs.smartmask_final = mymalloc(detect_size);
+    cnt->imgs.labels = mymalloc(detect_size * sizeof(*cnt->imgs.labels));
+    /* 4 connectivity gives at most one provisional label per two pixels */
+    cnt->imgs.label_parent = mymalloc((detect_size/2+2) * sizeof(*cnt->imgs.label_parent));
+    cnt->imgs.preview_image.image_norm = framepool_take(&cnt->imgs.image_pool, cnt->imgs.size_norm);
+    cnt->imgs.common_buffer = mymalloc(3 * cnt->imgs.width * cnt->imgs.height);
+    if (cnt->imgs.size_high > 0){
+        cnt->imgs.image_virgin.image_high = framepool_take(&cnt->imgs.image_pool
+            , cnt->crop_data.capture_size_high);
+        cnt->imgs.preview_image.image_high = framepool_take(&cnt->imgs.image_pool, cnt->imgs.size_high);
+        pic_view_init(&cnt->imgs.image_virgin.view_high, cnt->imgs.image_virgin.image_high
+            , cnt->imgs.width_high, cnt->imgs.height_high);
+        pic_view_init(&cnt->imgs.preview_image.view_high, cnt->imgs.preview_image.image_high
+            , cnt->imgs.width_high, cnt->imgs.height_high);
+    }
+
+    /* These images are always stored packed */
+    pic_view_init(&cnt->imgs.img_motion.view_norm, cnt->imgs.img_motion.image_norm
+        , cnt->imgs.width, cnt->imgs.height);
+    pic_view_init(&cnt->imgs.image_virgin.view_norm, cnt->imgs.image_virgin.image_norm
+        , cnt->imgs.width, cnt->imgs.height);
+    pic_view_init(&cnt->imgs.image_vprvcy.view_norm, cnt->imgs.image_vprvcy.image_norm
+        , cnt->imgs.width, cnt->imgs.height);
+    pic_view_init(&cnt->imgs.preview_image.view_norm, cnt->imgs.preview_image.image_norm
+        , cnt->imgs.width, cnt->imgs.height);
+
+    /* Always initialize smart_mask - someone could turn it on later... */
+    alg_smartmask_reset(cnt);
+}
+
+/**
+ * image_buffers_deinit
+ *
+ * This routine frees the image buffers allocated by image_buffers_init and
+ * the masks.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *
+ * Returns:     nothing
+ */
+static void image_buffers_deinit(struct context *cnt)
+{
+    cnt->imgs.image_source = NULL;
+    cnt->imgs.preview_shared = NULL;
+
+    /* The images are all in image_pool */
+    framepool_deinit(&cnt->imgs.image_pool);
+    cnt->imgs.img_motion.image_norm = NULL;
+    cnt->imgs.image_virgin.image_norm = NULL;
+    cnt->imgs.image_virgin.image_high = NULL;
+    cnt->imgs.image_vprvcy.image_norm = NULL;
+    cnt->imgs.preview_image.image_norm = NULL;
+    cnt->imgs.preview_image.image_high = NULL;
+
+    free(cnt->imgs.motion_bits);
+    cnt->imgs.motion_bits = NULL;
+
+    free(cnt->imgs.motion_rows);
+    cnt->imgs.motion_rows = NULL;
+
+    free(cnt->imgs.motion_cols);
+    cnt->imgs.motion_cols = NULL;
+
+    alg_state_deinit(cnt);
+
+    free(cnt->imgs.labels);
+    cnt->imgs.labels = NULL;
+
+    free(cnt->imgs.label_parent);
+    cnt->imgs.label_parent = NULL;
+
+    free(cnt->imgs.label_stats);
+    cnt->imgs.label_stats = NULL;
+    cnt->imgs.label_stats_size = 0;
+
+    free(cnt->imgs.label_runs);
+    cnt->imgs.label_runs = NULL;
+    cnt->imgs.label_runs_size = 0;
+    cnt->imgs.labels_total = 0;
+    cnt->imgs.labelsize_max = 0;
+
+    free(cnt->imgs.smartmask_final);
+    cnt->imgs.smartmask_final = NULL;
+
+    if (cnt->imgs.mask) free(cnt->imgs.mask);
+    cnt->imgs.mask = NULL;
+
+    if (cnt->imgs.mask_privacy) free(cnt->imgs.mask_privacy);
+    cnt->imgs.mask_privacy = NULL;
+
+    if (cnt->imgs.mask_privacy_uv) free(cnt->imgs.mask_privacy_uv);
+    cnt->imgs.mask_privacy_uv = NULL;
+
+    if (cnt->imgs.mask_privacy_high) free(cnt->imgs.mask_privacy_high);
+    cnt->imgs.mask_privacy_high = NULL;
+
+    if (cnt->imgs.mask_privacy_high_uv) free(cnt->imgs.mask_privacy_high_uv);
+    cnt->imgs.mask_privacy_high_uv = NULL;
+
+    free(cnt->imgs.common_buffer);
+    cnt->imgs.common_buffer = NULL;
 }
 
 /**
  * image_save_as_preview
  *
- * This routine is called when we detect motion and want to save an image in the preview buffer
+ * This routine is called when we detect motion and want to save an image in the preview buffer.
+ * Only the meta data is taken here, the preview shares the pixels of the ring slot until
+ * image_preview_copy copies them.
  *
  * Parameters:
  *
@@ -203,11 +573,10 @@ static void image_save_as_preview(struct context *cnt, struct image_data *img)
     /* Restore the pointers to the memory locations for images*/
     cnt->imgs.preview_image.image_norm = image_norm;
     cnt->imgs.preview_image.image_high = image_high;
-
-    /* Copy the actual images for norm and high */
-    memcpy(cnt->imgs.preview_image.image_norm, img->image_norm, cnt->imgs.size_norm);
+    pic_view_init(&cnt->imgs.preview_image.view_norm, image_norm, cnt->imgs.width, cnt->imgs.height);
     if (cnt->imgs.size_high > 0){
-        memcpy(cnt->imgs.preview_image.image_high, img->image_high, cnt->imgs.size_high);
+        pic_view_init(&cnt->imgs.preview_image.view_high, image_high
+            , cnt->imgs.width_high, cnt->imgs.height_high);
     }
 
     /*
@@ -217,23 +586,11 @@ static void image_save_as_preview(struct context *cnt, struct image_data *img)
     if (cnt->imgs.preview_image.diffs == 0)
         cnt->imgs.preview_image.diffs = 1;
 
-    /* draw locate box here when mode = LOCATE_PREVIEW */
-    if (cnt->locate_motion_mode == LOCATE_PREVIEW) {
+    cnt->imgs.preview_shared = img;
 
-        if (cnt->locate_motion_style == LOCATE_BOX) {
-            alg_draw_location(&img->location, &cnt->imgs, cnt->imgs.width, cnt->imgs.preview_image.image_norm,
-                              LOCATE_BOX, LOCATE_NORMAL, cnt->process_thisframe);
-        } else if (cnt->locate_motion_style == LOCATE_REDBOX) {
-            alg_draw_red_location(&img->location, &cnt->imgs, cnt->imgs.width, cnt->imgs.preview_image.image_norm,
-                                  LOCATE_REDBOX, LOCATE_NORMAL, cnt->process_thisframe);
-        } else if (cnt->locate_motion_style == LOCATE_CROSS) {
-            alg_draw_location(&img->location, &cnt->imgs, cnt->imgs.width, cnt->imgs.preview_image.image_norm,
-                              LOCATE_CROSS, LOCATE_NORMAL, cnt->process_thisframe);
-        } else if (cnt->locate_motion_style == LOCATE_REDCROSS) {
-            alg_draw_red_location(&img->location, &cnt->imgs, cnt->imgs.width, cnt->imgs.preview_image.image_norm,
-                                  LOCATE_REDCROSS, LOCATE_NORMAL, cnt->process_thisframe);
-        }
-    }
+    /* Only the ring slots are kept until the preview is written */
+    if ((img < cnt->imgs.image_ring) || (img >= cnt->imgs.image_ring + cnt->imgs.image_ring_size))
+        image_preview_copy(cnt);
 }
 
 /**
@@ -492,16 +849,16 @@ static void motion_detected(struct context *cnt, int dev, struct image_data *img
     if (cnt->locate_motion_mode == LOCATE_ON) {
 
         if (cnt->locate_motion_style == LOCATE_BOX) {
-            alg_draw_location(location, imgs, imgs->width, img->image_norm, LOCATE_BOX,
+            alg_draw_location(location, imgs, &img->view_norm, LOCATE_BOX,
                               LOCATE_BOTH, cnt->process_thisframe);
         } else if (cnt->locate_motion_style == LOCATE_REDBOX) {
-            alg_draw_red_location(location, imgs, imgs->width, img->image_norm, LOCATE_REDBOX,
+            alg_draw_red_location(location, imgs, &img->view_norm, LOCATE_REDBOX,
                                   LOCATE_BOTH, cnt->process_thisframe);
         } else if (cnt->locate_motion_style == LOCATE_CROSS) {
-            alg_draw_location(location, imgs, imgs->width, img->image_norm, LOCATE_CROSS,
+            alg_draw_location(location, imgs, &img->view_norm, LOCATE_CROSS,
                               LOCATE_BOTH, cnt->process_thisframe);
         } else if (cnt->locate_motion_style == LOCATE_REDCROSS) {
-            alg_draw_red_location(location, imgs, imgs->width, img->image_norm, LOCATE_REDCROSS,
+            alg_draw_red_location(location, imgs, &img->view_norm, LOCATE_REDCROSS,
                                   LOCATE_BOTH, cnt->process_thisframe);
         }
     }
@@ -616,8 +973,12 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
         /* Set inte global context that we are working with this image */
         cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_out];
 
+        /* The debug texts below are drawn into the slot but not into the preview */
+        if ((cnt->log_level >= DBG) && (cnt->imgs.preview_shared == cnt->current_image))
+            image_preview_copy(cnt);
+
         if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot < cnt->conf.framerate) {
-            if (cnt->log_level >= DBG) {
+            if ((cnt->log_level >= DBG) && (cnt->current_image->image_norm != NULL)) {
                 char tmp[32];
                 const char *t;
 
@@ -634,14 +995,14 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
 
                 mystrftime(cnt, tmp, sizeof(tmp), "%H%M%S-%q",
                            &cnt->imgs.image_ring[cnt->imgs.image_ring_out].timestamp_tv, NULL, 0);
-                draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image_norm,
+                draw_text_view(&cnt->imgs.image_ring[cnt->imgs.image_ring_out].view_norm,
                           cnt->imgs.width, cnt->imgs.height, 10, 20, tmp, cnt->text_scale);
-                draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image_norm,
+                draw_text_view(&cnt->imgs.image_ring[cnt->imgs.image_ring_out].view_norm,
                           cnt->imgs.width, cnt->imgs.height, 10, 30, t, cnt->text_scale);
             }
 
-            /* Output the picture to jpegs and ffmpeg */
-            event(cnt, EVENT_IMAGE_DETECTED,
+            /* Output the picture to jpegs and ffmpeg, without a raw image only to the movie */
+            event(cnt, (cnt->current_image->image_norm != NULL) ? EVENT_IMAGE_DETECTED : EVENT_FFMPEG_PUT,
               &cnt->imgs.image_ring[cnt->imgs.image_ring_out], NULL, NULL,
               &cnt->imgs.image_ring[cnt->imgs.image_ring_out].timestamp_tv);
 
@@ -669,8 +1030,9 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
                             MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO
                             ,_("Added %d fillerframes into movie"), frames);
                             sprintf(tmp, "Fillerframes %d", frames);
-                            draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image_norm,
-                                      cnt->imgs.width, cnt->imgs.height, 10, 40, tmp, cnt->text_scale);
+                            if (cnt->current_image->image_norm != NULL)
+                                draw_text_view(&cnt->imgs.image_ring[cnt->imgs.image_ring_out].view_norm,
+                                          cnt->imgs.width, cnt->imgs.height, 10, 40, tmp, cnt->text_scale);
                         }
                     }
                     /* Check how many frames it was last sec */
@@ -701,7 +1063,8 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
         cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags |= IMAGE_SAVED;
 
         /* Store it as a preview image, only if it has motion */
-        if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags & IMAGE_MOTION) {
+        if ((cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags & IMAGE_MOTION) &&
+            (cnt->current_image->image_norm != NULL)) {
             /* Check for most significant preview-shot when picture_output=best */
             if (cnt->new_img & NEWIMG_BEST) {
                 if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].diffs > cnt->imgs.preview_image.diffs) {
@@ -720,7 +1083,8 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
         if (++cnt->imgs.image_ring_out >= cnt->imgs.image_ring_size)
             cnt->imgs.image_ring_out = 0;
 
-        if (max_images != IMAGE_BUFFER_FLUSH) {
+        /* Frames without a raw image only hand packets to the movie and are not counted */
+        if ((max_images != IMAGE_BUFFER_FLUSH) && (cnt->current_image->image_norm != NULL)) {
             max_images--;
             /* breakout if we have done max_images */
             if (max_images == 0)
@@ -738,6 +1102,11 @@ static int init_camera_type(struct context *cnt){
 
     cnt->camera_type = CAMERA_TYPE_UNKNOWN;
 
+    if (cnt->conf.crop_source > 0) {
+        cnt->camera_type = CAMERA_TYPE_CROP;
+        return 0;
+    }
+
     #ifdef HAVE_MMAL
         if (cnt->conf.mmalcam_name) {
             cnt->camera_type = CAMERA_TYPE_MMAL;
@@ -779,6 +1148,46 @@ static int init_camera_type(struct context *cnt){
 
 }
 
+static void init_mask(struct context *cnt){
+
+    FILE *picture;
+
+    /* Load the mask file if any */
+    if (cnt->conf.mask_file) {
+        if ((picture = myfopen(cnt->conf.mask_file, "r"))) {
+            /*
+             * NOTE: The mask is expected to have the output dimensions. I.e., the mask
+             * applies to the already rotated image, not the capture image. Thus, use
+             * width and height from imgs.
+             */
+            cnt->imgs.mask = get_pgm(picture, cnt->imgs.width, cnt->imgs.height);
+            myfclose(picture);
+        } else {
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
+                ,_("Error opening mask file %s")
+                ,cnt->conf.mask_file);
+            /*
+             * Try to write an empty mask file to make it easier
+             * for the user to edit it
+             */
+            put_fixed_mask(cnt, cnt->conf.mask_file);
+        }
+
+        if (!cnt->imgs.mask) {
+            MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO
+                ,_("Failed to read mask image. Mask feature disabled."));
+        } else {
+            MOTION_LOG(INF, TYPE_ALL, NO_ERRNO
+                ,_("Maskfile \"%s\" loaded.")
+                ,cnt->conf.mask_file);
+        }
+    } else {
+        cnt->imgs.mask = NULL;
+    }
+
+    alg_state_mask(cnt);
+}
+
 static void init_mask_privacy(struct context *cnt){
 
     int indxrow, indxcol;
@@ -939,14 +1348,12 @@ static void mot_stream_init(struct context *cnt){
 
 }
 
-static void mot_stream_deinit(struct context *cnt){
+static void mot_stream_free(struct context *cnt){
 
     /* Need to check whether buffers were allocated since init
      * function defers the allocations to event_stream_put
     */
 
-    pthread_mutex_destroy(&cnt->mutex_stream);
-
     if (cnt->imgs.substream_image != NULL){
         free(cnt->imgs.substream_image);
         cnt->imgs.substream_image = NULL;
@@ -973,6 +1380,14 @@ static void mot_stream_deinit(struct context *cnt){
     }
 }
 
+static void mot_stream_deinit(struct context *cnt){
+
+    pthread_mutex_destroy(&cnt->mutex_stream);
+
+    mot_stream_free(cnt);
+
+}
+
 /* TODO: dbse functions are to be moved to separate module in future change*/
 static void dbse_global_deinit(void){
     MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, _("Closing MYSQL"));
@@ -1218,7 +1633,6 @@ static void dbse_sqlmask_update(struct context *cnt){
  */
 static int motion_init(struct context *cnt)
 {
-    FILE *picture;
     int indx, retcd;
 
     util_threadname_set("ml",cnt->threadnr,cnt->conf.camera_name);
@@ -1353,26 +1767,27 @@ static int motion_init(struct context *cnt)
      */
     cnt->imgs.size_high = (cnt->imgs.width_high * cnt->imgs.height_high * 3) / 2;
 
+    /*
+     * Now is a good time to init rotation data. Since vid_start has been
+     * called, we know that we have imgs.width and imgs.height. When capturing
+     * from a V4L device, these are copied from the corresponding conf values
+     * in vid_start. When capturing from a netcam, they get set in netcam_start,
+     * which is called from vid_start.
+     *
+     * rotate_init will set cap_width and cap_height in cnt->rotate_data.
+     */
+    rotate_init(cnt); /* rotate_deinit is called in main */
+
+    /*
+     * The crop is applied to the rotated image.  crop_init reduces the
+     * image dimensions in imgs so all the buffers for detection below are
+     * allocated at the size after the crop.
+     */
+    crop_init(cnt); /* crop_deinit is called in main */
+
     image_ring_resize(cnt, 1); /* Create a initial precapture ring buffer with 1 frame */
 
-    cnt->imgs.ref = mymalloc(cnt->imgs.size_norm);
-    cnt->imgs.img_motion.image_norm = mymalloc(cnt->imgs.size_norm);
-
-    /* contains the moving objects of ref. frame */
-    cnt->imgs.ref_dyn = mymalloc(cnt->imgs.motionsize * sizeof(*cnt->imgs.ref_dyn));
-    cnt->imgs.image_virgin.image_norm = mymalloc(cnt->imgs.size_norm);
-    cnt->imgs.image_vprvcy.image_norm = mymalloc(cnt->imgs.size_norm);
-    cnt->imgs.smartmask = mymalloc(cnt->imgs.motionsize);
-    cnt->imgs.smartmask_final = mymalloc(cnt->imgs.motionsize);
-    cnt->imgs.smartmask_buffer = mymalloc(cnt->imgs.motionsize * sizeof(*cnt->imgs.smartmask_buffer));
-    cnt->imgs.labels = mymalloc(cnt->imgs.motionsize * sizeof(*cnt->imgs.labels));
-    cnt->imgs.labelsize = mymalloc((cnt->imgs.motionsize/2+1) * sizeof(*cnt->imgs.labelsize));
-    cnt->imgs.preview_image.image_norm = mymalloc(cnt->imgs.size_norm);
-    cnt->imgs.common_buffer = mymalloc(3 * cnt->imgs.width * cnt->imgs.height);
-    if (cnt->imgs.size_high > 0){
-        cnt->imgs.image_virgin.image_high = mymalloc(cnt->imgs.size_high);
-        cnt->imgs.preview_image.image_high = mymalloc(cnt->imgs.size_high);
-    }
+    image_buffers_init(cnt);
 
     mot_stream_init(cnt);
 
@@ -1392,17 +1807,6 @@ static int motion_init(struct context *cnt)
     else
         cnt->imgs.picture_type = IMAGE_TYPE_JPEG;
 
-    /*
-     * Now is a good time to init rotation data. Since vid_start has been
-     * called, we know that we have imgs.width and imgs.height. When capturing
-     * from a V4L device, these are copied from the corresponding conf values
-     * in vid_start. When capturing from a netcam, they get set in netcam_start,
-     * which is called from vid_start.
-     *
-     * rotate_init will set cap_width and cap_height in cnt->rotate_data.
-     */
-    rotate_init(cnt); /* rotate_deinit is called in main */
-
     init_text_scale(cnt);   /*Initialize and validate the text_scale */
 
     /* Capture first image, or we will get an alarm on start */
@@ -1420,6 +1824,16 @@ static int motion_init(struct context *cnt)
             draw_text(cnt->imgs.image_virgin.image_norm, cnt->imgs.width, cnt->imgs.height,
                       10, 20, "Error capturing first image", cnt->text_scale);
             MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, _("Error capturing first image"));
+        } else {
+            /* Pack the cropped capture in place */
+            pic_view_copy(cnt->imgs.image_virgin.image_norm, &cnt->imgs.image_virgin.view_norm
+                , cnt->imgs.width, cnt->imgs.height);
+        }
+        pic_view_init(&cnt->imgs.image_virgin.view_norm, cnt->imgs.image_virgin.image_norm
+            , cnt->imgs.width, cnt->imgs.height);
+        if (cnt->imgs.size_high > 0) {
+            pic_view_init(&cnt->imgs.image_virgin.view_high, cnt->imgs.image_virgin.image_high
+                , cnt->imgs.width_high, cnt->imgs.height_high);
         }
     }
     cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_in];
@@ -1461,46 +1875,10 @@ static int motion_init(struct context *cnt)
     retcd = dbse_init(cnt);
     if (retcd != 0) return retcd;
 
-    /* Load the mask file if any */
-    if (cnt->conf.mask_file) {
-        if ((picture = myfopen(cnt->conf.mask_file, "r"))) {
-            /*
-             * NOTE: The mask is expected to have the output dimensions. I.e., the mask
-             * applies to the already rotated image, not the capture image. Thus, use
-             * width and height from imgs.
-             */
-            cnt->imgs.mask = get_pgm(picture, cnt->imgs.width, cnt->imgs.height);
-            myfclose(picture);
-        } else {
-            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
-                ,_("Error opening mask file %s")
-                ,cnt->conf.mask_file);
-            /*
-             * Try to write an empty mask file to make it easier
-             * for the user to edit it
-             */
-            put_fixed_mask(cnt, cnt->conf.mask_file);
-        }
-
-        if (!cnt->imgs.mask) {
-            MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO
-                ,_("Failed to read mask image. Mask feature disabled."));
-        } else {
-            MOTION_LOG(INF, TYPE_ALL, NO_ERRNO
-                ,_("Maskfile \"%s\" loaded.")
-                ,cnt->conf.mask_file);
-        }
-    } else {
-        cnt->imgs.mask = NULL;
-    }
+    init_mask(cnt);
 
     init_mask_privacy(cnt);
 
-    /* Always initialize smart_mask - someone could turn it on later... */
-    memset(cnt->imgs.smartmask, 0, cnt->imgs.motionsize);
-    memset(cnt->imgs.smartmask_final, 255, cnt->imgs.motionsize);
-    memset(cnt->imgs.smartmask_buffer, 0, cnt->imgs.motionsize * sizeof(*cnt->imgs.smartmask_buffer));
-
     /* Set noise level */
     cnt->noise = cnt->conf.noise_level;
 
@@ -1538,6 +1916,7 @@ static int motion_init(struct context *cnt)
 
     /* Prevent first few frames from triggering motion... */
     cnt->moved = 8;
+    cnt->ref_reset = FALSE;
 
     /* Work out expected frame rate based on config setting */
     if (cnt->conf.framerate < 2)
@@ -1613,105 +1992,52 @@ static int motion_init(struct context *cnt)
     cnt->rolling_frame = 0;
 
     if (cnt->conf.emulate_motion) {
-        MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, _("Emulating motion"));
-    }
-
-    return 0;
-}
-
-/**
- * motion_cleanup
- *
- * This routine is called from motion_loop when thread ends to
- * cleanup all memory etc. that motion_init did.
- *
- * Parameters:
- *
- *      cnt     Pointer to the motion context structure
- *
- * Returns:     nothing
- */
-static void motion_cleanup(struct context *cnt) {
-
-    if (cnt->conf.stream_preview_method == 99){
-        /* This is the depreciated Stop stream process */
-        if ((cnt->conf.stream_port) && (cnt->stream.socket != -1))
-            stream_stop(&cnt->stream);
-    }
-
-    event(cnt, EVENT_TIMELAPSEEND, NULL, NULL, NULL, NULL);
-    event(cnt, EVENT_ENDMOTION, NULL, NULL, NULL, NULL);
-
-    mot_stream_deinit(cnt);
-
-    if (cnt->video_dev >= 0) {
-        MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, _("Calling vid_close() from motion_cleanup"));
-        vid_close(cnt);
-    }
-
-    free(cnt->imgs.img_motion.image_norm);
-    cnt->imgs.img_motion.image_norm = NULL;
-
-    free(cnt->imgs.ref);
-    cnt->imgs.ref = NULL;
-
-    free(cnt->imgs.ref_dyn);
-    cnt->imgs.ref_dyn = NULL;
-
-    free(cnt->imgs.image_virgin.image_norm);
-    cnt->imgs.image_virgin.image_norm = NULL;
-
-    free(cnt->imgs.image_vprvcy.image_norm);
-    cnt->imgs.image_vprvcy.image_norm = NULL;
-
-    free(cnt->imgs.labels);
-    cnt->imgs.labels = NULL;
-
-    free(cnt->imgs.labelsize);
-    cnt->imgs.labelsize = NULL;
-
-    free(cnt->imgs.smartmask);
-    cnt->imgs.smartmask = NULL;
-
-    free(cnt->imgs.smartmask_final);
-    cnt->imgs.smartmask_final = NULL;
-
-    free(cnt->imgs.smartmask_buffer);
-    cnt->imgs.smartmask_buffer = NULL;
-
-    if (cnt->imgs.mask) free(cnt->imgs.mask);
-    cnt->imgs.mask = NULL;
-
-    if (cnt->imgs.mask_privacy) free(cnt->imgs.mask_privacy);
-    cnt->imgs.mask_privacy = NULL;
+        MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, _("Emulating motion"));
+    }
 
-    if (cnt->imgs.mask_privacy_uv) free(cnt->imgs.mask_privacy_uv);
-    cnt->imgs.mask_privacy_uv = NULL;
+    return 0;
+}
 
-    if (cnt->imgs.mask_privacy_high) free(cnt->imgs.mask_privacy_high);
-    cnt->imgs.mask_privacy_high = NULL;
+/**
+ * motion_cleanup
+ *
+ * This routine is called from motion_loop when thread ends to
+ * cleanup all memory etc. that motion_init did.
+ *
+ * Parameters:
+ *
+ *      cnt     Pointer to the motion context structure
+ *
+ * Returns:     nothing
+ */
+static void motion_cleanup(struct context *cnt) {
 
-    if (cnt->imgs.mask_privacy_high_uv) free(cnt->imgs.mask_privacy_high_uv);
-    cnt->imgs.mask_privacy_high_uv = NULL;
+    if (cnt->conf.stream_preview_method == 99){
+        /* This is the depreciated Stop stream process */
+        if ((cnt->conf.stream_port) && (cnt->stream.socket != -1))
+            stream_stop(&cnt->stream);
+    }
 
-    free(cnt->imgs.common_buffer);
-    cnt->imgs.common_buffer = NULL;
+    event(cnt, EVENT_TIMELAPSEEND, NULL, NULL, NULL, NULL);
+    event(cnt, EVENT_ENDMOTION, NULL, NULL, NULL, NULL);
 
-    free(cnt->imgs.preview_image.image_norm);
-    cnt->imgs.preview_image.image_norm = NULL;
+    pipeline_stop(cnt);
 
-    if (cnt->imgs.size_high > 0){
-        free(cnt->imgs.image_virgin.image_high);
-        cnt->imgs.image_virgin.image_high = NULL;
+    mot_stream_deinit(cnt);
 
-        free(cnt->imgs.preview_image.image_high);
-        cnt->imgs.preview_image.image_high = NULL;
+    if (cnt->video_dev >= 0) {
+        MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, _("Calling vid_close() from motion_cleanup"));
+        vid_close(cnt);
     }
 
+    image_buffers_deinit(cnt);
+
     image_ring_destroy(cnt); /* Cleanup the precapture ring buffer */
 
     rotate_deinit(cnt); /* cleanup image rotation data */
 
+    crop_deinit(cnt); /* cleanup image crop data */
+
     if (cnt->pipe != -1) {
         close(cnt->pipe);
         cnt->pipe = -1;
@@ -1750,16 +2076,19 @@ static void mlp_mask_privacy(struct context *cnt){
     * This function uses long operations to process 4 (32 bit) or 8 (64 bit)
     * bytes at a time, providing a significant boost in performance.
     * Then a trailer loop takes care of any remaining bytes.
+    * The masks are packed while the image is accessed through its view so
+    * the masks are applied one row of a plane at a time.
     */
     unsigned char *image;
     const unsigned char *mask;
     const unsigned char *maskuv;
-
-    int index_y;
-    int index_crcb;
+    struct image_view *view;
+    int index_x;
     int increment;
     int indx_img;                /* Counter for how many images we need to apply the mask to */
     int indx_max;                /* 1 if we are only doing norm, 2 if we are doing both norm and high */
+    int indx_plane, indx_row;
+    int width, height, widthp, heightp;
 
     indx_img = 1;
     indx_max = 1;
@@ -1769,49 +2098,63 @@ static void mlp_mask_privacy(struct context *cnt){
     while (indx_img <= indx_max){
         if (indx_img == 1) {
             /* Normal Resolution */
-            index_y = cnt->imgs.height * cnt->imgs.width;
-            image = cnt->current_image->image_norm;
+            width = cnt->imgs.width;
+            height = cnt->imgs.height;
+            view = &cnt->current_image->view_norm;
             mask = cnt->imgs.mask_privacy;
-            index_crcb = cnt->imgs.size_norm - index_y;
             maskuv = cnt->imgs.mask_privacy_uv;
         } else {
             /* High Resolution */
-            index_y = cnt->imgs.height_high * cnt->imgs.width_high;
-            image = cnt->current_image->image_high;
+            width = cnt->imgs.width_high;
+            height = cnt->imgs.height_high;
+            view = &cnt->current_image->view_high;
             mask = cnt->imgs.mask_privacy_high;
-            index_crcb = cnt->imgs.size_high - index_y;
             maskuv = cnt->imgs.mask_privacy_high_uv;
         }
 
-        while (index_y >= increment) {
-            *((unsigned long *)image) &= *((unsigned long *)mask);
-            image += increment;
-            mask += increment;
-            index_y -= increment;
-        }
-        while (--index_y >= 0) {
-            *(image++) &= *(mask++);
+        /* Mask luminance. */
+        for (indx_row = 0; indx_row < height; indx_row++) {
+            image = view->plane[0] + (indx_row * view->stride[0]);
+            index_x = width;
+            while (index_x >= increment) {
+                *((unsigned long *)image) &= *((unsigned long *)mask);
+                image += increment;
+                mask += increment;
+                index_x -= increment;
+            }
+            while (--index_x >= 0) {
+                *(image++) &= *(mask++);
+            }
         }
 
         /* Mask chrominance. */
-        while (index_crcb >= increment) {
-            index_crcb -= increment;
-            /*
-            * Replace the masked bytes with 0x080. This is done using two masks:
-            * the normal privacy mask is used to clear the masked bits, the
-            * "or" privacy mask is used to write 0x80. The benefit of that method
-            * is that we process 4 or 8 bytes in just two operations.
-            */
-            *((unsigned long *)image) &= *((unsigned long *)mask);
-            mask += increment;
-            *((unsigned long *)image) |= *((unsigned long *)maskuv);
-            maskuv += increment;
-            image += increment;
-        }
+        widthp = width / 2;
+        heightp = height / 2;
+        for (indx_plane = 1; indx_plane < 3; indx_plane++) {
+            for (indx_row = 0; indx_row < heightp; indx_row++) {
+                image = view->plane[indx_plane] + (indx_row * view->stride[indx_plane]);
+                index_x = widthp;
+                while (index_x >= increment) {
+                    index_x -= increment;
+                    /*
+                    * Replace the masked bytes with 0x080. This is done using two masks:
+                    * the normal privacy mask is used to clear the masked bits, the
+                    * "or" privacy mask is used to write 0x80. The benefit of that method
+                    * is that we process 4 or 8 bytes in just two operations.
+                    */
+                    *((unsigned long *)image) &= *((unsigned long *)mask);
+                    mask += increment;
+                    *((unsigned long *)image) |= *((unsigned long *)maskuv);
+                    maskuv += increment;
+                    image += increment;
+                }
 
-        while (--index_crcb >= 0) {
-            if (*(mask++) == 0x00) *image = 0x80; // Mask last remaining bytes.
-            image += 1;
+                while (--index_x >= 0) {
+                    if (*(mask++) == 0x00) *image = 0x80; // Mask last remaining bytes.
+                    image += 1;
+                    maskuv += 1;
+                }
+            }
         }
 
         indx_img++;
@@ -1849,7 +2192,7 @@ static void mlp_areadetect(struct context *cnt){
 
 static void mlp_prepare(struct context *cnt){
 
-    int frame_buffer_size;
+    int frame_buffer_size, raw_size;
     struct timeval tv1;
 
     /***** MOTION LOOP - PREPARE FOR NEW FRAME SECTION *****/
@@ -1888,12 +2231,16 @@ static void mlp_prepare(struct context *cnt){
 
     /*
      * Check if our buffer is still the right size
-     * If pre_capture or minimum_motion_frames has been changed
+     * If pre_capture, minimum_motion_frames or pre_capture_raw has been changed
      * via the http remote control we need to re-size the ring buffer
      */
     frame_buffer_size = cnt->conf.pre_capture + cnt->conf.minimum_motion_frames;
+    raw_size = cnt->imgs.image_ring_raw;
+    if (raw_size > frame_buffer_size)
+        raw_size = frame_buffer_size;
 
-    if (cnt->imgs.image_ring_size != frame_buffer_size)
+    if ((cnt->imgs.image_ring_size != frame_buffer_size) ||
+        (image_ring_raw_size(cnt, frame_buffer_size) != raw_size))
         image_ring_resize(cnt, frame_buffer_size);
 
     /* Get time for current frame */
@@ -1957,6 +2304,13 @@ static void mlp_resetimages(struct context *cnt){
     old_image = cnt->current_image;
     cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_in];
 
+    /* The capture overwrites the slot, the preview takes its own copy first */
+    if (cnt->imgs.preview_shared == cnt->current_image)
+        image_preview_copy(cnt);
+
+    if (cnt->current_image->image_norm == NULL)
+        image_ring_take_raw(cnt);
+
     /* Init/clear current_image */
     if (cnt->process_thisframe) {
         /* set diffs to 0 now, will be written after we calculated diffs in new image */
@@ -1988,6 +2342,84 @@ static void mlp_resetimages(struct context *cnt){
 
 }
 
+/**
+ * mlp_rebuild
+ *
+ * Sets up the rotation and the crop from the capture dimensions and
+ * allocates the image buffers that depend on the image dimensions again,
+ * so the camera keeps capturing.  The reference frame is taken from the
+ * next image.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *
+ * Returns:     nothing
+ */
+static void mlp_rebuild(struct context *cnt){
+
+    if (cnt->ffmpeg_timelapse)
+        event(cnt, EVENT_TIMELAPSEEND, NULL, NULL, NULL, NULL);
+
+    pthread_mutex_lock(&cnt->mutex_stream);
+        mot_stream_free(cnt);
+    pthread_mutex_unlock(&cnt->mutex_stream);
+
+    image_buffers_deinit(cnt);
+    image_ring_destroy(cnt);
+    rotate_deinit(cnt);
+    crop_deinit(cnt);
+
+    /* Start again from the capture dimensions as motion_init does after vid_start */
+    cnt->imgs.width = cnt->rotate_data.capture_width_norm;
+    cnt->imgs.height = cnt->rotate_data.capture_height_norm;
+    cnt->imgs.width_high = cnt->rotate_data.capture_width_high;
+    cnt->imgs.height_high = cnt->rotate_data.capture_height_high;
+    cnt->imgs.size_norm = (cnt->imgs.width * cnt->imgs.height * 3) / 2;
+    cnt->imgs.motionsize = cnt->imgs.width * cnt->imgs.height;
+    cnt->imgs.size_high = (cnt->imgs.width_high * cnt->imgs.height_high * 3) / 2;
+
+    rotate_init(cnt);
+    crop_init(cnt);
+
+    image_ring_resize(cnt, 1); /* mlp_prepare grows the ring to its size again */
+    image_buffers_init(cnt);
+    init_mask(cnt);
+    init_mask_privacy(cnt);
+
+    memset(cnt->imgs.image_virgin.image_norm, 0x80, cnt->imgs.size_norm);
+    memset(cnt->imgs.image_vprvcy.image_norm, 0x80, cnt->imgs.size_norm);
+    cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_in];
+    alg_update_reference_frame(cnt, RESET_REF_FRAME);
+    cnt->ref_reset = TRUE;
+
+    #if defined(HAVE_V4L2) && !defined(BSD)
+        /* The loopback devices take the new output dimensions */
+        if (cnt->pipe != -1) {
+            close(cnt->pipe);
+            cnt->pipe = vlp_startpipe(cnt->conf.video_pipe, cnt->imgs.width, cnt->imgs.height);
+            if (cnt->pipe < 0) {
+                MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO
+                    ,_("Failed to open video loopback for normal pictures"));
+                cnt->pipe = -1;
+            }
+        }
+        if (cnt->mpipe != -1) {
+            close(cnt->mpipe);
+            cnt->mpipe = vlp_startpipe(cnt->conf.video_pipe_motion, cnt->imgs.width, cnt->imgs.height);
+            if (cnt->mpipe < 0) {
+                MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO
+                    ,_("Failed to open video loopback for motion pictures"));
+                cnt->mpipe = -1;
+            }
+        }
+    #endif /* HAVE_V4L2 && !BSD */
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+        ,_("Image dimensions are now %dx%d"), cnt->imgs.width, cnt->imgs.height);
+
+}
+
 static int mlp_retry(struct context *cnt){
 
     /*
@@ -2044,7 +2476,18 @@ static int mlp_retry(struct context *cnt){
          * and the vid_start ONLY re-populates the height/width so we can check the size here.
          */
         size_high = (cnt->imgs.width_high * cnt->imgs.height_high * 3) / 2;
-        if (cnt->imgs.size_high != size_high) return 1;
+        if (cnt->crop_data.capture_size_high != size_high) return 1;
+
+        /*
+         * vid_start has reset the image dimensions to the capture size so
+         * apply the rotation and the crop to the image buffers again. This
+         * can not wait for the end of an event since the capture already
+         * delivers the new size, the dimensions of the movie stay the same.
+         */
+        if (cnt->crop_data.enabled || (cnt->rotate_data.degrees != 0) ||
+            (cnt->rotate_data.axis != FLIP_TYPE_NONE)) {
+            mlp_rebuild(cnt);
+        }
     }
     return 0;
 }
@@ -2065,7 +2508,7 @@ static int mlp_capture(struct context *cnt){
      * <0 = fatal error - leave the thread by breaking out of the main loop
      * >0 = non fatal error - copy last image or show grey image with message
      */
-    if (cnt->video_dev >= 0)
+    if ((cnt->video_dev >= 0) && !cnt->frame_stalled)
         vid_return_code = vid_next(cnt, cnt->current_image);
     else
         vid_return_code = 1; /* Non fatal error */
@@ -2086,13 +2529,32 @@ static int mlp_capture(struct context *cnt){
 
         /*
          * Save the newly captured still virgin image to a buffer
-         * which we will not alter with text and location graphics
+         * which we will not alter with text and location graphics.
+         * The copies are packed so a cropped image is only gathered here.
+         * The image before the privacy mask only gets a copy of its own
+         * when the mask changes it and the source stream shows it.
          */
-        memcpy(cnt->imgs.image_virgin.image_norm, cnt->current_image->image_norm, cnt->imgs.size_norm);
+        if (cnt->imgs.mask_privacy == NULL) {
+            cnt->imgs.image_source = &cnt->imgs.image_vprvcy;
+        } else if (cnt->stream_source.cnct_count > 0) {
+            pic_view_copy(cnt->imgs.image_virgin.image_norm, &cnt->current_image->view_norm
+                , cnt->imgs.width, cnt->imgs.height);
+            cnt->imgs.image_source = &cnt->imgs.image_virgin;
+        } else {
+            cnt->imgs.image_source = NULL;
+        }
 
         mlp_mask_privacy(cnt);
 
-        memcpy(cnt->imgs.image_vprvcy.image_norm, cnt->current_image->image_norm, cnt->imgs.size_norm);
+        pic_view_copy(cnt->imgs.image_vprvcy.image_norm, &cnt->current_image->view_norm
+            , cnt->imgs.width, cnt->imgs.height);
+        alg_detect_image(cnt);
+
+        /* The first image after mlp_rebuild becomes the reference frame */
+        if (cnt->ref_reset) {
+            alg_update_reference_frame(cnt, RESET_REF_FRAME);
+            cnt->ref_reset = FALSE;
+        }
 
         /*
          * If the camera is a netcam we let the camera decide the pace.
@@ -2111,11 +2573,13 @@ static int mlp_capture(struct context *cnt){
             ,_("Video device fatal error - Closing video device"));
         vid_close(cnt);
         /*
-         * Use virgin image, if we are not able to open it again next loop
-         * a gray image with message is applied
+         * Use the last image with the privacy mask, if we are not able to
+         * open it again next loop a gray image with message is applied
          * flag lost_connection
          */
-        memcpy(cnt->current_image->image_norm, cnt->imgs.image_virgin.image_norm, cnt->imgs.size_norm);
+        pic_view_init(&cnt->current_image->view_norm, cnt->current_image->image_norm
+            , cnt->imgs.width, cnt->imgs.height);
+        memcpy(cnt->current_image->image_norm, cnt->imgs.image_vprvcy.image_norm, cnt->imgs.size_norm);
         cnt->lost_connection = 1;
     /* NO FATAL ERROR -
     *        copy last image or show grey image with message
@@ -2165,6 +2629,9 @@ static int mlp_capture(struct context *cnt){
          */
         ++cnt->missing_frame_counter;
 
+        pic_view_init(&cnt->current_image->view_norm, cnt->current_image->image_norm
+            , cnt->imgs.width, cnt->imgs.height);
+
         if (cnt->video_dev >= 0 &&
             cnt->missing_frame_counter < (MISSING_FRAMES_TIMEOUT * cnt->conf.framerate)) {
             memcpy(cnt->current_image->image_norm, cnt->imgs.image_vprvcy.image_norm, cnt->imgs.size_norm);
@@ -2180,7 +2647,7 @@ static int mlp_capture(struct context *cnt){
             tv1.tv_usec = 0;
             memset(cnt->current_image->image_norm, 0x80, cnt->imgs.size_norm);
             mystrftime(cnt, tmpout, sizeof(tmpout), tmpin, &tv1, NULL, 0);
-            draw_text(cnt->current_image->image_norm, cnt->imgs.width, cnt->imgs.height,
+            draw_text_view(&cnt->current_image->view_norm, cnt->imgs.width, cnt->imgs.height,
                       10, 20 * cnt->text_scale, tmpout, cnt->text_scale);
 
             /* Write error message only once */
@@ -2209,7 +2676,7 @@ static int mlp_capture(struct context *cnt){
 }
 
 static void mlp_detection(struct context *cnt){
-
+    int lightswitch;
 
     /***** MOTION LOOP - MOTION DETECTION SECTION *****/
     /*
@@ -2224,26 +2691,37 @@ static void mlp_detection(struct context *cnt){
      */
     if (cnt->process_thisframe) {
         if (cnt->threshold && !cnt->pause) {
+            /*
+             * Lightswitch feature - has light intensity changed?
+             * This can happen due to change of light conditions or due to a sudden change of the camera
+             * sensitivity. If alg_lightswitch detects lightswitch we suspend motion detection the next
+             * 'lightswitch_frames' frames to allow the camera to settle.
+             * Don't check if we have lost connection, we detect "Lost signal" frame as lightswitch
+             * A sample of the pixels finds most lightswitches before the diff, which is then skipped.
+             */
+            lightswitch = FALSE;
+            if (cnt->conf.lightswitch_percent > 1 || cnt->conf.noise_tune)
+                alg_luma_stats(cnt);
+            if (cnt->conf.lightswitch_percent > 1 && !cnt->lost_connection)
+                lightswitch = alg_lightswitch_sampled(cnt);
+
             /*
              * If we've already detected motion and we want to see if there's
              * still motion, don't bother trying the fast one first. IF there's
              * motion, the alg_diff will trigger alg_diff_standard
              * anyway
              */
-            if (cnt->detecting_motion || cnt->conf.setup_mode)
-                cnt->current_image->diffs = alg_diff_standard(cnt, cnt->imgs.image_vprvcy.image_norm);
+            if (lightswitch)
+                cnt->current_image->diffs = 0;
+            else if (cnt->detecting_motion || cnt->conf.setup_mode)
+                cnt->current_image->diffs = alg_diff_standard(cnt, cnt->imgs.image_detect);
             else
-                cnt->current_image->diffs = alg_diff(cnt, cnt->imgs.image_vprvcy.image_norm);
+                cnt->current_image->diffs = alg_diff(cnt, cnt->imgs.image_detect);
 
-            /* Lightswitch feature - has light intensity changed?
-             * This can happen due to change of light conditions or due to a sudden change of the camera
-             * sensitivity. If alg_lightswitch detects lightswitch we suspend motion detection the next
-             * 'lightswitch_frames' frames to allow the camera to settle.
-             * Don't check if we have lost connection, we detect "Lost signal" frame as lightswitch
-             */
             if (cnt->conf.lightswitch_percent > 1 && !cnt->lost_connection) {
-                if (alg_lightswitch(cnt, cnt->current_image->diffs)) {
-                    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, _("Lightswitch detected"));
+                if (lightswitch || alg_lightswitch(cnt, cnt->current_image->diffs)) {
+                    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, _("Lightswitch detected, mean luma %d to %d")
+                        ,cnt->imgs.luma_ref_mean, cnt->imgs.luma_mean);
 
                     if (cnt->conf.lightswitch_frames < 1)
                         cnt->conf.lightswitch_frames = 1;
@@ -2269,7 +2747,7 @@ static void mlp_detection(struct context *cnt){
              */
             if (cnt->conf.roundrobin_switchfilter && cnt->current_image->diffs > cnt->threshold) {
                 cnt->current_image->diffs = alg_switchfilter(cnt, cnt->current_image->diffs,
-                                                             cnt->current_image->image_norm);
+                                                             &cnt->current_image->view_norm);
 
                 if ((cnt->current_image->diffs <= cnt->threshold) ||
                     (cnt->current_image->diffs > cnt->threshold_maximum)) {
@@ -2324,6 +2802,9 @@ static void mlp_detection(struct context *cnt){
         cnt->current_image->diffs = 0;
     }
 
+    /* Learn the crop from where the motion is */
+    if (cnt->process_thisframe) crop_auto_learn(cnt);
+
 }
 
 static void mlp_tuning(struct context *cnt){
@@ -2336,7 +2817,7 @@ static void mlp_tuning(struct context *cnt){
      */
     if ((cnt->conf.noise_tune && cnt->shots == 0) &&
          (!cnt->detecting_motion && (cnt->current_image->diffs <= cnt->threshold)))
-        alg_noise_tune(cnt, cnt->imgs.image_vprvcy.image_norm);
+        alg_noise_tune(cnt, cnt->imgs.image_detect);
 
 
     /*
@@ -2405,6 +2886,14 @@ static void mlp_overlay(struct context *cnt){
     char tmp[PATH_MAX];
 
     /***** MOTION LOOP - TEXT AND GRAPHICS OVERLAY SECTION *****/
+    /*
+     * The detection only keeps the motion bitmap. The motion image is
+     * rendered from it when a picture, movie, stream or pipe shows it.
+     */
+    if (cnt->conf.picture_output_motion || cnt->conf.movie_output_motion ||
+        cnt->conf.setup_mode || (cnt->stream_motion.cnct_count > 0) || (cnt->mpipe >= 0))
+        alg_motion_render(cnt, cnt->imgs.image_vprvcy.image_norm);
+
     /*
      * Some overlays on top of the motion image
      * Note that these now modifies the cnt->imgs.out so this buffer
@@ -2435,7 +2924,7 @@ static void mlp_overlay(struct context *cnt){
         else
             sprintf(tmp, "-");
 
-        draw_text(cnt->current_image->image_norm, cnt->imgs.width, cnt->imgs.height,
+        draw_text_view(&cnt->current_image->view_norm, cnt->imgs.width, cnt->imgs.height,
                   cnt->imgs.width - 10, 10, tmp, cnt->text_scale);
     }
 
@@ -2459,7 +2948,7 @@ static void mlp_overlay(struct context *cnt){
     if (cnt->conf.text_left) {
         mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_left,
                    &cnt->current_image->timestamp_tv, NULL, 0);
-        draw_text(cnt->current_image->image_norm, cnt->imgs.width, cnt->imgs.height,
+        draw_text_view(&cnt->current_image->view_norm, cnt->imgs.width, cnt->imgs.height,
                   10, cnt->imgs.height - (10 * cnt->text_scale), tmp, cnt->text_scale);
     }
 
@@ -2467,7 +2956,7 @@ static void mlp_overlay(struct context *cnt){
     if (cnt->conf.text_right) {
         mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_right,
                    &cnt->current_image->timestamp_tv, NULL, 0);
-        draw_text(cnt->current_image->image_norm, cnt->imgs.width, cnt->imgs.height,
+        draw_text_view(&cnt->current_image->view_norm, cnt->imgs.width, cnt->imgs.height,
                   cnt->imgs.width - 10, cnt->imgs.height - (10 * cnt->text_scale),
                   tmp, cnt->text_scale);
     }
@@ -2501,8 +2990,10 @@ static void mlp_actions(struct context *cnt){
          *  no motion then we reset the start movie time so that we do not
          *  get a pause in the movie.
         */
-        if ( (cnt->detecting_motion == 0) && (cnt->ffmpeg_output != NULL) )
+        if ( (cnt->detecting_motion == 0) && (cnt->ffmpeg_output != NULL) ) {
+            pipeline_drain(cnt);
             ffmpeg_reset_movie_start_time(cnt->ffmpeg_output, &cnt->current_image->timestamp_tv);
+        }
         cnt->detecting_motion = 1;
         if (cnt->conf.post_capture > 0) {
             /* Setup the postcap counter */
@@ -2544,8 +3035,10 @@ static void mlp_actions(struct context *cnt){
              *  no motion then we reset the start movie time so that we do not
              *  get a pause in the movie.
             */
-            if ( (cnt->detecting_motion == 0) && (cnt->ffmpeg_output != NULL) )
+            if ( (cnt->detecting_motion == 0) && (cnt->ffmpeg_output != NULL) ) {
+                pipeline_drain(cnt);
                 ffmpeg_reset_movie_start_time(cnt->ffmpeg_output, &cnt->current_image->timestamp_tv);
+            }
 
             cnt->detecting_motion = 1;
 
@@ -2610,6 +3103,7 @@ static void mlp_actions(struct context *cnt){
 
             /* Save preview_shot here at the end of event */
             if (cnt->imgs.preview_image.diffs) {
+                image_preview_copy(cnt);
                 event(cnt, EVENT_IMAGE_PREVIEW, NULL, NULL, NULL, &cnt->current_image->timestamp_tv);
                 cnt->imgs.preview_image.diffs = 0;
             }
@@ -2812,12 +3306,40 @@ static void mlp_loopback(struct context *cnt){
 
 }
 
+/**
+ * mlp_reconfigure
+ *
+ * Sets up the rotation and the crop again with mlp_rebuild when they were
+ * changed through the webcontrol.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *
+ * Returns:     nothing
+ */
+static void mlp_reconfigure(struct context *cnt){
+
+    if (!rotate_changed(cnt) && !crop_changed(cnt)) return;
+
+    /* Wait for the end of the event so the movie keeps its dimensions */
+    if (cnt->event_nr == cnt->prev_event) return;
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+        ,_("Setting up the rotation and crop again"));
+
+    mlp_rebuild(cnt);
+
+}
+
 static void mlp_parmsupdate(struct context *cnt){
     /***** MOTION LOOP - ONCE PER SECOND PARAMETER UPDATE SECTION *****/
 
     /* Check for some config parameter changes but only every second */
     if (cnt->shots != 0) return;
 
+    mlp_reconfigure(cnt);
+
     init_text_scale(cnt);  /* Initialize and validate text_scale */
 
     if (strcasecmp(cnt->conf.picture_output, "on") == 0)
@@ -2856,10 +3378,8 @@ static void mlp_parmsupdate(struct context *cnt){
     /* Has someone changed smart_mask_speed or framerate? */
     if (cnt->conf.smart_mask_speed != cnt->smartmask_speed ||
         cnt->smartmask_lastrate != cnt->lastrate) {
-        if (cnt->conf.smart_mask_speed == 0) {
-            memset(cnt->imgs.smartmask, 0, cnt->imgs.motionsize);
-            memset(cnt->imgs.smartmask_final, 255, cnt->imgs.motionsize);
-        }
+        if (cnt->conf.smart_mask_speed == 0)
+            alg_smartmask_reset(cnt);
 
         cnt->smartmask_lastrate = cnt->lastrate;
         cnt->smartmask_speed = cnt->conf.smart_mask_speed;
@@ -2870,6 +3390,20 @@ static void mlp_parmsupdate(struct context *cnt){
         cnt->smartmask_ratio = 5 * cnt->lastrate * (11 - cnt->smartmask_speed);
     }
 
+    /* Sanity check for detection_threads, silly value disables the stripes */
+    if (cnt->conf.detection_threads < 1 || cnt->conf.detection_threads > ALG_STRIPE_MAX)
+        cnt->conf.detection_threads = 1;
+
+    /* The calling camera thread works on a stripe itself */
+    if (cnt->conf.detection_threads > 1)
+        workpool_start(cnt->conf.detection_threads - 1);
+
+    /* Sanity check for movie_output_queue, the queue is only resized between movies */
+    if (cnt->conf.movie_output_queue < 0 || cnt->conf.movie_output_queue > PIPELINE_QUEUE_MAX)
+        cnt->conf.movie_output_queue = 0;
+    if (cnt->ffmpeg_output == NULL)
+        pipeline_start(cnt);
+
     dbse_sqlmask_update(cnt);
 
     cnt->threshold = cnt->conf.threshold;
@@ -2933,6 +3467,10 @@ static void mlp_frametiming(struct context *cnt){
         if (cnt->frame_delay > cnt->required_frame_time)
             cnt->frame_delay = cnt->required_frame_time;
 
+        /* The camera workers run the next pass after frame_delay */
+        if (cnt->scheduled)
+            return;
+
         /* Delay time in nanoseconds for SLEEP */
         delay_time_nsec = cnt->frame_delay * 1000;
 
@@ -2946,36 +3484,43 @@ static void mlp_frametiming(struct context *cnt){
 }
 
 /**
- * motion_loop
+ * motion_loop_pass
  *
- *   Thread function for the motion handling threads.
+ *   One pass of the camera loop, from the capture of a frame to the timing
+ *   of the next one.
  *
+ * Returns: 1 when the camera loop has to end, else 0
  */
-static void *motion_loop(void *arg)
+static int motion_loop_pass(struct context *cnt)
 {
-    struct context *cnt = arg;
-
-    if (motion_init(cnt) == 0){
-        while (!cnt->finish || cnt->event_stop) {
-            mlp_prepare(cnt);
-            if (cnt->get_image) {
-                mlp_resetimages(cnt);
-                if (mlp_retry(cnt) == 1)  break;
-                if (mlp_capture(cnt) == 1)  break;
-                mlp_detection(cnt);
-                mlp_tuning(cnt);
-                mlp_overlay(cnt);
-                mlp_actions(cnt);
-                mlp_setupmode(cnt);
-            }
-            mlp_snapshot(cnt);
-            mlp_timelapse(cnt);
-            mlp_loopback(cnt);
-            mlp_parmsupdate(cnt);
-            mlp_frametiming(cnt);
-        }
+    mlp_prepare(cnt);
+    if (cnt->get_image) {
+        mlp_resetimages(cnt);
+        if (mlp_retry(cnt) == 1)  return 1;
+        if (mlp_capture(cnt) == 1)  return 1;
+        mlp_detection(cnt);
+        mlp_tuning(cnt);
+        mlp_overlay(cnt);
+        mlp_actions(cnt);
+        mlp_setupmode(cnt);
     }
+    mlp_snapshot(cnt);
+    mlp_timelapse(cnt);
+    mlp_loopback(cnt);
+    mlp_parmsupdate(cnt);
+    mlp_frametiming(cnt);
 
+    return 0;
+}
+
+/**
+ * motion_loop_end
+ *
+ *   Cleans up a camera whose loop ended.
+ *
+ */
+static void motion_loop_end(struct context *cnt)
+{
     cnt->lost_connection = 1;
     MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, _("Thread exiting"));
 
@@ -2987,10 +3532,134 @@ static void *motion_loop(void *arg)
 
     cnt->running = 0;
     cnt->finish = 0;
+}
+
+/**
+ * motion_loop_schedule
+ *
+ *   Hands the camera to the camera workers once its device is open. Opening
+ *   it, the retries and the first capture stay on the thread of the camera,
+ *   they block.
+ *
+ * Returns: 0 when the workers took the camera
+ */
+static int motion_loop_schedule(struct context *cnt)
+{
+    int fd;
+
+    if ((cnt_list[0]->conf.camera_workers <= 0) || (cnt->video_dev < 0))
+        return -1;
+
+    /* The network cameras tell of their frames through scheduler_ready */
+    fd = (cnt->camera_type == CAMERA_TYPE_V4L2) ? cnt->video_dev : -1;
+
+    cnt->scheduled = TRUE;
+    if (scheduler_add(cnt, fd) == 0)
+        return 0;
+    cnt->scheduled = FALSE;
+
+    return -1;
+}
+
+/**
+ * motion_loop_run
+ *
+ *   Runs the passes of the camera on its own thread until the camera ends
+ *   or the camera workers take it.
+ */
+static void motion_loop_run(struct context *cnt)
+{
+    while (!cnt->finish || cnt->event_stop) {
+        if (motion_loop_schedule(cnt) == 0)  return;
+        if (motion_loop_pass(cnt) == 1)  break;
+    }
+
+    motion_loop_end(cnt);
+}
+
+/**
+ * motion_loop
+ *
+ *   Thread function for the motion handling threads.
+ *
+ */
+static void *motion_loop(void *arg)
+{
+    struct context *cnt = arg;
+
+    if (motion_init(cnt) == 0){
+        motion_loop_run(cnt);
+    } else {
+        motion_loop_end(cnt);
+    }
 
     pthread_exit(NULL);
 }
 
+/**
+ * motion_loop_resume
+ *
+ *   Thread function taking the camera back from the camera workers when its
+ *   device is lost, the retries to open it again block.
+ *
+ */
+static void *motion_loop_resume(void *arg)
+{
+    struct context *cnt = arg;
+
+    cnt->scheduled = FALSE;
+
+    util_threadname_set("ml",cnt->threadnr,cnt->conf.camera_name);
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    motion_loop_run(cnt);
+
+    pthread_exit(NULL);
+}
+
+/**
+ * motion_loop_step
+ *
+ *   Runs motion_loop for a camera on the camera workers, one pass per call.
+ *
+ * Returns: microseconds until the next pass, -1 when the camera ended or
+ *          went back to a thread of its own
+ */
+static long motion_loop_step(struct context *cnt, int stalled)
+{
+    pthread_attr_t thread_attr;
+    long delay;
+
+    if (!cnt->finish || cnt->event_stop) {
+        cnt->frame_stalled = stalled;
+        if (motion_loop_pass(cnt) == 0) {
+            cnt->frame_stalled = FALSE;
+            delay = (cnt->frame_delay > 0) ? cnt->frame_delay : 0;
+            if (cnt->video_dev >= 0)
+                return delay;
+
+            scheduler_remove(cnt);
+            pthread_attr_init(&thread_attr);
+            pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+            if (pthread_create(&cnt->thread_id, &thread_attr, &motion_loop_resume, cnt) == 0) {
+                pthread_attr_destroy(&thread_attr);
+                return -1;
+            }
+            pthread_attr_destroy(&thread_attr);
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
+                ,_("Unable to start a thread to open the device again"));
+            scheduler_add(cnt, -1);
+            return -1;
+        }
+        cnt->frame_stalled = FALSE;
+    }
+
+    scheduler_remove(cnt);
+    motion_loop_end(cnt);
+
+    return -1;
+}
+
 /**
  * become_daemon
  *
@@ -3135,6 +3804,8 @@ static void motion_shutdown(void){
 
     webu_stop(cnt_list);
 
+    crop_share_deinit(cnt_list);
+
     while (cnt_list[++i])
         context_destroy(cnt_list[i]);
 
@@ -3343,6 +4014,8 @@ static void motion_startup(int daemonize, int argc, char *argv[])
 
     motion_camera_ids();
 
+    crop_share_init(cnt_list);
+
     initialize_chars();
 
     webu_start(cnt_list);
@@ -3374,7 +4047,10 @@ static void motion_start_thread(struct context *cnt){
             ,cnt->camera_id, cnt->conf_filename);
     }
 
-    if (cnt->conf.netcam_url){
+    if (cnt->conf.crop_source > 0){
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO,_("Camera ID: %d Camera Name: %s Crop of camera: %d")
+            ,cnt->camera_id, cnt->conf.camera_name, cnt->conf.crop_source);
+    } else if (cnt->conf.netcam_url){
         snprintf(service,6,"%s",cnt->conf.netcam_url);
         MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO,_("Camera ID: %d Camera Name: %s Service: %s")
             ,cnt->camera_id, cnt->conf.camera_name,service);
@@ -3438,6 +4114,9 @@ static void motion_start_thread(struct context *cnt){
      * start another thread for this device. */
     cnt->running = 1;
 
+    /* The camera goes to the camera workers once its device is open */
+    cnt->scheduled = FALSE;
+
     pthread_attr_init(&thread_attr);
     pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
 
@@ -3512,7 +4191,9 @@ static void motion_watchdog(int indx){
             (cnt_list[indx]->netcam != NULL)){
             pthread_cancel(cnt_list[indx]->netcam->thread_id);
         }
-        pthread_cancel(cnt_list[indx]->thread_id);
+        /* A camera worker runs the other cameras too, only the handlers above are cancelled */
+        if (!cnt_list[indx]->scheduled)
+            pthread_cancel(cnt_list[indx]->thread_id);
     }
 
     if (cnt_list[indx]->watchdog < WATCHDOG_KILL) {
@@ -3555,6 +4236,9 @@ static void motion_watchdog(int indx){
                 pthread_kill(cnt_list[indx]->netcam->thread_id, SIGVTALRM);
             }
         }
+        /* The camera worker ends the camera itself once the pass returns */
+        if (cnt_list[indx]->scheduled) return;
+
         if (cnt_list[indx]->running &&
             pthread_kill(cnt_list[indx]->thread_id, 0) == ESRCH){
             MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO
@@ -3620,10 +4304,11 @@ static int motion_check_threadcount(void){
 }
 
 /**
- * main
+ * motion_run
  *
- *   Main entry point of Motion. Launches all the motion threads and contains
- *   the logic for starting up, restarting and cleaning up everything.
+ *   Runs Motion, called from main (main.c). Launches all the motion threads
+ *   and contains the logic for starting up, restarting and cleaning up
+ *   everything.
  *
  * Parameters:
  *
@@ -3632,7 +4317,7 @@ static int motion_check_threadcount(void){
  *
  * Returns: Motion exit status = 0 always
  */
-int main (int argc, char **argv)
+int motion_run(int argc, char **argv)
 {
     int i;
 
@@ -3644,6 +4329,8 @@ int main (int argc, char **argv)
 
     motion_startup(1, argc, argv);
 
+    alg_simd_init();
+
     ffmpeg_global_init();
 
     dbse_global_init();
@@ -3653,6 +4340,8 @@ int main (int argc, char **argv)
     do {
         if (restart) motion_restart(argc, argv);
 
+        scheduler_start(cnt_list[0]->conf.camera_workers, motion_loop_step);
+
         for (i = cnt_list[1] != NULL ? 1 : 0; cnt_list[i]; i++) {
             cnt_list[i]->threadnr = i ? i : 1;
             motion_start_thread(cnt_list[i]);
@@ -3681,6 +4370,8 @@ int main (int argc, char **argv)
 
         MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, _("Threads finished"));
 
+        scheduler_stop();
+
         /* Rest for a while if we're supposed to restart. */
         if (restart) SLEEP(1, 0);
 
@@ -3693,6 +4384,8 @@ int main (int argc, char **argv)
 
     dbse_global_deinit();
 
+    workpool_stop();
+
     motion_shutdown();
 
     /* Perform final cleanup. */
@@ -3735,6 +4428,35 @@ void * mymalloc(size_t nbytes)
     return dummy;
 }
 
+/**
+ * mymalloc_aligned
+ *
+ *   Allocates some memory starting on a multiple of align and checks if
+ *   that succeeded or not. If it failed, do some errorlogging and bail out.
+ *   The memory is zeroed and released with free.
+ *
+ * Parameters:
+ *
+ *   nbytes - no. of bytes to allocate
+ *   align  - alignment, a power of two multiple of sizeof(void *)
+ *
+ * Returns: a pointer to the allocated memory
+ */
+void * mymalloc_aligned(size_t nbytes, size_t align)
+{
+    void *dummy = NULL;
+
+    if (posix_memalign(&dummy, align, nbytes)) {
+        MOTION_LOG(EMG, TYPE_ALL, SHOW_ERRNO, _("Could not allocate %llu bytes of memory!")
+            ,(unsigned long long)nbytes);
+        motion_remove_pid();
+        exit(1);
+    }
+    memset(dummy, 0, nbytes);
+
+    return dummy;
+}
+
 /**
  * myrealloc
  *
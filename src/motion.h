@@ -13,6 +13,7 @@
 /* Forward declarations, used in functional definitions of headers */
 struct images;
 struct image_data;
+struct image_view;
 
 #include "config.h"
 
@@ -62,6 +63,7 @@ struct image_data;
 #include "stream.h"
 
 #include "track.h"
+#include "framepool.h"
 #include "netcam.h"
 #include "netcam_rtsp.h"
 #include "ffmpeg.h"
@@ -188,6 +190,18 @@ struct image_data;
  * so we only have to send it out when/if we want.
  */
 
+/* Area, bounding box and coordinate sums of one connected area of motion */
+struct label_stats {
+    int area;
+    int minx;
+    int miny;
+    int maxx;
+    int maxy;
+    long long sumx;                   /* The centroid is sumx / area */
+    long long sumy;
+    int above;                        /* Area is above the threshold */
+};
+
 /* A image can have detected motion in it, but dosn't trigger an event, if we use minimum_motion_frames */
 #define IMAGE_MOTION     1
 #define IMAGE_TRIGGER    2
@@ -202,7 +216,8 @@ enum CAMERA_TYPE {
     CAMERA_TYPE_BKTR,
     CAMERA_TYPE_MMAL,
     CAMERA_TYPE_RTSP,
-    CAMERA_TYPE_NETCAM
+    CAMERA_TYPE_NETCAM,
+    CAMERA_TYPE_CROP
 };
 
 enum WEBUI_LEVEL{
@@ -229,9 +244,22 @@ struct vdev_context {
 };
 
 
+/*
+ * Location of the three planes of a YUV 4:2:0 image.  In a packed image the
+ * planes follow each other and each stride equals the width of its plane.
+ * A crop only moves the start of the planes and keeps the strides of the
+ * captured image so the pixels never need to be moved (see crop_map).
+ */
+struct image_view {
+    unsigned char *plane[3];    /* First pixel of the Y, U and V planes */
+    int stride[3];              /* Bytes from the start of one row to the next */
+};
+
 struct image_data {
     unsigned char *image_norm;
     unsigned char *image_high;
+    struct image_view view_norm;    /* Planes of image_norm */
+    struct image_view view_high;    /* Planes of image_high */
     int diffs;
     int64_t        idnbr_norm;
     int64_t        idnbr_high;
@@ -282,6 +310,22 @@ struct stream_data {
  *               and contain the capture dimensions. The difference between
  *               capture and output dimensions is explained above.
  *               These values are set in rotate_init.
+ *
+ * crop_data     The values in crop_data contain the dimensions of the image
+ *               after the rotation but before the crop. When cropping, imgs
+ *               holds the smaller dimensions after the crop while the image
+ *               ring buffers must still be able to receive a full capture of
+ *               crop_data.capture_size_norm bytes. These values are set in
+ *               crop_init. When the crop is combined with a rotation or
+ *               a flip (rotate_data.fused), rotate_map writes the cropped
+ *               image packed to rotate_data.buffer_norm and copies it back
+ *               to the start of the ring buffer. Otherwise a cropped image
+ *               in the ring is not moved; its view_norm and view_high point
+ *               into the captured image with the strides of the capture
+ *               (see crop_map). The virgin and privacy images are always
+ *               packed with the imgs dimensions. A camera with
+ *               conf.crop_source set has no device; it copies its crop from
+ *               the image published by the source.
  */
 
 /* date/time drawing, draw.c */
@@ -289,23 +333,55 @@ int draw_text(unsigned char *image,
               int width, int height,
               int startx, int starty,
               const char *text, int factor);
+int draw_text_view(struct image_view *view,
+              int width, int height,
+              int startx, int starty,
+              const char *text, int factor);
 int initialize_chars(void);
 
 struct images {
     struct image_data *image_ring;    /* The base address of the image ring buffer */
     int image_ring_size;
+    int image_ring_slots;             /* Slots allocated, at least image_ring_size */
+    int image_ring_raw;               /* Slots holding a raw image, fewer than the slots with pre_capture_raw */
+    struct framepool ring_pool;       /* Images of the slots of the ring */
+    struct framepool image_pool;      /* virgin, vprvcy, motion and preview images */
     int image_ring_in;                /* Index in image ring buffer we last added a image into */
     int image_ring_out;               /* Index in image ring buffer we want to process next time */
 
-    unsigned char *ref;               /* The reference frame */
-    struct image_data img_motion;     /* Picture buffer for motion images */
-    int *ref_dyn;                     /* Dynamic objects to be excluded from reference frame */
-    struct image_data image_virgin;   /* Last picture frame with no text or locate overlay */
+    unsigned char *image_detect;      /* Luma the detection runs on, image_vprvcy when not scaled */
+    int detect_scale;                 /* detection_scale in use, the image is detect_scale times */
+    int detect_width;                 /* the detection size in both directions */
+    int detect_height;
+    unsigned char *state;             /* Reference frame, masks and counters row by row, see alg.h */
+    int state_pitch;                  /* Bytes per byte field of a row of state */
+    unsigned int *tile_sad;           /* Difference to the reference per tile of the detection */
+    unsigned char *tile_map;          /* 1 for the tiles the diff of the frame looked at */
+    int tile_cols;
+    int tile_rows;
+    struct image_data img_motion;     /* Motion images, rendered from motion_bits when shown */
+    uint64_t *motion_bits;            /* One bit per detection pixel in motion, rows start new words */
+    int motion_stride;                /* Words per row of motion_bits */
+    int *motion_rows;                 /* Pixels in motion per row and column, valid while */
+    int *motion_cols;                 /* motion_counts is set by the diff or the despeckle */
+    int motion_counts;
+    int ref_fused;                    /* The fused detection updated state.ref for this frame */
+    long long noise_sum;              /* Sums of alg_noise_tune from the fused detection */
+    int noise_count;
+    int luma_valid;                   /* alg_luma_stats sampled the image of this frame */
+    int luma_count;                   /* Pixels of the sampling grid */
+    int luma_samples;                 /* Pixels of the grid the smart mask leaves in */
+    int luma_mean;                    /* Mean luma of the grid in the image */
+    int luma_ref_mean;                /* and in the reference frame */
+    int luma_diffs[256];              /* Masked differences to the reference on the grid */
+    struct image_data image_virgin;   /* Capture before the privacy mask, see image_source */
     struct image_data image_vprvcy;   /* Virgin image with the privacy mask applied */
+    struct image_data *image_source;  /* Image of the source stream, image_vprvcy when the privacy */
+                                      /* mask did not change it, NULL when nobody watches it */
     struct image_data preview_image;  /* Picture buffer for best image when enables */
+    struct image_data *preview_shared; /* Ring slot whose pixels preview_image still shares */
     unsigned char *mask;              /* Buffer for the mask file */
-    unsigned char *smartmask;
-    unsigned char *smartmask_final;
+    unsigned char *smartmask_final;   /* Copy of state.smartmask_final for the overlay */
     unsigned char *common_buffer;
     unsigned char *substream_image;
 
@@ -315,9 +391,13 @@ struct images {
     unsigned char *mask_privacy_high;      /* Buffer for the privacy mask values */
     unsigned char *mask_privacy_high_uv;   /* Buffer for the privacy U&V values */
 
-    int *smartmask_buffer;
     int *labels;
-    int *labelsize;
+    int *label_parent;                /* Union-find forest of the provisional labels */
+    struct label_stats *label_stats;  /* Indexed by label, 0 is unused */
+    int label_stats_size;
+    struct label_run *label_runs;     /* Runs of motion pixels found by the labeling */
+    int label_runs_size;
+    int label_runs_count;             /* Runs found by the last labeling */
     int width;
     int height;
     int type;
@@ -333,6 +413,7 @@ struct images {
     int labels_above;
     int labelsize_max;
     int largest_label;
+    int labels_total;
 };
 
 enum FLIP_TYPE {
@@ -341,14 +422,35 @@ enum FLIP_TYPE {
     FLIP_TYPE_VERTICAL
 };
 
+enum CROP_AUTO {
+    CROP_AUTO_OFF,
+    CROP_AUTO_SUGGEST,
+    CROP_AUTO_APPLY
+};
+
+/*
+ * Location in the captured plane of the first pixel of a transformed plane
+ * and the steps to take for the next column and the next row.
+ */
+struct rotmap {
+    int offset;               /* Source offset of the first pixel */
+    int step_x;               /* Source step for the next pixel of a row */
+    int step_y;               /* Source step for the next row */
+};
+
 /* Contains data for image rotation, see rotate.c. */
 struct rotdata {
 
-    unsigned char *buffer_norm;  /* Temporary buffer for 90 and 270 degrees rotation of normal resolution image. */
-    unsigned char *buffer_high;  /* Temporary buffer for 90 and 270 degrees rotation of high resolution image. */
+    unsigned char *buffer_norm;  /* Temporary buffer for the transformed normal resolution image. */
+    unsigned char *buffer_high;  /* Temporary buffer for the transformed high resolution image. */
     int degrees;              /* Degrees to rotate; copied from conf.rotate_deg. */
     enum FLIP_TYPE axis;      /* Rotate image over the Horizontal or Vertical axis. */
 
+    int fused;                         /* Rotation, flip and crop are done in one pass */
+    int fused_crop;                    /* The crop is part of the fused pass */
+    struct rotmap map_norm[3];         /* Transform of the Y, U and V planes of normal resolution image */
+    struct rotmap map_high[3];         /* Transform of the Y, U and V planes of high resolution image */
+
     int capture_width_norm;            /* Capture width of normal resolution image */
     int capture_height_norm;           /* Capture height of normal resolution image */
 
@@ -357,21 +459,56 @@ struct rotdata {
 
 };
 
+/*
+ * Latest capture of a camera that is shared with the cameras that crop
+ * their region from it (conf.crop_source), see crop.c.
+ */
+struct crop_share {
+    pthread_mutex_t mutex;
+    unsigned char *image;             /* Latest image after the rotation and before the crop */
+    int size;                         /* Number of bytes allocated for image */
+    int width;                        /* Width of image; zero until the source publishes */
+    int height;                       /* Height of image */
+    unsigned int frames;              /* Count of the images published */
+};
+
 /* Contains data for image cropping, see crop.c. */
 struct cropdata {
 
-  unsigned char* buffer_norm;
-  unsigned char* buffer_high;
-  int px_left;
-  int px_right;
-  int px_top;
-  int px_bottom;
-
-  int capture_width_norm;            /* Capture width of normal resolution image */
-  int capture_height_norm;           /* Capture height of normal resolution image */
-
-  int capture_width_high;            /* Capture width of high resolution image */
-  int capture_height_high;           /* Capture height of high resolution image */
+    int enabled;                      /* Whether any of the crop values are set */
+    int px_left;                      /* Pixels to remove from normal resolution image; copied from conf.crop_* */
+    int px_right;
+    int px_top;
+    int px_bottom;
+
+    int px_left_high;                 /* Pixels to remove from high resolution image */
+    int px_right_high;
+    int px_top_high;
+    int px_bottom_high;
+
+    int conf_left;                    /* conf.crop_* values the crop was set up from */
+    int conf_right;
+    int conf_top;
+    int conf_bottom;
+    unsigned int generation;          /* Counts the setups of the crop */
+
+    int capture_width_norm;            /* Width of normal resolution image before the crop */
+    int capture_height_norm;           /* Height of normal resolution image before the crop */
+    int capture_size_norm;             /* Number of bytes for normal resolution image before the crop */
+
+    int capture_width_high;            /* Width of high resolution image before the crop */
+    int capture_height_high;           /* Height of high resolution image before the crop */
+    int capture_size_high;             /* Number of bytes for high resolution image before the crop */
+
+    struct crop_share *share;          /* Captures published for other cameras, when this is a source */
+    struct crop_share *source;         /* Captures of the source camera, when conf.crop_source is set */
+    unsigned int source_frames;        /* source->frames of the last image taken from the source */
+
+    enum CROP_AUTO auto_mode;          /* Learning of the crop; copied from conf.crop_auto */
+    int auto_done;                     /* The learned crop was applied so learning has stopped */
+    time_t auto_start;                 /* Start of the current learning window */
+    unsigned int *auto_rows;           /* Motion pixels counted per row of the image */
+    unsigned int *auto_cols;           /* Motion pixels counted per column of the image */
 
 };
 
@@ -438,6 +575,9 @@ struct context {
     volatile int watchdog;
 
     pthread_t thread_id;
+    int scheduled;                     /* Run by the camera workers instead of thread_id */
+    struct scheduler_entry *scheduler_entry;   /* Entry of the camera on the camera workers */
+    int frame_stalled;                 /* The pass runs without a new frame of the source */
 
     int event_nr;
     int prev_event;
@@ -460,6 +600,7 @@ struct context {
     unsigned int lastrate;
     unsigned int startup_frames;
     unsigned int moved;
+    unsigned int ref_reset;                  /* Take the next image as the reference frame */
     unsigned int pause;
     int missing_frame_counter;               /* counts failed attempts to fetch picture frame from camera */
     unsigned int lost_connection;
@@ -497,6 +638,7 @@ struct context {
     struct ffmpeg   *ffmpeg_output;
     struct ffmpeg   *ffmpeg_output_motion;
     struct ffmpeg   *ffmpeg_timelapse;
+    struct pipeline *pipeline;          /* Output stage encoding ffmpeg_output, NULL when off */
     int             movie_passthrough;
 
     char timelapsefilename[PATH_MAX];
@@ -553,8 +695,10 @@ extern FILE *ptr_logfile;
 /* TLS keys below */
 extern pthread_key_t tls_key_threadnr; /* key for thread number */
 
+int motion_run(int argc, char **argv);
 int http_bindsock(int, int, int);
 void * mymalloc(size_t);
+void * mymalloc_aligned(size_t, size_t);
 void * myrealloc(void *, size_t, const char *);
 FILE * myfopen(const char *, const char *);
 int myfclose(FILE *);
@@ -14,6 +14,7 @@
 #include "translate.h"
 #include "motion.h"  /* Needs to come first, because _GNU_SOURCE_ set there. */
 #include "netcam_http.h"
+#include "scheduler.h"
 
 #define CONNECT_TIMEOUT        10     /* Timeout on remote connection attempt */
 #define READ_TIMEOUT            5     /* Default timeout on recv requests */
@@ -896,6 +897,9 @@ void netcam_image_read_complete(netcam_context_ptr netcam)
      */
     pthread_cond_signal(&netcam->pic_ready);
     pthread_mutex_unlock(&netcam->mutex);
+
+    /* On the camera workers the motion loop runs when the frame is there */
+    scheduler_ready(netcam->cnt);
 }
 
 /**
@@ -14,6 +14,7 @@
 #include "translate.h"
 #include "rotate.h"    /* already includes motion.h */
 #include "crop.h"
+#include "picture.h"
 
 /* This is a workaround regarding these defines.  The config.h file defines
  * HAVE_STDLIB_H as 1 whereas the jpeglib.h just defines it without a value.
@@ -348,72 +349,195 @@ static int netcam_init_jpeg(netcam_context_ptr netcam, j_decompress_ptr cinfo)
 }
 
 /**
- * netcam_image_conv
+ * netcam_image_row
+ *
+ *      Converts one decoded YCbCr scanline into the planes of a YUV420P image.
+ *
+ * Parameters:
+ *      wline           pointer to the decoded scanline (3 bytes per pixel)
+ *      pic             pointer to the Y row of the destination
+ *      upic            pointer to the U row of the destination
+ *      vpic            pointer to the V row of the destination
+ *      width           number of pixels to convert
+ *
+ * Returns:             Nothing
+ */
+static void netcam_image_row(const unsigned char *wline, unsigned char *pic,
+                             unsigned char *upic, unsigned char *vpic, int width)
+{
+    int indx;
+
+    for (indx = 0; indx < width; indx++) {
+        pic[indx] = wline[indx * 3];
+        if (indx & 1) {
+            upic[indx / 2] = wline[indx * 3 + 1];
+            vpic[indx / 2] = wline[indx * 3 + 2];
+        }
+    }
+}
+
+#ifdef HAVE_JPEG_CROP
+/**
+ * netcam_image_conv_crop
+ *
+ *      Decodes only the part of the JPEG that remains after the crop.  The
+ *      rows above and below the crop are skipped and only the iMCU columns
+ *      that overlap the crop are decoded.  The result is identical to a full
+ *      decode followed by crop_map.
  *
  * Parameters:
  *      netcam          pointer to netcam_context
  *      cinfo           pointer to JPEG decompression context
- *      image           pointer to buffer of destination image (yuv420)
+ *      pic             pointer to buffer of destination image (yuv420)
  *
- * Returns :  netcam->jpeg_error
+ * Returns:             Nothing
  */
-static int netcam_image_conv(netcam_context_ptr netcam,
-                               struct jpeg_decompress_struct *cinfo,
-                                struct image_data *img_data)
+static void netcam_image_conv_crop(netcam_context_ptr netcam,
+                                   struct jpeg_decompress_struct *cinfo,
+                                   unsigned char *pic)
+{
+    JSAMPARRAY      line;
+    JDIMENSION      xoffset, cwidth;
+    unsigned char  *upic, *vpic;
+    int             width, height, skip, row;
+    int             left, top, margin, lead;
+
+    width  = netcam->cnt->imgs.width;
+    height = netcam->cnt->imgs.height;
+    left   = netcam->cnt->crop_data.px_left;
+    top    = netcam->cnt->crop_data.px_top;
+
+    upic = pic + width * height;
+    vpic = upic + (width * height) / 4;
+
+    /*
+     * Fancy upsampling of the chroma uses the neighbouring samples, so one
+     * iMCU of margin is decoded around the crop and then discarded.  Without
+     * it the pixels at the edge of the crop would differ from a full decode.
+     */
+    margin = cinfo->max_h_samp_factor * DCTSIZE;
+    xoffset = (left > margin) ? (JDIMENSION)(left - margin) : 0;
+    cwidth  = (left - xoffset) + width + margin;
+    if (xoffset + cwidth > cinfo->output_width) cwidth = cinfo->output_width - xoffset;
+
+    /* Widened by the library to whole iMCU columns */
+    jpeg_crop_scanline(cinfo, &xoffset, &cwidth);
+    skip = (left - xoffset) * 3;
+
+    line = (cinfo->mem->alloc_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE,
+                                       cinfo->output_width * cinfo->output_components, 1);
+
+    margin = cinfo->max_v_samp_factor * DCTSIZE;
+    lead = (top > margin) ? margin : top;
+    if (top - lead > 0) jpeg_skip_scanlines(cinfo, top - lead);
+    while (lead-- > 0) jpeg_read_scanlines(cinfo, line, 1);
+
+    for (row = 0; row < height; row++) {
+        jpeg_read_scanlines(cinfo, line, 1);
+
+        netcam_image_row(line[0] + skip, pic, upic, vpic, width);
+
+        pic += width;
+        if (row & 1) {
+            upic += width / 2;
+            vpic += width / 2;
+        }
+    }
+
+    /* Finish requires that all scanlines were consumed */
+    jpeg_skip_scanlines(cinfo, cinfo->output_height - cinfo->output_scanline);
+}
+#endif
+
+/**
+ * netcam_image_conv_full
+ *
+ *      Decodes the full JPEG image.
+ *
+ * Parameters:
+ *      cinfo           pointer to JPEG decompression context
+ *      pic             pointer to buffer of destination image (yuv420)
+ *
+ * Returns:             Nothing
+ */
+static void netcam_image_conv_full(struct jpeg_decompress_struct *cinfo, unsigned char *pic)
 {
     JSAMPARRAY      line;           /* Array of decomp data lines */
-    unsigned char  *wline;          /* Will point to line[0] */
-    /* Working variables */
-    int             linesize, i;
     unsigned char  *upic, *vpic;
-    unsigned char  *pic = img_data->image_norm;
     unsigned char   y;              /* Switch for decoding YUV data */
     unsigned int    width, height;
 
     width = cinfo->output_width;
     height = cinfo->output_height;
 
-    if (width && ((width != netcam->width) || (height != netcam->height))) {
-        MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO
-            ,_("JPEG image size %dx%d, JPEG was %dx%d")
-            ,netcam->width, netcam->height, width, height);
-        jpeg_destroy_decompress(cinfo);
-        netcam->jpeg_error |= 4;
-        return netcam->jpeg_error;
-    }
     /* Set the output pointers (these come from YUV411P definition. */
     upic = pic + width * height;
     vpic = upic + (width * height) / 4;
 
-
-    /* YCbCr format will give us one byte each for YUV. */
-    linesize = cinfo->output_width * 3;
-
     /* Allocate space for one line. */
     line = (cinfo->mem->alloc_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE,
                                        cinfo->output_width * cinfo->output_components, 1);
 
-    wline = line[0];
     y = 0;
 
     while (cinfo->output_scanline < height) {
         jpeg_read_scanlines(cinfo, line, 1);
 
-        for (i = 0; i < linesize; i += 3) {
-            pic[i / 3] = wline[i];
-            if (i & 1) {
-                upic[(i / 3) / 2] = wline[i + 1];
-                vpic[(i / 3) / 2] = wline[i + 2];
-            }
-        }
+        /* YCbCr format will give us one byte each for YUV. */
+        netcam_image_row(line[0], pic, upic, vpic, width);
 
-        pic += linesize / 3;
+        pic += width;
 
         if (y++ & 1) {
             upic += width / 2;
             vpic += width / 2;
         }
     }
+}
+
+/**
+ * netcam_image_conv
+ *
+ * Parameters:
+ *      netcam          pointer to netcam_context
+ *      cinfo           pointer to JPEG decompression context
+ *      image           pointer to buffer of destination image (yuv420)
+ *
+ * Returns :  netcam->jpeg_error
+ */
+static int netcam_image_conv(netcam_context_ptr netcam,
+                               struct jpeg_decompress_struct *cinfo,
+                                struct image_data *img_data)
+{
+    unsigned int    width, height;
+    int             cropped;
+
+    width = cinfo->output_width;
+    height = cinfo->output_height;
+
+    if (width && ((width != netcam->width) || (height != netcam->height))) {
+        MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO
+            ,_("JPEG image size %dx%d, JPEG was %dx%d")
+            ,netcam->width, netcam->height, width, height);
+        jpeg_destroy_decompress(cinfo);
+        netcam->jpeg_error |= 4;
+        return netcam->jpeg_error;
+    }
+
+    /*
+     * When only cropping, let the decoder skip what crop_map would discard.
+     * Rotation and flipping need the full image.
+     */
+    cropped = FALSE;
+#ifdef HAVE_JPEG_CROP
+    if (crop_in_capture(netcam->cnt) &&
+        (netcam->cnt->rotate_data.degrees == 0) &&
+        (netcam->cnt->rotate_data.axis == FLIP_TYPE_NONE)) {
+        netcam_image_conv_crop(netcam, cinfo, img_data->image_norm);
+        cropped = TRUE;
+    }
+#endif
+    if (!cropped) netcam_image_conv_full(cinfo, img_data->image_norm);
 
     jpeg_finish_decompress(cinfo);
     jpeg_destroy_decompress(cinfo);
@@ -421,6 +545,12 @@ static int netcam_image_conv(netcam_context_ptr netcam,
     rotate_map(netcam->cnt, img_data);
     crop_map(netcam->cnt, img_data);
 
+    /* The decoded image is already packed at the cropped size */
+    if (cropped) {
+        pic_view_init(&img_data->view_norm, img_data->image_norm
+            , netcam->cnt->imgs.width, netcam->cnt->imgs.height);
+    }
+
     if (netcam->jpeg_error)
         MOTION_LOG(DBG, TYPE_NETCAM, NO_ERRNO,_("jpeg_error %d"), netcam->jpeg_error);
 
@@ -27,8 +27,10 @@
 #include "translate.h"
 #include "rotate.h"    /* already includes motion.h */
 #include "crop.h"
+#include "picture.h"
 #include "netcam_rtsp.h"
 #include "video_v4l2.h"  /* Needed to validate palette for v4l2 via netcam */
+#include "scheduler.h"
 
 #ifdef HAVE_FFMPEG
 
@@ -503,11 +505,66 @@ static int netcam_rtsp_interrupt(void *ctx){
     return FALSE;
 }
 
-static int netcam_rtsp_resize(struct rtsp_context *rtsp_data){
+static int netcam_rtsp_crop_rect(struct rtsp_context *rtsp_data, struct rtsp_crop *crop, int *src_rect){
+    /* Convert the crop into a source rectangle of the decoded frame.  The rectangle
+     * is aligned to the chroma subsampling of the decoded format so each plane can
+     * be offset by whole samples.  Returns -1 if the format can not be offset this way.
+     */
+#if (LIBAVFORMAT_VERSION_MAJOR >= 56)
+    const AVPixFmtDescriptor *desc;
+    int maskw, maskh;
+    int codec_w, codec_h;
+
+    desc = av_pix_fmt_desc_get(rtsp_data->codec_context->pix_fmt);
+    if (desc == NULL) return -1;
+    if (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)) return -1;
+
+    codec_w = rtsp_data->codec_context->width;
+    codec_h = rtsp_data->codec_context->height;
+    maskw = (1 << desc->log2_chroma_w) - 1;
+    maskh = (1 << desc->log2_chroma_h) - 1;
+
+    src_rect[0] = ((crop->left * codec_w) / rtsp_data->imgsize.width) & ~maskw;
+    src_rect[1] = ((crop->top * codec_h) / rtsp_data->imgsize.height) & ~maskh;
+    src_rect[2] = ((crop->size.width * codec_w) / rtsp_data->imgsize.width) & ~maskw;
+    src_rect[3] = ((crop->size.height * codec_h) / rtsp_data->imgsize.height) & ~maskh;
+
+    if ((src_rect[2] <= 0) || (src_rect[3] <= 0)) return -1;
+    if (src_rect[0] + src_rect[2] > codec_w) src_rect[2] = (codec_w - src_rect[0]) & ~maskw;
+    if (src_rect[1] + src_rect[3] > codec_h) src_rect[3] = (codec_h - src_rect[1]) & ~maskh;
+    if ((src_rect[2] <= 0) || (src_rect[3] <= 0)) return -1;
+
+    return 0;
+#else
+    /* Older versions do not provide the format flags needed to validate the format */
+    src_rect[0] = crop->left;
+    return -1;
+#endif
+}
+
+static void netcam_rtsp_crop_planes(struct rtsp_context *rtsp_data, int *src_rect){
+    /* Move the plane pointers of the input frame to the top left of the crop */
+    const AVPixFmtDescriptor *desc;
+    int indx, shift_h;
+
+    desc = av_pix_fmt_desc_get(rtsp_data->codec_context->pix_fmt);
+
+    for (indx = 0; indx < 4; indx++){
+        if (rtsp_data->swsframe_in->data[indx] == NULL) continue;
+        shift_h = ((indx == 1) || (indx == 2)) ? desc->log2_chroma_h : 0;
+        rtsp_data->swsframe_in->data[indx] +=
+            (src_rect[1] >> shift_h) * rtsp_data->swsframe_in->linesize[indx] +
+            av_image_get_linesize(rtsp_data->codec_context->pix_fmt, src_rect[0], indx);
+    }
+}
+
+static int netcam_rtsp_resize(struct rtsp_context *rtsp_data, struct rtsp_crop *crop){
 
     int      retcd;
     char     errstr[128];
     uint8_t *buffer_out;
+    int      src_rect[4];
+    int      dst_w, dst_h, dst_size;
 
     if (rtsp_data->finish) return -1;   /* This just speeds up the shutdown time */
 
@@ -527,14 +584,54 @@ static int netcam_rtsp_resize(struct rtsp_context *rtsp_data){
         return -1;
     }
 
-    buffer_out=(uint8_t *)av_malloc(rtsp_data->swsframe_size*sizeof(uint8_t));
+    /* When cropping, only the source rectangle of the crop is converted so the
+     * buffer handed to the motion thread already holds the cropped image.
+     */
+    rtsp_data->crop_recv = *crop;
+    if ((crop->enabled) && (netcam_rtsp_crop_rect(rtsp_data, crop, src_rect) < 0)) {
+        rtsp_data->crop_recv.enabled = FALSE;
+    }
+
+    if (rtsp_data->crop_recv.enabled) {
+        netcam_rtsp_crop_planes(rtsp_data, src_rect);
+        dst_w = crop->size.width;
+        dst_h = crop->size.height;
+        dst_size = my_image_get_buffer_size(MY_PIX_FMT_YUV420P, dst_w, dst_h);
+    } else {
+        src_rect[0] = 0;
+        src_rect[1] = 0;
+        src_rect[2] = rtsp_data->codec_context->width;
+        src_rect[3] = rtsp_data->codec_context->height;
+        dst_w = rtsp_data->imgsize.width;
+        dst_h = rtsp_data->imgsize.height;
+        dst_size = rtsp_data->swsframe_size;
+    }
+
+    rtsp_data->swsctx = sws_getCachedContext(
+         rtsp_data->swsctx
+        ,src_rect[2]
+        ,src_rect[3]
+        ,rtsp_data->codec_context->pix_fmt
+        ,dst_w
+        ,dst_h
+        ,MY_PIX_FMT_YUV420P
+        ,SWS_BICUBIC,NULL,NULL,NULL);
+    if (rtsp_data->swsctx == NULL) {
+        if (rtsp_data->status == RTSP_NOTCONNECTED){
+            MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, _("Unable to allocate scaling context."));
+        }
+        netcam_rtsp_close_context(rtsp_data);
+        return -1;
+    }
+
+    buffer_out=(uint8_t *)av_malloc(dst_size*sizeof(uint8_t));
 
     retcd=my_image_fill_arrays(
         rtsp_data->swsframe_out
         ,buffer_out
         ,MY_PIX_FMT_YUV420P
-        ,rtsp_data->imgsize.width
-        ,rtsp_data->imgsize.height);
+        ,dst_w
+        ,dst_h);
     if (retcd < 0) {
         if (rtsp_data->status == RTSP_NOTCONNECTED){
             av_strerror(retcd, errstr, sizeof(errstr));
@@ -550,7 +647,7 @@ static int netcam_rtsp_resize(struct rtsp_context *rtsp_data){
         ,(const uint8_t* const *)rtsp_data->swsframe_in->data
         ,rtsp_data->swsframe_in->linesize
         ,0
-        ,rtsp_data->codec_context->height
+        ,src_rect[3]
         ,rtsp_data->swsframe_out->data
         ,rtsp_data->swsframe_out->linesize);
     if (retcd < 0) {
@@ -567,9 +664,9 @@ static int netcam_rtsp_resize(struct rtsp_context *rtsp_data){
          rtsp_data->swsframe_out
         ,(uint8_t *)rtsp_data->img_recv->ptr
         ,MY_PIX_FMT_YUV420P
-        ,rtsp_data->imgsize.width
-        ,rtsp_data->imgsize.height
-        ,rtsp_data->swsframe_size);
+        ,dst_w
+        ,dst_h
+        ,dst_size);
     if (retcd < 0) {
         if (rtsp_data->status == RTSP_NOTCONNECTED){
             av_strerror(retcd, errstr, sizeof(errstr));
@@ -579,7 +676,7 @@ static int netcam_rtsp_resize(struct rtsp_context *rtsp_data){
         netcam_rtsp_close_context(rtsp_data);
         return -1;
     }
-    rtsp_data->img_recv->used = rtsp_data->swsframe_size;
+    rtsp_data->img_recv->used = dst_size;
 
     av_free(buffer_out);
 
@@ -592,6 +689,7 @@ static int netcam_rtsp_read_image(struct rtsp_context *rtsp_data){
     int  size_decoded;
     int  retcd;
     int  haveimage;
+    struct rtsp_crop crop;
     char errstr[128];
     netcam_buff *xchg;
 
@@ -657,12 +755,17 @@ static int netcam_rtsp_read_image(struct rtsp_context *rtsp_data){
      */
     if (!rtsp_data->first_image) rtsp_data->status = RTSP_CONNECTED;
 
+    pthread_mutex_lock(&rtsp_data->mutex);
+        crop = rtsp_data->crop;
+    pthread_mutex_unlock(&rtsp_data->mutex);
+
     /* Skip resize/pix format for high pass-through */
+    rtsp_data->crop_recv.enabled = FALSE;
     if (!(rtsp_data->high_resolution && rtsp_data->passthrough)){
         if ((rtsp_data->imgsize.width  != rtsp_data->codec_context->width) ||
             (rtsp_data->imgsize.height != rtsp_data->codec_context->height) ||
-            (netcam_rtsp_check_pixfmt(rtsp_data) != 0) ){
-            if (netcam_rtsp_resize(rtsp_data) < 0){
+            (netcam_rtsp_check_pixfmt(rtsp_data) != 0) || (crop.enabled) ){
+            if (netcam_rtsp_resize(rtsp_data, &crop) < 0){
                 my_packet_unref(rtsp_data->packet_recv);
                 netcam_rtsp_close_context(rtsp_data);
                 return -1;
@@ -677,9 +780,13 @@ static int netcam_rtsp_read_image(struct rtsp_context *rtsp_data){
             xchg = rtsp_data->img_latest;
             rtsp_data->img_latest = rtsp_data->img_recv;
             rtsp_data->img_recv = xchg;
+            rtsp_data->crop_latest = rtsp_data->crop_recv;
         }
     pthread_mutex_unlock(&rtsp_data->mutex);
 
+    /* On the camera workers the motion loop runs on the frames of the normal stream */
+    if (!rtsp_data->high_resolution) scheduler_ready(rtsp_data->cnt);
+
     my_packet_unref(rtsp_data->packet_recv);
 
     if (rtsp_data->format_context->streams[rtsp_data->video_stream_index]->avg_frame_rate.den > 0){
@@ -999,6 +1106,9 @@ static void netcam_rtsp_set_parms (struct context *cnt, struct rtsp_context *rts
     rtsp_data->handler_finished = TRUE;
     rtsp_data->first_image = TRUE;
     rtsp_data->reconnect_count = 0;
+    memset(&rtsp_data->crop, 0, sizeof(rtsp_data->crop));
+    memset(&rtsp_data->crop_recv, 0, sizeof(rtsp_data->crop_recv));
+    memset(&rtsp_data->crop_latest, 0, sizeof(rtsp_data->crop_latest));
     rtsp_data->decoder_nm = cnt->netcam_decoder;
     rtsp_data->cnt = cnt;
 
@@ -1031,6 +1141,36 @@ static void netcam_rtsp_set_parms (struct context *cnt, struct rtsp_context *rts
 
 }
 
+static void netcam_rtsp_set_crop(struct context *cnt, struct rtsp_context *rtsp_data){
+    /* Pass the crop over to the handler so it can be done within the scaling of
+     * the image.  The crop is only known once motion has initialized the crop
+     * module which is after the handler started, so this is done on the first
+     * image and again whenever the crop is set up anew.  It is called with the
+     * mutex of the context locked.  Rotation and flipping work on the full frame
+     * so in those cases the crop stays in crop_map.  The high resolution stream
+     * is not scaled so it is also left for crop_map.
+     */
+    if (rtsp_data->crop.generation == cnt->crop_data.generation) return;
+    rtsp_data->crop.generation = cnt->crop_data.generation;
+    rtsp_data->crop.enabled = FALSE;
+
+    if (!crop_in_capture(cnt)) return;
+    if (rtsp_data->high_resolution) return;
+    if ((cnt->rotate_data.degrees != 0) ||
+        (cnt->rotate_data.axis != FLIP_TYPE_NONE)) return;
+
+    rtsp_data->crop.left = cnt->crop_data.px_left;
+    rtsp_data->crop.top = cnt->crop_data.px_top;
+    rtsp_data->crop.size.width = cnt->imgs.width;
+    rtsp_data->crop.size.height = cnt->imgs.height;
+    rtsp_data->crop.enabled = TRUE;
+
+    MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO
+        ,_("%s: Cropping within the scaling of the image")
+        ,rtsp_data->cameratype);
+
+}
+
 static int netcam_rtsp_set_dimensions (struct context *cnt) {
 
     cnt->imgs.width = 0;
@@ -1601,6 +1741,7 @@ int netcam_rtsp_setup(struct context *cnt){
 int netcam_rtsp_next(struct context *cnt, struct image_data *img_data){
 #ifdef HAVE_FFMPEG
     /* This is called from the motion loop thread */
+    int crop_norm;
 
     if ((cnt->rtsp->status == RTSP_RECONNECTING) ||
         (cnt->rtsp->status == RTSP_NOTCONNECTED)){
@@ -1608,6 +1749,14 @@ int netcam_rtsp_next(struct context *cnt, struct image_data *img_data){
         }
     pthread_mutex_lock(&cnt->rtsp->mutex);
         netcam_rtsp_pktarray_resize(cnt, FALSE);
+        netcam_rtsp_set_crop(cnt, cnt->rtsp);
+        /* An image cropped by the handler for an earlier crop has the wrong size */
+        crop_norm = cnt->rtsp->crop_latest.enabled;
+        if ((crop_norm) &&
+            (cnt->rtsp->crop_latest.generation != cnt->rtsp->crop.generation)) {
+            pthread_mutex_unlock(&cnt->rtsp->mutex);
+            return 1;
+        }
         memcpy(img_data->image_norm
                , cnt->rtsp->img_latest->ptr
                , cnt->rtsp->img_latest->used);
@@ -1632,9 +1781,15 @@ int netcam_rtsp_next(struct context *cnt, struct image_data *img_data){
     /* Rotate images if requested */
     rotate_map(cnt, img_data);
 
-    /* Cropes images if requested */
+    /* Crop images if requested */
     crop_map(cnt,img_data);
-    
+
+    /* The handler already cropped the normal image so it is packed at the output size */
+    if (crop_norm) {
+        pic_view_init(&img_data->view_norm, img_data->image_norm
+            , cnt->imgs.width, cnt->imgs.height);
+    }
+
     return 0;
 
 #else  /* No FFmpeg/Libav */
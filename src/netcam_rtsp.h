@@ -16,6 +16,14 @@ struct imgsize_context {
     int                   height;
 };
 
+struct rtsp_crop {
+    int                   enabled;      /* Boolean for whether the crop is applied in the scaling step */
+    int                   left;         /* Pixels removed from the left of the image (in imgsize units) */
+    int                   top;          /* Pixels removed from the top of the image (in imgsize units) */
+    struct imgsize_context size;        /* The image size after cropping in the scaling step */
+    unsigned int          generation;   /* The setup of the motion crop this was taken from */
+};
+
 #ifdef HAVE_FFMPEG
 
 #include <libavcodec/avcodec.h>
@@ -69,6 +77,9 @@ struct rtsp_context {
     const char               *camera_name;      /* The name of the camera as provided in the config file */
     char                      cameratype[30];   /* String specifying Normal or High for use in logging */
     struct imgsize_context    imgsize;          /* The image size parameters */
+    struct rtsp_crop          crop;             /* The crop requested by the motion thread */
+    struct rtsp_crop          crop_recv;        /* The crop applied to img_recv */
+    struct rtsp_crop          crop_latest;      /* The crop applied to img_latest */
 
     int                       rtsp_uses_tcp;    /* Flag from config for whether to use tcp transport */
     int                       v4l2_palette;     /* Palette from config for v4l2 devices */
@@ -383,7 +383,7 @@ static void put_webp_exif(WebPMux* webp_mux,
  *      it to an already open file.
  *
  * Inputs:
- * - image is the image in YUV420P format.
+ * - view points to the planes of the image in YUV420P format.
  * - width and height are the dimensions of the image
  * - quality is the webp encoding quality 0-100%
  *
@@ -393,7 +393,7 @@ static void put_webp_exif(WebPMux* webp_mux,
  * Returns nothing
  */
 static void put_webp_yuv420p_file(FILE *fp,
-                  unsigned char *image, int width, int height,
+                  struct image_view *view, int width, int height,
                   int quality, struct context *cnt, struct timeval *tv1, struct coord *box)
 {
     /* Create a config present and check for compatible library version */
@@ -418,10 +418,12 @@ static void put_webp_yuv420p_file(FILE *fp,
         return;
     }
 
-    /* Map the input YUV420P buffer as individual Y, U and V pointers */
-    webp_image.y = image;
-    webp_image.u = image + width * height;
-    webp_image.v = webp_image.u + (width * height) / 4;
+    /* Map the input YUV420P planes as individual Y, U and V pointers */
+    webp_image.y = view->plane[0];
+    webp_image.u = view->plane[1];
+    webp_image.v = view->plane[2];
+    webp_image.y_stride = view->stride[0];
+    webp_image.uv_stride = view->stride[1];
 
     /* Setup the memory writting method */
     WebPMemoryWriter webp_writer;
@@ -476,7 +478,7 @@ static void put_webp_yuv420p_file(FILE *fp,
  *      it to an already open file.
  *
  * Inputs:
- * - image is the image in YUV420P format.
+ * - view points to the planes of the image in YUV420P format.
  * - width and height are the dimensions of the image
  * - quality is the jpeg encoding quality 0-100%
  *
@@ -486,7 +488,7 @@ static void put_webp_yuv420p_file(FILE *fp,
  * Returns nothing
  */
 static void put_jpeg_yuv420p_file(FILE *fp,
-                  unsigned char *image, int width, int height,
+                  struct image_view *view, int width, int height,
                   int quality,
                   struct context *cnt, struct timeval *tv1, struct coord *box)
 {
@@ -494,7 +496,7 @@ static void put_jpeg_yuv420p_file(FILE *fp,
     int image_size = cnt->imgs.size_norm;
     unsigned char *buf = mymalloc(image_size);
 
-    sz = jpgutl_put_yuv420p(buf, image_size, image, width, height, quality, cnt ,tv1, box);
+    sz = jpgutl_put_yuv420p(buf, image_size, view, width, height, quality, cnt ,tv1, box);
     fwrite(buf, sz, 1, fp);
 
     free(buf);
@@ -508,7 +510,7 @@ static void put_jpeg_yuv420p_file(FILE *fp,
  *      it to an already open file.
  *
  * Inputs:
- * - image is the image in greyscale format.
+ * - view points to the image in greyscale format.
  * - width and height are the dimensions of the image
  * - quality is the jpeg encoding quality 0-100%
  * Output:
@@ -516,7 +518,7 @@ static void put_jpeg_yuv420p_file(FILE *fp,
  *
  * Returns nothing
  */
-static void put_jpeg_grey_file(FILE *picture, unsigned char *image, int width, int height,
+static void put_jpeg_grey_file(FILE *picture, struct image_view *view, int width, int height,
                   int quality, struct context *cnt, struct timeval *tv1, struct coord *box)
 
 {
@@ -524,7 +526,7 @@ static void put_jpeg_grey_file(FILE *picture, unsigned char *image, int width, i
     int image_size = cnt->imgs.size_norm;
     unsigned char *buf = mymalloc(image_size);
 
-    sz = jpgutl_put_grey(buf, image_size, image, width, height, quality, cnt ,tv1, box);
+    sz = jpgutl_put_grey(buf, image_size, view, width, height, quality, cnt ,tv1, box);
     fwrite(buf, sz, 1, picture);
 
     free(buf);
@@ -536,7 +538,7 @@ static void put_jpeg_grey_file(FILE *picture, unsigned char *image, int width, i
  *      Converts an greyscale image to a PPM image and writes
  *      it to an already open file.
  * Inputs:
- * - image is the image in YUV420P format.
+ * - view points to the planes of the image in YUV420P format.
  * - width and height are the dimensions of the image
  *
  * Output:
@@ -544,12 +546,10 @@ static void put_jpeg_grey_file(FILE *picture, unsigned char *image, int width, i
  *
  * Returns nothing
  */
-static void put_ppm_bgr24_file(FILE *picture, unsigned char *image, int width, int height)
+static void put_ppm_bgr24_file(FILE *picture, struct image_view *view, int width, int height)
 {
     int x, y;
-    unsigned char *l = image;
-    unsigned char *u = image + width * height;
-    unsigned char *v = u + (width * height) / 4;
+    unsigned char *l, *u, *v;
     int r, g, b;
     unsigned char rgb[3];
 
@@ -562,6 +562,9 @@ static void put_ppm_bgr24_file(FILE *picture, unsigned char *image, int width, i
     fprintf(picture, "%d %d\n", width, height);
     fprintf(picture, "%d\n", 255);
     for (y = 0; y < height; y++) {
+        l = view->plane[0] + (y * view->stride[0]);
+        u = view->plane[1] + ((y / 2) * view->stride[1]);
+        v = view->plane[2] + ((y / 2) * view->stride[2]);
 
         for (x = 0; x < width; x++) {
             r = 76283 * (((int)*l) - 16)+104595*(((int)*u) - 128);
@@ -595,13 +598,24 @@ static void put_ppm_bgr24_file(FILE *picture, unsigned char *image, int width, i
             /* ppm is rgb not bgr */
             fwrite(rgb, 1, 3, picture);
         }
-        if (y%2 == 0) {
-            u -= width / 2;
-            v -= width / 2;
-        }
     }
 }
 
+/**
+ * overlay_detect_index
+ *      Index in the planes of the detection, such as the smart mask and
+ *      the labels, of the pixel x, y of the image.
+ */
+static int overlay_detect_index(struct images *imgs, int x, int y)
+{
+    x /= imgs->detect_scale;
+    y /= imgs->detect_scale;
+    if (x >= imgs->detect_width) x = imgs->detect_width - 1;
+    if (y >= imgs->detect_height) y = imgs->detect_height - 1;
+
+    return y * imgs->detect_width + x;
+}
+
 /**
  * overlay_smartmask
  *      Copies smartmask as an overlay into motion images and movies.
@@ -610,7 +624,7 @@ static void put_ppm_bgr24_file(FILE *picture, unsigned char *image, int width, i
  */
 void overlay_smartmask(struct context *cnt, unsigned char *out)
 {
-    int i, x, v, width, height, line;
+    int i, x, v, width, height;
     struct images *imgs = &cnt->imgs;
     unsigned char *smartmask = imgs->smartmask_final;
     unsigned char *out_y, *out_u, *out_v;
@@ -624,11 +638,11 @@ void overlay_smartmask(struct context *cnt, unsigned char *out)
     out_v = out + v;
     out_u = out + i;
     for (i = 0; i < height; i += 2) {
-        line = i * width;
         for (x = 0; x < width; x += 2) {
-            if (smartmask[line + x] == 0 || smartmask[line + x + 1] == 0 ||
-                smartmask[line + width + x] == 0 ||
-                smartmask[line + width + x + 1] == 0) {
+            if (smartmask[overlay_detect_index(imgs, x, i)] == 0 ||
+                smartmask[overlay_detect_index(imgs, x + 1, i)] == 0 ||
+                smartmask[overlay_detect_index(imgs, x, i + 1)] == 0 ||
+                smartmask[overlay_detect_index(imgs, x + 1, i + 1)] == 0) {
 
                 *out_v = 255;
                 *out_u = 128;
@@ -639,10 +653,12 @@ void overlay_smartmask(struct context *cnt, unsigned char *out)
     }
     out_y = out;
     /* Set colour intensity for smartmask. */
-    for (i = 0; i < imgs->motionsize; i++) {
-        if (smartmask[i] == 0)
-            *out_y = 0;
-        out_y++;
+    for (i = 0; i < height; i++) {
+        for (x = 0; x < width; x++) {
+            if (smartmask[overlay_detect_index(imgs, x, i)] == 0)
+                *out_y = 0;
+            out_y++;
+        }
     }
 }
 
@@ -698,8 +714,9 @@ void overlay_fixed_mask(struct context *cnt, unsigned char *out)
  */
 void overlay_largest_label(struct context *cnt, unsigned char *out)
 {
-    int i, x, v, width, height, line;
+    int i, x, v, width, height;
     struct images *imgs = &cnt->imgs;
+    struct label_stats *stats = imgs->label_stats;
     int *labels = imgs->labels;
     unsigned char *out_y, *out_u, *out_v;
 
@@ -712,11 +729,11 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
     out_u = out + i;
     out_v = out + v;
     for (i = 0; i < height; i += 2) {
-        line = i * width;
         for (x = 0; x < width; x += 2) {
-            if (labels[line + x] & 32768 || labels[line + x + 1] & 32768 ||
-                labels[line + width + x] & 32768 ||
-                labels[line + width + x + 1] & 32768) {
+            if (stats[labels[overlay_detect_index(imgs, x, i)]].above ||
+                stats[labels[overlay_detect_index(imgs, x + 1, i)]].above ||
+                stats[labels[overlay_detect_index(imgs, x, i + 1)]].above ||
+                stats[labels[overlay_detect_index(imgs, x + 1, i + 1)]].above) {
 
                 *out_u = 255;
                 *out_v = 128;
@@ -727,10 +744,12 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
     }
     out_y = out;
     /* Set intensity for coloured label to have better visibility. */
-    for (i = 0; i < imgs->motionsize; i++) {
-        if (*labels++ & 32768)
-            *out_y = 0;
-        out_y++;
+    for (i = 0; i < height; i++) {
+        for (x = 0; x < width; x++) {
+            if (stats[labels[overlay_detect_index(imgs, x, i)]].above)
+                *out_y = 0;
+            out_y++;
+        }
     }
 }
 
@@ -741,7 +760,7 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
  * Inputs:
  * - cnt is the thread context struct
  * - image_size is the size of the input image buffer
- * - *image points to the image buffer that contains the YUV420P or Grayscale image about to be put
+ * - *view points to the planes of the YUV420P or Grayscale image about to be put
  * - quality is the jpeg quality setting from the config file.
  *
  * Output:
@@ -750,7 +769,7 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
  *
  * Returns the dest_image_size if successful. Otherwise 0.
  */
-int put_picture_memory(struct context *cnt, unsigned char* dest_image, int image_size, unsigned char *image,
+int put_picture_memory(struct context *cnt, unsigned char* dest_image, int image_size, struct image_view *view,
         int quality, int width, int height)
 {
     struct timeval tv1;
@@ -762,17 +781,17 @@ int put_picture_memory(struct context *cnt, unsigned char* dest_image, int image
     gettimeofday(&tv1, NULL);
 
     if (!cnt->conf.stream_grey){
-        return jpgutl_put_yuv420p(dest_image, image_size, image,
+        return jpgutl_put_yuv420p(dest_image, image_size, view,
                                        width, height, quality, cnt ,&tv1,NULL);
     } else {
-        return jpgutl_put_grey(dest_image, image_size, image,
+        return jpgutl_put_grey(dest_image, image_size, view,
                                        width, height, quality, cnt,&tv1,NULL);
     }
 
     return 0;
 }
 
-static void put_picture_fd(struct context *cnt, FILE *picture, unsigned char *image, int quality, int ftype){
+static void put_picture_fd(struct context *cnt, FILE *picture, struct image_view *view, int quality, int ftype){
     int width, height;
     int passthrough;
     int dummy = 1;
@@ -789,23 +808,23 @@ static void put_picture_fd(struct context *cnt, FILE *picture, unsigned char *im
     }
 
     if (cnt->imgs.picture_type == IMAGE_TYPE_PPM) {
-        put_ppm_bgr24_file(picture, image, width, height);
+        put_ppm_bgr24_file(picture, view, width, height);
     } else {
         if (dummy == 1){
             #ifdef HAVE_WEBP
             if (cnt->imgs.picture_type == IMAGE_TYPE_WEBP)
-                put_webp_yuv420p_file(picture, image, width, height, quality, cnt, &(cnt->current_image->timestamp_tv), &(cnt->current_image->location));
+                put_webp_yuv420p_file(picture, view, width, height, quality, cnt, &(cnt->current_image->timestamp_tv), &(cnt->current_image->location));
             #endif /* HAVE_WEBP */
             if (cnt->imgs.picture_type == IMAGE_TYPE_JPEG)
-                put_jpeg_yuv420p_file(picture, image, width, height, quality, cnt, &(cnt->current_image->timestamp_tv), &(cnt->current_image->location));
+                put_jpeg_yuv420p_file(picture, view, width, height, quality, cnt, &(cnt->current_image->timestamp_tv), &(cnt->current_image->location));
         } else {
-            put_jpeg_grey_file(picture, image, width, height, quality, cnt, &(cnt->current_image->timestamp_tv), &(cnt->current_image->location));
+            put_jpeg_grey_file(picture, view, width, height, quality, cnt, &(cnt->current_image->timestamp_tv), &(cnt->current_image->location));
        }
     }
 }
 
 
-void put_picture(struct context *cnt, char *file, unsigned char *image, int ftype)
+void put_picture(struct context *cnt, char *file, struct image_view *view, int ftype)
 {
     FILE *picture;
 
@@ -827,7 +846,7 @@ void put_picture(struct context *cnt, char *file, unsigned char *image, int ftyp
         }
     }
 
-    put_picture_fd(cnt, picture, image, cnt->conf.picture_quality, ftype);
+    put_picture_fd(cnt, picture, view, cnt->conf.picture_quality, ftype);
 
     myfclose(picture);
 }
@@ -969,20 +988,91 @@ void put_fixed_mask(struct context *cnt, const char *file)
         "re-run motion to enable mask feature"), cnt->conf.mask_file);
 }
 
-void pic_scale_img(int width_src, int height_src, unsigned char *img_src, unsigned char *img_dst){
+/**
+ * pic_scale_img
+ *      Scales the image described by view_src down to half of its width and
+ *      height by taking every other pixel of every other row of each plane.
+ *      The result is written packed to img_dst.
+ */
+void pic_scale_img(int width_src, int height_src, struct image_view *view_src, unsigned char *img_dst){
+
+    int i = 0, x, y, indx;
+    unsigned char *row;
 
-    int i = 0, x, y;
-    for (y = 0; y < height_src; y+=2)
+    for (y = 0; y < height_src; y+=2) {
+        row = view_src->plane[0] + (y * view_src->stride[0]);
         for (x = 0; x < width_src; x+=2)
-            img_dst[i++] = img_src[y * width_src + x];
+            img_dst[i++] = row[x];
+    }
 
-    for (y = 0; y < height_src / 2; y+=2)
-       for (x = 0; x < width_src; x += 4)
-       {
-          img_dst[i++] = img_src[(width_src * height_src) + (y * width_src) + x];
-          img_dst[i++] = img_src[(width_src * height_src) + (y * width_src) + (x + 1)];
-       }
+    for (indx = 1; indx < 3; indx++) {
+        for (y = 0; y < height_src / 2; y+=2) {
+            row = view_src->plane[indx] + (y * view_src->stride[indx]);
+            for (x = 0; x < width_src / 2; x+=2)
+                img_dst[i++] = row[x];
+        }
+    }
 
     return;
 }
 
+/**
+ * pic_view_init
+ *      Sets the view to describe a packed YUV420P image stored in img.
+ */
+void pic_view_init(struct image_view *view, unsigned char *img, int width, int height){
+
+    view->plane[0] = img;
+    view->plane[1] = img + (width * height);
+    view->plane[2] = view->plane[1] + ((width * height) / 4);
+    view->stride[0] = width;
+    view->stride[1] = width / 2;
+    view->stride[2] = width / 2;
+
+}
+
+/**
+ * pic_view_packed
+ *      Returns TRUE when the view describes a packed image stored in img.
+ */
+int pic_view_packed(struct image_view *view, unsigned char *img, int width, int height){
+
+    return ((view->plane[0] == img) &&
+        (view->plane[1] == img + (width * height)) &&
+        (view->plane[2] == img + (width * height) + ((width * height) / 4)) &&
+        (view->stride[0] == width) && (view->stride[1] == width / 2) &&
+        (view->stride[2] == width / 2));
+
+}
+
+/**
+ * pic_view_copy
+ *      Copies the image described by view into img as a packed YUV420P image.
+ *      The rows are copied in order starting from the first row of the Y plane
+ *      so img may be the start of the buffer the view points into.  Such a
+ *      copy packs the image in place.
+ */
+void pic_view_copy(unsigned char *img, struct image_view *view, int width, int height){
+
+    int indx, y, widthp, heightp;
+    unsigned char *src;
+
+    if (pic_view_packed(view, img, width, height)) return;
+
+    for (indx = 0; indx < 3; indx++) {
+        widthp  = (indx == 0) ? width : width / 2;
+        heightp = (indx == 0) ? height : height / 2;
+        src = view->plane[indx];
+        if ((src == img) && (view->stride[indx] == widthp)) {
+            img += widthp * heightp;
+            continue;
+        }
+        for (y = 0; y < heightp; y++) {
+            memmove(img, src, widthp);
+            img += widthp;
+            src += view->stride[indx];
+        }
+    }
+
+}
+
@@ -16,11 +16,14 @@ void overlay_smartmask(struct context *, unsigned char *);
 void overlay_fixed_mask(struct context *, unsigned char *);
 void put_fixed_mask(struct context *, const char *);
 void overlay_largest_label(struct context *, unsigned char *);
-int put_picture_memory(struct context *, unsigned char*, int, unsigned char *, int, int, int);
-void put_picture(struct context *, char *, unsigned char *, int);
+int put_picture_memory(struct context *, unsigned char*, int, struct image_view *, int, int, int);
+void put_picture(struct context *, char *, struct image_view *, int);
 unsigned char *get_pgm(FILE *, int, int);
 void preview_save(struct context *);
-void pic_scale_img(int width_src, int height_src, unsigned char *img_src, unsigned char *img_dst);
+void pic_scale_img(int width_src, int height_src, struct image_view *view_src, unsigned char *img_dst);
+void pic_view_init(struct image_view *view, unsigned char *img, int width, int height);
+int pic_view_packed(struct image_view *view, unsigned char *img, int width, int height);
+void pic_view_copy(unsigned char *img, struct image_view *view, int width, int height);
 
 unsigned prepare_exif(unsigned char **, const struct context *, const struct timeval *, const struct coord *);
 
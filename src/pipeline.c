@@ -0,0 +1,256 @@
+/*
+ *    pipeline.c
+ *
+ *    Output stage of a camera.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    The camera thread captures and detects.  With movie_output_queue the
+ *    encoding of the movie frames moves to a thread of its own so a slow
+ *    encoder no longer holds up the next capture.  The two threads share a
+ *    bounded single producer, single consumer queue of frame slots: the
+ *    camera thread copies a frame into the slot at head and publishes it by
+ *    advancing head, the output stage encodes the slot at tail and releases
+ *    it by advancing tail.  Each index is written by one thread only, so
+ *    the handoff itself takes no lock; the mutex only serves to sleep on an
+ *    empty or full queue.
+ */
+#include "translate.h"
+#include "motion.h"
+#include "ffmpeg.h"
+#include "picture.h"
+#include "pipeline.h"
+
+struct pipeline_slot {
+    struct image_data       img;        /* Frame with its pixels in buffer */
+    struct timeval          tv;
+    struct ffmpeg           *ffmpeg;
+    unsigned char           *buffer;
+    int                     size;       /* Bytes allocated in buffer */
+};
+
+struct pipeline {
+    struct context          *cnt;
+    struct pipeline_slot    *slots;
+    unsigned int            count;      /* Number of slots */
+    unsigned int            head;       /* Slots filled, advanced by the camera thread */
+    unsigned int            tail;       /* Slots encoded, advanced by the output stage */
+    int                     finish;
+    pthread_t               thread;
+    pthread_mutex_t         mutex;
+    pthread_cond_t          filled;
+    pthread_cond_t          emptied;
+
+    /* Counters of the camera thread */
+    unsigned long           queued;
+    unsigned long           dropped;    /* Frames lost with movie_output_drop */
+    unsigned long           waits;      /* Times the camera thread waited for a slot */
+    unsigned int            depth_max;  /* Most frames queued at a time */
+    unsigned long           logged;     /* queued at the last log */
+
+    /* Counters of the output stage */
+    unsigned long           encoded;
+    unsigned long           errors;
+};
+
+static void *pipeline_loop(void *arg)
+{
+    struct pipeline *pl = arg;
+    struct pipeline_slot *slot;
+    unsigned int tail;
+
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)pl->cnt->threadnr));
+    util_threadname_set("mo", pl->cnt->threadnr, pl->cnt->conf.camera_name);
+
+    pthread_mutex_lock(&pl->mutex);
+    for (;;) {
+        tail = pl->tail;
+        if (tail == __atomic_load_n(&pl->head, __ATOMIC_ACQUIRE)) {
+            if (pl->finish) break;
+            pthread_cond_wait(&pl->filled, &pl->mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&pl->mutex);
+
+        slot = &pl->slots[tail % pl->count];
+        if (ffmpeg_put_image(slot->ffmpeg, &slot->img, &slot->tv) == -1) {
+            MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, _("Error encoding image"));
+            pl->errors++;
+        }
+        pl->encoded++;
+        __atomic_store_n(&pl->tail, tail + 1, __ATOMIC_RELEASE);
+
+        pthread_mutex_lock(&pl->mutex);
+        pthread_cond_broadcast(&pl->emptied);
+    }
+    pthread_mutex_unlock(&pl->mutex);
+
+    return NULL;
+}
+
+/**
+ * pipeline_log
+ *
+ *  Logs the counters of both ends of the queue. Only called once the
+ *  output stage finished the queued frames, so its counters are settled.
+ */
+static void pipeline_log(struct pipeline *pl)
+{
+    MOTION_LOG(INF, TYPE_EVENTS, NO_ERRNO
+        ,_("Output stage: %lu frames queued, %lu encoded, %lu errors, %lu dropped"
+           ", %lu waits for a slot, at most %u of %u slots in use")
+        ,pl->queued, pl->encoded, pl->errors, pl->dropped
+        ,pl->waits, pl->depth_max, pl->count);
+    pl->logged = pl->queued;
+}
+
+void pipeline_start(struct context *cnt)
+{
+    struct pipeline *pl = cnt->pipeline;
+    unsigned int count = cnt->conf.movie_output_queue;
+
+    if (pl != NULL) {
+        if (pl->count == count) return;
+        pipeline_stop(cnt);
+    }
+    if (count == 0) return;
+
+    pl = mymalloc(sizeof(struct pipeline));
+    pl->cnt = cnt;
+    pl->slots = mymalloc(count * sizeof(struct pipeline_slot));
+    pl->count = count;
+    pthread_mutex_init(&pl->mutex, NULL);
+    pthread_cond_init(&pl->filled, NULL);
+    pthread_cond_init(&pl->emptied, NULL);
+
+    if (pthread_create(&pl->thread, NULL, pipeline_loop, pl)) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
+            ,_("Unable to start the output stage thread"));
+        pthread_cond_destroy(&pl->emptied);
+        pthread_cond_destroy(&pl->filled);
+        pthread_mutex_destroy(&pl->mutex);
+        free(pl->slots);
+        free(pl);
+        /* Do not try again every second */
+        cnt->conf.movie_output_queue = 0;
+        return;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+        ,_("Output stage started with %u slots"), count);
+
+    cnt->pipeline = pl;
+}
+
+void pipeline_stop(struct context *cnt)
+{
+    struct pipeline *pl = cnt->pipeline;
+    unsigned int indx;
+
+    if (pl == NULL) return;
+
+    pthread_mutex_lock(&pl->mutex);
+    pl->finish = TRUE;
+    pthread_cond_signal(&pl->filled);
+    pthread_mutex_unlock(&pl->mutex);
+
+    pthread_join(pl->thread, NULL);
+
+    if (pl->queued != pl->logged) pipeline_log(pl);
+
+    for (indx = 0; indx < pl->count; indx++)
+        free(pl->slots[indx].buffer);
+    pthread_cond_destroy(&pl->emptied);
+    pthread_cond_destroy(&pl->filled);
+    pthread_mutex_destroy(&pl->mutex);
+    free(pl->slots);
+    free(pl);
+
+    cnt->pipeline = NULL;
+}
+
+int pipeline_put(struct context *cnt, struct ffmpeg *ffmpeg
+    , struct image_data *img_data, const struct timeval *tv1)
+{
+    struct pipeline *pl = cnt->pipeline;
+    struct pipeline_slot *slot;
+    unsigned int head, depth;
+    int width, height, size;
+
+    if (pl == NULL) return -1;
+
+    /*
+     * Passthrough writes the packets of the camera, which its packet array
+     * only keeps for as far as the ring of images reaches back. A frame
+     * waiting in the queue could find its packets overwritten already.
+     */
+    if (ffmpeg->passthrough) return -1;
+
+    head = pl->head;
+    if (head - __atomic_load_n(&pl->tail, __ATOMIC_ACQUIRE) == pl->count) {
+        if (cnt->conf.movie_output_drop) {
+            pl->dropped++;
+            return 0;
+        }
+        pl->waits++;
+        pthread_mutex_lock(&pl->mutex);
+        while (head - __atomic_load_n(&pl->tail, __ATOMIC_ACQUIRE) == pl->count)
+            pthread_cond_wait(&pl->emptied, &pl->mutex);
+        pthread_mutex_unlock(&pl->mutex);
+    }
+
+    slot = &pl->slots[head % pl->count];
+    slot->img = *img_data;
+    slot->tv = *tv1;
+    slot->ffmpeg = ffmpeg;
+
+    /* Only the image of the resolution of the movie is copied */
+    slot->img.image_norm = NULL;
+    slot->img.image_high = NULL;
+    memset(&slot->img.view_norm, 0, sizeof(struct image_view));
+    memset(&slot->img.view_high, 0, sizeof(struct image_view));
+    width = ffmpeg->width;
+    height = ffmpeg->height;
+    size = (width * height * 3) / 2;
+    if (slot->size < size) {
+        free(slot->buffer);
+        slot->buffer = mymalloc(size);
+        slot->size = size;
+    }
+    if (ffmpeg->high_resolution) {
+        pic_view_copy(slot->buffer, &img_data->view_high, width, height);
+        slot->img.image_high = slot->buffer;
+        pic_view_init(&slot->img.view_high, slot->buffer, width, height);
+    } else {
+        pic_view_copy(slot->buffer, &img_data->view_norm, width, height);
+        slot->img.image_norm = slot->buffer;
+        pic_view_init(&slot->img.view_norm, slot->buffer, width, height);
+    }
+
+    __atomic_store_n(&pl->head, head + 1, __ATOMIC_RELEASE);
+
+    pl->queued++;
+    depth = head + 1 - __atomic_load_n(&pl->tail, __ATOMIC_ACQUIRE);
+    if (depth > pl->depth_max) pl->depth_max = depth;
+
+    pthread_mutex_lock(&pl->mutex);
+    pthread_cond_signal(&pl->filled);
+    pthread_mutex_unlock(&pl->mutex);
+
+    return 0;
+}
+
+void pipeline_drain(struct context *cnt)
+{
+    struct pipeline *pl = cnt->pipeline;
+
+    if (pl == NULL) return;
+
+    pthread_mutex_lock(&pl->mutex);
+    while (__atomic_load_n(&pl->tail, __ATOMIC_ACQUIRE) != pl->head)
+        pthread_cond_wait(&pl->emptied, &pl->mutex);
+    pthread_mutex_unlock(&pl->mutex);
+
+    if (pl->queued != pl->logged) pipeline_log(pl);
+}
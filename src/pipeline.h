@@ -0,0 +1,80 @@
+/*
+ *    pipeline.h
+ *
+ *    Include file for the output stage of a camera.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_PIPELINE_H
+#define _INCLUDE_PIPELINE_H
+
+/* Most slots of the queue of the output stage */
+#define PIPELINE_QUEUE_MAX  300
+
+struct ffmpeg;
+
+/**
+ * pipeline_start
+ *
+ *  Starts the output stage thread of the camera when movie_output_queue
+ *  is above 0. Without it the movie frames are encoded by the camera
+ *  thread as before.
+ *
+ * Parameters:
+ *
+ *  cnt - context of the camera
+ *
+ * Returns: nothing
+ */
+void pipeline_start(struct context *cnt);
+
+/**
+ * pipeline_stop
+ *
+ *  Encodes the frames still queued, ends the output stage thread and logs
+ *  its counters.
+ *
+ * Parameters:
+ *
+ *  cnt - context of the camera
+ *
+ * Returns: nothing
+ */
+void pipeline_stop(struct context *cnt);
+
+/**
+ * pipeline_put
+ *
+ *  Copies a frame into a free slot of the queue of the output stage, which
+ *  encodes it into the movie. When all slots are taken the camera thread
+ *  waits for one, or with movie_output_drop the frame is dropped.
+ *
+ * Parameters:
+ *
+ *  cnt      - context of the camera
+ *  ffmpeg   - movie receiving the frame
+ *  img_data - frame to encode
+ *  tv1      - time of the frame
+ *
+ * Returns: 0 when the output stage took the frame, -1 when it is not running
+ *          or the movie is written with passthrough
+ */
+int pipeline_put(struct context *cnt, struct ffmpeg *ffmpeg
+    , struct image_data *img_data, const struct timeval *tv1);
+
+/**
+ * pipeline_drain
+ *
+ *  Waits until the output stage encoded all queued frames. Must be called
+ *  before the camera thread touches a movie the output stage writes to.
+ *
+ * Parameters:
+ *
+ *  cnt - context of the camera
+ *
+ * Returns: nothing
+ */
+void pipeline_drain(struct context *cnt);
+
+#endif
@@ -31,6 +31,7 @@
  */
 #include "translate.h"
 #include "rotate.h"
+#include "crop.h"
 #include <stdint.h>
 #if defined(__APPLE__)
 #include <libkern/OSByteOrder.h>
@@ -108,70 +109,155 @@ static void flip_inplace_vertical(unsigned char *src, int width, int height)
     }
 }
 
+/* Size of the square blocks of pixels transformed at a time */
+#define ROTATE_TILE 32
+
 /**
- * rot90cw
+ * rotate_src_offset
  *
- *  Performs a 90 degrees clockwise rotation of the memory block pointed to
- *  by src. The rotation is NOT performed in-place; dst must point to a
- *  receiving memory block the same size as src.
+ *  Finds where the pixel at column x and row y of the rotated (but not yet
+ *  cropped) plane is located in the captured plane. The flip is applied to
+ *  the captured plane before the rotation.
  *
  * Parameters:
  *
- *   src    - pointer to the memory block (image) to rotate clockwise
- *   dst    - where to put the rotated memory block
- *   size   - the size (in bytes) of the memory blocks (both src and dst)
- *   width  - the width of the memory block when seen as an image
- *   height - the height of the memory block when seen as an image
+ *   cnt    - the current thread's context structure
+ *   width  - the width of the captured plane
+ *   height - the height of the captured plane
+ *   x      - the column in the rotated plane
+ *   y      - the row in the rotated plane
  *
- * Returns: nothing
+ * Returns: the offset of the pixel from the start of the captured plane
  */
-static void rot90cw(unsigned char *src, register unsigned char *dst, int size,
-                    int width, int height)
+static int rotate_src_offset(struct context *cnt, int width, int height, int x, int y)
 {
-    unsigned char *endp;
-    register unsigned char *base;
-    int j;
-
-    endp = src + size;
-    for (base = endp - width; base < endp; base++) {
-        src = base;
-        for (j = 0; j < height; j++, src -= width)
-            *dst++ = *src;
+    int fx, fy;
+
+    switch (cnt->rotate_data.degrees) {
+    case 90:
+        fx = y;
+        fy = height - 1 - x;
+        break;
+    case 180:
+        fx = width - 1 - x;
+        fy = height - 1 - y;
+        break;
+    case 270:
+        fx = width - 1 - y;
+        fy = x;
+        break;
+    default:
+        fx = x;
+        fy = y;
+        break;
+    }
 
+    if (cnt->rotate_data.axis == FLIP_TYPE_HORIZONTAL) {
+        fy = height - 1 - fy;
+    } else if (cnt->rotate_data.axis == FLIP_TYPE_VERTICAL) {
+        fx = width - 1 - fx;
     }
+
+    return (fy * width) + fx;
 }
 
 /**
- * rot90ccw
+ * rotate_map_plane
  *
- *  Performs a 90 degrees counterclockwise rotation of the memory block pointed
- *  to by src. The rotation is not performed in-place; dst must point to a
- *  receiving memory block the same size as src.
+ *  Sets up the transform of one plane.
  *
  * Parameters:
  *
- *   src    - pointer to the memory block (image) to rotate counterclockwise
- *   dst    - where to put the rotated memory block
- *   size   - the size (in bytes) of the memory blocks (both src and dst)
- *   width  - the width of the memory block when seen as an image
- *   height - the height of the memory block when seen as an image
+ *   cnt    - the current thread's context structure
+ *   map    - the transform to set up
+ *   width  - the width of the captured plane
+ *   height - the height of the captured plane
+ *   left   - columns removed by the crop on the left of the rotated plane
+ *   top    - rows removed by the crop on the top of the rotated plane
  *
  * Returns: nothing
  */
-static inline void rot90ccw(unsigned char *src, register unsigned char *dst,
-                            int size, int width, int height)
+static void rotate_map_plane(struct context *cnt, struct rotmap *map
+            , int width, int height, int left, int top)
 {
-    unsigned char *endp;
-    register unsigned char *base;
-    int j;
+    map->offset = rotate_src_offset(cnt, width, height, left, top);
+    map->step_x = rotate_src_offset(cnt, width, height, left + 1, top) - map->offset;
+    map->step_y = rotate_src_offset(cnt, width, height, left, top + 1) - map->offset;
+}
+
+/**
+ * rotate_transform_plane
+ *
+ *  Writes the transformed plane packed to dst. When the rows of the source
+ *  are not walked in order (90 and 270 degrees) the plane is processed in
+ *  square tiles so the source lines used by a tile stay in the cache.
+ *
+ * Parameters:
+ *
+ *   src    - the first byte of the captured plane
+ *   dst    - where to put the transformed plane
+ *   width  - the width of the transformed plane
+ *   height - the height of the transformed plane
+ *   map    - the transform of the plane
+ *
+ * Returns: nothing
+ */
+static void rotate_transform_plane(const unsigned char *src, unsigned char *dst
+            , int width, int height, const struct rotmap *map)
+{
+    const unsigned char *psrc;
+    unsigned char *pdst;
+    int x, y, tile_x, tile_y, max_x, max_y;
+
+    src += map->offset;
+
+    if (map->step_x == 1) {
+        for (y = 0; y < height; y++) {
+            memcpy(dst, src, width);
+            src += map->step_y;
+            dst += width;
+        }
+        return;
+    }
+
+    for (tile_y = 0; tile_y < height; tile_y += ROTATE_TILE) {
+        max_y = tile_y + ROTATE_TILE;
+        if (max_y > height) max_y = height;
+        for (tile_x = 0; tile_x < width; tile_x += ROTATE_TILE) {
+            max_x = tile_x + ROTATE_TILE;
+            if (max_x > width) max_x = width;
+            for (x = tile_x; x < max_x; x++) {
+                psrc = src + (tile_y * map->step_y) + (x * map->step_x);
+                pdst = dst + (tile_y * width) + x;
+                for (y = tile_y; y < max_y; y++) {
+                    *pdst = *psrc;
+                    pdst += width;
+                    psrc += map->step_y;
+                }
+            }
+        }
+    }
+}
 
-    endp = src + size;
-    dst = dst + size - 1;
-    for (base = endp - width; base < endp; base++) {
-        src = base;
-        for (j = 0; j < height; j++, src -= width)
-            *dst-- = *src;
+/**
+ * rotate_axis
+ *
+ *  Converts conf.flip_axis into the flip type.
+ *
+ * Parameters:
+ *
+ *   cnt - the current thread's context structure
+ *
+ * Returns: the flip type
+ */
+static enum FLIP_TYPE rotate_axis(struct context *cnt){
 
+    if (cnt->conf.flip_axis[0]=='h') {
+        return FLIP_TYPE_HORIZONTAL;
+    } else if (cnt->conf.flip_axis[0]=='v') {
+        return FLIP_TYPE_VERTICAL;
+    } else {
+        return FLIP_TYPE_NONE;
     }
 }
 
@@ -188,11 +274,13 @@ static inline void rot90ccw(unsigned char *src, register unsigned char *dst,
  * Returns: nothing
  */
 void rotate_init(struct context *cnt){
-    int size_norm, size_high;
+    int size_high;
 
     /* Make sure buffer_norm isn't freed if it hasn't been allocated. */
     cnt->rotate_data.buffer_norm = NULL;
     cnt->rotate_data.buffer_high = NULL;
+    cnt->rotate_data.fused = FALSE;
+    cnt->rotate_data.fused_crop = FALSE;
 
     /*
      * Assign the value in conf.rotate to rotate_data.degrees. This way,
@@ -208,13 +296,7 @@ void rotate_init(struct context *cnt){
         cnt->rotate_data.degrees = cnt->conf.rotate % 360; /* Range: 0..359 */
     }
 
-    if (cnt->conf.flip_axis[0]=='h') {
-        cnt->rotate_data.axis = FLIP_TYPE_HORIZONTAL;
-    } else if (cnt->conf.flip_axis[0]=='v') {
-        cnt->rotate_data.axis = FLIP_TYPE_VERTICAL;
-    } else {
-        cnt->rotate_data.axis = FLIP_TYPE_NONE;
-    }
+    cnt->rotate_data.axis = rotate_axis(cnt);
 
     /*
      * Upon entrance to this function, imgs.width and imgs.height contain the
@@ -234,7 +316,6 @@ void rotate_init(struct context *cnt){
     cnt->rotate_data.capture_width_high  = cnt->imgs.width_high;
     cnt->rotate_data.capture_height_high = cnt->imgs.height_high;
 
-    size_norm = cnt->imgs.width * cnt->imgs.height * 3 / 2;
     size_high = cnt->imgs.width_high * cnt->imgs.height_high * 3 / 2;
 
     if ((cnt->rotate_data.degrees == 90) || (cnt->rotate_data.degrees == 270)) {
@@ -254,12 +335,86 @@ void rotate_init(struct context *cnt){
     if (cnt->rotate_data.degrees == 0) return;
 
     /*
-     * Allocate memory if rotating 90 or 270 degrees, because those rotations
-     * cannot be performed in-place (they can, but it would be too slow).
+     * The buffers for 90 and 270 degrees rotation are allocated by
+     * rotate_fuse_init once the size after the crop is known.
      */
-    if ((cnt->rotate_data.degrees == 90) || (cnt->rotate_data.degrees == 270)){
-        cnt->rotate_data.buffer_norm = mymalloc(size_norm);
-        if (size_high > 0 ) cnt->rotate_data.buffer_high = mymalloc(size_high);
+
+}
+
+/**
+ * rotate_fuse_init
+ *
+ *  Sets up the single pass transform that rotates, flips and crops the
+ *  captured image into rotate_data.buffer_norm and buffer_high, from where
+ *  rotate_map copies the kept pixels back. It is used for 90 and 270 degrees
+ *  rotation, which cannot be performed in-place, and whenever a crop is
+ *  combined with a rotation or a flip so only the pixels that are kept get
+ *  transformed and copied.
+ *
+ * Parameters:
+ *
+ *   cnt - the current thread's context structure
+ *
+ * Returns: nothing
+ */
+void rotate_fuse_init(struct context *cnt){
+    int left, top, indx;
+    int width, height;
+    int crop;
+
+    /* A capture shared with other cameras keeps the full image */
+    crop = crop_in_capture(cnt);
+
+    cnt->rotate_data.fused = FALSE;
+    cnt->rotate_data.fused_crop = FALSE;
+
+    if ((cnt->rotate_data.degrees == 90) || (cnt->rotate_data.degrees == 270)) {
+        cnt->rotate_data.fused = TRUE;
+    } else if (crop &&
+        ((cnt->rotate_data.degrees != 0) || (cnt->rotate_data.axis != FLIP_TYPE_NONE))) {
+        cnt->rotate_data.fused = TRUE;
+    }
+
+    if (!cnt->rotate_data.fused) return;
+
+    cnt->rotate_data.fused_crop = crop;
+
+    left = 0;
+    top = 0;
+    if (crop) {
+        left = cnt->crop_data.px_left;
+        top = cnt->crop_data.px_top;
+    }
+    width = cnt->rotate_data.capture_width_norm;
+    height = cnt->rotate_data.capture_height_norm;
+    rotate_map_plane(cnt, &cnt->rotate_data.map_norm[0], width, height, left, top);
+    for (indx = 1; indx < 3; indx++) {
+        rotate_map_plane(cnt, &cnt->rotate_data.map_norm[indx]
+            , width / 2, height / 2, left / 2, top / 2);
+    }
+    if (crop) {
+        cnt->rotate_data.buffer_norm = mymalloc(cnt->imgs.size_norm);
+    } else {
+        cnt->rotate_data.buffer_norm = mymalloc(cnt->crop_data.capture_size_norm);
+    }
+
+    if (cnt->imgs.size_high > 0) {
+        if (crop) {
+            left = cnt->crop_data.px_left_high;
+            top = cnt->crop_data.px_top_high;
+        }
+        width = cnt->rotate_data.capture_width_high;
+        height = cnt->rotate_data.capture_height_high;
+        rotate_map_plane(cnt, &cnt->rotate_data.map_high[0], width, height, left, top);
+        for (indx = 1; indx < 3; indx++) {
+            rotate_map_plane(cnt, &cnt->rotate_data.map_high[indx]
+                , width / 2, height / 2, left / 2, top / 2);
+        }
+        if (crop) {
+            cnt->rotate_data.buffer_high = mymalloc(cnt->imgs.size_high);
+        } else {
+            cnt->rotate_data.buffer_high = mymalloc(cnt->crop_data.capture_size_high);
+        }
     }
 
 }
@@ -279,9 +434,35 @@ void rotate_deinit(struct context *cnt){
 
     if (cnt->rotate_data.buffer_norm)
         free(cnt->rotate_data.buffer_norm);
+    cnt->rotate_data.buffer_norm = NULL;
 
     if (cnt->rotate_data.buffer_high)
         free(cnt->rotate_data.buffer_high);
+    cnt->rotate_data.buffer_high = NULL;
+
+    cnt->rotate_data.fused = FALSE;
+    cnt->rotate_data.fused_crop = FALSE;
+}
+
+/**
+ * rotate_changed
+ *
+ *  Tells whether conf.rotate or conf.flip_axis differ from the values the
+ *  rotation was set up from.
+ *
+ * Parameters:
+ *
+ *   cnt - the current thread's context structure
+ *
+ * Returns: TRUE when the rotation needs to be set up again
+ */
+int rotate_changed(struct context *cnt){
+
+    if ((cnt->conf.rotate % 360) != cnt->rotate_data.degrees) return TRUE;
+
+    if (rotate_axis(cnt) != cnt->rotate_data.axis) return TRUE;
+
+    return FALSE;
 }
 
 /**
@@ -308,13 +489,14 @@ int rotate_map(struct context *cnt, struct image_data *img_data){
      *    V - as U
      */
 
-    int indx, indx_max;
+    int indx, indx_max, plane;
     int wh, wh4 = 0, w2 = 0, h2 = 0;  /* width * height, width * height / 4 etc. */
-    int size, deg;
+    int deg;
     enum FLIP_TYPE axis;
-    int width, height;
-    unsigned char *img;
+    int width, height, widthc, heightc;
+    unsigned char *img, *src, *dst;
     unsigned char *temp_buff;
+    struct rotmap *map;
 
     if (cnt->rotate_data.degrees == 0 && cnt->rotate_data.axis == FLIP_TYPE_NONE) return 0;
 
@@ -332,27 +514,64 @@ int rotate_map(struct context *cnt, struct image_data *img_data){
             img = img_data->image_norm;
             width = cnt->rotate_data.capture_width_norm;
             height = cnt->rotate_data.capture_height_norm;
+            widthc = cnt->crop_data.capture_width_norm;
+            heightc = cnt->crop_data.capture_height_norm;
+            if (cnt->rotate_data.fused_crop) {
+                widthc = cnt->imgs.width;
+                heightc = cnt->imgs.height;
+            }
             temp_buff = cnt->rotate_data.buffer_norm;
+            map = cnt->rotate_data.map_norm;
         } else {
             img = img_data->image_high;
             width = cnt->rotate_data.capture_width_high;
             height = cnt->rotate_data.capture_height_high;
+            widthc = cnt->crop_data.capture_width_high;
+            heightc = cnt->crop_data.capture_height_high;
+            if (cnt->rotate_data.fused_crop) {
+                widthc = cnt->imgs.width_high;
+                heightc = cnt->imgs.height_high;
+            }
             temp_buff = cnt->rotate_data.buffer_high;
+            map = cnt->rotate_data.map_high;
         }
         /*
          * Pre-calculate some stuff:
          *  wh   - size of the Y plane
-         *  size - size of the entire memory block
          *  wh4  - size of the U plane, and the V plane
          *  w2   - width of the U plane, and the V plane
          *  h2   - as w2, but height instead
          */
         wh = width * height;
-        size = wh * 3 / 2;
         wh4 = wh / 4;
         w2 = width / 2;
         h2 = height / 2;
 
+        if (cnt->rotate_data.fused) {
+            /*
+             * Write the rotated, flipped and cropped planes packed into the
+             * temporary buffer and copy back only the pixels that are kept.
+             * The copy stays: the buffer is shared by all the images of the
+             * camera while the ring keeps the earlier ones, so the views
+             * cannot point into it. With fused_crop, crop_map then sees an
+             * image that is already cropped.
+             */
+            src = img;
+            dst = temp_buff;
+            for (plane = 0; plane < 3; plane++) {
+                rotate_transform_plane(src, dst, widthc, heightc, &map[plane]);
+                src += (plane == 0) ? wh : wh4;
+                dst += widthc * heightc;
+                if (plane == 0) {
+                    widthc /= 2;
+                    heightc /= 2;
+                }
+            }
+            memcpy(img, temp_buff, dst - temp_buff);
+            indx++;
+            continue;
+        }
+
         switch (axis) {
         case FLIP_TYPE_HORIZONTAL:
             flip_inplace_horizontal(img,width, height);
@@ -369,25 +588,15 @@ int rotate_map(struct context *cnt, struct image_data *img_data){
         }
 
         switch (deg) {
-        case 90:
-            rot90cw(img, temp_buff, wh, width, height);
-            rot90cw(img + wh, temp_buff + wh, wh4, w2, h2);
-            rot90cw(img + wh + wh4, temp_buff + wh + wh4, wh4, w2, h2);
-            memcpy(img, temp_buff, size);
+        case 0:
             break;
         case 180:
             reverse_inplace_quad(img, wh);
             reverse_inplace_quad(img + wh, wh4);
             reverse_inplace_quad(img + wh + wh4, wh4);
             break;
-        case 270:
-            rot90ccw(img, temp_buff, wh, width, height);
-            rot90ccw(img + wh, temp_buff + wh, wh4, w2, h2);
-            rot90ccw(img + wh + wh4, temp_buff + wh + wh4, wh4, w2, h2);
-            memcpy(img, temp_buff, size);
-            break;
         default:
-            /* Invalid */
+            /* Invalid, 90 and 270 degrees are always fused */
             return -1;
         }
             indx++;
@@ -395,4 +604,3 @@ int rotate_map(struct context *cnt, struct image_data *img_data){
 
     return 0;
 }
-
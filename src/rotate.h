@@ -16,8 +16,8 @@
 /**
  * rotate_init
  *
- *  Sets up rotation data by allocating a temporary buffer for 90/270 degrees
- *  rotation, and by determining the right rotate-180-degrees function.
+ *  Sets up rotation data and swaps the image dimensions for 90/270 degrees
+ *  rotation.
  *
  * Parameters:
  *
@@ -27,6 +27,21 @@
  */
 void rotate_init(struct context *cnt);
 
+/**
+ * rotate_fuse_init
+ *
+ *  Sets up the transform that rotates, flips and crops the image in a
+ *  single pass and allocates its temporary buffers. Must be called after
+ *  crop_init has set the crop and the image dimensions after the crop.
+ *
+ * Parameters:
+ *
+ *  cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void rotate_fuse_init(struct context *cnt);
+
 /**
  * rotate_deinit
  *
@@ -38,6 +53,20 @@ void rotate_init(struct context *cnt);
  */
 void rotate_deinit(struct context *cnt);
 
+/**
+ * rotate_changed
+ *
+ *  Tells whether the rotation or flip in the configuration were changed
+ *  since rotate_init.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: TRUE when the rotation needs to be set up again
+ */
+int rotate_changed(struct context *cnt);
+
 /**
  * rotate_map
  *
@@ -45,9 +74,10 @@ void rotate_deinit(struct context *cnt);
  *  available in cnt. Rotation is performed clockwise. Supports 90,
  *  180 and 270 degrees rotation. 180 degrees rotation is performed
  *  in-place by simply reversing the image data, which is a very
- *  fast operation. 90 and 270 degrees rotation are performed using
- *  a temporary buffer and a somewhat more complicated algorithm,
- *  which makes them slower.
+ *  fast operation. 90 and 270 degrees rotation, and any rotation or
+ *  flip combined with a crop, are performed in one tiled pass into a
+ *  temporary buffer that only reads the pixels kept by the crop. The
+ *  image is then already cropped when it reaches crop_map.
  *
  *  Note that to the caller, all rotations will seem as they are
  *  performed in-place.
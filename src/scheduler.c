@@ -0,0 +1,582 @@
+/*
+ *    scheduler.c
+ *
+ *    Camera workers.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    With camera_workers the cameras do not get a thread each.  A fixed
+ *    number of worker threads, each pinned to a core, runs the passes of the
+ *    camera loops instead.  A camera whose pass is due sits in the run queue
+ *    of the worker that ran it last, so it tends to stay on the same core;
+ *    a worker with an empty queue steals from the queues of the others.
+ *    After a pass the camera waits in a list ordered by due time until its
+ *    next frame.  One idle worker sleeps until the first due time and moves
+ *    the due cameras to their queues.  An entry is in at most one queue or
+ *    the list at a time, so only one worker ever runs a camera.
+ *
+ *    A camera whose source tells when it has a new frame, a network camera
+ *    through scheduler_ready or a V4L2 device through its descriptor, is not
+ *    run when it is due but when its frame is there.  Until then it stays
+ *    parked in the list, for at most one more frame time.  The descriptors
+ *    of the parked cameras are watched by a poll thread of the workers.
+ */
+#include "translate.h"
+#include "motion.h"
+#include "scheduler.h"
+#include <poll.h>
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    #include <sched.h>
+#endif
+
+/* Longest wait for a frame of a camera without a frame time */
+#define SCHEDULER_READY_TMO 1000000
+
+struct scheduler_entry {
+    struct context          *cnt;
+    long long               due;        /* Microseconds of CLOCK_MONOTONIC the next pass is due */
+    int                     home;       /* Worker that ran the camera last */
+    int                     fd;         /* Readable when the source has a new frame, or -1 */
+    int                     awaits;     /* The source tells when it has a new frame */
+    int                     ready;      /* The source has a new frame since the last pass started */
+    int                     parked;     /* Due but waiting in the list for the frame */
+    struct scheduler_entry  *next;
+};
+
+struct scheduler_worker {
+    pthread_t               thread;
+    int                     indx;
+    int                     idle;       /* Waiting on wake */
+    pthread_cond_t          wake;
+    struct scheduler_entry  *head;      /* Cameras due, oldest first */
+    struct scheduler_entry  *tail;
+};
+
+static pthread_mutex_t scheduler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct scheduler_worker *scheduler_workers;
+static int scheduler_count;
+static int scheduler_home;              /* Worker the next camera added starts on */
+static int scheduler_finish;
+static scheduler_fn scheduler_step;
+static struct scheduler_entry *scheduler_waiting;   /* Cameras until their next pass, soonest first */
+static struct scheduler_worker *scheduler_timer;     /* Idle worker sleeping until the first due time */
+static pthread_t scheduler_poller;
+static int scheduler_polling;           /* The poll thread runs */
+static int scheduler_pipe[2] = {-1, -1};    /* Wakes the poll thread when a camera parks */
+
+static long long scheduler_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * scheduler_wake
+ *
+ *  Wakes worker when it is idle, else any idle worker to steal the work.
+ *  Called with scheduler_mutex held.
+ */
+static void scheduler_wake(struct scheduler_worker *worker)
+{
+    int indx;
+
+    if ((worker == NULL) || !worker->idle) {
+        worker = NULL;
+        for (indx = 0; indx < scheduler_count; indx++) {
+            if (scheduler_workers[indx].idle) {
+                worker = &scheduler_workers[indx];
+                break;
+            }
+        }
+        if (worker == NULL) return;
+    }
+
+    worker->idle = FALSE;
+    pthread_cond_signal(&worker->wake);
+}
+
+/**
+ * scheduler_poll_wake
+ *
+ *  Makes the poll thread take up the descriptors of the parked cameras again.
+ */
+static void scheduler_poll_wake(void)
+{
+    char byte = 0;
+
+    /* A full pipe already wakes it */
+    if (write(scheduler_pipe[1], &byte, 1) == -1 && errno != EAGAIN) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, _("Unable to wake the poll thread"));
+    }
+}
+
+static void scheduler_push(struct scheduler_worker *worker, struct scheduler_entry *entry)
+{
+    entry->next = NULL;
+    if (worker->tail != NULL) {
+        worker->tail->next = entry;
+    } else {
+        worker->head = entry;
+    }
+    worker->tail = entry;
+}
+
+static struct scheduler_entry *scheduler_pop(struct scheduler_worker *worker)
+{
+    struct scheduler_entry *entry = worker->head;
+
+    if (entry != NULL) {
+        worker->head = entry->next;
+        if (worker->head == NULL) worker->tail = NULL;
+    }
+
+    return entry;
+}
+
+/**
+ * scheduler_take
+ *
+ *  Takes the next camera of the queue of the worker, or steals one from
+ *  the queues of the other workers. Called with scheduler_mutex held.
+ */
+static struct scheduler_entry *scheduler_take(struct scheduler_worker *worker)
+{
+    struct scheduler_entry *entry;
+    int indx;
+
+    entry = scheduler_pop(worker);
+    for (indx = 1; (entry == NULL) && (indx < scheduler_count); indx++)
+        entry = scheduler_pop(&scheduler_workers[(worker->indx + indx) % scheduler_count]);
+
+    return entry;
+}
+
+/**
+ * scheduler_insert
+ *
+ *  Puts a camera into the list of waiting cameras and gets a worker to
+ *  watch the due time when it is the first. Called with scheduler_mutex held.
+ */
+static void scheduler_insert(struct scheduler_entry *entry, long long due)
+{
+    struct scheduler_entry **link;
+
+    entry->due = due;
+
+    for (link = &scheduler_waiting; *link; link = &(*link)->next) {
+        if ((*link)->due > entry->due) break;
+    }
+    entry->next = *link;
+    *link = entry;
+
+    if (link == &scheduler_waiting) scheduler_wake(scheduler_timer);
+}
+
+/**
+ * scheduler_unpark
+ *
+ *  Moves a parked camera whose frame came in from the list to the queue of
+ *  its worker. Called with scheduler_mutex held.
+ */
+static void scheduler_unpark(struct scheduler_entry *entry)
+{
+    struct scheduler_entry **link;
+    struct scheduler_worker *home;
+
+    for (link = &scheduler_waiting; *link != entry; link = &(*link)->next);
+    *link = entry->next;
+
+    entry->parked = FALSE;
+    home = &scheduler_workers[entry->home];
+    scheduler_push(home, entry);
+    scheduler_wake(home);
+}
+
+/**
+ * scheduler_release
+ *
+ *  Moves the cameras whose pass is due to the queues of their workers.
+ *  A camera waiting for a frame of its source is parked instead, once.
+ *  Called with scheduler_mutex held.
+ */
+static void scheduler_release(struct scheduler_worker *worker)
+{
+    struct scheduler_entry *entry;
+    struct scheduler_worker *home;
+    long long now, wait;
+
+    if (scheduler_waiting == NULL) return;
+
+    now = scheduler_now();
+    while ((scheduler_waiting != NULL) && (scheduler_waiting->due <= now)) {
+        entry = scheduler_waiting;
+        scheduler_waiting = entry->next;
+
+        if (entry->awaits && !entry->ready && !entry->parked) {
+            /* The camera reads the frame the source is about to deliver */
+            wait = entry->cnt->required_frame_time;
+            if (wait <= 0) wait = SCHEDULER_READY_TMO;
+            entry->parked = TRUE;
+            scheduler_insert(entry, now + wait);
+            if (entry->fd >= 0) scheduler_poll_wake();
+            continue;
+        }
+
+        /* A parked camera whose frame did not come runs without one */
+        entry->parked = FALSE;
+        home = &scheduler_workers[entry->home];
+        scheduler_push(home, entry);
+        if (home != worker) scheduler_wake(home);
+    }
+}
+
+/**
+ * scheduler_wait
+ *
+ *  Puts a camera into the list of waiting cameras until its next pass is due.
+ *  Called with scheduler_mutex held.
+ */
+static void scheduler_wait(struct scheduler_entry *entry, long delay)
+{
+    scheduler_insert(entry, scheduler_now() + delay);
+}
+
+/**
+ * scheduler_sleep
+ *
+ *  Waits until there is work. The first idle worker sleeps until the first
+ *  due time, the others until they are woken. Called with scheduler_mutex held.
+ */
+static void scheduler_sleep(struct scheduler_worker *worker)
+{
+    struct timespec ts;
+
+    worker->idle = TRUE;
+
+    if ((scheduler_timer == NULL) && (scheduler_waiting != NULL)) {
+        scheduler_timer = worker;
+        ts.tv_sec = scheduler_waiting->due / 1000000;
+        ts.tv_nsec = (scheduler_waiting->due % 1000000) * 1000;
+        pthread_cond_timedwait(&worker->wake, &scheduler_mutex, &ts);
+    } else {
+        pthread_cond_wait(&worker->wake, &scheduler_mutex);
+    }
+
+    worker->idle = FALSE;
+    if (scheduler_timer == worker) scheduler_timer = NULL;
+}
+
+/**
+ * scheduler_pin
+ *
+ *  Pins the worker to a core, the workers take the cores in turn.
+ */
+static void scheduler_pin(struct scheduler_worker *worker)
+{
+    #ifdef HAVE_PTHREAD_SETAFFINITY_NP
+        cpu_set_t cpus;
+        long cores;
+
+        cores = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cores < 1) return;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->indx % cores, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
+                ,_("Unable to pin camera worker %d to core %ld")
+                ,worker->indx, worker->indx % cores);
+        }
+    #else
+        (void)worker;
+    #endif
+}
+
+static void *scheduler_loop(void *arg)
+{
+    struct scheduler_worker *worker = arg;
+    struct scheduler_entry *entry;
+    long delay;
+    int stalled;
+
+    pthread_setspecific(tls_key_threadnr, (void *)(0));
+    util_threadname_set("cw", worker->indx, NULL);
+    scheduler_pin(worker);
+
+    pthread_mutex_lock(&scheduler_mutex);
+    while (!scheduler_finish) {
+        scheduler_release(worker);
+        entry = scheduler_take(worker);
+        if (entry == NULL) {
+            scheduler_sleep(worker);
+            continue;
+        }
+
+        /* Another worker watches the due times while this one is busy */
+        if ((scheduler_timer == NULL) && (scheduler_waiting != NULL))
+            scheduler_wake(NULL);
+
+        stalled = entry->awaits && !entry->ready;
+        entry->ready = FALSE;
+        pthread_mutex_unlock(&scheduler_mutex);
+
+        pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)entry->cnt->threadnr));
+        delay = scheduler_step(entry->cnt, stalled);
+        pthread_setspecific(tls_key_threadnr, (void *)(0));
+
+        pthread_mutex_lock(&scheduler_mutex);
+        if (delay < 0) {
+            free(entry);
+            continue;
+        }
+        entry->home = worker->indx;
+        if ((delay == 0) && (entry->ready || !entry->awaits)) {
+            scheduler_push(worker, entry);
+        } else {
+            scheduler_wait(entry, delay);
+        }
+    }
+    pthread_mutex_unlock(&scheduler_mutex);
+
+    return NULL;
+}
+
+/**
+ * scheduler_poll_loop
+ *
+ *  Watches the descriptors of the parked cameras and hands a camera whose
+ *  descriptor turns readable to its worker.
+ */
+static void *scheduler_poll_loop(void *arg)
+{
+    struct scheduler_entry *entry, **polled = NULL;
+    struct pollfd *fds = NULL;
+    int indx, count, size = 0;
+    char buf[64];
+
+    (void)arg;
+
+    pthread_setspecific(tls_key_threadnr, (void *)(0));
+    util_threadname_set("cp", 0, NULL);
+
+    pthread_mutex_lock(&scheduler_mutex);
+    while (!scheduler_finish) {
+        /* The pipe comes first, then the parked cameras with a descriptor */
+        count = 1;
+        for (entry = scheduler_waiting; entry; entry = entry->next) {
+            if (entry->parked && (entry->fd >= 0)) count++;
+        }
+        if (count > size) {
+            size = count;
+            fds = myrealloc(fds, size * sizeof(struct pollfd), "scheduler_poll_loop");
+            polled = myrealloc(polled, size * sizeof(struct scheduler_entry *), "scheduler_poll_loop");
+        }
+
+        fds[0].fd = scheduler_pipe[0];
+        fds[0].events = POLLIN;
+        count = 1;
+        for (entry = scheduler_waiting; entry; entry = entry->next) {
+            if (!entry->parked || (entry->fd < 0)) continue;
+            fds[count].fd = entry->fd;
+            fds[count].events = POLLIN;
+            polled[count] = entry;
+            count++;
+        }
+        pthread_mutex_unlock(&scheduler_mutex);
+
+        if (poll(fds, count, -1) == -1) fds[0].revents = 0;
+        if (fds[0].revents & POLLIN) {
+            while (read(scheduler_pipe[0], buf, sizeof(buf)) > 0);
+        }
+
+        pthread_mutex_lock(&scheduler_mutex);
+        for (indx = 1; indx < count; indx++) {
+            if (fds[indx].revents == 0) continue;
+            /* Only a camera still parked, it may have timed out meanwhile */
+            for (entry = scheduler_waiting; entry; entry = entry->next) {
+                if (entry == polled[indx]) break;
+            }
+            if ((entry == NULL) || !entry->parked) continue;
+            entry->ready = TRUE;
+            scheduler_unpark(entry);
+        }
+    }
+    pthread_mutex_unlock(&scheduler_mutex);
+
+    free(fds);
+    free(polled);
+
+    return NULL;
+}
+
+/**
+ * scheduler_poll_start
+ *
+ *  Starts the poll thread. Called with scheduler_mutex held.
+ */
+static void scheduler_poll_start(void)
+{
+    if (pipe(scheduler_pipe) == -1) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
+            ,_("Unable to create the pipe of the poll thread"));
+        return;
+    }
+    fcntl(scheduler_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(scheduler_pipe[1], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create(&scheduler_poller, NULL, scheduler_poll_loop, NULL)) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
+            ,_("Unable to start the poll thread of the camera workers"));
+        close(scheduler_pipe[0]);
+        close(scheduler_pipe[1]);
+        scheduler_pipe[0] = -1;
+        scheduler_pipe[1] = -1;
+        return;
+    }
+    scheduler_polling = TRUE;
+}
+
+void scheduler_start(int workers, scheduler_fn step)
+{
+    struct scheduler_worker *worker;
+    pthread_condattr_t attr;
+    int indx;
+
+    pthread_mutex_lock(&scheduler_mutex);
+
+    if ((scheduler_count > 0) || (workers <= 0)) {
+        pthread_mutex_unlock(&scheduler_mutex);
+        return;
+    }
+
+    scheduler_workers = mymalloc(workers * sizeof(struct scheduler_worker));
+    scheduler_step = step;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    for (indx = 0; indx < workers; indx++) {
+        worker = &scheduler_workers[indx];
+        worker->indx = indx;
+        pthread_cond_init(&worker->wake, &attr);
+        if (pthread_create(&worker->thread, NULL, scheduler_loop, worker)) {
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
+                ,_("Unable to start the camera worker thread"));
+            pthread_cond_destroy(&worker->wake);
+            break;
+        }
+        scheduler_count++;
+    }
+
+    pthread_condattr_destroy(&attr);
+
+    if (scheduler_count > 0) scheduler_poll_start();
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+        ,_("Camera worker threads: %d"), scheduler_count);
+
+    pthread_mutex_unlock(&scheduler_mutex);
+}
+
+void scheduler_stop(void)
+{
+    struct scheduler_entry *entry;
+    int indx;
+
+    pthread_mutex_lock(&scheduler_mutex);
+    scheduler_finish = TRUE;
+    for (indx = 0; indx < scheduler_count; indx++)
+        pthread_cond_signal(&scheduler_workers[indx].wake);
+    if (scheduler_polling) scheduler_poll_wake();
+    pthread_mutex_unlock(&scheduler_mutex);
+
+    for (indx = 0; indx < scheduler_count; indx++)
+        pthread_join(scheduler_workers[indx].thread, NULL);
+
+    if (scheduler_polling) {
+        pthread_join(scheduler_poller, NULL);
+        close(scheduler_pipe[0]);
+        close(scheduler_pipe[1]);
+        scheduler_pipe[0] = -1;
+        scheduler_pipe[1] = -1;
+        scheduler_polling = FALSE;
+    }
+
+    for (indx = 0; indx < scheduler_count; indx++) {
+        while ((entry = scheduler_pop(&scheduler_workers[indx])) != NULL)
+            free(entry);
+        pthread_cond_destroy(&scheduler_workers[indx].wake);
+    }
+    while ((entry = scheduler_waiting) != NULL) {
+        scheduler_waiting = entry->next;
+        free(entry);
+    }
+
+    free(scheduler_workers);
+    scheduler_workers = NULL;
+    scheduler_count = 0;
+    scheduler_home = 0;
+    scheduler_timer = NULL;
+    scheduler_finish = FALSE;
+}
+
+int scheduler_add(struct context *cnt, int fd)
+{
+    struct scheduler_entry *entry;
+    struct scheduler_worker *home;
+
+    pthread_mutex_lock(&scheduler_mutex);
+
+    if (scheduler_count == 0) {
+        pthread_mutex_unlock(&scheduler_mutex);
+        return -1;
+    }
+
+    entry = mymalloc(sizeof(struct scheduler_entry));
+    entry->cnt = cnt;
+    entry->home = scheduler_home++ % scheduler_count;
+    cnt->scheduler_entry = entry;
+
+    /* Without the poll thread the descriptor is not watched */
+    entry->fd = scheduler_polling ? fd : -1;
+    if (entry->fd >= 0) {
+        /* The first pass waits for the first frame */
+        entry->awaits = TRUE;
+        scheduler_wait(entry, 0);
+    } else {
+        home = &scheduler_workers[entry->home];
+        scheduler_push(home, entry);
+        scheduler_wake(home);
+    }
+
+    pthread_mutex_unlock(&scheduler_mutex);
+
+    return 0;
+}
+
+void scheduler_remove(struct context *cnt)
+{
+    pthread_mutex_lock(&scheduler_mutex);
+    cnt->scheduler_entry = NULL;
+    pthread_mutex_unlock(&scheduler_mutex);
+}
+
+void scheduler_ready(struct context *cnt)
+{
+    struct scheduler_entry *entry;
+
+    pthread_mutex_lock(&scheduler_mutex);
+
+    entry = cnt->scheduler_entry;
+    if (entry != NULL) {
+        entry->awaits = TRUE;
+        entry->ready = TRUE;
+        if (entry->parked) scheduler_unpark(entry);
+    }
+
+    pthread_mutex_unlock(&scheduler_mutex);
+}
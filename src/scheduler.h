@@ -0,0 +1,88 @@
+/*
+ *    scheduler.h
+ *
+ *    Include file for the camera workers.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_SCHEDULER_H
+#define _INCLUDE_SCHEDULER_H
+
+/* One pass of the loop of a camera, returns the microseconds until the next
+ * pass is due or -1 when the camera left the workers. stalled is TRUE when
+ * the source tells of its frames and had none since the last pass */
+typedef long (*scheduler_fn)(struct context *cnt, int stalled);
+
+/**
+ * scheduler_start
+ *
+ *  Starts the camera workers, each pinned to a core in turn. Does nothing
+ *  when they are running already.
+ *
+ * Parameters:
+ *
+ *  workers - number of worker threads
+ *  step    - function running one pass of a camera
+ *
+ * Returns: nothing
+ */
+void scheduler_start(int workers, scheduler_fn step);
+
+/**
+ * scheduler_stop
+ *
+ *  Ends and joins the camera workers. All cameras must have ended.
+ *
+ * Returns: nothing
+ */
+void scheduler_stop(void);
+
+/**
+ * scheduler_add
+ *
+ *  Hands a camera to the workers, which run its passes until the step
+ *  function returns -1. A camera is only ever run by one worker at a time.
+ *  With a descriptor a pass waits until it is readable, for at most one
+ *  frame time after the pass is due.
+ *
+ * Parameters:
+ *
+ *  cnt - context of the camera
+ *  fd  - descriptor readable when the source has a new frame, or -1
+ *
+ * Returns: 0 when the workers took the camera, -1 when they are not running
+ */
+int scheduler_add(struct context *cnt, int fd);
+
+/**
+ * scheduler_remove
+ *
+ *  Stops scheduler_ready from reaching the camera. Called by the step
+ *  function before it returns -1, the workers do not touch the context
+ *  after that.
+ *
+ * Parameters:
+ *
+ *  cnt - context of the camera
+ *
+ * Returns: nothing
+ */
+void scheduler_remove(struct context *cnt);
+
+/**
+ * scheduler_ready
+ *
+ *  Tells the workers the source of the camera has a new frame. The first
+ *  call makes the passes of the camera wait for its frames like with a
+ *  descriptor. Does nothing when the camera is not on the workers.
+ *
+ * Parameters:
+ *
+ *  cnt - context of the camera
+ *
+ * Returns: nothing
+ */
+void scheduler_ready(struct context *cnt);
+
+#endif
@@ -1230,8 +1230,8 @@ void stream_stop(struct stream *stm)
  *      Note: Clients that have disconnected are handled in the stream_flush()
  *          function.
  */
-void stream_put(struct context *cnt, struct stream *stm, int *stream_count, unsigned char *image,
-            int do_scale_down)
+void stream_put(struct context *cnt, struct stream *stm, int *stream_count, struct image_view *view,
+            int do_scale_down ATTRIBUTE_UNUSED)
 {
     struct timeval timeout;
     struct stream_buffer *tmpbuffer;
@@ -1245,8 +1245,6 @@ void stream_put(struct context *cnt, struct stream *stm, int *stream_count, unsi
     int headlength = sizeof(jpeghead) - 1;    /* Don't include terminator. */
     char len[20];    /* Will be used for sprintf, must be >= 16 */
 
-    /* will point either to the original image or a scaled down */
-    unsigned char *img = image;
     int image_width = cnt->imgs.width;
     int image_height = cnt->imgs.height;
     int image_size = cnt->imgs.size_norm;
@@ -1322,7 +1320,7 @@ void stream_put(struct context *cnt, struct stream *stm, int *stream_count, unsi
             wptr += headlength;
 
             /* Create a jpeg image and place into tmpbuffer. */
-            tmpbuffer->size = put_picture_memory(cnt, wptr, image_size, img,
+            tmpbuffer->size = put_picture_memory(cnt, wptr, image_size, view,
                                        cnt->conf.stream_quality, image_width, image_height);
 
             /* Fill in the image length into the header. */
@@ -1359,11 +1357,5 @@ void stream_put(struct context *cnt, struct stream *stm, int *stream_count, unsi
     if (cnt->conf.stream_auth_method != 0)
         pthread_mutex_unlock(&stream_auth_mutex);
 
-    /* free resized image buffer */
-    if (do_scale_down)
-    {
-        free (img);
-    }
-
     return;
 }
@@ -44,7 +44,7 @@ int stream_init(struct stream *stm,
                 int localhost,
                 int ipv6_enabled,
                 const char *cors_header);
-void stream_put(struct context *, struct stream *, int *, unsigned char *, int);
+void stream_put(struct context *, struct stream *, int *, struct image_view *, int);
 void stream_stop(struct stream *);
 
 #endif /* _INCLUDE_STREAM_H_ */
@@ -14,6 +14,7 @@
 #include "video_v4l2.h"
 #include "video_bktr.h"
 #include "jpegutils.h"
+#include "crop.h"
 
 typedef unsigned char uint8_t;
 typedef unsigned short int uint16_t;
@@ -685,6 +686,9 @@ void vid_close(struct context *cnt) {
         return;
     }
 
+    /* The capture is owned by the source camera */
+    if (cnt->camera_type == CAMERA_TYPE_CROP) return;
+
     MOTION_LOG(ERR, TYPE_VIDEO, NO_ERRNO,_("No Camera device cleanup (MMAL, Netcam, V4L2, BKTR)"));
     return;
 
@@ -758,6 +762,15 @@ int vid_start(struct context *cnt) {
         return dev;
     }
 
+    if (cnt->camera_type == CAMERA_TYPE_CROP) {
+        MOTION_LOG(NTC, TYPE_VIDEO, NO_ERRNO,_("Opening crop of camera %d"), cnt->conf.crop_source);
+        dev = crop_source_start(cnt);
+        if (dev < 0) {
+            MOTION_LOG(ERR, TYPE_VIDEO, NO_ERRNO,_("Crop source camera is not available"));
+        }
+        return dev;
+    }
+
     if (cnt->camera_type == CAMERA_TYPE_BKTR) {
         MOTION_LOG(NTC, TYPE_VIDEO, NO_ERRNO,_("Opening BKTR device"));
         dev = bktr_start(cnt);
@@ -826,5 +839,9 @@ int vid_next(struct context *cnt, struct image_data *img_data){
         return bktr_next(cnt, img_data);
     }
 
+    if (cnt->camera_type == CAMERA_TYPE_CROP) {
+        return crop_source_next(cnt, img_data);
+    }
+
     return -2;
 }
@@ -0,0 +1,186 @@
+/*
+ *    workpool.c
+ *
+ *    Worker threads shared by the cameras.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    A camera thread splits per pixel work into tasks, typically one per
+ *    horizontal stripe of the image, and hands them to the pool with
+ *    workpool_run.  Pending jobs are kept in a list; the workers and the
+ *    submitting thread take the next task of the oldest job until all
+ *    tasks are handed out, and the submitter waits for the last task to
+ *    finish.  The pool is sized by the largest detection_threads of the
+ *    cameras.
+ */
+#include "translate.h"
+#include "motion.h"
+#include "workpool.h"
+
+struct workpool_job {
+    workpool_fn             fn;
+    void                    *arg;
+    int                     count;      /* Number of tasks */
+    int                     next;       /* Next task to hand out */
+    int                     done;       /* Tasks finished */
+    pthread_cond_t          finished;
+    struct workpool_job     *next_job;
+};
+
+static pthread_mutex_t workpool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workpool_wake = PTHREAD_COND_INITIALIZER;
+static struct workpool_job *workpool_head;
+static pthread_t *workpool_threads;
+static int workpool_count;
+static int workpool_finish;
+
+/**
+ * workpool_take
+ *
+ *  Hands out the next task of a job and unlinks the job once its last
+ *  task is taken. Called with workpool_mutex held.
+ */
+static int workpool_take(struct workpool_job *job)
+{
+    struct workpool_job **link;
+    int indx = job->next++;
+
+    if (job->next == job->count) {
+        for (link = &workpool_head; *link; link = &(*link)->next_job) {
+            if (*link == job) {
+                *link = job->next_job;
+                break;
+            }
+        }
+    }
+    return indx;
+}
+
+/**
+ * workpool_finish_task
+ *
+ *  Counts a finished task and wakes the submitter after the last one.
+ *  Called with workpool_mutex held.
+ */
+static void workpool_finish_task(struct workpool_job *job)
+{
+    if (++job->done == job->count) pthread_cond_signal(&job->finished);
+}
+
+static void *workpool_loop(void *arg)
+{
+    struct workpool_job *job;
+    int indx;
+
+    (void)arg;
+
+    pthread_setspecific(tls_key_threadnr, (void *)(0));
+    util_threadname_set("wp", 0, NULL);
+
+    pthread_mutex_lock(&workpool_mutex);
+    while (!workpool_finish) {
+        if (workpool_head == NULL) {
+            pthread_cond_wait(&workpool_wake, &workpool_mutex);
+            continue;
+        }
+        job = workpool_head;
+        indx = workpool_take(job);
+        pthread_mutex_unlock(&workpool_mutex);
+
+        job->fn(job->arg, indx);
+
+        pthread_mutex_lock(&workpool_mutex);
+        workpool_finish_task(job);
+    }
+    pthread_mutex_unlock(&workpool_mutex);
+
+    return NULL;
+}
+
+void workpool_start(int threads)
+{
+    pthread_t *grown;
+
+    pthread_mutex_lock(&workpool_mutex);
+
+    if (threads > workpool_count) {
+        grown = myrealloc(workpool_threads, threads * sizeof(pthread_t), "workpool_start");
+        if (grown != NULL) {
+            workpool_threads = grown;
+            while (workpool_count < threads) {
+                if (pthread_create(&workpool_threads[workpool_count], NULL, workpool_loop, NULL)) {
+                    MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
+                        ,_("Unable to start the detection worker thread"));
+                    break;
+                }
+                workpool_count++;
+            }
+            MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+                ,_("Detection worker threads: %d"), workpool_count);
+        }
+    }
+
+    pthread_mutex_unlock(&workpool_mutex);
+}
+
+void workpool_stop(void)
+{
+    int indx;
+
+    pthread_mutex_lock(&workpool_mutex);
+    workpool_finish = TRUE;
+    pthread_cond_broadcast(&workpool_wake);
+    pthread_mutex_unlock(&workpool_mutex);
+
+    for (indx = 0; indx < workpool_count; indx++)
+        pthread_join(workpool_threads[indx], NULL);
+
+    free(workpool_threads);
+    workpool_threads = NULL;
+    workpool_count = 0;
+    workpool_finish = FALSE;
+}
+
+void workpool_run(workpool_fn fn, void *arg, int count)
+{
+    struct workpool_job job, **link;
+    int indx;
+
+    /* Nothing to share */
+    if ((count <= 1) || (workpool_count == 0)) {
+        for (indx = 0; indx < count; indx++) fn(arg, indx);
+        return;
+    }
+
+    job.fn = fn;
+    job.arg = arg;
+    job.count = count;
+    job.next = 0;
+    job.done = 0;
+    job.next_job = NULL;
+    pthread_cond_init(&job.finished, NULL);
+
+    pthread_mutex_lock(&workpool_mutex);
+
+    for (link = &workpool_head; *link; link = &(*link)->next_job);
+    *link = &job;
+    pthread_cond_broadcast(&workpool_wake);
+
+    while (job.next < job.count) {
+        indx = workpool_take(&job);
+        pthread_mutex_unlock(&workpool_mutex);
+
+        fn(arg, indx);
+
+        pthread_mutex_lock(&workpool_mutex);
+        workpool_finish_task(&job);
+    }
+
+    while (job.done < job.count)
+        pthread_cond_wait(&job.finished, &workpool_mutex);
+
+    pthread_mutex_unlock(&workpool_mutex);
+
+    pthread_cond_destroy(&job.finished);
+}
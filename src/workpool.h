@@ -0,0 +1,56 @@
+/*
+ *    workpool.h
+ *
+ *    Include file for the worker threads shared by the cameras.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_WORKPOOL_H
+#define _INCLUDE_WORKPOOL_H
+
+/* One task of a job, indx runs from 0 to the number of tasks - 1 */
+typedef void (*workpool_fn)(void *arg, int indx);
+
+/**
+ * workpool_start
+ *
+ *  Grows the pool to at least the given number of worker threads. The
+ *  pool never shrinks while Motion runs.
+ *
+ * Parameters:
+ *
+ *  threads - number of worker threads wanted
+ *
+ * Returns: nothing
+ */
+void workpool_start(int threads);
+
+/**
+ * workpool_stop
+ *
+ *  Ends and joins all worker threads. No job may be running.
+ *
+ * Returns: nothing
+ */
+void workpool_stop(void);
+
+/**
+ * workpool_run
+ *
+ *  Runs count tasks of a job and returns when all of them are done. The
+ *  calling thread works on the tasks too, so the job completes even when
+ *  the pool has fewer threads than tasks or none at all. Several threads
+ *  may run jobs at the same time.
+ *
+ * Parameters:
+ *
+ *  fn    - function running one task
+ *  arg   - argument passed to every task
+ *  count - number of tasks
+ *
+ * Returns: nothing
+ */
+void workpool_run(workpool_fn fn, void *arg, int count);
+
+#endif